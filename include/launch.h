@@ -1,6 +1,9 @@
 #ifndef LAUNCH_H_
 #define LAUNCH_H_
 
+#include <stddef.h>
+#include <sys/types.h>
+
 /*
    		Stateful notification functions
 		===============================
@@ -35,10 +38,24 @@
 	Additionally, the 'foo' job will not be launched until after the 'bar' job
 	has sent a notification that it's 'status' is 'running'. If the 'bar'
 	job posts a notification that it's 'status' is 'stopped', launchd will
-	terminate the 'foo' job by sending it a SIGTERM signal.
+	terminate the 'foo' job by sending it a SIGTERM signal. LaunchAfter
+	only holds back jobs that are launched when the manifest is loaded;
+	a job that is started explicitly is launched right away.
+
+	A job can only post the names in its Send list. The Receive list
+	selects the names that wake the job up and that notify_check()
+	returns; it does not hide the other names. Every job with a Send or
+	Receive list can read the state of every name, so states must not
+	hold secrets. States are limited to 256 bytes.
+
+	These functions are not thread-safe.
 
 */
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** A notification about a state change. */
 struct notify_state {
   char   *ns_name;	
@@ -61,6 +78,12 @@ int notify_post(const char *name, void *state, size_t len);
 /** 
   Check for pending notifications, and return the current state.
 
+  Each name that has changed since it was last checked is reported once,
+  with its latest state; ns_state is NUL-terminated. The structures
+  belong to the library, and remain valid until the next call to
+  notify_check(). If all *nchanges* entries are filled, call it again to
+  retrieve the rest.
+
   @param changes A buffer to write the notifications to
   @param nchanges The number of changes that can be stored in the buffer
 
@@ -88,8 +111,8 @@ ssize_t notify_check(notify_state_t *changes, size_t nchanges);
 	    notify_state_t changes;
 
 	    count = notify_check(&changes, 1);
-	    if (count == 1 && strcmp(changes.ns_name, "foo") == 0) {
-	       printf("the current state of foo is %s\n", changes.ns_state);
+	    if (count == 1 && strcmp(changes->ns_name, "foo") == 0) {
+	       printf("the current state of foo is %s\n", changes->ns_state);
 	    }
     	});
     	dispatch_resume(source);
@@ -125,7 +148,8 @@ void notify_dispatch_f(char *name, dispatch_queue_t queue, void *context, void (
 #endif
 
 /**
-  Disable notifications related to *name*.
+  Disable notifications related to *name*. Changes that are posted while
+  the name is suspended are reported by notify_check() after it is resumed.
 
   @return 0 if successful, or -1 if an error occurs.
 */
@@ -138,4 +162,8 @@ int notify_suspend(const char *name);
 */
 int notify_resume(const char *name);
 
-#endif /* LIBLAUNCH_H_ */
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LAUNCH_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "boot_scheduler.h"
+#include "log.h"
+
+void BootScheduler::enqueue(const std::string &label,
+                            const std::vector<std::string> &deps,
+                            Priority priority) {
+    if (queued.count(label)) {
+        throw std::logic_error("job is already queued");
+    }
+    Entry entry;
+    entry.priority = priority;
+    for (const auto &dep : deps) {
+        auto it = queued.find(dep);
+        if (it != queued.end()) {
+            it->second.dependents.push_back(label);
+            entry.deps.push_back(dep);
+            entry.unmet_deps++;
+        }
+    }
+    const bool is_ready = entry.unmet_deps == 0;
+    if (priority == Priority::Critical) {
+        critical_count++;
+    }
+    queued.emplace(label, std::move(entry));
+    if (is_ready) {
+        ready.emplace(priority, label);
+    }
+    // Avoid priority inversion: a critical job should not wait behind
+    // background jobs that it depends on.
+    for (const auto &dep : queued.at(label).deps) {
+        raisePriority(dep, priority);
+    }
+}
+
+void BootScheduler::raisePriority(const std::string &label,
+                                  Priority priority) {
+    auto it = queued.find(label);
+    if (it == queued.end() || it->second.priority <= priority) {
+        return;
+    }
+    auto &entry = it->second;
+    if (ready.erase({entry.priority, label})) {
+        ready.emplace(priority, label);
+    }
+    if (priority == Priority::Critical) {
+        critical_count++;
+    }
+    entry.priority = priority;
+    for (const auto &dep : entry.deps) {
+        raisePriority(dep, priority);
+    }
+}
+
+std::optional<std::string> BootScheduler::dequeue() {
+    if (ready.empty()) {
+        return std::nullopt;
+    }
+    std::string label = ready.begin()->second;
+    ready.erase(ready.begin());
+    auto node = queued.extract(label);
+    if (node.mapped().priority == Priority::Critical) {
+        critical_count--;
+    }
+    for (const auto &dependent : node.mapped().dependents) {
+        auto &entry = queued.at(dependent);
+        if (--entry.unmet_deps == 0) {
+            ready.emplace(entry.priority, dependent);
+        }
+    }
+    return label;
+}
+
+bool BootScheduler::isQueued(const std::string &label) const {
+    return queued.count(label) > 0;
+}
+
+void BootScheduler::clear() {
+    queued.clear();
+    ready.clear();
+    critical_count = 0;
+}
+
+void BootScheduler::recordBatch(size_t count,
+                                std::chrono::microseconds elapsed) {
+    if (count == 0) {
+        return;
+    }
+    const auto per_job_us = std::max<long long>(
+        elapsed.count() / static_cast<long long>(count), 1);
+    const size_t ideal = target_batch_duration.count() / per_job_us;
+    // Never grow or shrink by more than a factor of two at a time
+    const size_t lower = std::max(batch_limit / 2, min_batch_limit);
+    const size_t upper = std::min(batch_limit * 2, max_batch_limit);
+    batch_limit = std::clamp(ideal, lower, upper);
+    log_debug("bootstrapped %zu jobs in %lld us; next batch limit is %zu",
+              count, static_cast<long long>(elapsed.count()), batch_limit);
+}
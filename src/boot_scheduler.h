@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Decides which queued jobs to bootstrap next, and how many of them to
+ * bootstrap in each iteration of the event loop.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "manifest.h"
+
+class BootScheduler {
+  public:
+    using Priority = Manifest::Priority;
+
+    //! Add a job to the queue. Any of the \a deps that are still queued must
+    //! be dequeued before this job. The job's priority is inherited by the
+    //! queued jobs that it depends on.
+    void enqueue(const std::string &label, const std::vector<std::string> &deps,
+                 Priority priority);
+
+    //! Return the highest priority job whose dependencies have been dequeued
+    std::optional<std::string> dequeue();
+
+    [[nodiscard]] bool isQueued(const std::string &label) const;
+
+    [[nodiscard]] bool empty() const { return queued.empty(); }
+
+    [[nodiscard]] size_t size() const { return queued.size(); }
+
+    //! The number of queued jobs with the Critical priority
+    [[nodiscard]] size_t criticalRemaining() const { return critical_count; }
+
+    //! Discard all queued jobs
+    void clear();
+
+    //! The maximum number of jobs to bootstrap in the next batch
+    [[nodiscard]] size_t batchLimit() const { return batch_limit; }
+
+    //! Adjust the batch limit based on how long the last batch took
+    void recordBatch(size_t count, std::chrono::microseconds elapsed);
+
+    static constexpr size_t initial_batch_limit = 16;
+    static constexpr size_t min_batch_limit = 1;
+    static constexpr size_t max_batch_limit = 256;
+
+    //! Batches should take about this long, so the event loop stays responsive
+    static constexpr std::chrono::microseconds target_batch_duration{10000};
+
+  private:
+    struct Entry {
+        Priority priority;
+        size_t unmet_deps = 0;
+        std::vector<std::string> dependents;
+        std::vector<std::string> deps;
+    };
+
+    void raisePriority(const std::string &label, Priority priority);
+
+    std::unordered_map<std::string, Entry> queued;
+    //! Jobs with no unmet dependencies, ordered by priority then label
+    std::set<std::pair<Priority, std::string>> ready;
+    size_t critical_count = 0;
+    size_t batch_limit = initial_batch_limit;
+};
@@ -14,14 +14,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <arpa/inet.h>
 #include <cerrno>
+#include <cstring>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
 #include <system_error>
+#include <utility>
 
 #include "channel.h"
 #include "log.h"
@@ -105,40 +109,248 @@ int Channel::connect(const std::string &path) {
 }
 
 json Channel::readMessage() {
+    auto result = tryReadMessage();
+    if (!result) {
+        throw std::runtime_error("connection closed while awaiting a message");
+    }
+    return std::move(*result);
+}
+
+std::optional<json> Channel::tryReadMessage() {
     if (peerfd < 0 && sockfd < 0) {
         throw std::logic_error("must call accept() or connect() first");
     }
     int sd = (peerfd >= 0) ? peerfd : sockfd;
-    char buf[IPC_MAX_MSGLEN];
-    ssize_t bytes = read(sd, (char *)&buf, sizeof(buf));
-    if (bytes < 0) {
-        log_errno("read(2)");
-        throw std::system_error(errno, std::system_category(),
-                                "read(2) failed");
+    if (!fill(sd, IPC_HEADER_LEN)) {
+        return std::nullopt;
+    }
+    const Header header = decodeHeader(input.data());
+    if (!isSupported(header.encoding)) {
+        throw std::runtime_error("unsupported IPC message encoding");
     }
-    log_debug("read %zu bytes from IPC channel", (size_t)bytes);
+    const size_t end = IPC_HEADER_LEN + header.length;
+    fill(sd, end);
+    log_debug("read %u bytes from IPC channel", header.length);
+    json result;
     try {
-        return json::parse(buf);
+        result = decode(input.data() + IPC_HEADER_LEN, input.data() + end,
+                        static_cast<Encoding>(header.encoding));
     } catch (...) {
-        log_error("json::parse() failed");
-        throw std::runtime_error("JSON parse failed");
+        log_error("unable to decode an IPC message");
+        throw std::runtime_error("IPC message decoding failed");
+    }
+    // Keep anything that was read past the end of the message
+    std::copy(input.begin() + end, input.begin() + input_len, input.begin());
+    input_len -= end;
+
+    if (encoding != Encoding::Json && result.is_object() &&
+        result.value("UnsupportedEncoding", false)) {
+        log_debug("the server does not support encoding %d; using JSON",
+                  static_cast<int>(encoding));
+        encoding = Encoding::Json;
+        writeMessage(sd, last_request);
+        last_request = nullptr;
+        return tryReadMessage();
+    }
+    return result;
+}
+
+bool Channel::fill(int sd, size_t length) {
+    if (input.size() < length) {
+        input.resize(std::max({length, input.size() * 2, size_t{65536}}));
+    }
+    while (input_len < length) {
+        ssize_t bytes = receive(sd, input.data() + input_len,
+                                input.size() - input_len, received_fds);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("read(2)");
+            throw std::system_error(errno, std::system_category(),
+                                    "read(2) failed");
+        }
+        if (bytes == 0) {
+            if (input_len == 0) {
+                return false;
+            }
+            throw std::runtime_error("connection closed in the middle of a "
+                                     "message");
+        }
+        input_len += bytes;
     }
+    return true;
 }
 
-void Channel::writeMessage(const json &j) {
+void Channel::writeMessage(const json &j) { writeMessage(j, {}); }
+
+void Channel::writeMessage(const json &j, const std::vector<int> &fds) {
     if (peerfd < 0 && sockfd < 0) {
         throw std::logic_error("must call accept() or connect() first");
     }
+    if (encoding != Encoding::Json) {
+        // The server keeps the descriptors for the request that is resent
+        last_request = j;
+    }
+    writeMessage((peerfd >= 0) ? peerfd : sockfd, j, encoding, fds);
+}
+
+std::vector<int> Channel::takeDescriptors() {
+    return std::exchange(received_fds, {});
+}
+
+ssize_t Channel::receive(int sd, char *buf, size_t len,
+                         std::vector<int> &fds) {
+    struct iovec iov = {buf, len};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(IPC_MAX_FDS * sizeof(int))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+    const int flags = MSG_CMSG_CLOEXEC;
+#else
+    const int flags = 0;
+#endif
+    ssize_t bytes = recvmsg(sd, &msg, flags);
+    if (bytes < 0) {
+        return bytes;
+    }
+    for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+#ifndef MSG_CMSG_CLOEXEC
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+            fds.push_back(fd);
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        log_warning("discarded descriptors beyond the limit of %u",
+                    IPC_MAX_FDS);
+    }
+    return bytes;
+}
+
+void Channel::shutdownWrite() {
     int sd = (peerfd >= 0) ? peerfd : sockfd;
-    std::string buf = j.dump();
-    size_t bufsz = buf.length() + 1;
-    ssize_t bytes = write(sd, buf.data(), bufsz);
-    if ((size_t)bytes < bufsz) {
-        log_error("write(2) of %zd bytes: %s", bytes, strerror(errno));
+    if (shutdown(sd, SHUT_WR) < 0) {
+        log_errno("shutdown(2)");
         throw std::system_error(errno, std::system_category(),
-                                "write(2) failed");
+                                "shutdown(2) failed");
     }
-    log_debug("wrote %ld bytes to IPC channel", bytes);
+}
+
+void Channel::writeMessage(int sd, const json &j, Encoding encoding,
+                           const std::vector<int> &fds) {
+    if (fds.size() > IPC_MAX_FDS) {
+        throw std::length_error("too many descriptors for one IPC message");
+    }
+    std::string body = encode(j, encoding);
+    auto header = encodeHeader(body.length(), encoding);
+    struct iovec iov[2] = {{header.data(), header.size()},
+                           {body.data(), body.length()}};
+    struct iovec *next = iov;
+    int count = 2;
+    // The descriptors go with the first byte that is written
+    alignas(struct cmsghdr) char control[CMSG_SPACE(IPC_MAX_FDS * sizeof(int))];
+    struct msghdr msg = {};
+    if (!fds.empty()) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+        auto *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    while (count > 0) {
+        ssize_t bytes;
+        if (msg.msg_control) {
+            msg.msg_iov = next;
+            msg.msg_iovlen = count;
+            bytes = sendmsg(sd, &msg, 0);
+        } else {
+            bytes = writev(sd, next, count);
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("writev(2)");
+            throw std::system_error(errno, std::system_category(),
+                                    "writev(2) failed");
+        }
+        msg.msg_control = nullptr;
+        // Skip past what was written, which may end inside the body
+        while (count > 0 && (size_t)bytes >= next->iov_len) {
+            bytes -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = static_cast<char *>(next->iov_base) + bytes;
+            next->iov_len -= bytes;
+        }
+    }
+    log_debug("wrote %zu bytes to IPC channel", body.length());
+}
+
+std::array<char, IPC_HEADER_LEN> Channel::encodeHeader(size_t length,
+                                                       Encoding encoding) {
+    if (length > UINT32_MAX) {
+        throw std::length_error("IPC message is too long");
+    }
+    const uint32_t netlen = htonl(static_cast<uint32_t>(length));
+    std::array<char, IPC_HEADER_LEN> header;
+    memcpy(header.data(), &netlen, sizeof(netlen));
+    header[sizeof(netlen)] = static_cast<char>(encoding);
+    return header;
+}
+
+Channel::Header Channel::decodeHeader(const char *header) {
+    uint32_t netlen;
+    memcpy(&netlen, header, sizeof(netlen));
+    return {ntohl(netlen), static_cast<uint8_t>(header[sizeof(netlen)])};
+}
+
+bool Channel::isSupported(uint8_t encoding) {
+    return encoding <= static_cast<uint8_t>(Encoding::MessagePack);
+}
+
+std::string Channel::encode(const json &j, Encoding encoding) {
+    std::string result;
+    switch (encoding) {
+    case Encoding::Json:
+        result = j.dump();
+        break;
+    case Encoding::Cbor:
+        json::to_cbor(j, result);
+        break;
+    case Encoding::MessagePack:
+        json::to_msgpack(j, result);
+        break;
+    }
+    return result;
+}
+
+json Channel::decode(const char *first, const char *last, Encoding encoding) {
+    switch (encoding) {
+    case Encoding::Json:
+        return json::parse(first, last);
+    case Encoding::Cbor:
+        return json::from_cbor(first, last);
+    case Encoding::MessagePack:
+        return json::from_msgpack(first, last);
+    }
+    throw std::range_error("invalid encoding");
 }
 
 Channel::~Channel() {
@@ -152,6 +364,9 @@ Channel::~Channel() {
             log_errno("close(2)");
         }
     }
+    for (int fd : received_fds) {
+        (void)close(fd);
+    }
     // FIXME: should throw exception here if close() failed.
 }
 
@@ -174,6 +389,16 @@ int Channel::getSockFD() {
     }
 }
 
+void Channel::adoptListeningSocket(int fd) {
+    unbindAndStopListening();
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_errno("fcntl(2)");
+        throw std::system_error(errno, std::system_category(),
+                                "fcntl(2) failed");
+    }
+    sockfd = fd;
+}
+
 void Channel::unbindAndStopListening() {
     if (sockfd >= 0) {
         if (close(sockfd) != 0) {
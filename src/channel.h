@@ -25,28 +25,107 @@
 #include <sys/uio.h>
 #include <sys/un.h>
 
-/* Maximum length of an IPC message */
-#define IPC_MAX_MSGLEN 32768U
+/*
+ * Every message is preceded by its length in bytes, as a 32-bit unsigned
+ * integer in network byte order, and by one byte that names its encoding.
+ */
+#define IPC_HEADER_LEN 5U
 
+/* Maximum length of a request. Replies may be of any length. */
+#define IPC_MAX_MSGLEN (1U << 20)
+
+/*
+ * Maximum number of file descriptors that may be passed with a message, and
+ * that the server holds for a connection before they are used. They are
+ * sent as SCM_RIGHTS ancillary data along with the header of the message.
+ */
+#define IPC_MAX_FDS 16U
+
+#include <array>
+#include <cstdint>
 #include <nlohmann/json.hpp>
+#include <optional>
 #include <string>
+#include <vector>
 using json = nlohmann::json;
 
 class Channel {
   public:
+    //! How the body of a message is encoded. The server answers each request
+    //! in the encoding of the request. A server that does not support the
+    //! encoding answers in JSON with the UnsupportedEncoding key set, and the
+    //! client falls back to JSON.
+    enum class Encoding : uint8_t { Json = 0, Cbor = 1, MessagePack = 2 };
+
+    struct Header {
+        uint32_t length;
+        //! An Encoding value, which may be unknown
+        uint8_t encoding;
+    };
+
     Channel();
     ~Channel();
     void bindAndListen(const std::string &path, int backlog);
     void unbindAndStopListening();
+    //! Use a socket that is already bound and listening, such as one inherited
+    //! from the previous launchd process
+    void adoptListeningSocket(int fd);
     void accept();
     int connect(const std::string &path);
     void disconnect() noexcept;
     json readMessage();
+    //! Like readMessage(), but returns nothing if the peer closed the
+    //! connection instead of starting another message
+    std::optional<json> tryReadMessage();
     void writeMessage(const json &j);
+    //! Write a message, and pass copies of the descriptors with it
+    void writeMessage(const json &j, const std::vector<int> &fds);
+    //! Tell the peer that no more messages will be written. Replies can
+    //! still be read.
+    void shutdownWrite();
+    //! Write a message to a connection that is not owned by a Channel
+    static void writeMessage(int fd, const json &j,
+                             Encoding encoding = Encoding::Json,
+                             const std::vector<int> &fds = {});
     int getSockFD();
 
+    //! Take ownership of the descriptors that came with the messages that
+    //! have been read, oldest first
+    std::vector<int> takeDescriptors();
+
+    //! Like recv(2), but also receive descriptors that were passed with the
+    //! data. They are appended to fds, and are close-on-exec.
+    static ssize_t receive(int sd, char *buf, size_t len,
+                           std::vector<int> &fds);
+
+    //! Use a binary encoding for requests. Replies use the same encoding.
+    void setEncoding(Encoding encoding_) { encoding = encoding_; }
+    Encoding getEncoding() const { return encoding; }
+
+    static std::array<char, IPC_HEADER_LEN> encodeHeader(size_t length,
+                                                         Encoding encoding);
+    static Header decodeHeader(const char *header);
+    static bool isSupported(uint8_t encoding);
+    static std::string encode(const json &j, Encoding encoding);
+    static json decode(const char *first, const char *last,
+                       Encoding encoding);
+
   private:
+    //! Read until the buffer holds at least this many bytes. Returns false
+    //! if the peer closed the connection before anything was read.
+    bool fill(int sd, size_t length);
+
     struct sockaddr_un addr;
     int sockfd = -1;
     int peerfd = -1; // the other side of the channel
+    //! Bytes read but not yet returned. The buffer is reused by each call
+    //! to readMessage(), and only grows.
+    std::vector<char> input;
+    size_t input_len = 0;
+    Encoding encoding = Encoding::Json;
+    //! Kept while a binary encoding is used, so that the request can be sent
+    //! again in JSON to a server that does not support the encoding
+    json last_request;
+    //! Descriptors received but not taken yet
+    std::vector<int> received_fds;
 };
@@ -15,6 +15,7 @@
  */
 
 #include <array>
+#include <pwd.h>
 #include <stdexcept>
 #include <string>
 #include <unistd.h>
@@ -42,6 +43,15 @@ const std::string &Domain::to_string() const {
     }
 }
 
+DomainType Domain::typeFromString(const std::string &name) {
+    for (auto t : {DomainType::System, DomainType::User, DomainType::GUI}) {
+        if (Domain{t, "/"}.to_string() == name) {
+            return t;
+        }
+    }
+    throw std::runtime_error("Invalid domain type: " + name);
+}
+
 const std::vector<std::string> &Domain::getLoadPaths() const {
     switch (dtype) {
     case DomainType::System: {
@@ -92,6 +102,13 @@ std::filesystem::path Domain::detectStateDir() {
     // User and GUI share the same state directory.
     //
 
+    // The domain of this user may be hosted by a daemon running as root
+    std::error_code ec;
+    const auto hosted = hostedStateDir(getuid());
+    if (getuid() != 0 && std::filesystem::exists(hosted / "rpc.sock", ec)) {
+        return hosted;
+    }
+
     // The subdirectory under $HOME where state for the user domains are
     // stored Can be overridden by setting the $XDG_STATE_HOME variable
     std::filesystem::path state_home;
@@ -124,8 +141,22 @@ std::filesystem::path Domain::detectStateDir() {
 }
 
 Domain::Domain(std::optional<DomainType> t,
-               std::optional<std::filesystem::path> statedir_)
+               std::optional<std::filesystem::path> statedir_,
+               std::optional<uid_t> uid_)
     : dtype(t ? *t : detectDomainType()),
-      statedir(statedir_ ? std::move(*statedir_) : detectStateDir()) {
+      statedir(statedir_ ? std::move(*statedir_) : detectStateDir()),
+      uid(uid_) {
     // FIXME: validate permissions of statedir
 }
+
+std::filesystem::path Domain::hostedStateDir(uid_t uid) {
+    return std::filesystem::path{PKGSTATEDIR} / "user" / std::to_string(uid);
+}
+
+Domain Domain::forUser(uid_t uid) {
+    if (!getpwuid(uid)) {
+        throw std::runtime_error("unable to find the user with uid " +
+                                 std::to_string(uid));
+    }
+    return Domain{DomainType::User, hostedStateDir(uid), uid};
+}
@@ -18,6 +18,7 @@
 
 #include <filesystem>
 #include <optional>
+#include <sys/types.h>
 
 enum class DomainType {
     System,
@@ -28,17 +29,30 @@ enum class DomainType {
 class Domain {
   public:
     Domain(std::optional<DomainType> t = std::nullopt,
-           std::optional<std::filesystem::path> statedir_ = std::nullopt);
+           std::optional<std::filesystem::path> statedir_ = std::nullopt,
+           std::optional<uid_t> uid_ = std::nullopt);
+
+    //! The user domain of another user, for a daemon that hosts several
+    //! domains. The state is kept under the system state directory, where
+    //! the user cannot replace the files that launchd writes.
+    static Domain forUser(uid_t uid);
 
     [[nodiscard]] const std::string &to_string() const;
 
+    //! The inverse of to_string(). Throws if the name is not a domain type.
+    static DomainType typeFromString(const std::string &name);
+
     [[nodiscard]] const std::vector<std::string> &getLoadPaths() const;
 
     const DomainType dtype;
     const std::filesystem::path statedir;
+    //! The user that owns the domain, if it is not the user running launchd
+    const std::optional<uid_t> uid;
 
   private:
     static DomainType detectDomainType();
 
+    static std::filesystem::path hostedStateDir(uid_t uid);
+
     std::filesystem::path detectStateDir();
 };
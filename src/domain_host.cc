@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <signal.h>
+
+#include "domain_host.h"
+#include "log.h"
+
+Manager &DomainHost::addDomain(Domain domain) {
+    for (const auto &mgr : managers) {
+        if (mgr->getDomain().statedir == domain.statedir) {
+            throw std::runtime_error("a domain with the state directory " +
+                                     domain.statedir.string() +
+                                     " is already hosted");
+        }
+    }
+    managers.emplace_back(
+        std::make_unique<Manager>(std::move(domain), eventmgr, manifest_cache));
+    Manager &mgr = *managers.back();
+    const auto &hosted = mgr.getDomain();
+    log_notice("hosting the %s domain in %s", hosted.to_string().c_str(),
+               hosted.statedir.c_str());
+    if (running) {
+        mgr.startRunning();
+    }
+    return mgr;
+}
+
+void DomainHost::setupSignalHandlers() {
+    eventmgr.addSignal(SIGPIPE,
+                       [](int) { log_debug("caught SIGPIPE and ignored it"); });
+
+    eventmgr.addSignal(SIGINT, [this](int) { handleShutdownSignal("SIGINT"); });
+
+    eventmgr.addSignal(SIGTERM,
+                       [this](int) { handleShutdownSignal("SIGTERM"); });
+}
+
+void DomainHost::handleShutdownSignal(const std::string &signame) {
+    for (auto &mgr : managers) {
+        mgr->handleShutdownSignal(signame);
+    }
+}
+
+void DomainHost::startRunning() {
+    if (running) {
+        throw std::logic_error("the domain host is already running");
+    }
+    setupSignalHandlers();
+    running = true;
+    for (auto &mgr : managers) {
+        mgr->startRunning();
+    }
+}
+
+void DomainHost::stopRunning() {
+    for (auto &mgr : managers) {
+        if (mgr->fsm.state() != Manager::States::Finished) {
+            mgr->stopRunning();
+        }
+    }
+}
+
+void DomainHost::runMainLoop() {
+    if (!running) {
+        throw std::logic_error("must call startRunning() first");
+    }
+    while (!reexecRequested() && runOnce()) {
+    }
+}
+
+bool DomainHost::reexecRequested() const {
+    return std::any_of(managers.begin(), managers.end(),
+                       [](const auto &mgr) { return mgr->reexecRequested(); });
+}
+
+void DomainHost::cancelReexec() {
+    for (auto &mgr : managers) {
+        mgr->cancelReexec();
+    }
+}
+
+json DomainHost::saveImage() {
+    json domains = json::array();
+    for (auto &mgr : managers) {
+        if (mgr->fsm.state() == Manager::States::Running) {
+            domains.push_back(mgr->saveImage());
+        }
+    }
+    return domains;
+}
+
+void DomainHost::restoreImage(const json &image) {
+    if (running) {
+        throw std::logic_error("the domain host is already running");
+    }
+    setupSignalHandlers();
+    running = true;
+    for (const auto &domain_image : image) {
+        managers.emplace_back(std::make_unique<Manager>(
+            Manager::domainFromImage(domain_image), eventmgr, manifest_cache));
+        managers.back()->restoreImage(domain_image);
+    }
+}
+
+bool DomainHost::runOnce(std::optional<std::chrono::milliseconds> timeout) {
+    if (!running) {
+        throw std::logic_error("must call startRunning() first");
+    }
+    bool active = false;
+    bool shutting_down = false;
+    for (auto &mgr : managers) {
+        if (mgr->checkShutdown()) {
+            shutting_down = true;
+        }
+        if (mgr->fsm.state() != Manager::States::Finished) {
+            active = true;
+        }
+    }
+    if (!active) {
+        return false;
+    }
+    // Poll for jobs that have exited while any domain is shutting down
+    if (shutting_down) {
+        const std::chrono::milliseconds poll_interval{500};
+        timeout = timeout ? std::min(*timeout, poll_interval) : poll_interval;
+    }
+    eventmgr.waitForEvent(timeout);
+    for (auto &mgr : managers) {
+        mgr->syncStateFile();
+    }
+    return true;
+}
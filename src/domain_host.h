@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "domain.h"
+#include "event.h"
+#include "manager.h"
+#include "manifest_cache.h"
+
+//! Runs several domains in one daemon. The domains share an event loop and
+//! a cache of parsed manifests, but each has its own RPC socket, state file
+//! and jobs.
+class DomainHost {
+  public:
+    DomainHost() = default;
+
+    DomainHost(const DomainHost &) = delete;
+    DomainHost &operator=(const DomainHost &) = delete;
+
+    //! Add a domain. If the host is running, the domain is started too.
+    Manager &addDomain(Domain domain);
+
+    //! The managers of the hosted domains, in the order they were added
+    const std::vector<std::unique_ptr<Manager>> &getManagers() const {
+        return managers;
+    }
+
+    ManifestCache &getManifestCache() { return manifest_cache; }
+
+    void startRunning();
+
+    //! Begin a graceful shutdown of every domain
+    void stopRunning();
+
+    //! Run the event processing loop until every domain has shut down
+    void runMainLoop();
+
+    //! Run a single iteration of the event processing loop. Returns false
+    //! once every domain has shut down.
+    bool
+    runOnce(std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+
+    //! True if a domain has asked the daemon to execute itself again
+    bool reexecRequested() const;
+
+    void cancelReexec();
+
+    //! Save every domain for the next launchd process
+    json saveImage();
+
+    //! Start running the domains saved by saveImage() in the previous
+    //! process
+    void restoreImage(const json &image);
+
+  private:
+    void setupSignalHandlers();
+
+    void handleShutdownSignal(const std::string &signame);
+
+    // Declared first so that they outlive the managers
+    kq::EventManager eventmgr;
+    ManifestCache manifest_cache;
+
+    std::vector<std::unique_ptr<Manager>> managers;
+    bool running = false;
+};
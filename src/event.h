@@ -37,6 +37,7 @@
 #error No supported kernel event API detected
 #endif
 
+#include <cassert>
 #include <chrono>
 #include <functional>
 #include <iostream>
@@ -48,6 +49,7 @@
 
 #include <csignal>
 #include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -67,6 +69,8 @@ static inline void print(const std::string &msg) {
 struct proc_event {
     pid_t pid;
     int status;
+    //! Resource usage of the process, if the backend reaped it
+    struct rusage rusage;
 };
 
 struct signal_event {
@@ -85,9 +89,13 @@ struct ipc_event {
     std::string method, arg;
 };
 
+struct socket_write_event {
+    int sockfd;
+};
+
 // N.B. event_type must be kept in sync with the std::variant below.
 typedef std::variant<proc_event, signal_event, socket_event, timer_event,
-                     ipc_event>
+                     ipc_event, socket_write_event>
     Event;
 enum event_type {
     EVTYPE_PROC,
@@ -95,6 +103,7 @@ enum event_type {
     EVTYPE_SOCKET_READ,
     EVTYPE_TIMER,
     EVTYPE_IPC,
+    EVTYPE_SOCKET_WRITE,
     EVTYPE_NONE = 32,
 };
 
@@ -125,6 +134,11 @@ class KernelEventInterface {
 
     virtual void ignoreSocketRead(int sockfd) = 0;
 
+    //! Report when a socket can be written without blocking
+    virtual void monitorSocketWrite(int sockfd) = 0;
+
+    virtual void ignoreSocketWrite(int sockfd) = 0;
+
     virtual void monitorTimer(int timer_id, uint64_t milliseconds) = 0;
 
     virtual void ignoreTimer(int timer_id) = 0;
@@ -135,7 +149,7 @@ class KernelEventInterface {
         std::optional<Event> result;
         if (!child_status.empty()) {
             const auto &it = child_status.begin();
-            result = proc_event{it->first, it->second};
+            result = proc_event{it->first, it->second, {}};
             child_status.erase(it);
         } else if (!pending_events.empty()) {
             result = std::move(pending_events.front());
@@ -201,6 +215,10 @@ class EpollImplementation : public KernelEventInterface {
         cleanup_fds.insert(socket_read_fd);
         epollAdd(socket_read_fd, EVTYPE_SOCKET_READ);
 
+        socket_write_fd = epollCreate();
+        cleanup_fds.insert(socket_write_fd);
+        epollAdd(socket_write_fd, EVTYPE_SOCKET_WRITE);
+
         timer_epfd = epollCreate();
         cleanup_fds.insert(timer_epfd);
         epollAdd(timer_epfd, EVTYPE_TIMER);
@@ -256,6 +274,17 @@ class EpollImplementation : public KernelEventInterface {
                         "return an event");
                 }
             } break;
+            case EVTYPE_SOCKET_WRITE: {
+                auto event = epollGetOne(socket_write_fd, timeout);
+                if (event) {
+                    return Event(
+                        socket_write_event{static_cast<int>(event->data.fd)});
+                } else {
+                    kqtrace::print(
+                        "spurious wakeup: epollGetOne(socket_write_fd) did "
+                        "not return an event");
+                }
+            } break;
             case EVTYPE_TIMER: {
                 auto event = epollGetOne(timer_epfd, timeout);
                 if (event) {
@@ -275,7 +304,10 @@ class EpollImplementation : public KernelEventInterface {
                                    // should in the future.
                     for (const auto &[timer_id, tfd] : timerfd_map) {
                         if (tfd == fd) {
-                            return Event(timer_event{timer_id});
+                            // Timers are one-shot, like EV_ONESHOT in kqueue
+                            const int id = timer_id;
+                            ignoreTimer(id);
+                            return Event(timer_event{id});
                         }
                     }
                     throw std::range_error(
@@ -333,6 +365,23 @@ class EpollImplementation : public KernelEventInterface {
         }
     }
 
+    void monitorSocketWrite(int sockfd) override {
+        struct epoll_event epev;
+        epev.events = EPOLLOUT;
+        epev.data.fd = sockfd;
+        if (epoll_ctl(socket_write_fd, EPOLL_CTL_ADD, sockfd, &epev) < 0) {
+            throw std::system_error(errno, std::system_category(),
+                                    "epoll_ctl()");
+        }
+    }
+
+    void ignoreSocketWrite(int sockfd) override {
+        if (epoll_ctl(socket_write_fd, EPOLL_CTL_DEL, sockfd, nullptr) < 0) {
+            throw std::system_error(errno, std::system_category(),
+                                    "epoll_ctl()");
+        }
+    }
+
     void monitorSignal(int signum) override {
         sigaddset(&sigmask, signum);
         if (signalfd(sigfd, &sigmask, 0) < 0) {
@@ -397,7 +446,7 @@ class EpollImplementation : public KernelEventInterface {
 
     void ignoreTimer(int timer_id) override {
         int tfd = timerfd_map.at(timer_id);
-        int rv = epoll_ctl(epfd, EPOLL_CTL_DEL, tfd, nullptr);
+        int rv = epoll_ctl(timer_epfd, EPOLL_CTL_DEL, tfd, nullptr);
         int saved_errno = errno;
         (void)close(tfd); // FIXME: err handling
         timerfd_map.erase(timer_id);
@@ -437,7 +486,8 @@ class EpollImplementation : public KernelEventInterface {
             kqtrace::print("special case: handling one or more SIGCHLD events");
             for (;;) {
                 int status;
-                pid_t pid = waitpid(-1, &status, WNOHANG);
+                struct rusage rusage;
+                pid_t pid = wait4(-1, &status, WNOHANG, &rusage);
                 if (pid == 0) {
                     break;
                 } else if (pid < 0) {
@@ -449,7 +499,8 @@ class EpollImplementation : public KernelEventInterface {
                     }
                 }
                 if (watch_pids.count(pid)) {
-                    pending_events.emplace(Event(proc_event{pid, status}));
+                    pending_events.emplace(
+                        Event(proc_event{pid, status, rusage}));
                     watch_pids.erase(pid);
                 } else {
                     kqtrace::print("pid " + std::to_string(pid) +
@@ -509,6 +560,7 @@ class EpollImplementation : public KernelEventInterface {
     int epfd = -1;
     int sigfd = -1;
     int socket_read_fd = -1;
+    int socket_write_fd = -1;
     int timer_epfd = -1;
     sigset_t sigmask;                   // signals to catch
     std::unordered_set<int> watch_pids; // process IDs to monitor
@@ -576,11 +628,13 @@ class KqueueImplementation : public KernelEventInterface {
         switch (kev.filter) {
         case EVFILT_PROC:
             return Event(proc_event{static_cast<pid_t>(kev.ident),
-                                    static_cast<int>(kev.data)});
+                                    static_cast<int>(kev.data), {}});
         case EVFILT_SIGNAL:
             return Event(signal_event{static_cast<int>(kev.ident)});
         case EVFILT_READ:
             return Event(socket_event{static_cast<int>(kev.ident)});
+        case EVFILT_WRITE:
+            return Event(socket_write_event{static_cast<int>(kev.ident)});
         case EVFILT_TIMER:
             return Event(timer_event{static_cast<int>(kev.ident)});
         default:
@@ -623,6 +677,14 @@ class KqueueImplementation : public KernelEventInterface {
         changeKevent(sockfd, EVFILT_READ, EV_DELETE, 0);
     }
 
+    void monitorSocketWrite(int sockfd) override {
+        changeKevent(sockfd, EVFILT_WRITE, EV_ADD, 0);
+    }
+
+    void ignoreSocketWrite(int sockfd) override {
+        changeKevent(sockfd, EVFILT_WRITE, EV_DELETE, 0);
+    }
+
     void monitorSignal(int signum) override {
         if (signum == SIGCHLD) {
             throw std::range_error(
@@ -697,7 +759,9 @@ class EventManager {
         signal_callbacks.insert({{signum, callback}});
     }
 
-    void addProcess(pid_t pid, std::function<void(pid_t, int)> callback) {
+    void addProcess(
+        pid_t pid,
+        std::function<void(pid_t, int, const struct rusage &)> callback) {
         impl->monitorChildProcess(pid);
         process_callbacks.insert({{pid, callback}});
     }
@@ -722,6 +786,16 @@ class EventManager {
         socket_read_callbacks.erase(sd);
     }
 
+    void addSocketWrite(int sd, std::function<void(int)> callback) {
+        impl->monitorSocketWrite(sd);
+        socket_write_callbacks.insert({{sd, callback}});
+    }
+
+    void deleteSocketWrite(int sd) {
+        impl->ignoreSocketWrite(sd);
+        socket_write_callbacks.erase(sd);
+    }
+
     int addTimer(const std::chrono::milliseconds milliseconds,
                  std::function<void()> callback) {
         int timer_id = getNextTimerId();
@@ -737,6 +811,10 @@ class EventManager {
         ipc_callbacks.insert({std::move(name), std::move(callback)});
     }
 
+    void deleteIpcMethod(const std::string &name) {
+        ipc_callbacks.erase(name);
+    }
+
     void submitIpcCallback(std::string method, std::string arg) {
         impl->addPendingEvent(ipc_event{std::move(method), std::move(arg)});
     }
@@ -751,8 +829,12 @@ class EventManager {
         switch (event.index()) {
         case EVTYPE_IPC: {
             const auto &ipc_ev = std::get<ipc_event>(event);
-            const auto &callback = ipc_callbacks.at(ipc_ev.method);
-            callback(ipc_ev.arg);
+            auto it = ipc_callbacks.find(ipc_ev.method);
+            if (it == ipc_callbacks.end()) {
+                kqtrace::print("ignoring a call to a deleted IPC method");
+                break;
+            }
+            it->second(ipc_ev.arg);
             // Not needed because IPC methods persist until manually deleted.
             // impl->ignoreCallback(ipc_ev.method);
             break;
@@ -767,22 +849,45 @@ class EventManager {
             const auto &proc_ev = std::get<proc_event>(event);
             const auto &callback = process_callbacks.at(proc_ev.pid);
 
-            callback(proc_ev.pid, proc_ev.status);
+            callback(proc_ev.pid, proc_ev.status, proc_ev.rusage);
             deleteProcess(proc_ev.pid);
             break;
         }
         case EVTYPE_SOCKET_READ: {
-            const auto &sockfd = std::get<socket_event>(event).sockfd;
-            const auto &callback = socket_read_callbacks.at(sockfd);
+            const auto sockfd = std::get<socket_event>(event).sockfd;
+            auto it = socket_read_callbacks.find(sockfd);
+            if (it == socket_read_callbacks.end()) {
+                kqtrace::print("ignoring a socket that was already deleted");
+                break;
+            }
+            // The callback may delete itself, such as when closing the socket
+            auto callback = it->second;
+            callback(sockfd);
+            break;
+        }
+        case EVTYPE_SOCKET_WRITE: {
+            const auto sockfd = std::get<socket_write_event>(event).sockfd;
+            auto it = socket_write_callbacks.find(sockfd);
+            if (it == socket_write_callbacks.end()) {
+                kqtrace::print("ignoring a socket that was already deleted");
+                break;
+            }
+            auto callback = it->second;
             callback(sockfd);
             break;
         }
         case EVTYPE_TIMER: {
-            const auto &timer_id = std::get<timer_event>(event).timer_id;
-            const auto &callback = timer_callbacks.at(timer_id);
+            const auto timer_id = std::get<timer_event>(event).timer_id;
+            auto it = timer_callbacks.find(timer_id);
+            if (it == timer_callbacks.end()) {
+                kqtrace::print("ignoring a timer that was already deleted");
+                break;
+            }
+            // The kernel has already forgotten about the timer because of
+            // EV_ONESHOT, so only the callback needs to be removed.
+            auto callback = std::move(it->second);
+            timer_callbacks.erase(it);
             callback();
-            // Not needed because of EV_ONESHOT
-            // impl->ignoreTimer(timer_id);
             break;
         }
         default:
@@ -802,9 +907,11 @@ class EventManager {
     }
 
     std::unordered_map<int, std::function<void(int)>> signal_callbacks;
-    std::unordered_map<pid_t, std::function<void(pid_t, int)>>
+    std::unordered_map<pid_t,
+                       std::function<void(pid_t, int, const struct rusage &)>>
         process_callbacks;
     std::unordered_map<int, std::function<void(int)>> socket_read_callbacks;
+    std::unordered_map<int, std::function<void(int)>> socket_write_callbacks;
     std::unordered_map<int, std::function<void()>> timer_callbacks;
     std::unordered_map<std::string, std::function<void(std::string)>>
         ipc_callbacks;
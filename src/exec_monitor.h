@@ -56,6 +56,8 @@ enum class ExecErrorCode {
     ExecFailed,
     //! The post-fork cleanup handler failed
     ForkHandlerFailed,
+    //! fcntl(2) could not clear FD_CLOEXEC on an inherited descriptor
+    InheritDescriptorFailed,
 };
 
 //! An error message passed from the child process to the parent prior to exec()
@@ -104,6 +106,8 @@ struct ExecStatus {
             return "ExecFailed";
         case ExecErrorCode::ForkHandlerFailed:
             return "ForkHandlerFailed";
+        case ExecErrorCode::InheritDescriptorFailed:
+            return "InheritDescriptorFailed";
         default:
             throw std::runtime_error("Invalid error code");
         }
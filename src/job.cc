@@ -63,7 +63,7 @@ std::vector<std::string>
 Job::setup_environment_variables(const struct passwd *pwent) {
     std::vector<std::string> result;
     for (const auto &[key, val] : manifest.environment_variables) {
-        std::string kv = std::string{key}.append("=").append(val);
+        std::string kv = key.str() + "=" + expand(val);
         result.emplace_back(std::move(kv));
     }
 
@@ -134,8 +134,23 @@ Job::setup_environment_variables(const struct passwd *pwent) {
     return result;
 }
 
-static std::optional<ExecStatus> replace_fd(int oldfd, const std::string &path,
+//! Replace oldfd with a copy of passed_fd if it is set, or else with the
+//! file at the path
+static std::optional<ExecStatus> replace_fd(int oldfd, int passed_fd,
+                                            const std::string &path,
                                             int flags, int mode) {
+    if (passed_fd == oldfd) {
+        if (fcntl(oldfd, F_SETFD, 0) < 0) {
+            return ExecStatus{ExecErrorCode::Dup2Failed, errno};
+        }
+        return std::nullopt;
+    } else if (passed_fd >= 0) {
+        // The copy is not close-on-exec
+        if (dup2(passed_fd, oldfd) < 0) {
+            return ExecStatus{ExecErrorCode::Dup2Failed, errno};
+        }
+        return std::nullopt;
+    }
     int newfd = open(path.c_str(), flags, mode);
     if (newfd < 0) {
         return ExecStatus{ExecErrorCode::OpenFailed, errno};
@@ -164,24 +179,19 @@ Job::start_child_process(const ExecutionContext &ctx) {
         setpriority(PRIO_PROCESS, 0, manifest.nice.value()) < 0) {
         return ExecStatus{ExecErrorCode::SetPriorityFailed, errno};
     }
-    if (manifest.working_directory &&
-        chdir(manifest.working_directory->c_str()) < 0) {
-        return ExecStatus{ExecErrorCode::SetWorkingDirectoryFailed, errno};
-    }
-    if (manifest.root_directory &&
-        chroot(manifest.root_directory->c_str()) < 0) {
+    if (ctx.root_directory && chroot(ctx.root_directory->c_str()) < 0) {
         return ExecStatus{ExecErrorCode::SetRootDirectoryFailed, errno};
     }
-    if (manifest.user_name) {
+    if (ctx.uid) {
         if (manifest.init_groups &&
-            initgroups(manifest.user_name->c_str(), ctx.gid.value()) < 0) {
+            initgroups(ctx.user_name.c_str(), ctx.gid.value()) < 0) {
             return ExecStatus{ExecErrorCode::InitGroupsFailed, errno};
         }
         if (setgid(ctx.gid.value()) < 0) {
             return ExecStatus{ExecErrorCode::SetGroupIdFailed, errno};
         }
 #if HAVE_SETLOGIN
-        if (setlogin(manifest.user_name->c_str()) < 0) {
+        if (setlogin(ctx.user_name.c_str()) < 0) {
             return ExecStatus{ExecErrorCode::SetLoginFailed, errno};
         }
 #endif
@@ -189,28 +199,39 @@ Job::start_child_process(const ExecutionContext &ctx) {
             return ExecStatus{ExecErrorCode::SetUserIdFailed, errno};
         }
     }
+    // Only directories the job's user can search are usable
+    if (ctx.working_directory && chdir(ctx.working_directory->c_str()) < 0) {
+        return ExecStatus{ExecErrorCode::SetWorkingDirectoryFailed, errno};
+    }
 
     std::optional<ExecStatus> maybe_error;
-    maybe_error = replace_fd(STDIN_FILENO, manifest.stdin_path, O_RDONLY, 0);
+    maybe_error = replace_fd(STDIN_FILENO, stdio_fds[0], ctx.stdin_path,
+                             O_RDONLY, 0);
     if (maybe_error) {
         maybe_error->errorContext = ExecStatus::RedirectStdin;
         return maybe_error;
     }
 
-    maybe_error = replace_fd(STDOUT_FILENO, manifest.stdout_path,
+    maybe_error = replace_fd(STDOUT_FILENO, stdio_fds[1], ctx.stdout_path,
                              O_CREAT | O_WRONLY, 0600);
     if (maybe_error) {
         maybe_error->errorContext = ExecStatus::RedirectStdout;
         return maybe_error;
     }
 
-    maybe_error = replace_fd(STDERR_FILENO, manifest.stderr_path,
+    maybe_error = replace_fd(STDERR_FILENO, stdio_fds[2], ctx.stderr_path,
                              O_CREAT | O_WRONLY, 0600);
     if (maybe_error) {
         maybe_error->errorContext = ExecStatus::RedirectStderr;
         return maybe_error;
     }
 
+    for (int fd : ctx.inherited_fds) {
+        if (fcntl(fd, F_SETFD, 0) < 0) {
+            return ExecStatus{ExecErrorCode::InheritDescriptorFailed, errno};
+        }
+    }
+
     char **envp =
         static_cast<char **>(calloc(ctx.environ.size() + 1, sizeof(char *)));
     if (!envp) {
@@ -221,25 +242,17 @@ Job::start_child_process(const ExecutionContext &ctx) {
     }
 
     char **argv = static_cast<char **>(
-        calloc(manifest.program_arguments.size() + 1, sizeof(char *)));
+        calloc(ctx.program_arguments.size() + 1, sizeof(char *)));
     if (!argv) {
         free(envp);
         return ExecStatus{ExecErrorCode::MemoryAllocationFailed, errno};
     }
-    for (size_t i = 0; i < manifest.program_arguments.size(); i++) {
-        argv[i] = const_cast<char *>(manifest.program_arguments[i].c_str());
+    for (size_t i = 0; i < ctx.program_arguments.size(); i++) {
+        argv[i] = const_cast<char *>(ctx.program_arguments[i].c_str());
     }
 
-    char *path;
-    if (manifest.program) {
-        path = (char *)manifest.program.value().c_str();
-    } else {
-        path = argv[0];
-    }
-    // TODO: move this to manifest load-time error
-    if (!path) {
-        throw std::logic_error("path cannot be empty");
-    }
+    // Manifest::rectify() ensures that Program is always set
+    char *path = const_cast<char *>(ctx.program.c_str());
 //    if (job.manifest.enable_globbing) {
 //        // TODO: globbing
 //    }
@@ -266,25 +279,84 @@ Job::start_child_process(const ExecutionContext &ctx) {
     return ExecStatus{ExecErrorCode::ExecFailed, saved_errno};
 }
 
+std::optional<std::string> Job::credentialsError(const Manifest &manifest,
+                                                  uid_t uid) {
+    const struct passwd *pwent = ::getpwuid(uid);
+    if (!pwent) {
+        return "unable to find the user that owns the domain";
+    }
+    const gid_t gid = pwent->pw_gid;
+    if (manifest.user_name) {
+        pwent = ::getpwnam(manifest.user_name->c_str());
+        if (!pwent || pwent->pw_uid != uid) {
+            return "UserName is not the user that owns the domain";
+        }
+    }
+    if (manifest.group_name) {
+        const struct group *grent = ::getgrnam(manifest.group_name->c_str());
+        if (!grent || grent->gr_gid != gid) {
+            return "GroupName is not the group of the user that owns the "
+                   "domain";
+        }
+    }
+    // A chroot(2) the user controls could hold their own setuid binaries and
+    // system files
+    if (manifest.root_directory) {
+        return "RootDirectory is not allowed in a hosted domain";
+    }
+    if (manifest.nice && static_cast<int>(*manifest.nice) < 0) {
+        return "a negative Nice is not allowed in a hosted domain";
+    }
+    return std::nullopt;
+}
+
 bool Job::run(const std::function<void()> post_fork_cleanup) {
     std::optional<uid_t> uid;
     std::optional<uid_t> gid;
 
+    // Jobs in a domain hosted for another user always run as that user. The
+    // manifest was checked when it was loaded, but the user and group
+    // databases may have changed since.
+    if (context.default_uid) {
+        if (auto error = credentialsError(manifest, *context.default_uid)) {
+            log_error("job %s: %s", label.c_str(), error->c_str());
+            notify("SpawnFailed", {{"Error", *error}});
+            return false;
+        }
+    }
+
     struct group *grent;
     if (manifest.group_name) {
         grent = ::getgrnam(manifest.group_name.value().c_str());
     } else {
         grent = ::getgrgid(getgid());
     }
+    if (manifest.group_name && !grent) {
+        log_error("job %s: unable to find the group to run as", label.c_str());
+        notify("SpawnFailed", {{"Error", "unable to find the group to run as"}});
+        return false;
+    }
+
+    // A hosted domain may be owned by the user that launchd runs as
+    const bool switch_user =
+        context.default_uid ? *context.default_uid != getuid()
+                            : manifest.user_name.has_value();
 
     struct passwd *pwent;
-    if (manifest.user_name) {
+    if (context.default_uid) {
+        pwent = ::getpwuid(*context.default_uid);
+    } else if (manifest.user_name) {
         pwent = ::getpwnam(manifest.user_name.value().c_str());
     } else {
         pwent = ::getpwuid(getuid());
     }
+    if (!pwent) {
+        log_error("job %s: unable to find the user to run as", label.c_str());
+        notify("SpawnFailed", {{"Error", "unable to find the user to run as"}});
+        return false;
+    }
 
-    if (manifest.user_name) {
+    if (switch_user) {
         uid = pwent->pw_uid;
         if (manifest.group_name) {
             gid = grent->gr_gid;
@@ -293,16 +365,54 @@ bool Job::run(const std::function<void()> post_fork_cleanup) {
         }
     }
 
-    ExecutionContext ctx{uid, gid, setup_environment_variables(pwent)};
+    ExecutionContext ctx;
+    ctx.uid = uid;
+    ctx.gid = gid;
+    if (switch_user) {
+        ctx.user_name = pwent->pw_name;
+    }
+    ctx.environ = setup_environment_variables(pwent);
+    ctx.program = expand(manifest.program.value());
+    for (const auto &arg : manifest.program_arguments) {
+        ctx.program_arguments.emplace_back(expand(arg));
+    }
+    if (manifest.working_directory) {
+        ctx.working_directory = expand(*manifest.working_directory);
+    }
+    if (manifest.root_directory) {
+        ctx.root_directory = expand(*manifest.root_directory);
+    }
+    ctx.stdin_path = expand(manifest.stdin_path);
+    ctx.stdout_path = expand(manifest.stdout_path);
+    ctx.stderr_path = expand(manifest.stderr_path);
+    if (!manifest.notifications.send.empty() ||
+        !manifest.notifications.receive.empty()) {
+        auto strings = [](const auto &vec) {
+            return std::vector<std::string>(vec.begin(), vec.end());
+        };
+        const auto *endpoint = context.notifications.attach(
+            label.str(), strings(manifest.notifications.send),
+            strings(manifest.notifications.receive));
+        if (endpoint) {
+            ctx.environ.insert(ctx.environ.end(), endpoint->environ.begin(),
+                               endpoint->environ.end());
+            ctx.inherited_fds = {endpoint->socket, endpoint->table};
+        } else {
+            log_warning("job %s: starting without notifications",
+                        label.c_str());
+        }
+    }
 
     ExecMonitor ipcpipe;
     ipcpipe.createPipe();
 
-    pid = fork();
-    if (pid < 0) {
+    pid() = fork();
+    if (pid() < 0) {
+        const int saved_errno = errno;
         log_errno("fork(2)");
+        notify("SpawnFailed", {{"Error", strerror(saved_errno)}});
         return false;
-    } else if (pid == 0) {
+    } else if (pid() == 0) {
         // This is the child process.
         ipcpipe.becomeChild();
         try {
@@ -318,24 +428,25 @@ bool Job::run(const std::function<void()> post_fork_cleanup) {
         exit(127);
     } else {
         // This is the parent process.
-        started_at = current_time();
-        log_debug("job %s started at %lld with pid %d", manifest.label.c_str(),
-                  static_cast<long long>(started_at.value()), pid);
+        started_at() = current_time();
+        log_debug("job %s started at %lld with pid %d", label.c_str(),
+                  static_cast<long long>(started_at().value()), pid());
 
         ipcpipe.becomeParent();
         ExecStatus status = ipcpipe.readStatus();
         if (status.errorCode == ExecErrorCode::ExecSuccess) {
-            pgid = getpgid(pid);
-            if (pgid < 0) {
-                log_errno("getpgid(pid=%d) failed", pid);
+            pgid() = getpgid(pid());
+            if (pgid() < 0) {
+                log_errno("getpgid(pid=%d) failed", pid());
             }
             return true;
         } else {
-            log_error("job %s failed to start: %s", manifest.label.c_str(),
+            log_error("job %s failed to start: %s", label.c_str(),
                       status.toString().c_str());
-            ::kill(pid, 9);
-            ::waitpid(pid, nullptr, 0);
-            pid = 0;
+            notify("SpawnFailed", {{"Error", status.toString()}});
+            ::kill(pid(), 9);
+            ::waitpid(pid(), nullptr, 0);
+            pid() = 0;
             return false;
         }
     }
@@ -352,14 +463,58 @@ job_schedule_t Job::_set_schedule() const {
 }
 
 Job::Job(std::optional<std::filesystem::path> manifest_path_,
-         Manifest manifest_, kq::EventManager &eventmgr_,
-         StateFile &state_file_)
-    : manifest_path(std::move(manifest_path_)), manifest(std::move(manifest_)),
-      pid(0), pgid(-1), last_exit_status(0), term_signal(0),
-      schedule(_set_schedule()), eventmgr(eventmgr_), state_file(state_file_) {
+         std::shared_ptr<const Manifest> manifest_,
+         const JobContext &context_, std::optional<std::string> instance_)
+    : context(context_), table(context.table), id(table.add(this)),
+      manifest_path(std::move(manifest_path_)),
+      shared_manifest(std::move(manifest_)), manifest(*shared_manifest),
+      instance(std::move(instance_)),
+      label(instance ? Label{manifest.label.str() + *instance}
+                     : manifest.label),
+      schedule(_set_schedule()), eventmgr(context.eventmgr),
+      state_file(context.state_file) {
     initFSM();
 }
 
+Job::~Job() {
+    for (int fd : stdio_fds) {
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+    }
+    context.notifications.detach(label.str());
+    context.status_page.clear(id);
+    table.remove(id);
+}
+
+void Job::adoptStandardDescriptors(std::array<int, 3> &fds) {
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i] >= 0) {
+            if (stdio_fds[i] >= 0) {
+                (void)close(stdio_fds[i]);
+            }
+            stdio_fds[i] = std::exchange(fds[i], -1);
+        }
+    }
+}
+
+std::string Job::expand(const std::string &str) const {
+    if (!instance) {
+        return str;
+    }
+    std::string result;
+    result.reserve(str.size());
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '%' && i + 1 < str.size() && str[i + 1] == 'i') {
+            result.append(*instance);
+            i++;
+        } else {
+            result.push_back(str[i]);
+        }
+    }
+    return result;
+}
+
 void Job::initFSM() {
     fsm.add_transitions(
         {// From: Loaded
@@ -372,7 +527,10 @@ void Job::initFSM() {
                  return !isDisabled() &&
                         (manifest.run_at_load || manifest.keep_alive.always);
              },
-             [this] { fsm.execute(Triggers::StartRequested); },
+             [this] {
+                 start_cause = StartCause::Load;
+                 fsm.execute(Triggers::StartRequested);
+             },
          },
          {
              States::Loaded,
@@ -397,7 +555,7 @@ void Job::initFSM() {
              Triggers::UnloadRequested,
              [] { return true; },
              [this] {
-                 eventmgr.submitIpcCallback("delete_job", manifest.label.str());
+                 eventmgr.submitIpcCallback(context.delete_method, label.str());
              },
          },
          // From: Waiting
@@ -408,7 +566,7 @@ void Job::initFSM() {
              Triggers::StartRequested,
              [] { return true; },
              [this] {
-                 if (timer_id) {
+                 if (timer_id()) {
                      cancelTimer();
                  } // why wouldn't it have a timer if it is waiting??
                  startJob();
@@ -420,10 +578,10 @@ void Job::initFSM() {
              Triggers::UnloadRequested,
              [] { return true; },
              [this] {
-                 if (timer_id) {
+                 if (timer_id()) {
                      cancelTimer();
                  }
-                 eventmgr.submitIpcCallback("delete_job", manifest.label.str());
+                 eventmgr.submitIpcCallback(context.delete_method, label.str());
              },
          },
          // From: Running
@@ -431,7 +589,8 @@ void Job::initFSM() {
          {States::Running, States::Exited, Triggers::ProcessExited,
           [this] {
               return !manifest.keep_alive.always &&
-                     !manifest.start_interval.has_value() && !unload_requested;
+                     !manifest.start_interval.has_value() &&
+                     !unload_requested();
           },
           [this] {
               log_notice("job %s: transitioned to Exited state", getLabel());
@@ -442,9 +601,12 @@ void Job::initFSM() {
              Triggers::ProcessExited,
              [this] {
                  return manifest.keep_alive.always && !shouldThrottle() &&
-                        !unload_requested;
+                        !unload_requested();
+             },
+             [this] {
+                 start_cause = StartCause::KeepAlive;
+                 startJob();
              },
-             [this] { startJob(); },
          },
          {
              States::Running,
@@ -462,7 +624,7 @@ void Job::initFSM() {
              Triggers::ProcessExited,
              [this] {
                  return manifest.keep_alive.always && shouldThrottle() &&
-                        !unload_requested;
+                        !unload_requested();
              },
              [this] { startAfterThrottleInterval(); },
          },
@@ -470,66 +632,70 @@ void Job::initFSM() {
              States::Running,
              States::Unloaded,
              Triggers::ProcessExited,
-             [this] { return unload_requested; },
+             [this] { return unload_requested(); },
              [this] {
-                 eventmgr.submitIpcCallback("delete_job", manifest.label.str());
+                 eventmgr.submitIpcCallback(context.delete_method, label.str());
              },
          },
          // From: Exited
          // To: Any state
+         {
+             States::Exited,
+             States::Running,
+             Triggers::StartRequested,
+             [] { return true; },
+             [this] { startJob(); },
+         },
          {
              States::Exited,
              States::Unloaded,
              Triggers::UnloadRequested,
              [] { return true; },
              [this] {
-                 eventmgr.submitIpcCallback("delete_job", manifest.label.str());
+                 eventmgr.submitIpcCallback(context.delete_method, label.str());
              },
          }});
     fsm.add_debug_fn([this](Job::States from_state, Job::States to_state,
                             Job::Triggers trigger) {
-        log_debug(
-            "job %s: trigger %s caused the state to change from %s to %s ",
-            getLabel(), triggerToString(trigger), stateToString(from_state),
-            stateToString(to_state));
+        stateChanged(from_state, to_state, trigger);
     });
 }
 
 bool Job::killJob(int signum) const noexcept {
-    if (pid == 0) {
+    if (pid() == 0) {
         log_warning("tried to send a signal to a job that is not running");
         return true;
     }
-    if (::kill(pid, signum) < 0) {
+    if (::kill(pid(), signum) < 0) {
         if (errno == ESRCH) {
-            log_debug("kill(2) of pid %d: got ESRCH", pid);
+            log_debug("kill(2) of pid %d: got ESRCH", pid());
         } else {
-            log_errno("kill(2) of pid %d", pid);
+            log_errno("kill(2) of pid %d", pid());
             return false;
         }
-        log_error("kill(2) of PID %d failed: %s", pid, strerror(errno));
+        log_error("kill(2) of PID %d failed: %s", pid(), strerror(errno));
         return false;
     }
-    log_notice("sent signal %d to process %d for job %s", signum, pid,
-               manifest.label.c_str());
+    log_notice("sent signal %d to process %d for job %s", signum, pid(),
+               label.c_str());
     return true;
 }
 
 bool Job::killProcessGroup() const noexcept {
-    if (pgid < 0) {
-        log_warning("job %s has no process group ID", manifest.label.c_str());
+    if (pgid() < 0) {
+        log_warning("job %s has no process group ID", label.c_str());
         return false;
     }
     if (manifest.abandon_process_group) {
-        log_info("process group %d will be abandoned", pgid);
+        log_info("process group %d will be abandoned", pgid());
         return false;
     }
-    pid_t negative_pgid = -1 * pgid;
+    pid_t negative_pgid = -1 * pgid();
     for (;;) {
-        log_debug("sending SIGKILL to process group %d", pgid);
-        if (killpg(pgid, SIGKILL) == -1) {
+        log_debug("sending SIGKILL to process group %d", pgid());
+        if (killpg(pgid(), SIGKILL) == -1) {
             if (errno != ESRCH && errno != EPERM) {
-                log_errno("killpg(pgid=%d)", pgid);
+                log_errno("killpg(pgid=%d)", pgid());
                 return false;
             }
         }
@@ -538,7 +704,7 @@ bool Job::killProcessGroup() const noexcept {
             if (errno == ECHILD) {
                 log_debug(
                     "all child processes in process group %d have been reaped",
-                    pgid);
+                    pgid());
             } else {
                 log_errno("waitpid(2)");
                 return false;
@@ -568,6 +734,16 @@ const char *Job::stateToString(const Job::States &state) {
     }
 }
 
+std::optional<Job::States> Job::stateFromString(const std::string &str) {
+    for (auto state : {States::Loaded, States::Waiting, States::Running,
+                       States::Exited, States::Unloaded}) {
+        if (str == stateToString(state)) {
+            return state;
+        }
+    }
+    return std::nullopt;
+}
+
 const char *Job::triggerToString(const Job::Triggers &trigger) {
     switch (trigger) {
     case Job::Triggers::Bootstrap:
@@ -595,98 +771,155 @@ void Job::reapChildProcess(int status) {
     //      job.term_signal
     //  converting the above into methods that examine exit_status.
     if (WIFEXITED(status)) {
-        last_exit_status = WEXITSTATUS(status);
-        log_debug("job %s pid %d exited with status %d", manifest.label.c_str(),
-                  pid, last_exit_status);
+        last_exit_status() = WEXITSTATUS(status);
+        log_debug("job %s pid %d exited with status %d", label.c_str(),
+                  pid(), last_exit_status());
     } else if (WIFSIGNALED(status)) {
-        last_exit_status = -1;
-        term_signal = WTERMSIG(status);
+        last_exit_status() = -1;
+        term_signal() = WTERMSIG(status);
         log_debug("job %s pid %d was terminated by signal %d",
-                  manifest.label.c_str(), pid, term_signal);
+                  label.c_str(), pid(), term_signal());
     } else if (WIFSTOPPED(status)) {
         throw std::logic_error(
             "This method should not be called when the process is stopped");
     } else {
         throw std::range_error("invalid status");
     }
-    pid = 0;
+    pid() = 0;
     killProcessGroup();
 }
 
 void Job::startJob() {
     log_notice("starting job: %s", getLabel());
-    started_at = current_time();
+    if (started_at()) {
+        restarts()++;
+    }
+    started_at() = current_time();
+    run_cause = start_cause;
+    start_cause = StartCause::Request;
+    run_started = std::chrono::system_clock::now();
     std::function<void()> const post_fork_cleanup = [this]() {
         eventmgr.handleFork();
     };
     if (run(post_fork_cleanup)) {
-        eventmgr.addProcess(pid, [this](pid_t, int status) {
-            if (WIFSTOPPED(status)) {
-                int stop_signal = WSTOPSIG(status);
-                log_info("job %s: pid %d was stopped by signal %d", getLabel(),
-                         pid, stop_signal);
-            } else {
-                reapChildProcess(status);
-                fsm.execute(Job::Triggers::ProcessExited);
-            }
-        });
+        watchProcess();
     } else {
         log_error("FIXME -- what to do here?? throttle and retry?");
     }
 }
 
+void Job::watchProcess() {
+    eventmgr.addProcess(pid(), [this](pid_t, int status,
+                                      const struct rusage &usage) {
+        if (WIFSTOPPED(status)) {
+            int stop_signal = WSTOPSIG(status);
+            log_info("job %s: pid %d was stopped by signal %d", getLabel(),
+                     pid(), stop_signal);
+        } else {
+            recordRun(status, usage);
+            reapChildProcess(status);
+            fsm.execute(Job::Triggers::ProcessExited);
+            if (restart_on_exit) {
+                restart_on_exit = false;
+                if (fsm.state() == States::Exited) {
+                    fsm.execute(Triggers::StartRequested);
+                }
+            }
+        }
+    });
+}
+
+void Job::armTimer(std::chrono::milliseconds delay, TimerAction action) {
+    timer_deadline = std::chrono::steady_clock::now() + delay;
+    timer_action = action;
+    timer_id() = eventmgr.addTimer(delay, [this]() {
+        timer_id() = std::nullopt;
+        switch (timer_action) {
+        case TimerAction::StartRequested:
+            // Only KeepAlive throttling waits before requesting a start
+            start_cause = StartCause::KeepAlive;
+            fsm.execute(Triggers::StartRequested);
+            break;
+        case TimerAction::StartJob:
+            start_cause = StartCause::Interval;
+            startJob();
+            break;
+        }
+    });
+}
+
 void Job::startAfterThrottleInterval() {
-    time_t elapsed = current_time() - *started_at;
+    time_t elapsed = current_time() - *started_at();
     const std::chrono::seconds seconds{manifest.throttle_interval - elapsed};
     const std::chrono::milliseconds milliseconds = seconds;
     log_debug("%s: will restart in %lld seconds due to KeepAlive setting",
-              manifest.label.c_str(), (long long)seconds.count());
-    timer_id = eventmgr.addTimer(milliseconds, [this]() {
-        timer_id = std::nullopt;
-        fsm.execute(Triggers::StartRequested);
-    });
+              label.c_str(), (long long)seconds.count());
+    notify("Throttle", {{"Delay", seconds.count()}});
+    armTimer(milliseconds, TimerAction::StartRequested);
 }
 
 void Job::schedulePeriodicJob() {
-    assert(!timer_id);
+    assert(!timer_id());
     log_debug("periodic job %s will start after T=%u", getLabel(),
               manifest.start_interval.value());
     std::chrono::milliseconds const ms{manifest.start_interval.value()};
-    timer_id = eventmgr.addTimer(ms, [this]() {
-        timer_id = std::nullopt;
-        startJob();
-    });
+    armTimer(ms, TimerAction::StartJob);
+}
+
+void Job::stateChanged(States from_state, States to_state,
+                       Triggers trigger) {
+    table.states[id] = static_cast<uint8_t>(to_state);
+    publishStatus();
+    context.operations.jobChanged(label.str());
+    notify("Transition", {{"From", stateToString(from_state)},
+                          {"To", stateToString(to_state)},
+                          {"Trigger", triggerToString(trigger)}});
+    log_debug("job %s: trigger %s caused the state to change from %s to %s ",
+              getLabel(), triggerToString(trigger), stateToString(from_state),
+              stateToString(to_state));
 }
 
 void Job::forceUnloadJob() noexcept {
-    if (pid) {
-        log_debug("%s: sending SIGKILL to pid %d", getLabel(), pid);
-        kill(pid, SIGKILL);
-        if (waitpid(pid, nullptr, 0) < 0) {
-            log_errno("waitpid(2)");
+    if (pid()) {
+        log_debug("%s: sending SIGKILL to pid %d", getLabel(), pid());
+        kill(pid(), SIGKILL);
+        int status;
+        struct rusage usage;
+        if (wait4(pid(), &status, 0, &usage) < 0) {
+            log_errno("wait4(2)");
+        } else {
+            recordRun(status, usage);
         }
         killProcessGroup();
-        eventmgr.deleteProcess(pid);
-        pid = 0;
-        pgid = -1;
+        eventmgr.deleteProcess(pid());
+        pid() = 0;
+        pgid() = -1;
     }
-    if (timer_id) {
+    if (timer_id()) {
         cancelTimer();
     }
+    const auto from_state = fsm.state();
     fsm.reset(Job::States::Unloaded);
+    if (from_state == Job::States::Unloaded) {
+        return;
+    }
+    // Resetting the state machine bypasses the debug fn
+    try {
+        stateChanged(from_state, Job::States::Unloaded,
+                     Job::Triggers::UnloadRequested);
+    } catch (const std::exception &e) {
+        log_error("job %s: %s", getLabel(), e.what());
+    }
 }
 
 bool Job::shouldThrottle() {
-    time_t elapsed = current_time() - *started_at;
+    time_t elapsed = current_time() - *started_at();
     return elapsed < manifest.throttle_interval;
 }
 
 bool Job::isDisabled() const {
-    const std::string &label = manifest.label.str();
-    const auto state = state_file.getValue();
-    if (state.at("Overrides").contains(label)) {
-        const auto job_state = state["Overrides"][label];
-        return !job_state.at("Enabled");
+    if (const auto *ovr = state_file.findOverride(label.str())) {
+        return !ovr->enabled;
     } else {
         return manifest.disabled;
     }
@@ -698,13 +931,13 @@ bool Job::unloadJob(bool forceUnload) {
                   getLabel());
         return false;
     }
-    if (unload_requested) {
+    if (unload_requested()) {
         log_debug("tried to unload a job that is already in the process of "
                   "unloading: %s",
                   getLabel());
         return false;
     } else {
-        unload_requested = true;
+        unload_requested() = true;
     }
     if (isDisabled() && !forceUnload) {
         log_debug("will not unload %s: it is disabled", getLabel());
@@ -716,8 +949,134 @@ bool Job::unloadJob(bool forceUnload) {
     return true;
 }
 
+void Job::publishStatus() const {
+    static_assert(static_cast<int>(States::Loaded) == LAUNCH_STATUS_LOADED &&
+                      static_cast<int>(States::Running) ==
+                          LAUNCH_STATUS_RUNNING &&
+                      static_cast<int>(States::Unloaded) ==
+                          LAUNCH_STATUS_UNLOADED,
+                  "the status page must use the same state numbers");
+    launch_status_entry entry{};
+    snprintf(entry.label, sizeof(entry.label), "%s", getLabel());
+    entry.pid = pid();
+    entry.state = table.states[id];
+    entry.last_exit_status = last_exit_status();
+    entry.term_signal = term_signal();
+    entry.restarts = table.restarts[id];
+    context.status_page.update(id, entry);
+}
+
+void Job::recordRun(int status, const struct rusage &usage) const noexcept {
+    using namespace std::chrono;
+    RunRecord record{};
+    snprintf(record.label, sizeof(record.label), "%s", getLabel());
+    record.started_at =
+        duration_cast<milliseconds>(run_started.time_since_epoch()).count();
+    record.exited_at =
+        duration_cast<milliseconds>(system_clock::now().time_since_epoch())
+            .count();
+    record.pid = pid();
+    if (WIFSIGNALED(status)) {
+        record.exit_status = -1;
+        record.term_signal = WTERMSIG(status);
+    } else {
+        record.exit_status = WEXITSTATUS(status);
+    }
+    record.cause = run_cause;
+    record.setUsage(usage);
+    context.run_history.append(record);
+    if (record.term_signal) {
+        notify("Exit",
+               {{"PID", record.pid}, {"TermSignal", record.term_signal}});
+    } else {
+        notify("Exit",
+               {{"PID", record.pid}, {"ExitStatus", record.exit_status}});
+    }
+}
+
 void Job::cancelTimer() {
-    log_debug("cancelling timer ID %d", *timer_id);
-    eventmgr.deleteTimer(timer_id.value());
-    timer_id = std::nullopt;
+    log_debug("cancelling timer ID %d", *timer_id());
+    eventmgr.deleteTimer(timer_id().value());
+    timer_id() = std::nullopt;
+}
+
+json Job::saveImage() const {
+    json result = {{"State", stateToString(fsm.state())},
+                   {"Pid", pid()},
+                   {"Pgid", pgid()},
+                   {"LastExitStatus", last_exit_status()},
+                   {"TermSignal", term_signal()},
+                   {"Restarts", table.restarts[id]},
+                   {"RunCause", static_cast<int>(run_cause)},
+                   {"RunStartedAt",
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        run_started.time_since_epoch())
+                        .count()},
+                   {"UnloadRequested", unload_requested()}};
+    if (table.started_at[id]) {
+        result["StartedAt"] = static_cast<int64_t>(*table.started_at[id]);
+    }
+    if (table.timer_ids[id]) {
+        // The monotonic clock is not reset by execve(2)
+        using namespace std::chrono;
+        result["TimerDeadline"] =
+            duration_cast<milliseconds>(timer_deadline.time_since_epoch())
+                .count();
+        result["TimerAction"] = static_cast<int>(timer_action);
+    }
+    return result;
+}
+
+void Job::restoreImage(const json &image) {
+    using namespace std::chrono;
+    const auto state = stateFromString(image.at("State").get<std::string>());
+    if (!state) {
+        throw std::runtime_error("invalid job state");
+    }
+    pid() = image.at("Pid").get<pid_t>();
+    pgid() = image.at("Pgid").get<pid_t>();
+    last_exit_status() = image.at("LastExitStatus").get<int>();
+    term_signal() = image.at("TermSignal").get<int>();
+    restarts() = image.value("Restarts", 0U);
+    run_cause = static_cast<StartCause>(image.value("RunCause", 0));
+    run_started = system_clock::time_point{
+        milliseconds{image.value("RunStartedAt", int64_t{0})}};
+    unload_requested() = image.at("UnloadRequested").get<bool>();
+    if (image.contains("StartedAt")) {
+        started_at() = static_cast<time_t>(image["StartedAt"].get<int64_t>());
+    }
+    fsm.reset(*state);
+    table.states[id] = static_cast<uint8_t>(*state);
+    publishStatus();
+    if (image.contains("TimerDeadline")) {
+        const steady_clock::time_point deadline{
+            milliseconds{image["TimerDeadline"].get<int64_t>()}};
+        const auto delay = duration_cast<milliseconds>(deadline -
+                                                       steady_clock::now());
+        armTimer(std::max(delay, milliseconds{0}),
+                 static_cast<TimerAction>(image["TimerAction"].get<int>()));
+    }
+    if (pid() > 0) {
+        try {
+            watchProcess();
+        } catch (const kq::error::ProcessNotFound &) {
+            // The previous process reaped it but did not handle the event
+            log_warning("job %s: pid %d exited during the re-exec",
+                        getLabel(), pid());
+            pid() = 0;
+            killProcessGroup();
+            fsm.execute(Triggers::ProcessExited);
+            return;
+        }
+        // The process still uses the notification endpoint of the previous
+        // launchd, which was not handed over
+        if (!manifest.notifications.send.empty() ||
+            !manifest.notifications.receive.empty()) {
+            log_warning("job %s: restarting pid %d, which can no longer post "
+                        "or receive notifications",
+                        getLabel(), pid());
+            restart_on_exit = true;
+            (void)killJob(SIGTERM);
+        }
+    }
 }
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <array>
 #include <filesystem>
 
 #include <grp.h>
@@ -30,14 +31,51 @@ using json = nlohmann::json;
 #include "event.h"
 #include "exec_monitor.h"
 #include "fsm.h"
+#include "job_events.h"
+#include "job_table.h"
 #include "log.h"
 #include "manifest.h"
+#include "notify_broker.h"
+#include "run_history.h"
 #include "state_file.hpp"
+#include "status_page.h"
 
 struct ExecutionContext {
     std::optional<gid_t> gid;
     std::optional<uid_t> uid;
+    //! The name of the user to switch to, if uid is set
+    std::string user_name;
     std::vector<std::string> environ;
+
+    // Manifest values after instance substitution
+    std::string program;
+    std::vector<std::string> program_arguments;
+    std::optional<std::string> working_directory;
+    std::optional<std::string> root_directory;
+    std::string stdin_path, stdout_path, stderr_path;
+    //! Close-on-exec descriptors that the program inherits
+    std::vector<int> inherited_fds;
+};
+
+//! The parts of the ::Manager that are shared by all of its jobs
+class OperationTracker;
+
+struct JobContext {
+    kq::EventManager &eventmgr;
+    StateFile &state_file;
+    JobTable &table;
+    //! The IPC method that deletes an unloaded job from the manager
+    std::string delete_method;
+    //! The user that runs jobs without a UserName key, if not the current user
+    std::optional<uid_t> default_uid;
+    StatusPage &status_page;
+    RunHistory &run_history;
+    //! Notified of every state change
+    OperationTracker &operations;
+    //! Clients that watch for job events
+    JobEvents &events;
+    //! Carries the notifications that jobs post and receive
+    NotifyBroker &notifications;
 };
 
 typedef enum {
@@ -50,29 +88,59 @@ struct Job {
     friend class Manager;
     friend struct ManagerTest;
 
-    Job(std::optional<std::filesystem::path> manifest_path_, Manifest manifest_,
-        kq::EventManager &eventmgr, StateFile &state_file_);
+    Job(std::optional<std::filesystem::path> manifest_path_,
+        std::shared_ptr<const Manifest> manifest_, const JobContext &context_,
+        std::optional<std::string> instance_ = std::nullopt);
+
+    ~Job();
+
+    Job(const Job &) = delete;
+    Job &operator=(const Job &) = delete;
 
   protected:
+    // Shared with the ::Manager of this job
+    const JobContext &context;
+
+    //! The table that holds the frequently used state of this job
+    JobTable &table;
+    const JobTable::JobId id;
+
+    pid_t &pid() { return table.pids[id]; }
+    pid_t pid() const { return table.pids[id]; }
+    pid_t &pgid() { return table.pgids[id]; }
+    pid_t pgid() const { return table.pgids[id]; }
+    int &last_exit_status() { return table.last_exit_statuses[id]; }
+    int last_exit_status() const { return table.last_exit_statuses[id]; }
+    int &term_signal() { return table.term_signals[id]; }
+    int term_signal() const { return table.term_signals[id]; }
+    uint32_t &restarts() { return table.restarts[id]; }
+
     //! The time that the job started
-    std::optional<time_t> started_at;
+    std::optional<time_t> &started_at() { return table.started_at[id]; }
 
     std::optional<std::filesystem::path> manifest_path;
-    const Manifest manifest;
-    pid_t pid, pgid;
-    int last_exit_status, term_signal;
+    //! The manifest, which is shared by all instances of a template
+    const std::shared_ptr<const Manifest> shared_manifest;
+    const Manifest &manifest;
+    //! If this job is an instance of a template, the instance name
+    const std::optional<std::string> instance;
+    //! The unique label of this job. For an instance, this is the label of
+    //! the template followed by the instance name.
+    const Label label;
     job_schedule_t schedule;
 
-    const char *getLabel() const { return manifest.label.c_str(); }
+    const char *getLabel() const { return label.c_str(); }
 
     //! Get the current state
     const char *getState() const;
 
     void dump() const {
-        log_debug("job dump: label=%s state=%s", manifest.label.c_str(),
-                  getState());
+        log_debug("job dump: label=%s state=%s", label.c_str(), getState());
     }
 
+    //! Replace each %i in the string with the instance name
+    [[nodiscard]] std::string expand(const std::string &str) const;
+
     bool killJob(int signum) const noexcept;
 
     bool killProcessGroup() const noexcept;
@@ -82,10 +150,37 @@ struct Job {
     //! Return true if the job is disabled
     [[nodiscard]] bool isDisabled() const;
 
+    //! Copy the current state of the job to the status page
+    void publishStatus() const;
+
+    //! Add the process that just exited to the run history
+    void recordRun(int status, const struct rusage &usage) const noexcept;
+
+    //! Use the descriptors as standard input, output and error. Entries of
+    //! -1 are ignored, and the job takes ownership of the others.
+    void adoptStandardDescriptors(std::array<int, 3> &fds);
+
+    //! Tell the clients that watch this job about an event
+    void notify(const char *event, json details) const noexcept {
+        if (!context.events.empty()) {
+            context.events.publish(label.str(), event, std::move(details));
+        }
+    }
+
+    //! The runtime state of the job, for handing over to a new launchd
+    //! process on re-exec
+    [[nodiscard]] json saveImage() const;
+
+    //! Take over the state saved by saveImage() in the previous process,
+    //! including its running process and pending timer
+    void restoreImage(const json &image);
+
   private:
     std::vector<std::string>
     setup_environment_variables(const struct passwd *pwent);
     std::optional<ExecStatus> start_child_process(const ExecutionContext &ctx);
+    //! Reap the process of the job when it exits
+    void watchProcess();
     job_schedule_t _set_schedule() const;
     void reapChildProcess(int status);
     // Used by job_state::starting
@@ -103,18 +198,54 @@ struct Job {
     };
     FSM::Fsm<States, States::Loaded, Triggers> fsm;
     static const char *stateToString(const States &state);
+    static std::optional<States> stateFromString(const std::string &str);
     static const char *triggerToString(const Triggers &trigger);
+    //! Return an error if the manifest would run the job as a user other
+    //! than the given uid, or with a group other than its primary group
+    static std::optional<std::string> credentialsError(const Manifest &manifest,
+                                                       uid_t uid);
+
+    std::optional<int> &timer_id() { return table.timer_ids[id]; }
+
+    //! What happens when the timer of the job expires
+    enum class TimerAction { StartRequested, StartJob };
+    //! When the timer expires, and what it does then. Only used by
+    //! saveImage(), so they are not kept in the table.
+    std::chrono::steady_clock::time_point timer_deadline;
+    TimerAction timer_action = TimerAction::StartRequested;
 
-    std::optional<int> timer_id;
+    //! Set when the boot queue has bootstrapped the job, whether or not
+    //! that started it
+    bool bootstrapped = false;
+
+    //! Start the job again once its process has been stopped
+    bool restart_on_exit = false;
+
+    //! Descriptors that a client passed to use instead of the stdio paths
+    //! of the manifest, or -1. They are not handed over on re-exec.
+    std::array<int, 3> stdio_fds = {-1, -1, -1};
+
+    //! Why the next process will be started
+    StartCause start_cause = StartCause::Request;
+    //! Why the current process was started, and when by the wall clock
+    StartCause run_cause = StartCause::Request;
+    std::chrono::system_clock::time_point run_started;
+
+    void armTimer(std::chrono::milliseconds delay, TimerAction action);
 
     //! If true, the job is in the process of being unloaded
-    bool unload_requested = false;
+    std::vector<bool>::reference unload_requested() {
+        return table.unload_requested[id];
+    }
+    bool unload_requested() const { return table.unload_requested[id]; }
 
-    // Shared with the ::Manager of this job
     kq::EventManager &eventmgr;
     const StateFile &state_file;
 
     void initFSM();
+    //! Record a change of state in the job table, the status page, the
+    //! operation tracker and the event stream
+    void stateChanged(States from_state, States to_state, Triggers trigger);
     void startJob();
 
     //! Send a SIGTERM and wait for the process to exit gracefully.
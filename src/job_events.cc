@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+
+#include <fnmatch.h>
+
+#include "job_events.h"
+#include "log.h"
+
+JobEvents::Id JobEvents::subscribe(std::vector<std::string> patterns,
+                                   Listener listener) {
+    const Id id = next_id++;
+    subscribers.emplace(id, Subscriber{std::move(patterns),
+                                       std::move(listener)});
+    return id;
+}
+
+void JobEvents::unsubscribe(Id id) noexcept { subscribers.erase(id); }
+
+bool JobEvents::matches(const Subscriber &subscriber,
+                        const std::string &label) {
+    if (subscriber.patterns.empty()) {
+        return true;
+    }
+    for (const auto &pattern : subscriber.patterns) {
+        if (fnmatch(pattern.c_str(), label.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobEvents::publish(const std::string &label, const char *event,
+                        json details) noexcept {
+    if (subscribers.empty()) {
+        return;
+    }
+    try {
+        using namespace std::chrono;
+        details["Time"] =
+            duration_cast<milliseconds>(system_clock::now().time_since_epoch())
+                .count();
+        details["Label"] = label;
+        details["Event"] = event;
+        // Look up the next subscriber after each call, because the
+        // listener may change the subscribers
+        Id last = 0;
+        for (auto it = subscribers.upper_bound(last); it != subscribers.end();
+             it = subscribers.upper_bound(last)) {
+            last = it->first;
+            if (matches(it->second, label)) {
+                const auto listener = it->second.listener;
+                listener(details);
+            }
+        }
+    } catch (const std::exception &exc) {
+        log_error("unable to publish a job event: %s", exc.what());
+    }
+}
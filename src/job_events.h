@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * Delivers a record of each job event to the clients that watch for them.
+ * Every record is an object with Time, Label and Event keys, and keys that
+ * depend on the event:
+ *
+ *  - Transition: From, To and Trigger
+ *  - Exit: PID, and ExitStatus or TermSignal
+ *  - Throttle: Delay, in seconds
+ *  - SpawnFailed: Error
+ */
+class JobEvents {
+  public:
+    using Id = uint64_t;
+    using Listener = std::function<void(const json &record)>;
+
+    //! Call the listener for the events of each job whose label matches one
+    //! of the glob patterns, or of every job if there are no patterns
+    Id subscribe(std::vector<std::string> patterns, Listener listener);
+    void unsubscribe(Id id) noexcept;
+
+    //! True if nobody is listening, so that records need not be built
+    [[nodiscard]] bool empty() const { return subscribers.empty(); }
+
+    [[nodiscard]] size_t size() const { return subscribers.size(); }
+
+    //! Send a record to the subscribers. Listeners may subscribe and
+    //! unsubscribe while it is being sent.
+    void publish(const std::string &label, const char *event,
+                 json details = json::object()) noexcept;
+
+  private:
+    struct Subscriber {
+        std::vector<std::string> patterns;
+        Listener listener;
+    };
+
+    [[nodiscard]] static bool matches(const Subscriber &subscriber,
+                                      const std::string &label);
+
+    Id next_id = 1;
+    std::map<Id, Subscriber> subscribers;
+};
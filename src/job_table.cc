@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "job_table.h"
+
+JobTable::JobId JobTable::add(Job *job) {
+    JobId id;
+    if (free_ids.empty()) {
+        id = static_cast<JobId>(jobs.size());
+        jobs.push_back(job);
+        states.push_back(0);
+        pids.push_back(0);
+        pgids.push_back(-1);
+        last_exit_statuses.push_back(0);
+        term_signals.push_back(0);
+        restarts.push_back(0);
+        started_at.emplace_back();
+        timer_ids.emplace_back();
+        unload_requested.push_back(false);
+        pending.push_back(true);
+    } else {
+        id = free_ids.back();
+        free_ids.pop_back();
+        jobs[id] = job;
+        states[id] = 0;
+        pids[id] = 0;
+        pgids[id] = -1;
+        last_exit_statuses[id] = 0;
+        term_signals[id] = 0;
+        restarts[id] = 0;
+        started_at[id] = std::nullopt;
+        timer_ids[id] = std::nullopt;
+        unload_requested[id] = false;
+        pending[id] = true;
+    }
+    return id;
+}
+
+void JobTable::remove(JobId id) {
+    jobs[id] = nullptr;
+    free_ids.push_back(id);
+}
+
+size_t JobTable::heapBytes() const {
+    return jobs.capacity() * sizeof(Job *) + states.capacity() +
+           (pids.capacity() + pgids.capacity()) * sizeof(pid_t) +
+           (last_exit_statuses.capacity() + term_signals.capacity()) *
+               sizeof(int) +
+           restarts.capacity() * sizeof(uint32_t) +
+           started_at.capacity() * sizeof(std::optional<time_t>) +
+           timer_ids.capacity() * sizeof(std::optional<int>) +
+           (unload_requested.capacity() + pending.capacity()) / 8 +
+           free_ids.capacity() * sizeof(JobId);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The state of a job that is read or written on every event is stored in
+ * parallel arrays indexed by a dense job id. Scans over all jobs then read a
+ * few contiguous arrays instead of visiting each Job and its manifest.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <vector>
+
+#include <sys/types.h>
+
+struct Job;
+
+class JobTable {
+  public:
+    using JobId = uint32_t;
+
+    //! Add a job and return its id. Ids of removed jobs are reused.
+    JobId add(Job *job);
+
+    //! Remove a job. Its id may be given to the next job that is added.
+    void remove(JobId id);
+
+    //! The number of slots, including free slots
+    size_t slots() const { return jobs.size(); }
+
+    //! The number of jobs
+    size_t size() const { return jobs.size() - free_ids.size(); }
+
+    //! An estimate of the heap memory used by the table, in bytes
+    size_t heapBytes() const;
+
+    // Each column has one entry per slot. Free slots have a null job.
+    std::vector<Job *> jobs;
+    //! The Job::States value of each job
+    std::vector<uint8_t> states;
+    std::vector<pid_t> pids;
+    std::vector<pid_t> pgids;
+    std::vector<int> last_exit_statuses;
+    std::vector<int> term_signals;
+    //! How many times the process was started again after the first time
+    std::vector<uint32_t> restarts;
+    std::vector<std::optional<time_t>> started_at;
+    std::vector<std::optional<int>> timer_ids;
+    std::vector<bool> unload_requested;
+    //! True if the job is waiting to be added to Manager::jobs
+    std::vector<bool> pending;
+
+  private:
+    std::vector<JobId> free_ids;
+};
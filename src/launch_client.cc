@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "domain.h"
+#include "launch_client.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct launch_reply {
+    uint64_t id;
+    json reply;
+    //! The message body as it was received
+    std::string data;
+    Channel::Encoding encoding;
+};
+
+struct launch_client {
+    std::string path;
+    int fd = -1;
+    Channel::Encoding encoding;
+    uint64_t next_id = 1;
+    //! The first request on the connection, which a reply without an id
+    //! answers
+    uint64_t first_id = 0;
+    //! Requests that have been sent and not returned yet
+    std::unordered_set<uint64_t> outstanding;
+    //! Replies that have arrived and not returned yet
+    std::deque<std::unique_ptr<launch_reply>> ready;
+    std::string input;
+    //! Set once launchd has closed the connection. The replies that arrived
+    //! before that are still returned.
+    bool closed = false;
+
+    ~launch_client() { disconnect(); }
+
+    void connect();
+    void disconnect() noexcept;
+    //! Close the socket, and forget the requests that will not be answered
+    //! now. Replies that have already arrived are kept.
+    void closeSocket() noexcept;
+    //! Connect again if launchd has closed an idle connection
+    void reconnectIfClosed();
+    uint64_t send(const json &request, const int *fds, size_t nfds);
+    uint64_t sendNow(const json &request, const int *fds, size_t nfds);
+    void write(const std::string &message, const int *fds, size_t nfds);
+    //! Read what is available without blocking, and queue the replies
+    void readAvailable();
+    std::unique_ptr<launch_reply> take(const uint64_t *id);
+    std::unique_ptr<launch_reply> wait(const uint64_t *id, int timeout_ms);
+};
+
+namespace {
+
+[[noreturn]] void throwErrno(const char *what) {
+    throw std::system_error(errno, std::system_category(), what);
+}
+
+//! Run a function of the C API, and turn exceptions into errno values
+template <typename T, typename F> T guard(T failure, F f) noexcept {
+    try {
+        return f();
+    } catch (const std::system_error &exc) {
+        errno = exc.code().value();
+    } catch (const std::bad_alloc &) {
+        errno = ENOMEM;
+    } catch (const json::exception &) {
+        errno = EINVAL;
+    } catch (const std::exception &) {
+        errno = EPROTO;
+    }
+    return failure;
+}
+
+json labelRequest(const char *method, const char *label) {
+    if (!label) {
+        throw std::system_error(EINVAL, std::system_category());
+    }
+    return json::array({method, {{"Label", label}}});
+}
+
+int sendRequest(launch_client_t *client, const json &request, uint64_t *id) {
+    *id = client->send(request, nullptr, 0);
+    return 0;
+}
+
+} // namespace
+
+void launch_client::connect() {
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0) {
+        throwErrno("socket(2)");
+    }
+    struct sockaddr_un sun = {};
+    sun.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(sun.sun_path)) {
+        (void)close(sd);
+        throw std::system_error(ENAMETOOLONG, std::system_category());
+    }
+    memcpy(sun.sun_path, path.c_str(), path.size() + 1);
+    if (::connect(sd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        fcntl(sd, F_SETFL, O_NONBLOCK) < 0) {
+        const int saved_errno = errno;
+        (void)close(sd);
+        throw std::system_error(saved_errno, std::system_category(),
+                                "connect(2)");
+    }
+    fd = sd;
+    input.clear();
+    closed = false;
+
+    // Settle the encoding before any request is pipelined behind it
+    first_id = sendNow(json::array({"version"}), nullptr, 0);
+    auto reply = wait(&first_id, -1);
+    if (reply->reply.is_object() &&
+        reply->reply.value("UnsupportedEncoding", false)) {
+        encoding = Channel::Encoding::Json;
+        const uint64_t retry = sendNow(json::array({"version"}), nullptr, 0);
+        (void)wait(&retry, -1);
+    }
+}
+
+void launch_client::disconnect() noexcept {
+    if (fd >= 0) {
+        (void)close(fd);
+        fd = -1;
+    }
+    outstanding.clear();
+    ready.clear();
+    input.clear();
+    closed = false;
+}
+
+void launch_client::closeSocket() noexcept {
+    if (fd >= 0) {
+        (void)close(fd);
+        fd = -1;
+    }
+    outstanding.clear();
+    for (const auto &reply : ready) {
+        outstanding.insert(reply->id);
+    }
+    input.clear();
+    closed = false;
+}
+
+void launch_client::reconnectIfClosed() {
+    if (closed) {
+        closeSocket();
+        connect();
+        return;
+    }
+    if (!outstanding.empty()) {
+        return;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) <= 0) {
+        return;
+    }
+    char byte;
+    if (recv(fd, &byte, 1, MSG_PEEK) > 0) {
+        return;
+    }
+    closeSocket();
+    connect();
+}
+
+uint64_t launch_client::send(const json &request, const int *fds,
+                             size_t nfds) {
+    if (nfds > IPC_MAX_FDS) {
+        throw std::system_error(E2BIG, std::system_category());
+    }
+    if (fd < 0) {
+        connect();
+    } else {
+        reconnectIfClosed();
+    }
+    return sendNow(request, fds, nfds);
+}
+
+uint64_t launch_client::sendNow(const json &request, const int *fds,
+                                size_t nfds) {
+    // Id 0 is left for replies that do not carry an id
+    const uint64_t id = next_id++;
+    json envelope = {{"Id", id}, {"Request", request}};
+    if (nfds > 0) {
+        envelope["FDs"] = nfds;
+    }
+    const auto body = Channel::encode(envelope, encoding);
+    const auto header = Channel::encodeHeader(body.size(), encoding);
+    outstanding.insert(id);
+    try {
+        write(std::string(header.begin(), header.end()) + body, fds, nfds);
+    } catch (...) {
+        closeSocket();
+        throw;
+    }
+    return id;
+}
+
+void launch_client::write(const std::string &message, const int *fds,
+                          size_t nfds) {
+    // The descriptors go with the first byte that is written
+    alignas(struct cmsghdr) char control[CMSG_SPACE(IPC_MAX_FDS * sizeof(int))];
+    struct msghdr msg = {};
+    if (nfds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        auto *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    size_t offset = 0;
+    while (offset < message.size()) {
+        struct iovec iov = {const_cast<char *>(message.data()) + offset,
+                            message.size() - offset};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        const ssize_t bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (bytes >= 0) {
+            offset += bytes;
+            msg.msg_control = nullptr;
+            msg.msg_controllen = 0;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            throwErrno("sendmsg(2)");
+        }
+        // launchd stops reading while its replies are not being read, so
+        // read them while waiting to write
+        struct pollfd pfd = {fd, POLLIN | POLLOUT, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            throwErrno("poll(2)");
+        }
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            readAvailable();
+        }
+    }
+}
+
+void launch_client::readAvailable() {
+    char buf[65536];
+    for (;;) {
+        const ssize_t bytes = recv(fd, buf, sizeof(buf), 0);
+        if (bytes > 0) {
+            input.append(buf, bytes);
+            continue;
+        } else if (bytes == 0) {
+            // The replies before the end are still complete
+            closed = true;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        throwErrno("recv(2)");
+    }
+
+    size_t start = 0;
+    while (input.size() - start >= IPC_HEADER_LEN) {
+        const auto header = Channel::decodeHeader(input.data() + start);
+        const size_t end = start + IPC_HEADER_LEN + header.length;
+        if (input.size() < end) {
+            break;
+        }
+        if (!Channel::isSupported(header.encoding)) {
+            throw std::runtime_error("unsupported encoding");
+        }
+        auto reply = std::make_unique<launch_reply>();
+        reply->encoding = static_cast<Channel::Encoding>(header.encoding);
+        reply->data.assign(input, start + IPC_HEADER_LEN, header.length);
+        auto msg = Channel::decode(reply->data.data(),
+                                   reply->data.data() + reply->data.size(),
+                                   reply->encoding);
+        // A reply without an id answers a request that could not be decoded,
+        // and only the first request is sent before that is ruled out
+        if (msg.is_object() && msg.contains("Id")) {
+            reply->id = msg["Id"].get<uint64_t>();
+            reply->reply = std::move(msg["Reply"]);
+        } else {
+            reply->id = first_id;
+            reply->reply = std::move(msg);
+        }
+        ready.push_back(std::move(reply));
+        start = end;
+    }
+    input.erase(0, start);
+}
+
+std::unique_ptr<launch_reply> launch_client::take(const uint64_t *id) {
+    for (auto it = ready.begin(); it != ready.end(); ++it) {
+        if (!id || (*it)->id == *id) {
+            auto reply = std::move(*it);
+            ready.erase(it);
+            outstanding.erase(reply->id);
+            return reply;
+        }
+    }
+    return nullptr;
+}
+
+std::unique_ptr<launch_reply> launch_client::wait(const uint64_t *id,
+                                                  int timeout_ms) {
+    if (id ? !outstanding.count(*id) : outstanding.empty()) {
+        throw std::system_error(ENOENT, std::system_category());
+    }
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds{timeout_ms};
+    for (;;) {
+        if (auto reply = take(id)) {
+            return reply;
+        }
+        if (closed) {
+            // The reply will never arrive
+            if (id) {
+                outstanding.erase(*id);
+            } else {
+                outstanding.clear();
+            }
+            throw std::system_error(ECONNRESET, std::system_category(),
+                                    "launchd closed the connection");
+        }
+        int remaining = -1;
+        if (timeout_ms >= 0) {
+            remaining = static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now())
+                    .count());
+            remaining = std::max(remaining, 0);
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        const int ready_count = poll(&pfd, 1, remaining);
+        if (ready_count < 0 && errno != EINTR) {
+            throwErrno("poll(2)");
+        } else if (ready_count == 0) {
+            throw std::system_error(ETIMEDOUT, std::system_category());
+        }
+        try {
+            readAvailable();
+        } catch (...) {
+            closeSocket();
+            throw;
+        }
+    }
+}
+
+extern "C" {
+
+launch_client_t *launch_client_open(const char *path,
+                                    enum launch_encoding encoding) {
+    return guard<launch_client_t *>(nullptr, [&] {
+        if (!Channel::isSupported(encoding)) {
+            throw std::system_error(EINVAL, std::system_category());
+        }
+        auto client = std::make_unique<launch_client>();
+        client->path = path ? std::string{path}
+                            : (Domain{}.statedir / "rpc.sock").string();
+        client->encoding = static_cast<Channel::Encoding>(encoding);
+        client->connect();
+        return client.release();
+    });
+}
+
+void launch_client_close(launch_client_t *client) { delete client; }
+
+int launch_client_fd(const launch_client_t *client) { return client->fd; }
+
+enum launch_encoding launch_client_encoding(const launch_client_t *client) {
+    return static_cast<enum launch_encoding>(client->encoding);
+}
+
+int launch_client_send(launch_client_t *client, const char *request,
+                       const int *fds, size_t nfds, uint64_t *id) {
+    return guard(-1, [&] {
+        *id = client->send(json::parse(request), fds, nfds);
+        return 0;
+    });
+}
+
+int launch_request_list(launch_client_t *client, uint64_t *id) {
+    return guard(-1, [&] {
+        return sendRequest(client, json::array({"list"}), id);
+    });
+}
+
+int launch_request_start(launch_client_t *client, const char *label,
+                         uint64_t *id) {
+    return guard(-1, [&] {
+        return sendRequest(client, labelRequest("start", label), id);
+    });
+}
+
+int launch_request_stop(launch_client_t *client, const char *label,
+                        uint64_t *id) {
+    return guard(-1, [&] {
+        return sendRequest(client, labelRequest("stop", label), id);
+    });
+}
+
+int launch_request_remove(launch_client_t *client, const char *label,
+                          uint64_t *id) {
+    return guard(-1, [&] {
+        return sendRequest(client, labelRequest("remove", label), id);
+    });
+}
+
+int launch_request_enable(launch_client_t *client, const char *label,
+                          uint64_t *id) {
+    return guard(-1, [&] {
+        return sendRequest(client, labelRequest("enable", label), id);
+    });
+}
+
+int launch_request_disable(launch_client_t *client, const char *label,
+                           uint64_t *id) {
+    return guard(-1, [&] {
+        return sendRequest(client, labelRequest("disable", label), id);
+    });
+}
+
+int launch_request_kill(launch_client_t *client, const char *label,
+                        const char *signal, uint64_t *id) {
+    return guard(-1, [&] {
+        auto request = labelRequest("kill", label);
+        if (!signal) {
+            throw std::system_error(EINVAL, std::system_category());
+        }
+        request[1]["Signal"] = signal;
+        return sendRequest(client, request, id);
+    });
+}
+
+int launch_request_wait(launch_client_t *client, const uint64_t *operations,
+                        size_t count, double timeout, uint64_t *id) {
+    return guard(-1, [&] {
+        json kwargs = {{"Operations", std::vector<uint64_t>(
+                                          operations, operations + count)}};
+        if (timeout > 0) {
+            kwargs["Timeout"] = timeout;
+        }
+        return sendRequest(client, json::array({"wait", kwargs}), id);
+    });
+}
+
+launch_reply_t *launch_client_wait(launch_client_t *client, uint64_t id,
+                                   int timeout_ms) {
+    return guard<launch_reply_t *>(nullptr, [&] {
+        return client->wait(&id, timeout_ms).release();
+    });
+}
+
+launch_reply_t *launch_client_next(launch_client_t *client, int timeout_ms) {
+    return guard<launch_reply_t *>(nullptr, [&] {
+        return client->wait(nullptr, timeout_ms).release();
+    });
+}
+
+size_t launch_client_outstanding(const launch_client_t *client) {
+    return client->outstanding.size();
+}
+
+void launch_reply_free(launch_reply_t *reply) { delete reply; }
+
+uint64_t launch_reply_id(const launch_reply_t *reply) { return reply->id; }
+
+int launch_reply_failed(const launch_reply_t *reply) {
+    return reply->reply.is_object() && reply->reply.value("error", false);
+}
+
+int launch_reply_operation(const launch_reply_t *reply, uint64_t *operation) {
+    return guard(-1, [&] {
+        const auto &r = reply->reply;
+        if (!r.is_object() || !r.contains("Operation")) {
+            throw std::system_error(ENOENT, std::system_category());
+        }
+        *operation = r["Operation"].get<uint64_t>();
+        return 0;
+    });
+}
+
+int launch_reply_jobs(const launch_reply_t *reply, struct launch_job **jobs,
+                      size_t *count) {
+    return guard(-1, [&] {
+        const auto &r = reply->reply;
+        if (!r.is_array()) {
+            throw std::system_error(EINVAL, std::system_category());
+        }
+        auto *result = static_cast<struct launch_job *>(
+            calloc(r.size() ? r.size() : 1, sizeof(struct launch_job)));
+        if (!result) {
+            throw std::bad_alloc();
+        }
+        try {
+            for (size_t i = 0; i < r.size(); i++) {
+                const auto &job = r[i];
+                const auto &label = job.at("Label").get<std::string>();
+                strncpy(result[i].label, label.c_str(),
+                        LAUNCH_CLIENT_LABEL_MAX - 1);
+                // The pid is "-" when the job is not running
+                const auto &pid = job.at("PID").get<std::string>();
+                result[i].pid = (pid == "-") ? 0 : std::stoi(pid);
+                result[i].last_exit_status = job.at("LastExitStatus");
+            }
+        } catch (...) {
+            free(result);
+            throw;
+        }
+        *jobs = result;
+        *count = r.size();
+        return 0;
+    });
+}
+
+int launch_reply_operations(const launch_reply_t *reply,
+                            struct launch_operation **operations,
+                            size_t *count, int *timed_out) {
+    return guard(-1, [&] {
+        const auto &ops = reply->reply.at("Operations");
+        auto *result = static_cast<struct launch_operation *>(
+            calloc(ops.size() ? ops.size() : 1, sizeof(launch_operation)));
+        if (!result) {
+            throw std::bad_alloc();
+        }
+        bool timed_out_value;
+        try {
+            for (size_t i = 0; i < ops.size(); i++) {
+                const auto &status = ops[i].value("Status", "");
+                result[i].id = ops[i].value("Id", uint64_t{0});
+                if (status == "Pending") {
+                    result[i].status = LAUNCH_OPERATION_PENDING;
+                } else if (status == "Succeeded") {
+                    result[i].status = LAUNCH_OPERATION_SUCCEEDED;
+                } else if (status == "Failed") {
+                    result[i].status = LAUNCH_OPERATION_FAILED;
+                } else {
+                    result[i].status = LAUNCH_OPERATION_UNKNOWN;
+                }
+            }
+            timed_out_value = reply->reply.value("TimedOut", false);
+        } catch (...) {
+            free(result);
+            throw;
+        }
+        *operations = result;
+        *count = ops.size();
+        *timed_out = timed_out_value;
+        return 0;
+    });
+}
+
+char *launch_reply_json(const launch_reply_t *reply) {
+    return guard<char *>(nullptr, [&] {
+        char *result = strdup(reply->reply.dump().c_str());
+        if (!result) {
+            throw std::bad_alloc();
+        }
+        return result;
+    });
+}
+
+const void *launch_reply_data(const launch_reply_t *reply, size_t *len,
+                              enum launch_encoding *encoding) {
+    *len = reply->data.size();
+    *encoding = static_cast<enum launch_encoding>(reply->encoding);
+    return reply->data.data();
+}
+
+} // extern "C"
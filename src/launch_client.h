@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A client for the launchd control protocol, for programs that query and
+ * control jobs without running launchctl.
+ *
+ * A client holds one connection to the RPC socket of a domain and reuses it
+ * for every request. If launchd closed the connection while no request was
+ * outstanding, for example because it was idle, the client connects again.
+ *
+ * Requests are asynchronous. launch_client_send() and the launch_request_*()
+ * functions return once the request has been written, with an id for the
+ * request, and any number of requests may be outstanding. Replies are
+ * collected with launch_client_wait() or launch_client_next(), in any order.
+ * The descriptor returned by launch_client_fd() becomes readable when more
+ * replies arrive, so a client can be driven from an event loop; when it
+ * does, call launch_client_next() with a timeout of 0 until it returns NULL.
+ *
+ * A client must not be used by more than one thread at a time.
+ */
+
+#ifndef LAUNCH_CLIENT_H
+#define LAUNCH_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LAUNCH_CLIENT_LABEL_MAX 128
+
+/* How messages are encoded on the wire. These are the values of the
+ * encoding byte in the header of each message. */
+enum launch_encoding {
+    LAUNCH_ENCODING_JSON = 0,
+    LAUNCH_ENCODING_CBOR = 1,
+    LAUNCH_ENCODING_MSGPACK = 2,
+};
+
+/* The values of launch_operation::status */
+enum launch_operation_status {
+    LAUNCH_OPERATION_PENDING,
+    LAUNCH_OPERATION_SUCCEEDED,
+    LAUNCH_OPERATION_FAILED,
+    /* launchd does not remember the operation */
+    LAUNCH_OPERATION_UNKNOWN,
+};
+
+struct launch_job {
+    char label[LAUNCH_CLIENT_LABEL_MAX];
+    /* 0 if the job is not running */
+    pid_t pid;
+    int last_exit_status;
+};
+
+struct launch_operation {
+    uint64_t id;
+    int status;
+};
+
+typedef struct launch_client launch_client_t;
+typedef struct launch_reply launch_reply_t;
+
+/* Connect to the RPC socket at the given path, or to the socket of the
+ * domain of the caller if path is NULL. Requests are sent in the given
+ * encoding, or in JSON if launchd does not support it. Returns NULL and sets
+ * errno if launchd cannot be reached. */
+launch_client_t *launch_client_open(const char *path,
+                                    enum launch_encoding encoding);
+
+/* Close the connection. Outstanding requests are abandoned. */
+void launch_client_close(launch_client_t *client);
+
+/* The socket of the client, for polling. It changes when the client
+ * connects again. */
+int launch_client_fd(const launch_client_t *client);
+
+/* The encoding that launchd agreed to */
+enum launch_encoding launch_client_encoding(const launch_client_t *client);
+
+/* Send a request, given as JSON text such as ["start", {"Label": "foo"}],
+ * along with copies of nfds descriptors. Stores the id of the request in
+ * *id. Returns 0 on success, or -1 and sets errno. */
+int launch_client_send(launch_client_t *client, const char *request,
+                       const int *fds, size_t nfds, uint64_t *id);
+
+/* Typed requests, which behave like launch_client_send() */
+int launch_request_list(launch_client_t *client, uint64_t *id);
+int launch_request_start(launch_client_t *client, const char *label,
+                         uint64_t *id);
+int launch_request_stop(launch_client_t *client, const char *label,
+                        uint64_t *id);
+int launch_request_remove(launch_client_t *client, const char *label,
+                          uint64_t *id);
+int launch_request_enable(launch_client_t *client, const char *label,
+                          uint64_t *id);
+int launch_request_disable(launch_client_t *client, const char *label,
+                           uint64_t *id);
+/* The signal is a name such as "SIGHUP", or a number */
+int launch_request_kill(launch_client_t *client, const char *label,
+                        const char *signal, uint64_t *id);
+/* Ask launchd to reply when the operations have completed, or after the
+ * timeout in seconds if it is positive */
+int launch_request_wait(launch_client_t *client, const uint64_t *operations,
+                        size_t count, double timeout, uint64_t *id);
+
+/* Wait for the reply to a request, for up to timeout_ms milliseconds, or
+ * forever if it is negative. Replies to other requests that arrive in the
+ * meantime are kept. Returns NULL and sets errno to ETIMEDOUT if there is no
+ * reply yet, to ENOENT if the request is not outstanding, to ECONNRESET if
+ * launchd closed the connection without answering it, or to another value
+ * if the connection failed. Replies that arrived before the connection was
+ * closed or failed can still be collected; the other outstanding requests
+ * are lost when the next request is sent. */
+launch_reply_t *launch_client_wait(launch_client_t *client, uint64_t id,
+                                   int timeout_ms);
+
+/* Like launch_client_wait(), for the next reply to any request */
+launch_reply_t *launch_client_next(launch_client_t *client, int timeout_ms);
+
+/* The number of requests without a reply, including replies that have
+ * arrived but have not been returned yet */
+size_t launch_client_outstanding(const launch_client_t *client);
+
+void launch_reply_free(launch_reply_t *reply);
+
+/* The id of the request */
+uint64_t launch_reply_id(const launch_reply_t *reply);
+
+/* Nonzero if launchd could not carry out the request */
+int launch_reply_failed(const launch_reply_t *reply);
+
+/* Store the id of the operation that a mutating request started. Returns 0,
+ * or -1 and sets errno to ENOENT if the reply has no operation. */
+int launch_reply_operation(const launch_reply_t *reply, uint64_t *operation);
+
+/* Copy the jobs of a reply to launch_request_list() into a new array, which
+ * the caller must free(3). Returns 0, or -1 and sets errno to EINVAL if the
+ * reply is not a list of jobs. */
+int launch_reply_jobs(const launch_reply_t *reply, struct launch_job **jobs,
+                      size_t *count);
+
+/* Copy the operations of a reply to launch_request_wait() into a new array,
+ * which the caller must free(3), and store whether the wait timed out.
+ * Returns 0, or -1 and sets errno to EINVAL. */
+int launch_reply_operations(const launch_reply_t *reply,
+                            struct launch_operation **operations,
+                            size_t *count, int *timed_out);
+
+/* The reply as JSON text, which the caller must free(3). Returns NULL and
+ * sets errno on failure. */
+char *launch_reply_json(const launch_reply_t *reply);
+
+/* The message as it was received, without decoding it again: an object with
+ * the Id and the Reply, in the encoding of the client. The data is valid
+ * until the reply is freed. */
+const void *launch_reply_data(const launch_reply_t *reply, size_t *len,
+                              enum launch_encoding *encoding);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LAUNCH_CLIENT_H */
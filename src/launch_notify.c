@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The notification functions of launch.h, for jobs with a Notifications
+ * key. launchd passes each such job a datagram socket and a read-only
+ * descriptor for the notification table (see notify_table.h). Posts go to
+ * launchd over the socket; launchd updates the table and sends a wakeup to
+ * every job that receives the name. notify_check() reads the current state
+ * of the names that the job receives from the table, so it never blocks and
+ * never needs a reply from launchd.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "launch.h"
+#include "notify_table.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Give up if launchd appears to have died in the middle of an update */
+#define MAX_ATTEMPTS 10000
+
+/* A name that the job receives */
+struct subscription {
+    uint32_t slot;
+    /* The sequence number that was last reported */
+    uint32_t seen;
+    int suspended;
+    struct notify_state state;
+    char name[NOTIFY_NAME_MAX];
+    char buf[NOTIFY_STATE_MAX + 1];
+};
+
+static struct {
+    int initialized;
+    int sock;
+    int table_fd;
+    const struct notify_table_header *header;
+    size_t length;
+    struct subscription *subs;
+    size_t nsubs;
+} notify = {0, -1, -1, NULL, 0, NULL, 0};
+
+static const struct notify_table_entry *
+entry_at(const struct notify_table_header *header, uint32_t slot)
+{
+    return (const struct notify_table_entry *)(header + 1) + slot;
+}
+
+static size_t table_length(uint32_t capacity)
+{
+    return sizeof(struct notify_table_header) +
+           (size_t)capacity * sizeof(struct notify_table_entry);
+}
+
+/* Map the table again if launchd has grown it */
+static int remap_table(void)
+{
+    const struct notify_table_header *header;
+    struct stat sb;
+    uint32_t capacity;
+    void *addr;
+
+    capacity = __atomic_load_n(&notify.header->capacity, __ATOMIC_ACQUIRE);
+    if (table_length(capacity) <= notify.length)
+        return 0;
+    if (fstat(notify.table_fd, &sb) < 0)
+        return -1;
+    addr = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED,
+                notify.table_fd, 0);
+    if (addr == MAP_FAILED)
+        return -1;
+    header = notify.header;
+    notify.header = addr;
+    (void)munmap((void *)header, notify.length);
+    notify.length = (size_t)sb.st_size;
+    return 0;
+}
+
+static int parse_fd(const char *str, char **end)
+{
+    long value;
+
+    errno = 0;
+    value = strtol(str, end, 10);
+    if (errno != 0 || *end == str || value < 0 || value > 65535)
+        return -1;
+    return (int)value;
+}
+
+static int parse_slots(const char *str)
+{
+    const char *p;
+    char *end;
+    size_t count, i;
+    unsigned long slot;
+
+    count = 0;
+    for (p = str; *p != '\0'; p++) {
+        if (*p == ',')
+            count++;
+    }
+    if (*str != '\0')
+        count++;
+    notify.subs = calloc(count ? count : 1, sizeof(*notify.subs));
+    if (notify.subs == NULL)
+        return -1;
+    for (i = 0, p = str; i < count; i++, p = end + 1) {
+        errno = 0;
+        slot = strtoul(p, &end, 10);
+        if (errno != 0 || end == p || (*end != ',' && *end != '\0') ||
+            slot >= __atomic_load_n(&notify.header->count, __ATOMIC_ACQUIRE)) {
+            errno = EINVAL;
+            return -1;
+        }
+        notify.subs[i].slot = (uint32_t)slot;
+        if (remap_table() < 0)
+            return -1;
+        /* Names are written before the entry is counted, and never change */
+        memcpy(notify.subs[i].name, entry_at(notify.header, slot)->name,
+               NOTIFY_NAME_MAX);
+        notify.subs[i].name[NOTIFY_NAME_MAX - 1] = '\0';
+    }
+    notify.nsubs = count;
+    return 0;
+}
+
+static int notify_init(void)
+{
+    const char *fds, *slots;
+    struct stat sb;
+    char *end;
+    void *addr;
+    int saved_errno;
+
+    if (notify.initialized)
+        return 0;
+    fds = getenv(NOTIFY_FD_ENV);
+    slots = getenv(NOTIFY_SLOTS_ENV);
+    if (fds == NULL || slots == NULL) {
+        /* The job does not have a Notifications key */
+        errno = ENOTCONN;
+        return -1;
+    }
+    notify.sock = parse_fd(fds, &end);
+    if (notify.sock < 0 || *end != ',' ||
+        (notify.table_fd = parse_fd(end + 1, &end)) < 0 || *end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(notify.table_fd, &sb) < 0)
+        return -1;
+    if ((size_t)sb.st_size < sizeof(struct notify_table_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+    addr = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED,
+                notify.table_fd, 0);
+    if (addr == MAP_FAILED)
+        return -1;
+    notify.header = addr;
+    notify.length = (size_t)sb.st_size;
+    if (notify.header->magic != NOTIFY_TABLE_MAGIC ||
+        notify.header->version != NOTIFY_TABLE_VERSION ||
+        notify.header->entry_size != sizeof(struct notify_table_entry)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (parse_slots(slots) < 0)
+        goto fail;
+    notify.initialized = 1;
+    return 0;
+
+fail:
+    saved_errno = errno;
+    free(notify.subs);
+    notify.subs = NULL;
+    (void)munmap((void *)notify.header, notify.length);
+    notify.header = NULL;
+    errno = saved_errno;
+    return -1;
+}
+
+/* Copy the state of a subscription into its buffer, and return its sequence
+ * number */
+static int read_entry(struct subscription *sub, uint32_t *sequence)
+{
+    const struct notify_table_entry *entry;
+    uint32_t seq, len;
+    int attempt;
+
+    entry = entry_at(notify.header, sub->slot);
+    for (attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        seq = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        len = entry->length;
+        if (len > NOTIFY_STATE_MAX)
+            len = NOTIFY_STATE_MAX;
+        memcpy(sub->buf, entry->state, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != seq)
+            continue;
+        sub->buf[len] = '\0';
+        sub->state.ns_name = sub->name;
+        sub->state.ns_state = sub->buf;
+        sub->state.ns_len = len;
+        *sequence = seq;
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static struct subscription *find_subscription(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < notify.nsubs; i++) {
+        if (strcmp(notify.subs[i].name, name) == 0)
+            return &notify.subs[i];
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+int notify_post(const char *name, void *state, size_t len)
+{
+    char msg[NOTIFY_POST_MAX];
+    size_t namelen;
+
+    if (notify_init() < 0)
+        return -1;
+    namelen = strlen(name);
+    if (namelen == 0 || namelen >= NOTIFY_NAME_MAX ||
+        len > NOTIFY_STATE_MAX || (len > 0 && state == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(msg, name, namelen + 1);
+    if (len > 0)
+        memcpy(msg + namelen + 1, state, len);
+    for (;;) {
+        if (send(notify.sock, msg, namelen + 1 + len, MSG_NOSIGNAL) >= 0)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+ssize_t notify_check(notify_state_t *changes, size_t nchanges)
+{
+    struct subscription *sub;
+    uint32_t seq;
+    ssize_t count;
+    size_t i;
+    char byte;
+
+    if (notify_init() < 0)
+        return -1;
+    /* Drain the wakeups before reading the table, so that a post after the
+     * table has been read wakes the job up again */
+    for (;;) {
+        if (recv(notify.sock, &byte, 1, MSG_DONTWAIT) >= 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        return -1;
+    }
+    if (remap_table() < 0)
+        return -1;
+    count = 0;
+    for (i = 0; i < notify.nsubs && (size_t)count < nchanges; i++) {
+        sub = &notify.subs[i];
+        if (sub->suspended)
+            continue;
+        seq = __atomic_load_n(&entry_at(notify.header, sub->slot)->sequence,
+                              __ATOMIC_ACQUIRE);
+        if (seq == 0 || seq == sub->seen)
+            continue;
+        if (read_entry(sub, &seq) < 0)
+            return -1;
+        sub->seen = seq;
+        changes[count++] = &sub->state;
+    }
+    return count;
+}
+
+int notify_get_fd(void)
+{
+    if (notify_init() < 0)
+        return -1;
+    return notify.sock;
+}
+
+int notify_suspend(const char *name)
+{
+    struct subscription *sub;
+
+    if (notify_init() < 0)
+        return -1;
+    sub = find_subscription(name);
+    if (sub == NULL)
+        return -1;
+    sub->suspended = 1;
+    return 0;
+}
+
+int notify_resume(const char *name)
+{
+    struct subscription *sub;
+
+    if (notify_init() < 0)
+        return -1;
+    sub = find_subscription(name);
+    if (sub == NULL)
+        return -1;
+    sub->suspended = 0;
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "launch_status.h"
+
+/* Give up if launchd appears to have died in the middle of an update */
+#define MAX_ATTEMPTS 10000
+
+struct launch_status {
+    char *path;
+    const struct launch_status_header *header;
+    size_t length;
+};
+
+static const struct launch_status_entry *
+first_entry(const struct launch_status_header *header)
+{
+    return (const struct launch_status_entry *)(header + 1);
+}
+
+static int map_page(const char *path, const struct launch_status_header **out,
+                    size_t *length)
+{
+    const struct launch_status_header *header;
+    struct stat sb;
+    void *addr;
+    int fd, saved_errno;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0)
+        goto fail;
+    if ((size_t)sb.st_size < sizeof(*header)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    addr = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        goto fail;
+    (void)close(fd);
+
+    /* The capacity of a page never changes, so it can be checked once */
+    header = addr;
+    if (header->magic != LAUNCH_STATUS_MAGIC ||
+        header->version != LAUNCH_STATUS_VERSION ||
+        header->entry_size != sizeof(struct launch_status_entry) ||
+        sizeof(*header) + (size_t)header->capacity * header->entry_size >
+            (size_t)sb.st_size) {
+        (void)munmap(addr, (size_t)sb.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    *out = header;
+    *length = (size_t)sb.st_size;
+    return 0;
+
+fail:
+    saved_errno = errno;
+    (void)close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+/* Switch to the current file if launchd has replaced the page */
+static int check_stale(launch_status_t *status)
+{
+    const struct launch_status_header *header;
+    size_t length;
+
+    if (!(__atomic_load_n(&status->header->flags, __ATOMIC_ACQUIRE) &
+          LAUNCH_STATUS_STALE))
+        return 0;
+    if (map_page(status->path, &header, &length) < 0)
+        return -1;
+    (void)munmap((void *)status->header, status->length);
+    status->header = header;
+    status->length = length;
+    return 0;
+}
+
+static uint32_t read_begin(const struct launch_status_header *header)
+{
+    return __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+}
+
+static int read_retry(const struct launch_status_header *header, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&header->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static uint32_t entry_count(const struct launch_status_header *header)
+{
+    uint32_t count = __atomic_load_n(&header->count, __ATOMIC_RELAXED);
+    return count < header->capacity ? count : header->capacity;
+}
+
+launch_status_t *launch_status_open(const char *path)
+{
+    launch_status_t *status;
+
+    status = calloc(1, sizeof(*status));
+    if (status == NULL)
+        return NULL;
+    status->path = strdup(path);
+    if (status->path == NULL) {
+        free(status);
+        return NULL;
+    }
+    if (map_page(path, &status->header, &status->length) < 0) {
+        int saved_errno = errno;
+        free(status->path);
+        free(status);
+        errno = saved_errno;
+        return NULL;
+    }
+    return status;
+}
+
+void launch_status_close(launch_status_t *status)
+{
+    if (status == NULL)
+        return;
+    (void)munmap((void *)status->header, status->length);
+    free(status->path);
+    free(status);
+}
+
+int launch_status_snapshot(launch_status_t *status,
+                           struct launch_status_entry **entries,
+                           size_t *count)
+{
+    struct launch_status_entry *buf;
+    uint32_t seq, n, i;
+    size_t used;
+    int attempt;
+
+    for (attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        if (check_stale(status) < 0)
+            return -1;
+        seq = read_begin(status->header);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        n = entry_count(status->header);
+        buf = malloc(n ? n * sizeof(*buf) : 1);
+        if (buf == NULL)
+            return -1;
+        memcpy(buf, first_entry(status->header), n * sizeof(*buf));
+        if (read_retry(status->header, seq)) {
+            free(buf);
+            continue;
+        }
+        used = 0;
+        for (i = 0; i < n; i++) {
+            if (buf[i].label[0] == '\0')
+                continue;
+            buf[i].label[LAUNCH_STATUS_LABEL_MAX - 1] = '\0';
+            buf[used++] = buf[i];
+        }
+        *entries = buf;
+        *count = used;
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int launch_status_lookup(launch_status_t *status, const char *label,
+                         struct launch_status_entry *entry)
+{
+    const struct launch_status_entry *entries;
+    uint32_t seq, n, i;
+    int attempt, found;
+
+    for (attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        if (check_stale(status) < 0)
+            return -1;
+        seq = read_begin(status->header);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        n = entry_count(status->header);
+        entries = first_entry(status->header);
+        found = 0;
+        for (i = 0; i < n; i++) {
+            if (strncmp(entries[i].label, label, LAUNCH_STATUS_LABEL_MAX) ==
+                0) {
+                memcpy(entry, &entries[i], sizeof(*entry));
+                found = 1;
+                break;
+            }
+        }
+        if (read_retry(status->header, seq))
+            continue;
+        if (!found || label[0] == '\0') {
+            errno = ESRCH;
+            return -1;
+        }
+        entry->label[LAUNCH_STATUS_LABEL_MAX - 1] = '\0';
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+const char *launch_status_state_name(int32_t state)
+{
+    switch (state) {
+    case LAUNCH_STATUS_LOADED:
+        return "Loaded";
+    case LAUNCH_STATUS_WAITING:
+        return "Waiting";
+    case LAUNCH_STATUS_RUNNING:
+        return "Running";
+    case LAUNCH_STATUS_EXITED:
+        return "Exited";
+    case LAUNCH_STATUS_UNLOADED:
+        return "Unloaded";
+    default:
+        return "Unknown";
+    }
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The status page is a file in the state directory of a domain that
+ * launchd maps into memory and updates in place whenever a job changes
+ * state. Monitoring tools can map it read-only and list the jobs without
+ * making an RPC call.
+ *
+ * The page is a header followed by an array of entries. Only launchd
+ * writes to it. Every update is bracketed by increments of the sequence
+ * number, which is odd while an update is in progress, so a reader that
+ * sees the same even sequence number before and after copying the entries
+ * has a consistent snapshot. When the array must grow, launchd replaces
+ * the file and marks the old page as stale; readers then open the file
+ * again.
+ */
+
+#ifndef LAUNCH_STATUS_H
+#define LAUNCH_STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LAUNCH_STATUS_MAGIC 0x5453444cU /* "LDST" */
+#define LAUNCH_STATUS_VERSION 1U
+#define LAUNCH_STATUS_FILENAME "status"
+#define LAUNCH_STATUS_LABEL_MAX 128
+
+/* Header flags */
+#define LAUNCH_STATUS_STALE 0x1U /* the file has been replaced */
+
+/* The values of launch_status_entry::state */
+enum launch_status_state {
+    LAUNCH_STATUS_LOADED,
+    LAUNCH_STATUS_WAITING,
+    LAUNCH_STATUS_RUNNING,
+    LAUNCH_STATUS_EXITED,
+    LAUNCH_STATUS_UNLOADED,
+};
+
+struct launch_status_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t flags;
+    uint32_t entry_size;
+    uint32_t capacity;
+    /* The number of entries in use, including free entries */
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct launch_status_entry {
+    /* Empty if the entry is free */
+    char label[LAUNCH_STATUS_LABEL_MAX];
+    int32_t pid;
+    int32_t state;
+    int32_t last_exit_status;
+    int32_t term_signal;
+    uint32_t restarts;
+    uint32_t reserved;
+};
+
+typedef struct launch_status launch_status_t;
+
+/* Map the status page at the given path. Returns NULL and sets errno if it
+ * cannot be opened or is not a valid status page. */
+launch_status_t *launch_status_open(const char *path);
+
+void launch_status_close(launch_status_t *status);
+
+/* Copy every job into a new array, which the caller must free(3). Returns 0
+ * on success, or -1 and sets errno. */
+int launch_status_snapshot(launch_status_t *status,
+                           struct launch_status_entry **entries,
+                           size_t *count);
+
+/* Copy the job with the given label. Returns 0 on success, or -1 and sets
+ * errno to ESRCH if there is no such job. */
+int launch_status_lookup(launch_status_t *status, const char *label,
+                         struct launch_status_entry *entry);
+
+/* The name of a launch_status_state value */
+const char *launch_status_state_name(int32_t state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LAUNCH_STATUS_H */
@@ -16,6 +16,7 @@
 
 #include <err.h>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 
 #include "channel.h"
@@ -39,6 +40,26 @@ int launchctl_main(int argc, char *argv[]) {
 
     std::vector<std::string> args(argv + 2, argv + argc);
     auto subcommand = std::string(argv[1]);
+    if (subcommand == "-" || subcommand == "batch") {
+        try {
+            size_t failures;
+            if (subcommand == "-") {
+                failures = client.runBatch(std::cin, Domain());
+            } else {
+                std::ifstream input{args.at(0)};
+                if (!input) {
+                    std::cerr << "ERROR: unable to open " << args.at(0)
+                              << std::endl;
+                    return EXIT_FAILURE;
+                }
+                failures = client.runBatch(input, Domain());
+            }
+            return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+        } catch (const std::exception &exc) {
+            std::cerr << "ERROR: " << exc.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
     if (!client.methodExists(subcommand)) {
         std::cerr << "ERROR: unknown subcommand" << std::endl;
         return EXIT_FAILURE;
@@ -31,8 +31,10 @@
 #endif
 
 #include "config.h"
+#include "domain_host.h"
 #include "log.h"
 #include "manager.h"
+#include "reexec.h"
 
 void double_fork(void);
 
@@ -114,11 +116,38 @@ static bool run_boot_script(const char *path) {
 
 void usage() { printf("todo: usage\n"); }
 
+//! Save the domains and execute the launchd binary again. This only returns
+//! if that fails, after closing the descriptors that were saved.
+static void reexecute(const std::vector<std::string> &args,
+                      const json &domains, bool hosted) {
+    const json image = {
+        {"Version", 1}, {"Hosted", hosted}, {"Domains", domains}};
+    int fd = -1;
+    try {
+        fd = reexec::createImage(image);
+        reexec::execute(args, fd);
+    } catch (const std::exception &exc) {
+        log_error("re-exec failed: %s", exc.what());
+    }
+    if (fd >= 0) {
+        (void)close(fd);
+    }
+    for (const auto &domain : domains) {
+        if (domain.contains("RpcFd")) {
+            (void)close(domain["RpcFd"].get<int>());
+        }
+    }
+}
+
 int launchd_main(int argc, char *argv[]) {
     int c;
     pid_t pid = getpid();
     bool daemonize = false;
     bool boot_manager = false;
+    std::vector<uid_t> hosted_uids;
+    std::optional<int> image_fd;
+    // getopt(3) may reorder argv
+    const std::vector<std::string> args(argv, argv + argc);
 
     //    /* Sanitize environment variables */
     //    if ((getuid() != 0) && (access(getenv("HOME"), R_OK | W_OK | X_OK) <
@@ -128,7 +157,7 @@ int launchd_main(int argc, char *argv[]) {
     //        stderr); exit(1);
     //    }
 
-    while ((c = getopt(argc, argv, "bdv")) != -1) {
+    while ((c = getopt(argc, argv, "bdR:U:v")) != -1) {
         switch (c) {
         case 'b':
             boot_manager = true;
@@ -136,6 +165,19 @@ int launchd_main(int argc, char *argv[]) {
         case 'd':
             daemonize = true;
             break;
+        case 'R':
+            // Set by reexec::execute(), not by users
+            image_fd = atoi(optarg);
+            break;
+        case 'U': {
+            char *endp;
+            const long uid = strtol(optarg, &endp, 10);
+            if (*optarg == '\0' || *endp != '\0' || uid < 0) {
+                errx(1, "invalid uid: %s", optarg);
+            }
+            hosted_uids.push_back(static_cast<uid_t>(uid));
+            break;
+        }
         case 'v':
             //            logmask = LOG_DEBUG;
             break;
@@ -152,27 +194,82 @@ int launchd_main(int argc, char *argv[]) {
     //    log_notice("relaunchd version %s starting",
     //    relaunch::config::VERSION);
 
-    if (boot_manager && !run_boot_script("/lib/relaunchd/bootstrap")) {
+    // After a re-exec, the system is already booted and the process must
+    // keep its pid, so that it remains the parent of the jobs.
+    if (boot_manager && !image_fd &&
+        !run_boot_script("/lib/relaunchd/bootstrap")) {
         err(1, "bootstrap failed");
     }
 
     if (daemonize) {
-        if (chdir("/") != 0) {
-            abort();
-        }
-        if (pid != 1) {
-            double_fork();
+        if (!image_fd) {
+            if (chdir("/") != 0) {
+                abort();
+            }
+            if (pid != 1) {
+                double_fork();
+            }
+            redirect_stdio(pid);
         }
-        redirect_stdio(pid);
     } else {
         log_freopen(stdout);
     }
 
     (void)become_a_subreaper();
 
-    Manager mgr;
-    mgr.startRunning();
-    mgr.runMainLoop();
+    std::optional<json> image;
+    if (image_fd) {
+        try {
+            image = reexec::loadImage(*image_fd);
+            log_notice("restarted by re-exec");
+        } catch (const std::exception &exc) {
+            // The jobs of the previous process are still running, and
+            // booting afresh would start a second copy of every one of them
+            log_error("unable to load the re-exec image: %s", exc.what());
+            errx(1, "unable to load the re-exec image: %s", exc.what());
+        }
+    }
+
+    const bool hosted = image ? image->at("Hosted").get<bool>()
+                              : !hosted_uids.empty();
+    if (!hosted) {
+        Manager mgr = image ? Manager{Manager::domainFromImage(
+                                  image->at("Domains").at(0))}
+                            : Manager{};
+        if (image) {
+            mgr.restoreImage(image->at("Domains").at(0));
+        } else {
+            mgr.startRunning();
+        }
+        for (;;) {
+            mgr.runMainLoop();
+            if (!mgr.reexecRequested()) {
+                break;
+            }
+            reexecute(args, json::array({mgr.saveImage()}), false);
+            mgr.cancelReexec();
+        }
+    } else {
+        // Host the user domains alongside our own domain
+        DomainHost host;
+        if (image) {
+            host.restoreImage(image->at("Domains"));
+        } else {
+            host.addDomain(Domain{});
+            for (const auto uid : hosted_uids) {
+                host.addDomain(Domain::forUser(uid));
+            }
+            host.startRunning();
+        }
+        for (;;) {
+            host.runMainLoop();
+            if (!host.reexecRequested()) {
+                break;
+            }
+            reexecute(args, host.saveImage(), true);
+            host.cancelReexec();
+        }
+    }
 
     if (boot_manager && !run_boot_script("/lib/relaunchd/bootout")) {
         err(1, "bootout failed");
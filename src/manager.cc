@@ -16,9 +16,11 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <dirent.h>
 #include <fcntl.h>
@@ -27,6 +29,7 @@
 #include <signal.h>
 #include <sstream>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -40,13 +43,59 @@
 #include "rpc_server.h"
 #include "signal_names.h"
 #include "state_file.hpp"
+#include "string_pool.h"
 
 using json = nlohmann::json;
 
+//! The key of a manifest in the path index. The file may no longer exist.
+static std::string canonicalPath(const std::filesystem::path &path) {
+    std::error_code ec;
+    auto result = std::filesystem::weakly_canonical(path, ec);
+    return ec ? path.lexically_normal().string() : result.string();
+}
+
+void Manager::createUserStateDir(const Domain &domain) {
+    // The directory belongs to launchd rather than to the user, who could
+    // otherwise replace the files that launchd writes with links to any other
+    // file. The user can read it, and connects to the socket in it.
+    std::vector<std::filesystem::path> missing;
+    for (auto dir = domain.statedir; !dir.empty() && dir != dir.parent_path();
+         dir = dir.parent_path()) {
+        if (std::filesystem::exists(dir)) {
+            break;
+        }
+        missing.push_back(dir);
+    }
+    if (!missing.empty()) {
+        log_debug("creating %s", domain.statedir.c_str());
+        std::filesystem::create_directories(domain.statedir);
+        for (const auto &dir : missing) {
+            std::filesystem::permissions(
+                dir, std::filesystem::perms::owner_all |
+                         std::filesystem::perms::group_read |
+                         std::filesystem::perms::group_exec |
+                         std::filesystem::perms::others_read |
+                         std::filesystem::perms::others_exec);
+        }
+    }
+    for (const auto &dir : {domain.statedir, domain.statedir.parent_path()}) {
+        struct stat sb;
+        if (lstat(dir.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode) ||
+            sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+            throw std::runtime_error(
+                "refusing to use " + domain.statedir.string() + ": " +
+                dir.string() + " is not a directory that only launchd can "
+                               "write to");
+        }
+    }
+}
+
 StateFile Manager::createOrOpenStatefile(const Domain &domain) {
     const auto &statedir = domain.statedir;
 
-    if (getuid() != 0 && !std::filesystem::exists(statedir)) {
+    if (domain.uid) {
+        createUserStateDir(domain);
+    } else if (getuid() != 0 && !std::filesystem::exists(statedir)) {
         log_debug("creating %s", statedir.c_str());
         std::filesystem::create_directories(statedir);
     }
@@ -69,8 +118,20 @@ void Manager::setupSignalHandlers() {
 
 bool Manager::loadManifest(const std::filesystem::path &path,
                            bool overrideDisabled, bool forceLoad) {
-    json obj = manifest::parse(path);
-    return loadManifest(obj, path, overrideDisabled, forceLoad);
+    if (fsm.state() == States::GracefulShutdown) {
+        log_error(
+            "refusing to load a new job while the manager is shutting down");
+        return false;
+    }
+    std::shared_ptr<const Manifest> manifest;
+    try {
+        manifest = manifest_cache.get(path, domain.getLoadPaths());
+    } catch (const std::exception &exc) {
+        log_error("failed to parse manifest at %s: %s", path.c_str(),
+                  exc.what());
+        return false;
+    }
+    return addManifest(std::move(manifest), path, overrideDisabled, forceLoad);
 }
 
 bool Manager::loadManifest(const json &jsondata, const std::string &path,
@@ -80,23 +141,53 @@ bool Manager::loadManifest(const json &jsondata, const std::string &path,
             "refusing to load a new job while the manager is shutting down");
         return false;
     }
-    Manifest manifest;
+    std::shared_ptr<const Manifest> manifest;
     try {
-        manifest = jsondata.get<manifest::Manifest>();
+        manifest = manifest_cache.parse(jsondata, path, domain.getLoadPaths());
     } catch (const std::exception &exc) {
         log_error("failed to parse manifest at %s: %s", path.c_str(),
                   exc.what());
         return false;
     }
+    return addManifest(std::move(manifest), path, overrideDisabled, forceLoad);
+}
+
+bool Manager::addManifest(std::shared_ptr<const Manifest> shared_manifest,
+                          const std::string &path, bool overrideDisabled,
+                          bool forceLoad) {
+    const Manifest &manifest = *shared_manifest;
     const auto &label = static_cast<std::string>(manifest.label);
 
     /* Check for duplicate jobs */
-    if (jobExists(manifest.label) ||
+    if (jobExists(manifest.label) || templates.count(label) > 0 ||
         pending_jobs.count(manifest.label.str()) > 0) {
         log_error("tried to load a duplicate job with label %s", label.c_str());
         return false;
     }
 
+    // The owner of a hosted domain must not be able to run jobs as anyone
+    // else, since launchd runs as root
+    if (domain.uid) {
+        if (auto error = Job::credentialsError(manifest, *domain.uid)) {
+            log_error("will not load %s: %s", label.c_str(), error->c_str());
+            return false;
+        }
+    }
+
+    // Templates are not started; their instances are created on request.
+    if (manifest.isTemplate()) {
+        log_notice("loaded template %s from %s", label.c_str(), path.c_str());
+        templates.emplace(label, std::move(shared_manifest));
+        indexPath(path, label);
+        return true;
+    }
+
+    if (createsDependencyCycle(label, manifest.dependencies())) {
+        log_error("will not load %s: its dependencies would form a cycle",
+                  label.c_str());
+        return false;
+    }
+
     if (overrideDisabled) {
         log_debug("%s: overriding the Disabled key", label.c_str());
         overrideJobEnabled(manifest.label, true);
@@ -115,10 +206,9 @@ bool Manager::loadManifest(const json &jsondata, const std::string &path,
     }
 
     // Check if the job is disabled in the state file
-    auto state = state_file.getValue();
-    if (state.at("Overrides").contains(label)) {
-        const auto job_state = state["Overrides"][label];
-        if (!job_state.at("Enabled")) {
+    const auto *ovr = state_file.findOverride(label);
+    if (ovr) {
+        if (!ovr->enabled) {
             if (forceLoad) {
                 log_notice("will forcibly load %s even though it is disabled "
                            "in the state file",
@@ -133,29 +223,117 @@ bool Manager::loadManifest(const json &jsondata, const std::string &path,
     }
 
     log_notice("loaded job %s from %s", label.c_str(), path.c_str());
-    auto jobp = std::make_unique<Job>(path, manifest, eventmgr, state_file);
-    pending_jobs.emplace(jobp->manifest.label.str(), std::move(jobp));
+    auto jobp = make_slab<Job>(path, std::move(shared_manifest), job_context);
+    pending_jobs.emplace(jobp->label.str(), std::move(jobp));
+    indexPath(path, label);
 
     return true;
 }
 
+void Manager::indexPath(const std::string &path, const std::string &label) {
+    // Jobs submitted over RPC do not have a manifest file
+    if (path != "/dev/null") {
+        path_index[canonicalPath(path)] = label;
+    }
+}
+
+void Manager::unindexPath(const std::optional<std::filesystem::path> &path,
+                          const std::string &label) {
+    if (!path) {
+        return;
+    }
+    auto it = path_index.find(canonicalPath(*path));
+    if (it != path_index.end() && it->second == label) {
+        path_index.erase(it);
+    }
+}
+
+bool Manager::instantiateJob(const Label &label) {
+    if (fsm.state() == States::GracefulShutdown) {
+        log_error(
+            "refusing to load a new job while the manager is shutting down");
+        return false;
+    }
+    const auto &str = label.str();
+    const auto pos = str.find('@');
+    if (pos == std::string::npos || pos + 1 == str.size()) {
+        log_error("%s is not a valid instance label", label.c_str());
+        return false;
+    }
+    const auto template_label = str.substr(0, pos + 1);
+    auto it = templates.find(template_label);
+    if (it == templates.end()) {
+        log_error("cannot create %s: template %s is not loaded", label.c_str(),
+                  template_label.c_str());
+        return false;
+    }
+    if (jobExists(label) || pending_jobs.count(str) > 0) {
+        log_error("tried to load a duplicate job with label %s", label.c_str());
+        return false;
+    }
+    const auto &manifest = *it->second;
+    if (createsDependencyCycle(str, manifest.dependencies())) {
+        log_error("will not load %s: its dependencies would form a cycle",
+                  label.c_str());
+        return false;
+    }
+
+    log_notice("created job %s from template %s", label.c_str(),
+               template_label.c_str());
+    auto jobp = make_slab<Job>(std::nullopt, it->second, job_context,
+                               str.substr(pos + 1));
+    pending_jobs.emplace(str, std::move(jobp));
+    return true;
+}
+
+bool Manager::templateExists(const Label &label) const {
+    return templates.count(label.str()) > 0;
+}
+
+bool Manager::unloadTemplate(const Label &label) {
+    auto it = templates.find(label.str());
+    if (it == templates.end()) {
+        log_info("tried to unload a template that is not loaded: %s",
+                 label.c_str());
+        return false;
+    }
+    // Each loaded instance holds a reference to the template manifest.
+    if (it->second.use_count() > 1) {
+        log_error("will not unload template %s: it has %ld instances",
+                  label.c_str(), it->second.use_count() - 1);
+        return false;
+    }
+    templates.erase(it);
+    for (auto pit = path_index.begin(); pit != path_index.end(); ++pit) {
+        if (pit->second == label.str()) {
+            path_index.erase(pit);
+            break;
+        }
+    }
+    log_notice("unloaded template %s", label.c_str());
+    return true;
+}
+
 bool Manager::unloadJob(Job &job, bool overrideDisabled, bool forceUnload) {
-    auto it = jobs.find(static_cast<std::string>(job.manifest.label));
+    auto it = jobs.find(job.label.str());
     if (it != jobs.end()) {
         if (overrideDisabled) {
             log_debug("%s: overriding the Disabled key", job.getLabel());
-            overrideJobEnabled(job.manifest.label, false);
+            overrideJobEnabled(job.label, false);
         }
         return job.unloadJob(forceUnload);
     } else {
         log_info("tried to unload a job that is not loaded: %s",
-                 job.manifest.label.c_str());
+                 job.label.c_str());
         return false;
     }
 }
 
 bool Manager::unloadJob(const Label &label, bool overrideDisabled,
                         bool forceUnload) {
+    if (templateExists(label)) {
+        return unloadTemplate(label);
+    }
     if (!jobExists(label)) {
         log_info("tried to unload a job that is not loaded: %s", label.c_str());
         return false;
@@ -166,70 +344,255 @@ bool Manager::unloadJob(const Label &label, bool overrideDisabled,
 
 bool Manager::unloadJob(const std::filesystem::path &path,
                         bool overrideDisabled, bool forceUnload) {
-    json obj;
-    try {
-        obj = manifest::parse(path);
-    } catch (...) {
-        log_error("error parsing %s", path.c_str());
-        return false;
+    const auto key = canonicalPath(path);
+    auto it = path_index.find(key);
+    if (it != path_index.end()) {
+        return unloadJob(Label{it->second}, overrideDisabled, forceUnload);
     }
-    std::string buf;
-    if (obj.contains("Label")) {
-        obj.at("Label").get_to(buf);
-        return unloadJob(Label{buf}, overrideDisabled, forceUnload);
-    } else {
-        log_error("manifest has no Label key");
+
+    // Otherwise, unload every manifest that was loaded from the directory,
+    // except for jobs that are already being unloaded.
+    std::vector<std::string> labels;
+    bool found = false;
+    for (const auto &[manifest_path, label] : path_index) {
+        if (std::filesystem::path{manifest_path}.parent_path() != key) {
+            continue;
+        }
+        found = true;
+        auto jit = jobs.find(label);
+        if (jit != jobs.end() &&
+            (jit->second->unload_requested() ||
+             jit->second->fsm.state() == Job::States::Unloaded)) {
+            continue;
+        }
+        labels.push_back(label);
+    }
+    if (!found) {
+        log_error("no jobs were loaded from %s", path.c_str());
         return false;
     }
+    bool success = true;
+    for (const auto &label : labels) {
+        if (!unloadJob(Label{label}, overrideDisabled, forceUnload)) {
+            log_warning("unload failed: %s", label.c_str());
+            success = false;
+        }
+    }
+    return success;
 }
 
 json Manager::listJobs() {
     auto result = json::array();
-    for (const auto &[label, jobp] : jobs) {
-        auto &job = *jobp;
-        std::string pid = (job.pid == 0) ? "-" : std::to_string(job.pid);
-        if (job.pid == 0) {
-            pid = "-";
-        } else {
-            pid = std::to_string(job.pid);
+    for (JobTable::JobId id = 0; id < job_table.slots(); id++) {
+        const Job *job = job_table.jobs[id];
+        if (!job || job_table.pending[id]) {
+            continue;
         }
+        const pid_t pid = job_table.pids[id];
         result.emplace_back(json::object({
-            {"Label", std::string{job.manifest.label}},
-            {"PID", std::move(pid)},
-            {"LastExitStatus", job.last_exit_status},
+            {"Label", job->label.str()},
+            {"PID", (pid == 0) ? "-" : std::to_string(pid)},
+            {"LastExitStatus", job_table.last_exit_statuses[id]},
         }));
     }
     return result;
 }
 
+bool Manager::stopJob(const Label &label) {
+    if (!jobExists(label)) {
+        return false;
+    }
+    getJob(label).fsm.execute(Job::Triggers::StopRequested);
+    return true;
+}
+
+bool Manager::adoptStandardDescriptors(const Label &label,
+                                       std::array<int, 3> &fds) {
+    for (auto *map : {&jobs, &pending_jobs}) {
+        auto it = map->find(label.str());
+        if (it != map->end()) {
+            it->second->adoptStandardDescriptors(fds);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::optional<JobStatus> Manager::jobStatus(const std::string &label) const {
+    for (const auto *map : {&jobs, &pending_jobs}) {
+        auto it = map->find(label);
+        if (it != map->end()) {
+            const Job &job = *it->second;
+            return JobStatus{static_cast<int>(job.fsm.state()), job.pid(),
+                             job.bootstrapped};
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<Operation::Id> Manager::requestStart(const Label &label) {
+    if (!jobExists(label)) {
+        return std::nullopt;
+    }
+    startJob(getJob(label));
+    const auto id = operations.begin(Operation::Kind::Start);
+    operations.expect(id, label.str());
+    operations.commit(id);
+    return id;
+}
+
+std::optional<Operation::Id> Manager::requestStop(const Label &label) {
+    if (!jobExists(label)) {
+        return std::nullopt;
+    }
+    // The pid is recorded before the signal is sent
+    const auto id = operations.begin(Operation::Kind::Stop);
+    operations.expect(id, label.str());
+    stopJob(label);
+    operations.commit(id);
+    return id;
+}
+
+Operation::Id Manager::requestLoad(const std::vector<std::string> &paths,
+                                   bool overrideDisabled, bool forceLoad,
+                                   bool &ok) {
+    std::unordered_set<std::string> before;
+    for (const auto *map : {&jobs, &pending_jobs}) {
+        for (const auto &[label, jobp] : *map) {
+            before.insert(label);
+        }
+    }
+    ok = true;
+    for (const auto &path : paths) {
+        if (!loadAllManifests(path, overrideDisabled, forceLoad)) {
+            ok = false;
+        }
+    }
+    startRunning();
+
+    const auto id = operations.begin(Operation::Kind::Load);
+    for (const auto *map : {&jobs, &pending_jobs}) {
+        for (const auto &[label, jobp] : *map) {
+            if (before.count(label) == 0) {
+                operations.expect(id, label);
+            }
+        }
+    }
+    operations.commit(id);
+    return id;
+}
+
+Operation::Id Manager::requestUnload(const std::function<bool()> &unload,
+                                     bool &ok) {
+    std::vector<std::string> candidates;
+    for (const auto &[label, jobp] : jobs) {
+        if (!jobp->unload_requested() &&
+            jobp->fsm.state() != Job::States::Unloaded) {
+            candidates.push_back(label);
+        }
+    }
+    ok = unload();
+
+    const auto id = operations.begin(Operation::Kind::Unload);
+    for (const auto &label : candidates) {
+        auto it = jobs.find(label);
+        if (it == jobs.end() || it->second->unload_requested()) {
+            operations.expect(id, label);
+        }
+    }
+    operations.commit(id);
+    return id;
+}
+
+json Manager::runHistory(const std::optional<std::string> &label,
+                         size_t limit) const {
+    auto result = json::array();
+    for (const auto &record : run_history.query(label, limit)) {
+        result.push_back(record.toJson());
+    }
+    return result;
+}
+
 void Manager::overrideJobEnabled(const Label &label_, bool enabled) {
     // FIXME: do we care if it exists?
     //  auto & job = manager_get_job_by_label(label);
     const auto &label = static_cast<std::string>(label_);
-    auto doc = state_file.getValue();
-    if (doc.at("Overrides").contains(label)) {
-        doc["Overrides"][label]["Enabled"] = enabled;
-    } else {
-        doc["Overrides"].emplace(label, json::object({{"Enabled", enabled}}));
-    }
-    state_file.setValue(doc);
+    const auto *current = state_file.findOverride(label);
+    auto ovr = current ? *current : StateFile::Override{};
+    ovr.enabled = enabled;
+    state_file.setOverride(label, ovr);
     log_notice("job %s: setting enabled=%d", label.c_str(), enabled);
 }
 
 Manager::Manager(Domain domain_)
-    : domain(std::move(domain_)), state_file(createOrOpenStatefile(domain)) {
+    : owned_eventmgr(std::make_unique<kq::EventManager>()),
+      owned_manifest_cache(std::make_unique<ManifestCache>()),
+      notify_broker(*owned_eventmgr), domain(std::move(domain_)),
+      eventmgr(*owned_eventmgr),
+      manifest_cache(*owned_manifest_cache), rpc_server(eventmgr, *this),
+      operations(eventmgr,
+                 [this](const auto &label) { return jobStatus(label); }),
+      state_file(createOrOpenStatefile(domain)),
+      job_context{eventmgr,    state_file, job_table,
+                  "delete_job", domain.uid, status_page,
+                  run_history, operations, job_events,
+                  notify_broker} {
+    initialize();
+}
+
+Manager::Manager(Domain domain_, kq::EventManager &eventmgr_,
+                 ManifestCache &manifest_cache_)
+    : notify_broker(eventmgr_), domain(std::move(domain_)),
+      eventmgr(eventmgr_), manifest_cache(manifest_cache_),
+      rpc_server(eventmgr, *this),
+      operations(eventmgr,
+                 [this](const auto &label) { return jobStatus(label); }),
+      state_file(createOrOpenStatefile(domain)),
+      // Each domain on the shared event loop needs its own IPC method
+      job_context{eventmgr, state_file, job_table,
+                  "delete_job:" + domain.statedir.string(), domain.uid,
+                  status_page, run_history, operations, job_events,
+                  notify_broker} {
+    initialize();
+}
+
+void Manager::initialize() {
     initFSM();
-    eventmgr.addIpcMethod("delete_job", [this](const std::string &arg) {
-        auto it = jobs.find(arg);
-        if (it != jobs.end()) {
-            jobs.erase(it);
-        }
-    });
+    try {
+        status_page.open(domain.statedir / LAUNCH_STATUS_FILENAME);
+    } catch (const std::system_error &exc) {
+        // Clients can still use the RPC interface
+        log_error("unable to create the status page: %s", exc.what());
+    }
+    try {
+        run_history.open(domain.statedir / "history");
+    } catch (const std::system_error &exc) {
+        log_error("unable to open the run history: %s", exc.what());
+    }
+    try {
+        notify_broker.open(domain.statedir / NOTIFY_TABLE_FILENAME);
+        notify_broker.setListener(
+            [this](const std::string &name) { notificationPosted(name); });
+    } catch (const std::system_error &exc) {
+        // Jobs are started without notifications
+        log_error("unable to create the notification table: %s", exc.what());
+    }
+    eventmgr.addIpcMethod(job_context.delete_method,
+                          [this](const std::string &arg) {
+                              auto it = jobs.find(arg);
+                              if (it != jobs.end()) {
+                                  unindexPath(it->second->manifest_path, arg);
+                                  jobs.erase(it);
+                                  operations.jobChanged(arg);
+                              }
+                          });
 }
 
 Manager::~Manager() {
-    chan.unbindAndStopListening();
+    cancelBootQueue();
+    stopRpcServer();
     forceUnloadAllJobs();
+    eventmgr.deleteIpcMethod(job_context.delete_method);
 }
 
 bool Manager::handleEvent(std::optional<std::chrono::milliseconds> timeout) {
@@ -240,15 +603,15 @@ bool Manager::handleEvent(std::optional<std::chrono::milliseconds> timeout) {
         log_debug("waiting for an event: timeout=%lld",
                   timeout ? timeout.value().count() : 0LL);
         eventmgr.waitForEvent(timeout);
+        syncStateFile();
         break;
     case States::GracefulShutdown:
-        if (jobs.empty()) {
-            fsm.execute(Triggers::AllJobsExited);
-        } else {
+        if (checkShutdown()) {
             log_debug("shutting down: %zu jobs remaining: waiting for an "
                       "event: timeout=0.5s",
                       jobs.size());
             eventmgr.waitForEvent(std::chrono::milliseconds{500});
+            syncStateFile();
         }
         break;
     case States::Finished:
@@ -257,6 +620,27 @@ bool Manager::handleEvent(std::optional<std::chrono::milliseconds> timeout) {
     return fsm.state() != States::Finished;
 }
 
+bool Manager::syncStateFile() {
+    try {
+        state_file.sync();
+        return true;
+    } catch (const std::exception &exc) {
+        log_error("unable to save the state file: %s", exc.what());
+        return false;
+    }
+}
+
+bool Manager::checkShutdown() {
+    if (fsm.state() != States::GracefulShutdown) {
+        return false;
+    }
+    if (jobs.empty()) {
+        fsm.execute(Triggers::AllJobsExited);
+        return false;
+    }
+    return true;
+}
+
 bool Manager::jobExists(const Label &label) const {
     return jobs.count(static_cast<std::string>(label));
 }
@@ -268,9 +652,14 @@ Job &Manager::getJob(const Label &label) const {
 bool Manager::unloadAllJobs() noexcept {
     bool success = true;
     log_debug("unloading all jobs");
-    for (auto &[label, jobp] : jobs) {
-        auto &job = *jobp;
-        if (job.fsm.state() != Job::States::Unloaded && !job.unload_requested) {
+    const auto unloaded = static_cast<uint8_t>(Job::States::Unloaded);
+    for (JobTable::JobId id = 0; id < job_table.slots(); id++) {
+        if (!job_table.jobs[id] || job_table.pending[id]) {
+            continue;
+        }
+        if (job_table.states[id] != unloaded &&
+            !job_table.unload_requested[id]) {
+            auto &job = *job_table.jobs[id];
             bool result;
             try {
                 result = job.unloadJob(true);
@@ -317,15 +706,26 @@ bool Manager::unloadAllJobs() noexcept {
 //}
 
 void Manager::startJob(Job &job) {
-    log_debug("trying to start %s", job.manifest.label.c_str());
+    log_debug("trying to start %s", job.getLabel());
     job.fsm.execute(Job::Triggers::StartRequested);
 }
 
 void Manager::startAllJobs() {
+    std::vector<std::string> labels;
     for (auto &[label, jobp] : pending_jobs) {
         if (jobs.count(label) == 0) {
+            job_table.pending[jobp->id] = false;
+            jobp->publishStatus();
+            for (const auto &[name, state] :
+                 jobp->manifest.notifications.exit_if) {
+                auto &watchers = exit_watchers[name.str()];
+                if (std::find(watchers.begin(), watchers.end(), label) ==
+                    watchers.end()) {
+                    watchers.push_back(label);
+                }
+            }
             jobs.emplace(label, std::move(jobp));
-            jobs.at(label)->fsm.execute(Job::Triggers::Bootstrap);
+            labels.push_back(label);
         } else {
             // This should not happen because loadManifest() and startAllJobs()
             // should be called together.
@@ -335,6 +735,262 @@ void Manager::startAllJobs() {
         }
     }
     pending_jobs.clear();
+
+    if (boot_scheduler.empty()) {
+        boot_stats = BootStats{};
+        boot_stats.started_at = std::chrono::steady_clock::now();
+    }
+    // Enqueue in dependency order, so every job's dependencies are already
+    // queued when it is added.
+    for (const auto &wave : planStartWaves(std::move(labels))) {
+        for (const auto &label : wave) {
+            const auto &manifest = jobs.at(label)->manifest;
+            std::vector<std::string> deps;
+            for (const auto &dep : manifest.dependencies()) {
+                deps.push_back(dep.str());
+            }
+            boot_scheduler.enqueue(label, deps, manifest.priority);
+        }
+    }
+    if (!boot_timer_id) {
+        runBootQueue();
+    }
+}
+
+void Manager::runBootQueue() {
+    using namespace std::chrono;
+    boot_timer_id = std::nullopt;
+    const size_t limit = boot_scheduler.batchLimit();
+    size_t count = 0;
+    const auto batch_start = steady_clock::now();
+    while (count < limit) {
+        auto maybe_label = boot_scheduler.dequeue();
+        if (!maybe_label) {
+            break;
+        }
+        // The job may have been unloaded while it was queued.
+        auto it = jobs.find(*maybe_label);
+        if (it == jobs.end()) {
+            continue;
+        }
+        auto &job = *it->second;
+        if (job.fsm.state() != Job::States::Loaded || job.unload_requested()) {
+            continue;
+        }
+        if (!launchConditionsMet(job)) {
+            log_debug("job %s: waiting for its LaunchAfter conditions",
+                      job.getLabel());
+            awaiting_notification.insert(job.label.str());
+            continue;
+        }
+        if (dependenciesSatisfied(job)) {
+            job.fsm.execute(Job::Triggers::Bootstrap);
+            job.bootstrapped = true;
+            operations.jobChanged(job.label.str());
+            count++;
+        }
+    }
+    const auto now = steady_clock::now();
+    boot_scheduler.recordBatch(count,
+                               duration_cast<microseconds>(now - batch_start));
+    boot_stats.jobs_started += count;
+
+    const auto elapsed = duration_cast<milliseconds>(now - boot_stats.started_at);
+    if (!boot_stats.critical_ready && boot_scheduler.criticalRemaining() == 0) {
+        boot_stats.critical_ready = elapsed;
+    }
+    if (boot_scheduler.empty()) {
+        boot_stats.finished = elapsed;
+        log_notice("started %zu jobs in %lld ms; critical jobs were started "
+                   "after %lld ms",
+                   boot_stats.jobs_started,
+                   static_cast<long long>(elapsed.count()),
+                   static_cast<long long>(boot_stats.critical_ready->count()));
+    } else {
+        // Let the event loop handle other events before the next batch.
+        boot_timer_id =
+            eventmgr.addTimer(milliseconds{1}, [this] { runBootQueue(); });
+    }
+}
+
+void Manager::cancelBootQueue() {
+    if (boot_timer_id) {
+        eventmgr.deleteTimer(*boot_timer_id);
+        boot_timer_id = std::nullopt;
+    }
+    if (!boot_scheduler.empty()) {
+        log_notice("will not start %zu queued jobs", boot_scheduler.size());
+        boot_scheduler.clear();
+    }
+}
+
+std::vector<std::vector<std::string>>
+Manager::planStartWaves(std::vector<std::string> labels) const {
+    std::sort(labels.begin(), labels.end());
+    const std::unordered_set<std::string> batch{labels.begin(), labels.end()};
+
+    // Only edges between jobs in this batch constrain the order; jobs that
+    // were loaded by an earlier batch have already been started.
+    std::unordered_map<std::string, size_t> indegree;
+    std::unordered_map<std::string, std::vector<std::string>> dependents;
+    for (const auto &label : labels) {
+        indegree[label] = 0;
+        for (const auto &dep : findManifest(label)->dependencies()) {
+            if (batch.count(dep.str())) {
+                indegree[label]++;
+                dependents[dep.str()].push_back(label);
+            }
+        }
+    }
+
+    std::vector<std::vector<std::string>> waves;
+    std::vector<std::string> wave;
+    for (const auto &label : labels) {
+        if (indegree[label] == 0) {
+            wave.push_back(label);
+        }
+    }
+    size_t planned = 0;
+    while (!wave.empty()) {
+        std::vector<std::string> next;
+        for (const auto &label : wave) {
+            for (const auto &dependent : dependents[label]) {
+                if (--indegree[dependent] == 0) {
+                    next.push_back(dependent);
+                }
+            }
+        }
+        std::sort(next.begin(), next.end());
+        planned += wave.size();
+        waves.emplace_back(std::move(wave));
+        wave = std::move(next);
+    }
+    if (planned != labels.size()) {
+        // loadManifest() rejects cycles, so this should not happen.
+        log_error("%zu jobs were not started due to a dependency cycle",
+                  labels.size() - planned);
+    }
+    return waves;
+}
+
+bool Manager::createsDependencyCycle(const std::string &label,
+                                     const std::vector<Label> &deps) const {
+    std::unordered_set<std::string> visited;
+    std::vector<std::string> stack;
+    for (const auto &dep : deps) {
+        stack.push_back(dep.str());
+    }
+    while (!stack.empty()) {
+        const std::string current = std::move(stack.back());
+        stack.pop_back();
+        if (current == label) {
+            return true;
+        }
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        const Manifest *dep_manifest = findManifest(current);
+        if (dep_manifest) {
+            for (const auto &dep : dep_manifest->dependencies()) {
+                stack.push_back(dep.str());
+            }
+        }
+    }
+    return false;
+}
+
+bool Manager::dependenciesSatisfied(const Job &job) const {
+    for (const auto &dep : job.manifest.requires_jobs) {
+        auto it = jobs.find(dep.str());
+        if (it == jobs.end() || it->second->unload_requested() ||
+            it->second->fsm.state() == Job::States::Unloaded) {
+            log_error("will not start %s: required job %s is not loaded",
+                      job.getLabel(), dep.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Manager::conditionHolds(
+    const Manifest::Notifications::Condition &condition) const {
+    const auto state = notify_broker.state(condition.first.str());
+    return state && *state == condition.second.str();
+}
+
+bool Manager::launchConditionsMet(const Job &job) const {
+    const auto &conditions = job.manifest.notifications.launch_after;
+    return std::all_of(conditions.begin(), conditions.end(),
+                       [this](const auto &c) { return conditionHolds(c); });
+}
+
+void Manager::notificationPosted(const std::string &name) {
+    std::vector<Job *> ready;
+    for (auto it = awaiting_notification.begin();
+         it != awaiting_notification.end();) {
+        auto job_it = jobs.find(*it);
+        if (job_it == jobs.end() ||
+            job_it->second->fsm.state() != Job::States::Loaded ||
+            job_it->second->unload_requested()) {
+            it = awaiting_notification.erase(it);
+        } else if (launchConditionsMet(*job_it->second)) {
+            ready.push_back(job_it->second.get());
+            it = awaiting_notification.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto *job : ready) {
+        if (dependenciesSatisfied(*job)) {
+            log_debug("job %s: its LaunchAfter conditions hold",
+                      job->getLabel());
+            job->fsm.execute(Job::Triggers::Bootstrap);
+            job->bootstrapped = true;
+            operations.jobChanged(job->label.str());
+        }
+    }
+
+    auto watchers = exit_watchers.find(name);
+    if (watchers == exit_watchers.end()) {
+        return;
+    }
+    auto &labels = watchers->second;
+    for (size_t i = 0; i < labels.size();) {
+        auto job_it = jobs.find(labels[i]);
+        if (job_it == jobs.end()) {
+            labels.erase(labels.begin() + static_cast<ptrdiff_t>(i));
+            continue;
+        }
+        i++;
+        auto &job = *job_it->second;
+        if (job.fsm.state() != Job::States::Running || job.pid() == 0) {
+            continue;
+        }
+        for (const auto &condition : job.manifest.notifications.exit_if) {
+            if (condition.first.str() == name && conditionHolds(condition)) {
+                log_notice("job %s: stopping because %s is %s",
+                           job.getLabel(), name.c_str(),
+                           condition.second.c_str());
+                job.fsm.execute(Job::Triggers::StopRequested);
+                break;
+            }
+        }
+    }
+    if (labels.empty()) {
+        exit_watchers.erase(watchers);
+    }
+}
+
+const Manifest *Manager::findManifest(const std::string &label) const {
+    auto it = jobs.find(label);
+    if (it != jobs.end()) {
+        return &it->second->manifest;
+    }
+    it = pending_jobs.find(label);
+    if (it != pending_jobs.end()) {
+        return &it->second->manifest;
+    }
+    return nullptr;
 }
 
 void Manager::loadDefaultManifests() {
@@ -376,6 +1032,10 @@ bool Manager::loadAllManifests(const std::string &path, bool overrideDisabled,
         log_notice("loading all manifests in %s/", path.c_str());
         using std::filesystem::directory_iterator;
         for (const auto &file : directory_iterator(path)) {
+            // Subdirectories hold defaults documents, not manifests
+            if (file.is_directory()) {
+                continue;
+            }
             try {
                 if (!loadManifest(file.path(), overrideDisabled, forceLoad)) {
                     error = true;
@@ -430,6 +1090,26 @@ void Manager::clearStateFile() {
 
 const Domain &Manager::getDomain() const { return domain; }
 
+HeapUsage Manager::getHeapUsage() const {
+    HeapUsage result;
+    std::unordered_set<const Manifest *> manifests;
+    for (const auto *map : {&jobs, &pending_jobs}) {
+        for (const auto &[label, jobp] : *map) {
+            result.jobs++;
+            result.job_bytes += sizeof(Job) + label.capacity();
+            manifests.insert(&jobp->manifest);
+        }
+    }
+    for (const auto &[_, manifest] : templates) {
+        manifests.insert(manifest.get());
+    }
+    for (const auto *manifest : manifests) {
+        result.manifest_bytes += sizeof(Manifest) + manifest->heapBytes();
+    }
+    result.string_pool_bytes = StringPool::global().heapBytes();
+    return result;
+}
+
 void Manager::forceUnloadAllJobs() noexcept {
     for (auto &[_, jobp] : jobs) {
         jobp->forceUnloadJob();
@@ -452,7 +1132,9 @@ void Manager::initFSM() {
             Triggers::StartRequested,
             [] { return true; },
             [this] {
-                setupSignalHandlers();
+                if (!isHosted()) {
+                    setupSignalHandlers();
+                }
                 startRpcServer();
                 loadDefaultManifests();
                 startAllJobs();
@@ -472,7 +1154,8 @@ void Manager::initFSM() {
             [] { return true; },
             [this] {
                 // Prevent users from submitting new jobs
-                chan.unbindAndStopListening();
+                stopRpcServer();
+                cancelBootQueue();
                 unloadAllJobs();
             },
         },
@@ -502,8 +1185,18 @@ void Manager::initFSM() {
 void Manager::startRpcServer() {
     auto sockfilename = domain.statedir / "rpc.sock";
     chan.bindAndListen(sockfilename, 1024);
-    eventmgr.addSocketRead(chan.getSockFD(),
-                           [this](int) { rpc_dispatch(chan, *this); });
+    if (domain.uid && getuid() == 0 &&
+        chown(sockfilename.c_str(), *domain.uid, -1) < 0) {
+        log_errno("chown(2) of %s", sockfilename.c_str());
+    }
+    rpc_server.start(chan.getSockFD());
+}
+
+void Manager::stopRpcServer() {
+    // The descriptor must be forgotten before it is closed, because the
+    // event loop may be shared with other domains that reuse the number.
+    rpc_server.stop();
+    chan.unbindAndStopListening();
 }
 
 void Manager::handleShutdownSignal(const std::string &signame) {
@@ -534,7 +1227,152 @@ void Manager::runMainLoop() {
     if (fsm.state() != States::Running) {
         throw std::logic_error("must call startRunning() first");
     }
-    while (handleEvent()) {
+    while (!reexec_requested && handleEvent()) {
+    }
+}
+
+json Manager::saveImage() {
+    state_file.compact();
+    json domain_image = {{"Type", domain.to_string()},
+                         {"StateDir", domain.statedir.string()}};
+    if (domain.uid) {
+        domain_image["Uid"] = *domain.uid;
+    }
+    json result = {{"Domain", std::move(domain_image)}};
+    if (rpc_server.isListening()) {
+        // F_DUPFD does not copy the close-on-exec flag
+        int fd = fcntl(chan.getSockFD(), F_DUPFD, 3);
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category(), "fcntl()");
+        }
+        result["RpcFd"] = fd;
+    }
+
+    auto &templates_image = result["Templates"] = json::array();
+    std::unordered_map<const Manifest *, std::string> template_labels;
+    for (const auto &[label, manifest] : templates) {
+        template_labels.emplace(manifest.get(), label);
+        json entry = {{"Manifest", *manifest}};
+        for (const auto &[path, indexed] : path_index) {
+            if (indexed == label) {
+                entry["Path"] = path;
+            }
+        }
+        templates_image.push_back(std::move(entry));
+    }
+
+    auto &jobs_image = result["Jobs"] = json::array();
+    for (const auto *map : {&pending_jobs, &jobs}) {
+        for (const auto &[label, jobp] : *map) {
+            const Job &job = *jobp;
+            const auto state = job.fsm.state();
+            if (state == Job::States::Unloaded) {
+                continue;
+            }
+            // Jobs that have not been bootstrapped are queued again
+            json entry = {{"Pending", map == &pending_jobs ||
+                                          state == Job::States::Loaded}};
+            if (job.instance) {
+                entry["Template"] = template_labels.at(&job.manifest);
+                entry["Instance"] = *job.instance;
+            } else {
+                entry["Manifest"] = job.manifest;
+            }
+            if (job.manifest_path) {
+                entry["ManifestPath"] = job.manifest_path->string();
+            }
+            entry["Job"] = job.saveImage();
+            jobs_image.push_back(std::move(entry));
+        }
+    }
+    return result;
+}
+
+Domain Manager::domainFromImage(const json &image) {
+    const auto &domain_image = image.at("Domain");
+    std::optional<uid_t> uid;
+    if (domain_image.contains("Uid")) {
+        uid = domain_image["Uid"].get<uid_t>();
+    }
+    return Domain{
+        Domain::typeFromString(domain_image.at("Type").get<std::string>()),
+        domain_image.at("StateDir").get<std::string>(), uid};
+}
+
+void Manager::restoreImage(const json &image) {
+    if (fsm.state() != States::Unconfigured) {
+        throw std::logic_error("the manager is already running");
+    }
+    fsm.reset(States::Running);
+    if (!isHosted()) {
+        setupSignalHandlers();
+    }
+    if (image.contains("RpcFd")) {
+        chan.adoptListeningSocket(image["RpcFd"].get<int>());
+        rpc_server.start(chan.getSockFD());
+    } else {
+        startRpcServer();
+    }
+
+    // Share the cached manifest if the file has not changed since it was
+    // loaded
+    auto restoreManifest = [this](const json &obj,
+                                  const std::optional<std::string> &path) {
+        if (path) {
+            try {
+                auto cached = manifest_cache.get(*path, domain.getLoadPaths());
+                if (json(*cached) == obj) {
+                    return cached;
+                }
+            } catch (const std::exception &) {
+                // The file has been removed or is no longer valid
+            }
+        }
+        return manifest_cache.parse(obj, "/dev/null", domain.getLoadPaths());
+    };
+    auto optionalPath = [](const json &entry, const char *key) {
+        return entry.contains(key)
+                   ? std::make_optional(entry[key].get<std::string>())
+                   : std::nullopt;
+    };
+
+    for (const auto &entry : image.at("Templates")) {
+        const auto path = optionalPath(entry, "Path");
+        auto manifest = restoreManifest(entry.at("Manifest"), path);
+        const auto label = manifest->label.str();
+        templates.emplace(label, std::move(manifest));
+        if (path) {
+            indexPath(*path, label);
+        }
+    }
+    for (const auto &entry : image.at("Jobs")) {
+        const auto path = optionalPath(entry, "ManifestPath");
+        std::shared_ptr<const Manifest> manifest;
+        std::optional<std::string> instance;
+        if (entry.contains("Instance")) {
+            manifest = templates.at(entry.at("Template").get<std::string>());
+            instance = entry["Instance"].get<std::string>();
+        } else {
+            manifest = restoreManifest(entry.at("Manifest"), path);
+        }
+        auto jobp = make_slab<Job>(path, std::move(manifest), job_context,
+                                   std::move(instance));
+        const auto label = jobp->label.str();
+        if (path) {
+            indexPath(*path, label);
+        }
+        if (entry.at("Pending").get<bool>()) {
+            pending_jobs.emplace(label, std::move(jobp));
+        } else {
+            job_table.pending[jobp->id] = false;
+            jobp->restoreImage(entry.at("Job"));
+            jobs.emplace(label, std::move(jobp));
+        }
+    }
+    log_notice("restored %zu jobs from the previous launchd process",
+               jobs.size() + pending_jobs.size());
+    if (!pending_jobs.empty()) {
+        startAllJobs();
     }
 }
 
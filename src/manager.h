@@ -20,18 +20,61 @@
 #include <filesystem>
 #include <nlohmann/json.hpp>
 
+#include "boot_scheduler.h"
 #include "channel.h"
 #include "domain.h"
 #include "event.h"
 #include "job.h"
+#include "manifest_cache.h"
+#include "operation.h"
+#include "rpc_server.h"
+#include "slab.h"
 #include "state_file.hpp"
 
+//! Timing information about the most recent batch of jobs to be started
+struct BootStats {
+    std::chrono::steady_clock::time_point started_at;
+    //! Time until every job with the Critical priority was bootstrapped
+    std::optional<std::chrono::milliseconds> critical_ready;
+    //! Time until every queued job was bootstrapped
+    std::optional<std::chrono::milliseconds> finished;
+    size_t jobs_started = 0;
+};
+
+//! Estimated heap memory used by job definitions
+struct HeapUsage {
+    size_t jobs = 0;
+    //! Bytes used by Job objects
+    size_t job_bytes = 0;
+    //! Bytes owned by manifests, counting each shared manifest once
+    size_t manifest_bytes = 0;
+    //! Bytes used by the string pool, which is shared by all manifests
+    size_t string_pool_bytes = 0;
+
+    size_t perJob() const {
+        return jobs ? (job_bytes + manifest_bytes + string_pool_bytes) / jobs
+                    : 0;
+    }
+};
+
+//! Jobs keyed by label. Jobs and hash table nodes are allocated from slabs.
+using JobMap = std::unordered_map<
+    std::string, slab_ptr<Job>, std::hash<std::string>,
+    std::equal_to<std::string>,
+    SlabAllocator<std::pair<const std::string, slab_ptr<Job>>>>;
+
 class Manager {
+    friend class DomainHost;
     friend struct ManagerTest;
 
   public:
     Manager(Domain domain_);
 
+    //! Create a manager that shares the event loop and manifest cache of a
+    //! daemon hosting several domains. The host handles signals.
+    Manager(Domain domain_, kq::EventManager &eventmgr_,
+            ManifestCache &manifest_cache_);
+
     Manager() : Manager(Domain{}) {}
 
     virtual ~Manager();
@@ -55,9 +98,15 @@ class Manager {
 
     json listJobs();
 
+    //! The most recent runs, newest first, optionally only of one job
+    [[nodiscard]] json runHistory(const std::optional<std::string> &label,
+                                  size_t limit) const;
+
     bool unloadJob(const Label &label, bool overrideDisabled = false,
                    bool forceUnload = false);
 
+    //! Unload the job loaded from a manifest file, or every job loaded from
+    //! a directory. The manifests are not read again.
     bool unloadJob(const std::filesystem::path &path,
                    bool overrideDisabled = false, bool forceUnload = false);
 
@@ -66,6 +115,49 @@ class Manager {
 
     bool unloadAllJobs() noexcept;
 
+    //! Send SIGTERM to the process of a running job
+    bool stopJob(const Label &label);
+
+    //! Give a job descriptors to use as its standard input, output and
+    //! error instead of the paths in its manifest. Entries of -1 are
+    //! ignored, and the job takes ownership of the others. Returns false
+    //! if there is no such job.
+    bool adoptStandardDescriptors(const Label &label, std::array<int, 3> &fds);
+
+    // Asynchronous requests. Each returns the id of an operation that
+    // completes when the affected jobs reach the target state.
+
+    //! Start a job, or return nothing if it does not exist
+    std::optional<Operation::Id> requestStart(const Label &label);
+
+    //! Stop a job, or return nothing if it does not exist
+    std::optional<Operation::Id> requestStop(const Label &label);
+
+    //! Load the manifests from each path. The operation completes when the
+    //! new jobs have been bootstrapped. \p ok is cleared if a path fails.
+    Operation::Id requestLoad(const std::vector<std::string> &paths,
+                              bool overrideDisabled, bool forceLoad, bool &ok);
+
+    //! Run a function that unloads jobs, such as one of the unloadJob()
+    //! overloads. The operation completes when those jobs are gone.
+    Operation::Id requestUnload(const std::function<bool()> &unload,
+                                bool &ok);
+
+    OperationTracker &getOperations() { return operations; }
+
+    RpcServer &getRpcServer() { return rpc_server; }
+
+    JobEvents &getJobEvents() { return job_events; }
+
+    NotifyBroker &getNotifyBroker() { return notify_broker; }
+
+    //! Create a job from a template. The label has the form "name@instance",
+    //! where "name@" is the label of a loaded template.
+    bool instantiateJob(const Label &label);
+
+    //! Return true if a template with the given label is loaded
+    bool templateExists(const Label &label) const;
+
     bool killJob(const Label &, const std::string &signame_or_number);
 
     //! Return true if the job exists
@@ -79,10 +171,44 @@ class Manager {
 
     const Domain &getDomain() const;
 
+    const BootStats &getBootStats() const { return boot_stats; }
+
+    HeapUsage getHeapUsage() const;
+
     void startRunning();
 
     void stopRunning();
 
+    //! Ask the main loop to stop so that launchd can execute itself again
+    void requestReexec() { reexec_requested = true; }
+
+    void cancelReexec() { reexec_requested = false; }
+
+    bool reexecRequested() const { return reexec_requested; }
+
+    //! Save the domain, its jobs and its RPC socket for the next launchd
+    //! process. The socket is duplicated without close-on-exec.
+    json saveImage();
+
+    //! Start running with the state saved by saveImage() in the previous
+    //! process, instead of loading the default manifests. Running jobs are
+    //! adopted rather than restarted.
+    void restoreImage(const json &image);
+
+    //! The domain described by an image from saveImage()
+    static Domain domainFromImage(const json &image);
+
+    //! Make pending state changes durable. Called once per iteration of the
+    //! event loop, and before replying to a request. Returns false if the
+    //! changes could not be written; they are tried again on the next call.
+    bool syncStateFile();
+
+    //! The size of the state file journal, including unsynced changes. It
+    //! grows whenever the state is changed.
+    [[nodiscard]] size_t stateJournalSize() const {
+        return state_file.journalSize();
+    }
+
     //! Run the event processing loop until shutdown is complete
     void runMainLoop();
 
@@ -94,31 +220,151 @@ class Manager {
   private:
     void initFSM();
 
+    //! Finish construction; shared by both constructors
+    void initialize();
+
+    //! True if the event loop belongs to a ::DomainHost
+    bool isHosted() const { return !owned_eventmgr; }
+
+    //! Add a parsed manifest as a new job or template
+    bool addManifest(std::shared_ptr<const Manifest> manifest,
+                     const std::string &path, bool overrideDisabled,
+                     bool forceLoad);
+
     void startRpcServer();
 
+    void stopRpcServer();
+
+    //! Finish a graceful shutdown if every job has exited. Returns true if
+    //! the shutdown is still waiting for jobs to exit.
+    bool checkShutdown();
+
     void startAllJobs();
 
+    //! Bootstrap the next batch of jobs from the boot queue
+    void runBootQueue();
+
+    //! Stop bootstrapping queued jobs
+    void cancelBootQueue();
+
+    //! Group the given jobs into waves, where each job in a wave depends only
+    //! on jobs in earlier waves. Each wave is sorted by label.
+    std::vector<std::vector<std::string>>
+    planStartWaves(std::vector<std::string> labels) const;
+
+    //! Return true if adding a job with these dependencies would create a
+    //! dependency cycle
+    bool createsDependencyCycle(const std::string &label,
+                                const std::vector<Label> &deps) const;
+
+    //! Unload a template, if none of its instances are loaded
+    bool unloadTemplate(const Label &label);
+
+    //! Record the manifest file that a job or template was loaded from
+    void indexPath(const std::string &path, const std::string &label);
+
+    //! Forget the manifest file of a job that is being deleted
+    void unindexPath(const std::optional<std::filesystem::path> &path,
+                     const std::string &label);
+
+    //! Return true if every job in the Requires key is loaded
+    bool dependenciesSatisfied(const Job &job) const;
+
+    //! Return true if the name has been posted with the given state
+    bool conditionHolds(
+        const Manifest::Notifications::Condition &condition) const;
+
+    //! Return true if every LaunchAfter condition of the job holds
+    bool launchConditionsMet(const Job &job) const;
+
+    //! Launch the jobs that were waiting for the name, and stop the jobs
+    //! that should exit because of it
+    void notificationPosted(const std::string &name);
+
+    //! Find the manifest of a loaded or pending job
+    const Manifest *findManifest(const std::string &label) const;
+
     static StateFile createOrOpenStatefile(const Domain &);
 
+    //! Create the state directory of a domain owned by another user, and
+    //! check that the user cannot write to it
+    static void createUserStateDir(const Domain &);
+
     void forceUnloadAllJobs() noexcept;
 
     Job &getJob(const Label &label) const;
 
     void startJob(Job &job);
 
+    //! The status of a loaded or pending job, for the operation tracker
+    std::optional<JobStatus> jobStatus(const std::string &label) const;
+
     void setupSignalHandlers();
 
     void handleShutdownSignal(const std::string &signame);
 
+    bool reexec_requested = false;
+
+    //! Set if the manager is not hosted, so it has its own event loop and
+    //! manifest cache
+    std::unique_ptr<kq::EventManager> owned_eventmgr;
+    std::unique_ptr<ManifestCache> owned_manifest_cache;
+
+    //! The frequently used state of every job, including pending jobs. It
+    //! must outlive the jobs.
+    JobTable job_table;
+
+    //! The status of every job, shared with clients. It must outlive the
+    //! jobs.
+    StatusPage status_page;
+
+    //! The most recent runs of every job
+    RunHistory run_history;
+
+    //! Clients that watch for job events. It must outlive the jobs and the
+    //! RPC server.
+    JobEvents job_events;
+
+    //! The notifications that jobs post and receive. It must outlive the
+    //! jobs.
+    NotifyBroker notify_broker;
+
+    //! Jobs that the boot queue held back until their LaunchAfter
+    //! conditions hold
+    std::unordered_set<std::string> awaiting_notification;
+
+    //! The labels of the jobs with an ExitIf condition on each name. Labels
+    //! of jobs that are gone are removed when the name is next posted.
+    std::unordered_map<std::string, std::vector<std::string>> exit_watchers;
+
     //! Jobs that have been queued for loading but are waiting for a
     //! StartAllJobs() signal
-    std::unordered_map<std::string, std::unique_ptr<Job>> pending_jobs;
+    JobMap pending_jobs;
+
+    JobMap jobs;
+
+    //! The label of each job or template, keyed by the canonical path of
+    //! its manifest
+    std::unordered_map<std::string, std::string> path_index;
+
+    //! Templates for parameterized jobs. Every instance shares the manifest of
+    //! its template.
+    std::unordered_map<std::string, std::shared_ptr<const Manifest>> templates;
+
+    //! Jobs that have been loaded but not bootstrapped yet
+    BootScheduler boot_scheduler;
+    std::optional<int> boot_timer_id;
+    BootStats boot_stats;
 
-    std::unordered_map<std::string, std::unique_ptr<Job>> jobs;
     const Domain domain;
-    kq::EventManager eventmgr;
+    kq::EventManager &eventmgr;
+    ManifestCache &manifest_cache;
+    //! Creates the socket that the RPC server listens on
     Channel chan;
+    RpcServer rpc_server;
+    OperationTracker operations;
     StateFile state_file;
+    JobContext job_context;
 
     // FSM implementation
     enum class States { Unconfigured, Running, GracefulShutdown, Finished };
@@ -15,6 +15,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
 #include <grp.h>
 #include <pwd.h>
@@ -27,6 +29,7 @@ using json = nlohmann::json;
 
 #include "log.h"
 #include "manifest.h"
+#include "notify_table.h"
 
 namespace manifest {
 class InvalidManifestError : public std::exception {
@@ -90,7 +93,9 @@ void from_json(const json &j, Manifest &m) {
         m.program = tmp;
     }
     if (j.contains("ProgramArguments")) {
-        j.at("ProgramArguments").get_to(m.program_arguments);
+        for (const auto &elem : j.at("ProgramArguments")) {
+            m.program_arguments.emplace_back(elem.get<std::string>());
+        }
     }
     if (j.contains("EnableGlobbing")) {
         // j.at("EnableGlobbing").get_to(m.enable_globbing);
@@ -110,7 +115,9 @@ void from_json(const json &j, Manifest &m) {
         m.root_directory = std::move(tmp);
     }
     if (j.contains("EnvironmentVariables")) {
-        j.at("EnvironmentVariables").get_to(m.environment_variables);
+        for (const auto &[key, val] : j.at("EnvironmentVariables").items()) {
+            m.environment_variables.set(key, val.get<std::string>());
+        }
     }
     if (j.contains("Umask")) {
         auto elem = j.at("Umask");
@@ -163,13 +170,13 @@ void from_json(const json &j, Manifest &m) {
         throw NotSupportedError();
     }
     if (j.contains("StandardInPath")) {
-        j.at("StandardInPath").get_to(m.stdin_path);
+        m.stdin_path = j.at("StandardInPath").get<std::string>();
     }
     if (j.contains("StandardOutPath")) {
-        j.at("StandardOutPath").get_to(m.stdout_path);
+        m.stdout_path = j.at("StandardOutPath").get<std::string>();
     }
     if (j.contains("StandardErrorPath")) {
-        j.at("StandardErrorPath").get_to(m.stderr_path);
+        m.stderr_path = j.at("StandardErrorPath").get<std::string>();
     }
     if (j.contains("AbandonProcessGroup")) {
         j.at("AbandonProcessGroup").get_to(m.abandon_process_group);
@@ -192,12 +199,143 @@ void from_json(const json &j, Manifest &m) {
     if (j.contains("Sockets")) {
         throw NotSupportedError();
     }
+    if (j.contains("After")) {
+        for (const auto &elem : j.at("After")) {
+            m.after.emplace_back(elem.get<std::string>());
+        }
+    }
+    if (j.contains("Requires")) {
+        for (const auto &elem : j.at("Requires")) {
+            m.requires_jobs.emplace_back(elem.get<std::string>());
+        }
+    }
+    if (j.contains("Notifications")) {
+        const auto &obj = j.at("Notifications");
+        for (const auto &elem : obj.value("Send", json::array())) {
+            m.notifications.send.emplace_back(elem.get<std::string>());
+        }
+        for (const auto &elem : obj.value("Receive", json::array())) {
+            m.notifications.receive.emplace_back(elem.get<std::string>());
+        }
+        auto conditions = [&obj](const char *key) {
+            std::vector<Manifest::Notifications::Condition> result;
+            for (const auto &elem : obj.value(key, json::array())) {
+                const auto str = elem.get<std::string>();
+                const auto pos = str.find('=');
+                if (pos == std::string::npos || pos == 0) {
+                    throw std::runtime_error(std::string{"invalid "} + key +
+                                             " condition: " + str);
+                }
+                result.emplace_back(str.substr(0, pos), str.substr(pos + 1));
+            }
+            return result;
+        };
+        m.notifications.launch_after = conditions("LaunchAfter");
+        m.notifications.exit_if = conditions("ExitIf");
+    }
+    if (j.contains("Priority")) {
+        std::string tmp;
+        j.at("Priority").get_to(tmp);
+        if (tmp == "critical") {
+            m.priority = Manifest::Priority::Critical;
+        } else if (tmp == "normal") {
+            m.priority = Manifest::Priority::Normal;
+        } else if (tmp == "background") {
+            m.priority = Manifest::Priority::Background;
+        } else {
+            throw std::runtime_error("unsupported Priority value");
+        }
+    }
     m.rectify();
     if (!m.validate()) {
         throw InvalidManifestError();
     }
 }
 
+void to_json(json &j, const Manifest &m) {
+    auto strings = [](const auto &vec) {
+        json result = json::array();
+        for (const auto &elem : vec) {
+            result.push_back(elem.str());
+        }
+        return result;
+    };
+    j = json{{"Label", m.label.str()},
+             {"Program", m.program.value().str()},
+             {"ProgramArguments", strings(m.program_arguments)},
+             {"Disabled", m.disabled},
+             {"RunAtLoad", m.run_at_load},
+             {"ExitTimeout", m.exit_timeout.count()},
+             {"ThrottleInterval", m.throttle_interval},
+             {"InitGroups", m.init_groups},
+             {"StandardInPath", m.stdin_path.str()},
+             {"StandardOutPath", m.stdout_path.str()},
+             {"StandardErrorPath", m.stderr_path.str()},
+             {"AbandonProcessGroup", m.abandon_process_group},
+             {"KeepAlive", m.keep_alive.always}};
+    if (m.user_name) {
+        j["UserName"] = m.user_name->str();
+    }
+    if (m.group_name) {
+        j["GroupName"] = m.group_name->str();
+    }
+    if (m.working_directory) {
+        j["WorkingDirectory"] = m.working_directory->str();
+    }
+    if (m.root_directory) {
+        j["RootDirectory"] = m.root_directory->str();
+    }
+    if (!m.environment_variables.empty()) {
+        auto &env = j["EnvironmentVariables"] = json::object();
+        for (const auto &[key, val] : m.environment_variables) {
+            env[key.str()] = val.str();
+        }
+    }
+    if (m.umask) {
+        // Parsed as an octal string
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%o", static_cast<unsigned>(*m.umask));
+        j["Umask"] = buf;
+    }
+    if (m.start_interval) {
+        j["StartInterval"] = *m.start_interval;
+    }
+    if (m.nice) {
+        j["Nice"] = *m.nice;
+    }
+    if (!m.after.empty()) {
+        j["After"] = strings(m.after);
+    }
+    if (!m.requires_jobs.empty()) {
+        j["Requires"] = strings(m.requires_jobs);
+    }
+    if (!m.notifications.empty()) {
+        auto conditions = [](const auto &vec) {
+            json result = json::array();
+            for (const auto &[name, state] : vec) {
+                result.push_back(name.str() + "=" + state.str());
+            }
+            return result;
+        };
+        j["Notifications"] = {
+            {"Send", strings(m.notifications.send)},
+            {"Receive", strings(m.notifications.receive)},
+            {"LaunchAfter", conditions(m.notifications.launch_after)},
+            {"ExitIf", conditions(m.notifications.exit_if)}};
+    }
+    switch (m.priority) {
+    case Manifest::Priority::Critical:
+        j["Priority"] = "critical";
+        break;
+    case Manifest::Priority::Normal:
+        j["Priority"] = "normal";
+        break;
+    case Manifest::Priority::Background:
+        j["Priority"] = "background";
+        break;
+    }
+}
+
 #if XML_MANIFEST_SUPPORT
 // FIXME: needs work, see https://github.com/mheily/relaunchd/issues/16
 std::optional<json> parse_xml(const char *path) {
@@ -283,6 +421,53 @@ json parse(const std::filesystem::path &path) {
     }
 }
 
+std::shared_ptr<const json>
+DefaultsCache::get(const std::string &name,
+                   const std::vector<std::filesystem::path> &search_paths) {
+    if (name.empty() || name.find('/') != name.npos) {
+        throw std::runtime_error("invalid Inherits value: " + name);
+    }
+    for (const auto &dir : search_paths) {
+        const auto path = dir / "defaults" / (name + ".json");
+        std::error_code ec;
+        const auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) {
+            continue;
+        }
+        auto it = cache.find(path.string());
+        if (it != cache.end() && it->second.mtime == mtime) {
+            return it->second.doc;
+        }
+        auto doc = std::make_shared<const json>(parse(path));
+        if (!doc->is_object()) {
+            throw std::runtime_error(path.string() + " is not an object");
+        }
+        if (doc->contains("Label") || doc->contains("Inherits")) {
+            throw std::runtime_error(
+                path.string() + ": defaults may not set Label or Inherits");
+        }
+        log_debug("parsed defaults from %s", path.c_str());
+        cache[path.string()] = Entry{mtime, doc};
+        return doc;
+    }
+    throw std::runtime_error("defaults not found: " + name);
+}
+
+json applyDefaults(const json &obj, const json &defaults) {
+    json result = obj;
+    result.erase("Inherits");
+    for (const auto &[key, val] : defaults.items()) {
+        if (!result.contains(key)) {
+            result[key] = val;
+        } else if (key == "EnvironmentVariables") {
+            auto env = val;
+            env.update(result[key]);
+            result[key] = std::move(env);
+        }
+    }
+    return result;
+}
+
 void Manifest::rectify() {
     if (!program && program_arguments.empty()) {
         // TODO: convert to ManifestError
@@ -295,6 +480,82 @@ void Manifest::rectify() {
     }
 }
 
+std::vector<Label> Manifest::dependencies() const {
+    std::vector<Label> result{after};
+    result.insert(result.end(), requires_jobs.begin(), requires_jobs.end());
+    return result;
+}
+
+bool Manifest::isTemplate() const { return label.str().back() == '@'; }
+
+bool Manifest::validNotificationNames() const {
+    auto valid = [](const InternedString &name) {
+        return !name.str().empty() && name.str().size() < NOTIFY_NAME_MAX;
+    };
+    const auto &n = notifications;
+    return std::all_of(n.send.begin(), n.send.end(), valid) &&
+           std::all_of(n.receive.begin(), n.receive.end(), valid) &&
+           std::all_of(n.launch_after.begin(), n.launch_after.end(),
+                       [&](const auto &c) { return valid(c.first); }) &&
+           std::all_of(n.exit_if.begin(), n.exit_if.end(),
+                       [&](const auto &c) { return valid(c.first); });
+}
+
+size_t Manifest::heapBytes() const {
+    size_t result = program_arguments.capacity() * sizeof(InternedString) +
+                    environment_variables.heapBytes() +
+                    (after.capacity() + requires_jobs.capacity()) * sizeof(Label);
+    // Labels are not interned
+    const size_t sso_capacity = std::string{}.capacity();
+    for (const auto *vec : {&after, &requires_jobs}) {
+        for (const auto &dep : *vec) {
+            if (dep.str().capacity() > sso_capacity) {
+                result += dep.str().capacity() + 1;
+            }
+        }
+    }
+    if (label.str().capacity() > sso_capacity) {
+        result += label.str().capacity() + 1;
+    }
+    const auto &n = notifications;
+    result += (n.send.capacity() + n.receive.capacity()) *
+                  sizeof(InternedString) +
+              (n.launch_after.capacity() + n.exit_if.capacity()) *
+                  sizeof(Notifications::Condition);
+    return result;
+}
+
+void Environment::set(const std::string &key, const std::string &value) {
+    auto it = std::lower_bound(vars.begin(), vars.end(), key,
+                               [](const value_type &var, const std::string &k) {
+                                   return var.first.str() < k;
+                               });
+    if (it != vars.end() && it->first == key) {
+        it->second = value;
+    } else {
+        vars.emplace(it, key, value);
+    }
+}
+
+const InternedString *Environment::find(std::string_view key) const {
+    auto it = std::lower_bound(vars.begin(), vars.end(), key,
+                               [](const value_type &var, std::string_view k) {
+                                   return var.first.str() < k;
+                               });
+    if (it != vars.end() && it->first == key) {
+        return &it->second;
+    }
+    return nullptr;
+}
+
+const InternedString &Environment::at(std::string_view key) const {
+    const auto *result = find(key);
+    if (!result) {
+        throw std::out_of_range(std::string{key});
+    }
+    return *result;
+}
+
 bool Manifest::validate() {
     if (!static_cast<const std::string>(label).size()) {
         log_error("job does not have a label");
@@ -308,6 +569,14 @@ bool Manifest::validate() {
     } else if (group_name && !user_name) {
         log_error("job %s sets GroupName but does not provide UserName",
                   label.c_str());
+    } else if (std::find(after.begin(), after.end(), label) != after.end() ||
+               std::find(requires_jobs.begin(), requires_jobs.end(), label) !=
+                   requires_jobs.end()) {
+        log_error("job %s cannot depend on itself", label.c_str());
+    } else if (!validNotificationNames()) {
+        log_error("job %s has a notification name that is empty or longer "
+                  "than %d bytes",
+                  label.c_str(), NOTIFY_NAME_MAX - 1);
     } else {
         return true;
     }
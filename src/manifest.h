@@ -18,9 +18,11 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <inttypes.h>
@@ -30,6 +32,8 @@
 
 #include <nlohmann/json.hpp>
 
+#include "string_pool.h"
+
 using json = nlohmann::json;
 
 //! The default value of ExitTimeout, in seconds
@@ -85,24 +89,59 @@ struct cron_spec {
     int32_t month;
 };
 
+//! Environment variables, stored as interned pairs sorted by name
+class Environment {
+  public:
+    using value_type = std::pair<InternedString, InternedString>;
+    using const_iterator = std::vector<value_type>::const_iterator;
+
+    //! Set a variable, replacing any existing value
+    void set(const std::string &key, const std::string &value);
+
+    //! Return the value of a variable, or nullptr if it is not set
+    const InternedString *find(std::string_view key) const;
+
+    //! Return the value of a variable, or throw std::out_of_range
+    const InternedString &at(std::string_view key) const;
+
+    size_t count(std::string_view key) const { return find(key) ? 1 : 0; }
+
+    size_t size() const { return vars.size(); }
+
+    bool empty() const { return vars.empty(); }
+
+    const_iterator begin() const { return vars.begin(); }
+
+    const_iterator end() const { return vars.end(); }
+
+    //! Heap memory used by this object, excluding the interned strings
+    size_t heapBytes() const { return vars.capacity() * sizeof(value_type); }
+
+  private:
+    std::vector<value_type> vars;
+};
+
 struct Manifest {
+    //! Scheduling class used when many jobs are started at once
+    enum class Priority { Critical, Normal, Background };
+
     Label label;
 
-    std::optional<std::string> user_name;
-    std::optional<std::string> group_name;
+    std::optional<InternedString> user_name;
+    std::optional<InternedString> group_name;
 
     /// TODO: Make this std::variant
-    std::optional<std::string> program;
-    std::vector<std::string> program_arguments;
+    std::optional<InternedString> program;
+    std::vector<InternedString> program_arguments;
     ///
 
     bool disabled = false;
     // bool enable_globbing;
     bool run_at_load = false;
-    std::optional<std::string> working_directory;
-    std::optional<std::string> root_directory;
+    std::optional<InternedString> working_directory;
+    std::optional<InternedString> root_directory;
 
-    std::unordered_map<std::string, std::string> environment_variables;
+    Environment environment_variables;
 
     std::optional<mode_t> umask;
     std::chrono::seconds exit_timeout =
@@ -114,9 +153,9 @@ struct Manifest {
     // std::vector<std::string> watch_paths;
     // std::vector<std::string> queue_directories;
     // bool start_on_mount = false;
-    std::string stdin_path = "/dev/null";
-    std::string stdout_path = "/dev/null";
-    std::string stderr_path = "/dev/null";
+    InternedString stdin_path = "/dev/null";
+    InternedString stdout_path = "/dev/null";
+    InternedString stderr_path = "/dev/null";
     bool abandon_process_group = false;
     // std::optional<struct cron_spec> calendar_interval;
     struct {
@@ -124,9 +163,50 @@ struct Manifest {
                              /* TODO: various other conditions */
     } keep_alive;
 
+    //! Jobs that should be started before this job, if they are loaded
+    std::vector<Label> after;
+    //! Jobs that must be loaded and started before this job
+    std::vector<Label> requires_jobs;
+
+    Priority priority = Priority::Normal;
+
+    //! Stateful notifications between jobs, as described in launch.h
+    struct Notifications {
+        //! A condition of the form name=state
+        using Condition = std::pair<InternedString, InternedString>;
+
+        //! Names that the job may post
+        std::vector<InternedString> send;
+        //! Names whose changes wake the job up
+        std::vector<InternedString> receive;
+        //! The job is not launched at load until all of these hold
+        std::vector<Condition> launch_after;
+        //! The job is sent a SIGTERM when any of these holds
+        std::vector<Condition> exit_if;
+
+        [[nodiscard]] bool empty() const {
+            return send.empty() && receive.empty() && launch_after.empty() &&
+                   exit_if.empty();
+        }
+    } notifications;
+
     // TODO: ResourceLimits, HopefullyExits*, inetd, LowPriorityIO,
     // LaunchOnlyOnce SLIST_HEAD(,job_manifest_socket) sockets;
 
+    //! Labels of all jobs that this job depends on (After and Requires)
+    std::vector<Label> dependencies() const;
+
+    //! Return true if this is a template for parameterized jobs, which is
+    //! indicated by a label that ends with '@'
+    bool isTemplate() const;
+
+    //! Return true if every notification name fits in the table
+    bool validNotificationNames() const;
+
+    //! Heap memory owned by this manifest, in bytes. Interned strings are
+    //! shared with other manifests, so they are not included.
+    size_t heapBytes() const;
+
     void rectify();
     bool validate();
     //        mode_t getUmask() {
@@ -138,11 +218,41 @@ struct Manifest {
 
 void from_json(const json &j, Manifest &m);
 
+//! Convert a manifest back into a document that from_json() accepts
+void to_json(json &j, const Manifest &m);
+
 #if XML_MANIFEST_SUPPORT
 std::optional<json> parse_xml(const char *path);
 #endif
 
 json parse(const std::filesystem::path &);
+
+//! Defaults documents that manifests name in their Inherits key. Each
+//! document is parsed once and shared by every manifest that inherits it.
+class DefaultsCache {
+  public:
+    //! Find the defaults document with the given name in the "defaults"
+    //! subdirectory of each search path, in order.
+    std::shared_ptr<const json>
+    get(const std::string &name,
+        const std::vector<std::filesystem::path> &search_paths);
+
+    //! The number of cached documents
+    size_t size() const { return cache.size(); }
+
+  private:
+    struct Entry {
+        std::filesystem::file_time_type mtime;
+        std::shared_ptr<const json> doc;
+    };
+
+    //! Cached documents, keyed by path
+    std::unordered_map<std::string, Entry> cache;
+};
+
+//! Merge a defaults document into a manifest. Keys in the manifest take
+//! precedence, and EnvironmentVariables are merged key by key.
+json applyDefaults(const json &obj, const json &defaults);
 } // namespace manifest
 
 using Manifest = manifest::Manifest;
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "manifest_cache.h"
+#include "log.h"
+#include "slab.h"
+
+//! Allocate a manifest and its reference count together in a slab
+static std::shared_ptr<const Manifest> makeSharedManifest(Manifest manifest) {
+    return std::allocate_shared<Manifest>(SlabAllocator<Manifest>{},
+                                          std::move(manifest));
+}
+
+//! Defaults are searched for next to the manifest, then in the load paths of
+//! the domain.
+static std::vector<std::filesystem::path>
+searchPaths(const std::string &path,
+            const std::vector<std::string> &load_paths) {
+    std::vector<std::filesystem::path> result;
+    if (path != "/dev/null") {
+        result.emplace_back(std::filesystem::path{path}.parent_path());
+    }
+    for (const auto &load_path : load_paths) {
+        result.emplace_back(load_path);
+    }
+    return result;
+}
+
+std::shared_ptr<const Manifest>
+ManifestCache::parse(const json &jsondata,
+                     const std::vector<std::filesystem::path> &search_paths,
+                     std::shared_ptr<const json> *defaults_out) {
+    if (!jsondata.contains("Inherits")) {
+        return makeSharedManifest(jsondata.get<Manifest>());
+    }
+    auto defaults = defaults_cache.get(
+        jsondata.at("Inherits").get<std::string>(), search_paths);
+    auto result = makeSharedManifest(
+        manifest::applyDefaults(jsondata, *defaults).get<Manifest>());
+    if (defaults_out) {
+        *defaults_out = std::move(defaults);
+    }
+    return result;
+}
+
+std::shared_ptr<const Manifest>
+ManifestCache::parse(const json &jsondata, const std::string &path,
+                     const std::vector<std::string> &load_paths) {
+    return parse(jsondata, searchPaths(path, load_paths), nullptr);
+}
+
+std::shared_ptr<const Manifest>
+ManifestCache::get(const std::filesystem::path &path,
+                   const std::vector<std::string> &load_paths) {
+    std::error_code ec;
+    auto canonical = std::filesystem::weakly_canonical(path, ec);
+    if (ec) {
+        canonical = path.lexically_normal();
+    }
+    const auto mtime = std::filesystem::last_write_time(canonical);
+    const auto search_paths = searchPaths(path, load_paths);
+
+    std::string key;
+    for (const auto &load_path : load_paths) {
+        key += load_path + ":";
+    }
+    key += canonical.string();
+
+    auto it = cache.find(key);
+    if (it != cache.end() && it->second.mtime == mtime) {
+        auto &entry = it->second;
+        auto manifest = entry.manifest.lock();
+        // The defaults document may have changed even if the manifest did not
+        if (manifest && (!entry.inherits ||
+                         defaults_cache.get(*entry.inherits, search_paths) ==
+                             entry.defaults)) {
+            log_debug("using the cached manifest for %s", path.c_str());
+            return manifest;
+        }
+    }
+
+    const json obj = manifest::parse(path);
+    Entry entry;
+    entry.mtime = mtime;
+    if (obj.contains("Inherits")) {
+        entry.inherits = obj.at("Inherits").get<std::string>();
+    }
+    auto manifest = parse(obj, search_paths, &entry.defaults);
+    entry.manifest = manifest;
+    cache[key] = std::move(entry);
+    if (cache.size() >= prune_at) {
+        prune();
+    }
+    return manifest;
+}
+
+size_t ManifestCache::size() const {
+    size_t result = 0;
+    for (const auto &[_, entry] : cache) {
+        if (!entry.manifest.expired()) {
+            result++;
+        }
+    }
+    return result;
+}
+
+void ManifestCache::prune() {
+    for (auto it = cache.begin(); it != cache.end();) {
+        if (it->second.manifest.expired()) {
+            it = cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    prune_at = std::max<size_t>(64, cache.size() * 2);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "manifest.h"
+
+//! Parsed manifests, shared by every domain hosted by the daemon. A manifest
+//! file in a shared load path is parsed once, and every domain that loads it
+//! holds a reference to the same immutable Manifest.
+class ManifestCache {
+  public:
+    //! Return the manifest in the file, parsing it if it is not cached or has
+    //! changed since it was parsed. Throws if the file cannot be parsed.
+    std::shared_ptr<const Manifest>
+    get(const std::filesystem::path &path,
+        const std::vector<std::string> &load_paths);
+
+    //! Parse a manifest document, resolving its Inherits key. The result is
+    //! not cached. Throws if the document is not a valid manifest.
+    std::shared_ptr<const Manifest>
+    parse(const json &jsondata, const std::string &path,
+          const std::vector<std::string> &load_paths);
+
+    //! The number of cached manifests that are still in use
+    size_t size() const;
+
+    //! Defaults documents named by the Inherits key
+    manifest::DefaultsCache &defaults() { return defaults_cache; }
+
+  private:
+    struct Entry {
+        std::filesystem::file_time_type mtime;
+        //! The Inherits key, and the defaults document that it named
+        std::optional<std::string> inherits;
+        std::shared_ptr<const json> defaults;
+        //! Unloaded manifests are freed; the entry is pruned later
+        std::weak_ptr<const Manifest> manifest;
+    };
+
+    std::shared_ptr<const Manifest>
+    parse(const json &jsondata,
+          const std::vector<std::filesystem::path> &search_paths,
+          std::shared_ptr<const json> *defaults_out);
+
+    //! Remove entries for manifests that are no longer in use
+    void prune();
+
+    //! Cached manifests, keyed by the load paths of the domain and the
+    //! canonical path of the file
+    std::unordered_map<std::string, Entry> cache;
+    size_t prune_at = 64;
+
+    manifest::DefaultsCache defaults_cache;
+};
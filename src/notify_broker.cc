@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "notify_broker.h"
+
+namespace {
+
+size_t tableLength(uint32_t capacity) {
+    return sizeof(notify_table_header) +
+           static_cast<size_t>(capacity) * sizeof(notify_table_entry);
+}
+
+//! The state without the NUL bytes that C callers tend to post with it
+std::string_view trimState(std::string_view state) {
+    while (!state.empty() && state.back() == '\0') {
+        state.remove_suffix(1);
+    }
+    return state;
+}
+
+} // namespace
+
+NotifyBroker::NotifyBroker(kq::EventManager &eventmgr_)
+    : eventmgr(eventmgr_) {}
+
+NotifyBroker::~NotifyBroker() { close(); }
+
+void NotifyBroker::open(const std::filesystem::path &path_,
+                        uint32_t capacity) {
+    close();
+    path = path_;
+    // Jobs of a previous launchd keep their own copy
+    (void)unlink(path.c_str());
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "open(2) of " + path.string());
+    }
+    reader_fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat sb, reader_sb;
+    if (reader_fd < 0 || fstat(fd, &sb) < 0 ||
+        fstat(reader_fd, &reader_sb) < 0) {
+        const int saved_errno = errno;
+        close();
+        throw std::system_error(saved_errno, std::system_category(),
+                                "open(2) of " + path.string());
+    }
+    // The path may have been replaced between the two opens
+    if (reader_sb.st_dev != sb.st_dev || reader_sb.st_ino != sb.st_ino) {
+        close();
+        throw std::runtime_error(path.string() + " was replaced while opening");
+    }
+    dev = sb.st_dev;
+    ino = sb.st_ino;
+    try {
+        grow(std::max<uint32_t>(capacity, 1));
+    } catch (...) {
+        close();
+        throw;
+    }
+    header->magic = NOTIFY_TABLE_MAGIC;
+    header->version = NOTIFY_TABLE_VERSION;
+    header->entry_size = sizeof(notify_table_entry);
+}
+
+void NotifyBroker::close() {
+    for (auto &[label, client] : clients) {
+        closeClient(*client);
+    }
+    clients.clear();
+    receivers.clear();
+    slots.clear();
+    if (header) {
+        (void)munmap(header, length);
+        header = nullptr;
+        length = 0;
+    }
+    for (int *p : {&fd, &reader_fd}) {
+        if (*p >= 0) {
+            (void)::close(*p);
+            *p = -1;
+        }
+    }
+    if (dev == 0 && ino == 0) {
+        return;
+    }
+    // Another manager may have replaced our table
+    struct stat sb;
+    if (stat(path.c_str(), &sb) == 0 && sb.st_dev == dev && sb.st_ino == ino &&
+        unlink(path.c_str()) < 0) {
+        log_errno("unlink(2) of %s", path.c_str());
+    }
+    dev = 0;
+    ino = 0;
+}
+
+// Entries never move, so the file is extended and mapped again. Readers map
+// it again when they see the new capacity.
+void NotifyBroker::grow(uint32_t new_capacity) {
+    const size_t new_length = tableLength(new_capacity);
+    if (ftruncate(fd, static_cast<off_t>(new_length)) < 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "ftruncate(2) of " + path.string());
+    }
+    void *addr = mmap(nullptr, new_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::system_category(),
+                                "unable to map " + path.string());
+    }
+    if (header) {
+        (void)munmap(header, length);
+    }
+    header = static_cast<notify_table_header *>(addr);
+    length = new_length;
+    __atomic_store_n(&header->capacity, new_capacity, __ATOMIC_RELEASE);
+}
+
+std::optional<uint32_t> NotifyBroker::slot(const std::string &name) {
+    if (!header) {
+        return std::nullopt;
+    }
+    auto it = slots.find(name);
+    if (it != slots.end()) {
+        return it->second;
+    }
+    if (name.empty() || name.size() >= NOTIFY_NAME_MAX) {
+        log_error("invalid notification name: %s", name.c_str());
+        return std::nullopt;
+    }
+    const uint32_t index = header->count;
+    if (index >= header->capacity) {
+        try {
+            grow(header->capacity * 2);
+        } catch (const std::system_error &exc) {
+            log_error("unable to grow the notification table: %s", exc.what());
+            return std::nullopt;
+        }
+    }
+    // The name is written before the entry is counted, and never changes
+    memcpy(entries()[index].name, name.c_str(), name.size() + 1);
+    __atomic_store_n(&header->count, index + 1, __ATOMIC_RELEASE);
+    slots.emplace(name, index);
+    return index;
+}
+
+const NotifyBroker::Endpoint *
+NotifyBroker::attach(const std::string &label,
+                     const std::vector<std::string> &send,
+                     const std::vector<std::string> &receive) {
+    if (auto it = clients.find(label); it != clients.end()) {
+        return &it->second->endpoint;
+    }
+    if (!header) {
+        return nullptr;
+    }
+    std::vector<uint32_t> receive_slots;
+    for (const auto &name : send) {
+        if (!slot(name)) {
+            return nullptr;
+        }
+    }
+    for (const auto &name : receive) {
+        const auto index = slot(name);
+        if (!index) {
+            return nullptr;
+        }
+        receive_slots.push_back(*index);
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_errno("socketpair(2)");
+        return nullptr;
+    }
+    if (fcntl(sv[0], F_SETFL, O_NONBLOCK) < 0) {
+        log_errno("fcntl(2)");
+        (void)::close(sv[0]);
+        (void)::close(sv[1]);
+        return nullptr;
+    }
+    auto client = std::make_unique<Client>();
+    client->label = label;
+    client->socket = sv[0];
+    client->send = {send.begin(), send.end()};
+    std::string slot_list;
+    for (uint32_t index : receive_slots) {
+        if (!slot_list.empty()) {
+            slot_list += ',';
+        }
+        slot_list += std::to_string(index);
+        receivers[index].push_back(client.get());
+    }
+    // Every job shares the whole table, so Receive only selects wakeups
+    client->endpoint = Endpoint{
+        sv[1],
+        reader_fd,
+        {std::string{NOTIFY_FD_ENV} + "=" + std::to_string(sv[1]) + "," +
+             std::to_string(reader_fd),
+         std::string{NOTIFY_SLOTS_ENV} + "=" + slot_list}};
+    auto *clientp = client.get();
+    eventmgr.addSocketRead(sv[0],
+                           [this, clientp](int) { readPosts(*clientp); });
+    clients.emplace(label, std::move(client));
+    log_debug("job %s: attached to notifications", label.c_str());
+    return &clientp->endpoint;
+}
+
+void NotifyBroker::detach(const std::string &label) {
+    auto it = clients.find(label);
+    if (it == clients.end()) {
+        return;
+    }
+    auto *client = it->second.get();
+    for (auto &[index, list] : receivers) {
+        list.erase(std::remove(list.begin(), list.end(), client), list.end());
+    }
+    closeClient(*client);
+    clients.erase(it);
+}
+
+void NotifyBroker::closeClient(Client &client) noexcept {
+    try {
+        eventmgr.deleteSocketRead(client.socket);
+    } catch (const std::exception &exc) {
+        log_error("unable to stop watching notifications of %s: %s",
+                  client.label.c_str(), exc.what());
+    }
+    (void)::close(client.socket);
+    (void)::close(client.endpoint.socket);
+    client.socket = -1;
+    client.endpoint.socket = -1;
+}
+
+void NotifyBroker::readPosts(Client &client) {
+    // The client may be detached by the listener
+    const std::string label = client.label;
+    char buf[NOTIFY_POST_MAX + 1];
+    for (;;) {
+        auto it = clients.find(label);
+        if (it == clients.end() || it->second.get() != &client) {
+            return;
+        }
+        const ssize_t bytes = recv(client.socket, buf, sizeof(buf), 0);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_errno("recv(2)");
+            }
+            return;
+        }
+        const auto *nul =
+            static_cast<const char *>(memchr(buf, '\0', bytes));
+        if (!nul || nul == buf ||
+            bytes > static_cast<ssize_t>(NOTIFY_POST_MAX)) {
+            log_warning("job %s: discarded an invalid notification",
+                        label.c_str());
+            continue;
+        }
+        const std::string name(buf, static_cast<size_t>(nul - buf));
+        const std::string_view state{
+            nul + 1, static_cast<size_t>(buf + bytes - nul - 1)};
+        if (!client.send.count(name) || state.size() > NOTIFY_STATE_MAX) {
+            log_warning("job %s: may not post %s", label.c_str(), name.c_str());
+            continue;
+        }
+        post(name, state);
+    }
+}
+
+bool NotifyBroker::post(const std::string &name, std::string_view state) {
+    if (state.size() > NOTIFY_STATE_MAX) {
+        return false;
+    }
+    const auto index = slot(name);
+    if (!index) {
+        return false;
+    }
+    auto &entry = entries()[*index];
+    // The sequence number is odd while the state is being written
+    __atomic_store_n(&entry.sequence, entry.sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(entry.state, state.data(), state.size());
+    entry.length = static_cast<uint32_t>(state.size());
+    __atomic_store_n(&entry.sequence, entry.sequence + 1, __ATOMIC_RELEASE);
+
+    // A receiver with a full socket already has a wakeup pending
+    if (auto it = receivers.find(*index); it != receivers.end()) {
+        static const char wakeup = 1;
+        for (const auto *client : it->second) {
+            (void)send(client->socket, &wakeup, 1, MSG_DONTWAIT);
+        }
+    }
+    if (listener) {
+        listener(name);
+    }
+    return true;
+}
+
+std::optional<std::string> NotifyBroker::state(const std::string &name) const {
+    auto it = slots.find(name);
+    if (it == slots.end()) {
+        return std::nullopt;
+    }
+    const auto &entry = entries()[it->second];
+    if (entry.sequence == 0) {
+        return std::nullopt;
+    }
+    return std::string{trimState({entry.state, entry.length})};
+}
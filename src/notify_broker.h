@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "event.h"
+#include "notify_table.h"
+
+/**
+ * Brokers the notifications that jobs post with notify_post(3). It owns the
+ * table that is described in notify_table.h, accepts a post only if the
+ * name is in the Send list of the job that made it, and wakes up the jobs
+ * that receive the name. Every attached job can read the whole table.
+ *
+ * Endpoints are not handed over on re-exec, so jobs that survive a re-exec
+ * are restarted, and attach to the new table.
+ */
+class NotifyBroker {
+  public:
+    //! Called after the state of a name has been posted
+    using Listener = std::function<void(const std::string &name)>;
+
+    //! What a job inherits: its end of the socket, the read-only table, and
+    //! the environment variables that name them
+    struct Endpoint {
+        int socket;
+        int table;
+        std::vector<std::string> environ;
+    };
+
+    explicit NotifyBroker(kq::EventManager &eventmgr_);
+    ~NotifyBroker();
+    NotifyBroker(const NotifyBroker &) = delete;
+    NotifyBroker &operator=(const NotifyBroker &) = delete;
+
+    //! Create the table at the given path, replacing any table that a
+    //! previous launchd left behind
+    void open(const std::filesystem::path &path_, uint32_t capacity = 64);
+
+    //! Detach every job and remove the table
+    void close();
+
+    [[nodiscard]] bool isOpen() const { return header != nullptr; }
+
+    void setListener(Listener listener_) { listener = std::move(listener_); }
+
+    //! The endpoint of a job, which is created on first use and kept until
+    //! detach(), so that every process of the job uses the same one. Returns
+    //! nullptr if the table is not open or is full.
+    const Endpoint *attach(const std::string &label,
+                           const std::vector<std::string> &send,
+                           const std::vector<std::string> &receive);
+
+    void detach(const std::string &label);
+
+    //! Update the state of a name and wake up its receivers. Returns false
+    //! if the table is not open or is full.
+    bool post(const std::string &name, std::string_view state);
+
+    //! The current state of a name, or nothing if it was never posted
+    [[nodiscard]] std::optional<std::string>
+    state(const std::string &name) const;
+
+    [[nodiscard]] uint32_t capacity() const {
+        return header ? header->capacity : 0;
+    }
+
+  private:
+    struct Client {
+        std::string label;
+        //! The end of the socket that launchd reads posts from
+        int socket = -1;
+        Endpoint endpoint;
+        std::unordered_set<std::string> send;
+    };
+
+    //! The entry of a name, which is assigned on first use
+    std::optional<uint32_t> slot(const std::string &name);
+    void grow(uint32_t new_capacity);
+    void readPosts(Client &client);
+    void closeClient(Client &client) noexcept;
+    [[nodiscard]] notify_table_entry *entries() const {
+        return reinterpret_cast<notify_table_entry *>(header + 1);
+    }
+
+    kq::EventManager &eventmgr;
+    std::filesystem::path path;
+    int fd = -1;
+    //! A read-only descriptor for the table, which every job inherits
+    int reader_fd = -1;
+    notify_table_header *header = nullptr;
+    size_t length = 0;
+    //! Identifies our file, so that close() does not remove a newer table
+    dev_t dev = 0;
+    ino_t ino = 0;
+    std::unordered_map<std::string, uint32_t> slots;
+    //! Keyed by label
+    std::unordered_map<std::string, std::unique_ptr<Client>> clients;
+    //! The clients that receive each entry
+    std::unordered_map<uint32_t, std::vector<Client *>> receivers;
+    Listener listener;
+};
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The notification table is a file in the state directory of a domain that
+ * holds the current state of every notification name, as posted with
+ * notify_post(3). launchd maps it into memory and is its only writer. Jobs
+ * with a Notifications key inherit a read-only descriptor for it, along with
+ * a datagram socket that carries their posts to launchd and wakes them up
+ * when a name that they receive changes.
+ *
+ * The table is a header followed by an array of entries. An entry is
+ * assigned to a name once, and never moves; the table grows in place when
+ * it is full, so readers map it again when the capacity exceeds what they
+ * have mapped. Every update of an entry is bracketed by increments of its
+ * sequence number, which is odd while an update is in progress, so a reader
+ * that sees the same even number before and after copying the state has a
+ * consistent copy. The sequence number of a name that has never been posted
+ * is zero.
+ */
+
+#ifndef NOTIFY_TABLE_H
+#define NOTIFY_TABLE_H
+
+#include <stdint.h>
+
+#define NOTIFY_TABLE_MAGIC 0x59544f4eU /* "NOTY" */
+#define NOTIFY_TABLE_VERSION 1U
+#define NOTIFY_TABLE_FILENAME "notify"
+#define NOTIFY_NAME_MAX 128
+#define NOTIFY_STATE_MAX 256
+
+/*
+ * The environment variables of a job with notifications: the socket and
+ * the table descriptor, separated by a comma, and the entries of the names
+ * that the job receives, as a comma-separated list.
+ */
+#define NOTIFY_FD_ENV "LAUNCH_NOTIFY_FD"
+#define NOTIFY_SLOTS_ENV "LAUNCH_NOTIFY_SLOTS"
+
+/* A post is a datagram that holds the name, a NUL byte and the state. A
+ * wakeup is a datagram of one byte. */
+#define NOTIFY_POST_MAX (NOTIFY_NAME_MAX + NOTIFY_STATE_MAX)
+
+struct notify_table_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t capacity;
+    /* The number of entries that have been assigned to a name */
+    uint32_t count;
+    uint32_t reserved[3];
+};
+
+struct notify_table_entry {
+    uint32_t sequence;
+    uint32_t length;
+    char name[NOTIFY_NAME_MAX];
+    char state[NOTIFY_STATE_MAX];
+};
+
+#endif /* NOTIFY_TABLE_H */
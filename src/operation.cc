@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "launch_status.h"
+#include "operation.h"
+
+namespace {
+
+const char *kindToString(Operation::Kind kind) {
+    switch (kind) {
+    case Operation::Kind::Start:
+        return "Start";
+    case Operation::Kind::Stop:
+        return "Stop";
+    case Operation::Kind::Load:
+        return "Load";
+    case Operation::Kind::Unload:
+        return "Unload";
+    default:
+        __builtin_unreachable();
+    }
+}
+
+const char *statusToString(Operation::Status status) {
+    switch (status) {
+    case Operation::Status::Pending:
+        return "Pending";
+    case Operation::Status::Succeeded:
+        return "Succeeded";
+    case Operation::Status::Failed:
+        return "Failed";
+    default:
+        __builtin_unreachable();
+    }
+}
+
+} // namespace
+
+json Operation::toJson() const {
+    json result = {{"Id", id},
+                   {"Kind", kindToString(kind)},
+                   {"Status", statusToString(status)}};
+    if (status == Status::Pending) {
+        auto labels = json::array();
+        for (const auto &[label, pid] : remaining) {
+            labels.push_back(label);
+        }
+        result["Waiting"] = std::move(labels);
+    }
+    if (!error.empty()) {
+        result["Error"] = error;
+    }
+    return result;
+}
+
+OperationTracker::OperationTracker(kq::EventManager &eventmgr_,
+                                   StatusLookup lookup_)
+    : eventmgr(eventmgr_), lookup(std::move(lookup_)) {}
+
+OperationTracker::~OperationTracker() {
+    for (auto &waiter : waiters) {
+        respond(waiter, false);
+    }
+}
+
+Operation::Id OperationTracker::begin(Operation::Kind kind) {
+    const auto id = next_id++;
+    Operation op;
+    op.id = id;
+    op.kind = kind;
+    operations.emplace(id, std::move(op));
+    pending_count++;
+    return id;
+}
+
+void OperationTracker::expect(Operation::Id id, const std::string &label) {
+    auto &op = operations.at(id);
+    const auto status = lookup(label);
+    if (op.remaining.emplace(label, status ? status->pid : 0).second) {
+        by_label[label].push_back(id);
+    }
+}
+
+void OperationTracker::commit(Operation::Id id) {
+    check(operations.at(id));
+    wakeWaiters();
+}
+
+void OperationTracker::jobChanged(const std::string &label) {
+    auto it = by_label.find(label);
+    if (it == by_label.end()) {
+        return;
+    }
+    // check() may remove entries from the list
+    const auto ids = it->second;
+    for (const auto id : ids) {
+        check(operations.at(id));
+    }
+    wakeWaiters();
+}
+
+bool OperationTracker::reached(const Operation &op, const std::string &label,
+                               pid_t start_pid, Operation::Status &outcome,
+                               std::string &error) const {
+    const auto status = lookup(label);
+    const int state = status ? status->state : LAUNCH_STATUS_UNLOADED;
+    switch (op.kind) {
+    case Operation::Kind::Start:
+        if (state == LAUNCH_STATUS_UNLOADED) {
+            outcome = Operation::Status::Failed;
+            error = label + " was unloaded";
+            return true;
+        }
+        // A job whose process could not be spawned is left without a pid
+        if (state == LAUNCH_STATUS_RUNNING && status->pid == 0) {
+            outcome = Operation::Status::Failed;
+            error = label + " could not be spawned";
+            return true;
+        }
+        return state == LAUNCH_STATUS_RUNNING;
+    case Operation::Kind::Stop:
+        // A KeepAlive job has stopped once its process has been replaced
+        return state != LAUNCH_STATUS_RUNNING || status->pid == 0 ||
+               status->pid != start_pid;
+    case Operation::Kind::Load:
+        if (state == LAUNCH_STATUS_UNLOADED) {
+            outcome = Operation::Status::Failed;
+            error = label + " was unloaded";
+            return true;
+        }
+        return state != LAUNCH_STATUS_LOADED || status->bootstrapped;
+    case Operation::Kind::Unload:
+        return state == LAUNCH_STATUS_UNLOADED;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+void OperationTracker::check(Operation &op) {
+    if (op.status != Operation::Status::Pending) {
+        return;
+    }
+    auto outcome = Operation::Status::Succeeded;
+    for (auto it = op.remaining.begin(); it != op.remaining.end();) {
+        auto job_outcome = Operation::Status::Succeeded;
+        std::string error;
+        if (reached(op, it->first, it->second, job_outcome, error)) {
+            if (job_outcome == Operation::Status::Failed) {
+                outcome = job_outcome;
+                op.error = std::move(error);
+            }
+            unwatch(op, it->first);
+            it = op.remaining.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (op.remaining.empty() || outcome == Operation::Status::Failed) {
+        complete(op, outcome);
+    }
+}
+
+void OperationTracker::complete(Operation &op, Operation::Status status) {
+    for (const auto &[label, pid] : op.remaining) {
+        unwatch(op, label);
+    }
+    op.remaining.clear();
+    op.status = status;
+    pending_count--;
+    completed.push_back(op.id);
+    while (completed.size() > completed_limit) {
+        operations.erase(completed.front());
+        completed.pop_front();
+    }
+}
+
+void OperationTracker::unwatch(const Operation &op, const std::string &label) {
+    auto it = by_label.find(label);
+    if (it == by_label.end()) {
+        return;
+    }
+    auto &ids = it->second;
+    ids.erase(std::remove(ids.begin(), ids.end(), op.id), ids.end());
+    if (ids.empty()) {
+        by_label.erase(it);
+    }
+}
+
+const Operation *OperationTracker::find(Operation::Id id) const {
+    auto it = operations.find(id);
+    return it == operations.end() ? nullptr : &it->second;
+}
+
+void OperationTracker::wait(const std::vector<Operation::Id> &ids,
+                            std::optional<std::chrono::milliseconds> timeout,
+                            Reply reply) {
+    Waiter waiter{ids, std::move(reply), std::nullopt};
+    if (done(waiter)) {
+        respond(waiter, false);
+        return;
+    }
+    waiters.push_back(std::move(waiter));
+    if (timeout) {
+        auto it = std::prev(waiters.end());
+        it->timer_id = eventmgr.addTimer(*timeout, [this, it] {
+            it->timer_id = std::nullopt;
+            // The reply may add or wake other waiters
+            std::list<Waiter> expired;
+            expired.splice(expired.end(), waiters, it);
+            respond(expired.front(), true);
+        });
+    }
+}
+
+bool OperationTracker::done(const Waiter &waiter) const {
+    return std::all_of(waiter.ids.begin(), waiter.ids.end(), [this](auto id) {
+        const auto *op = find(id);
+        return !op || op->status != Operation::Status::Pending;
+    });
+}
+
+void OperationTracker::respond(Waiter &waiter, bool timed_out) {
+    if (waiter.timer_id) {
+        eventmgr.deleteTimer(*waiter.timer_id);
+        waiter.timer_id = std::nullopt;
+    }
+    auto results = json::array();
+    bool error = false;
+    for (const auto id : waiter.ids) {
+        const auto *op = find(id);
+        if (op) {
+            results.push_back(op->toJson());
+            error = error || op->status != Operation::Status::Succeeded;
+        } else {
+            // Forgotten, or never existed
+            results.push_back({{"Id", id}, {"Status", "Unknown"}});
+            error = true;
+        }
+    }
+    waiter.reply({{"error", error},
+                  {"TimedOut", timed_out},
+                  {"Operations", std::move(results)}});
+}
+
+void OperationTracker::wakeWaiters() {
+    // A reply may start operations that call this again, so the waiters
+    // are taken out of the list before they are answered
+    std::list<Waiter> finished;
+    for (auto it = waiters.begin(); it != waiters.end();) {
+        auto next = std::next(it);
+        if (done(*it)) {
+            finished.splice(finished.end(), waiters, it);
+        }
+        it = next;
+    }
+    for (auto &waiter : finished) {
+        respond(waiter, false);
+    }
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <nlohmann/json.hpp>
+
+#include "event.h"
+
+using json = nlohmann::json;
+
+//! A request that changes the state of one or more jobs. It completes when
+//! every job reaches the target state of the request.
+struct Operation {
+    using Id = uint64_t;
+    enum class Kind { Start, Stop, Load, Unload };
+    enum class Status { Pending, Succeeded, Failed };
+
+    Id id;
+    Kind kind;
+    Status status = Status::Pending;
+    //! Labels of the jobs that have not reached the target state yet, and
+    //! the pid that each job had when the operation began
+    std::unordered_map<std::string, pid_t> remaining;
+    std::string error;
+
+    [[nodiscard]] json toJson() const;
+};
+
+//! What an OperationTracker needs to know about a job
+struct JobStatus {
+    //! The Job::States value, which is also a launch_status_state
+    int state;
+    //! Zero when the job has no process
+    pid_t pid;
+    //! True once the boot queue has bootstrapped the job
+    bool bootstrapped;
+};
+
+/**
+ * Keeps track of operations until they complete, and answers clients that
+ * wait for them. Recently completed operations are remembered so that
+ * clients can wait after the fact.
+ */
+class OperationTracker {
+  public:
+    //! Returns the status of a job, or nothing if there is no such job
+    using StatusLookup =
+        std::function<std::optional<JobStatus>(const std::string &label)>;
+    using Reply = std::function<void(const json &response)>;
+
+    OperationTracker(kq::EventManager &eventmgr_, StatusLookup lookup_);
+    //! Clients that are still waiting get the current status
+    ~OperationTracker();
+    OperationTracker(const OperationTracker &) = delete;
+    OperationTracker &operator=(const OperationTracker &) = delete;
+
+    //! Start an operation. Call expect() for each job, then commit().
+    Operation::Id begin(Operation::Kind kind);
+    void expect(Operation::Id id, const std::string &label);
+    //! Check the jobs of the operation, which may complete it immediately
+    void commit(Operation::Id id);
+
+    //! Check the operations that are waiting for a job
+    void jobChanged(const std::string &label);
+
+    //! Call the reply function when all of the operations have completed,
+    //! or when the timeout expires.
+    void wait(const std::vector<Operation::Id> &ids,
+              std::optional<std::chrono::milliseconds> timeout, Reply reply);
+
+    [[nodiscard]] const Operation *find(Operation::Id id) const;
+
+    //! The number of pending operations
+    [[nodiscard]] size_t pendingCount() const { return pending_count; }
+
+    //! How many completed operations are remembered
+    static constexpr size_t completed_limit = 4096;
+
+  private:
+    struct Waiter {
+        std::vector<Operation::Id> ids;
+        Reply reply;
+        std::optional<int> timer_id;
+    };
+
+    //! True if the job is in the target state of the operation
+    [[nodiscard]] bool reached(const Operation &op, const std::string &label,
+                               pid_t start_pid, Operation::Status &outcome,
+                               std::string &error) const;
+    void check(Operation &op);
+    void complete(Operation &op, Operation::Status status);
+    void unwatch(const Operation &op, const std::string &label);
+    [[nodiscard]] bool done(const Waiter &waiter) const;
+    void respond(Waiter &waiter, bool timed_out);
+    void wakeWaiters();
+
+    kq::EventManager &eventmgr;
+    StatusLookup lookup;
+    Operation::Id next_id = 1;
+    size_t pending_count = 0;
+    std::unordered_map<Operation::Id, Operation> operations;
+    //! Completed operations, oldest first
+    std::deque<Operation::Id> completed;
+    //! The pending operations that each job is part of
+    std::unordered_map<std::string, std::vector<Operation::Id>> by_label;
+    std::list<Waiter> waiters;
+};
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cerrno>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "log.h"
+#include "reexec.h"
+
+namespace reexec {
+
+int createImage(const json &image) {
+    const std::string data = image.dump();
+#if defined(__linux__)
+    int fd = memfd_create("relaunchd-image", 0);
+#else
+    char path[] = "/tmp/relaunchd-image.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        (void)unlink(path);
+    }
+#endif
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "unable to create the re-exec image");
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t rv = write(fd, data.data() + written, data.size() - written);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved_errno = errno;
+            (void)close(fd);
+            throw std::system_error(saved_errno, std::system_category(),
+                                    "unable to write the re-exec image");
+        }
+        written += static_cast<size_t>(rv);
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        int saved_errno = errno;
+        (void)close(fd);
+        throw std::system_error(saved_errno, std::system_category(), "lseek()");
+    }
+    return fd;
+}
+
+json loadImage(int fd) {
+    std::string data;
+    char buf[4096];
+    for (;;) {
+        ssize_t rv = read(fd, buf, sizeof(buf));
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved_errno = errno;
+            (void)close(fd);
+            throw std::system_error(saved_errno, std::system_category(),
+                                    "unable to read the re-exec image");
+        }
+        if (rv == 0) {
+            break;
+        }
+        data.append(buf, static_cast<size_t>(rv));
+    }
+    (void)close(fd);
+    return json::parse(data);
+}
+
+//! The path of the running binary. If it has been replaced by an upgrade,
+//! this is the path of the new binary.
+static std::string executablePath(const std::string &argv0) {
+#if defined(__linux__)
+    char buf[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if (len > 0) {
+        std::string result{buf, static_cast<size_t>(len)};
+        const std::string deleted{" (deleted)"};
+        if (result.size() > deleted.size() &&
+            result.compare(result.size() - deleted.size(), deleted.size(),
+                           deleted) == 0) {
+            result.resize(result.size() - deleted.size());
+        }
+        return result;
+    }
+#endif
+    return argv0;
+}
+
+void execute(const std::vector<std::string> &args, int image_fd) {
+    if (args.empty()) {
+        throw std::logic_error("argv[0] is required");
+    }
+    // Replace the image option of a previous re-exec
+    std::vector<std::string> new_args;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == IMAGE_OPTION && i + 1 < args.size()) {
+            i++;
+            continue;
+        }
+        new_args.push_back(args[i]);
+    }
+    new_args.insert(new_args.begin() + 1,
+                    {IMAGE_OPTION, std::to_string(image_fd)});
+
+    std::vector<char *> argv;
+    for (auto &arg : new_args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    const auto path = executablePath(args[0]);
+    log_notice("re-executing %s", path.c_str());
+    (void)execv(path.c_str(), argv.data());
+    throw std::system_error(errno, std::system_category(),
+                            "execv() of " + path);
+}
+
+} // namespace reexec
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Re-executing launchd replaces the program without losing its jobs. The
+ * runtime state is written to an anonymous file that is inherited across
+ * execve(2), and the new process adopts the running jobs from it.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+namespace reexec {
+
+//! The option that passes the descriptor of the image to the new process
+static constexpr const char *IMAGE_OPTION = "-R";
+
+//! Write an image to an anonymous file that is not closed on exec, and
+//! return its descriptor
+int createImage(const json &image);
+
+//! Read and close an image created by createImage()
+json loadImage(int fd);
+
+//! Execute the current launchd binary again with the same arguments, plus
+//! an option that points to the image. Only returns by throwing.
+[[noreturn]] void execute(const std::vector<std::string> &args, int image_fd);
+
+} // namespace reexec
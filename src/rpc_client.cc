@@ -14,39 +14,85 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 #include "rpc_client.h"
 
 namespace subcommand {
-void disable(Channel &chan, std::vector<std::string> &args) {
+json disable(std::vector<std::string> &args) {
+    auto kwargs = json::object({{"Label", args.at(0)}});
+    return json::array({"disable", kwargs});
+}
+
+json enable(std::vector<std::string> &args) {
     auto kwargs = json::object({{"Label", args.at(0)}});
-    json msg = json::array({"disable", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"enable", kwargs});
 }
 
-void enable(Channel &chan, std::vector<std::string> &args) {
+json instantiate(std::vector<std::string> &args) {
     auto kwargs = json::object({{"Label", args.at(0)}});
-    json msg = json::array({"enable", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"instantiate", kwargs});
+}
+
+void instantiateReply(const json &response,
+                      const std::vector<std::string> &args) {
+    if (response.at("error").get<bool>()) {
+        throw std::runtime_error("unable to create " + args.at(0));
+    }
+}
+
+json history(std::vector<std::string> &args) {
+    auto kwargs = json::object();
+    for (auto it = args.begin(); it != args.end(); it++) {
+        if (*it == "-n" && std::next(it) != args.end()) {
+            it++;
+            kwargs["Limit"] = std::stoul(*it);
+        } else {
+            kwargs["Label"] = *it;
+        }
+    }
+    return json::array({"history", kwargs});
 }
 
-void kill(Channel &chan, std::vector<std::string> &args) {
+void historyReply(const json &msg, const std::vector<std::string> &) {
+    printf("%-19s %10s %-8s %-9s %s\n", "Started", "Runtime", "Status",
+           "Cause", "Label");
+    for (const auto &row : msg.at("Runs")) {
+        const auto started_at = row["StartedAt"].get<int64_t>();
+        const time_t started_sec = static_cast<time_t>(started_at / 1000);
+        char started[32] = "-";
+        struct tm tm;
+        if (started_at > 0 && localtime_r(&started_sec, &tm)) {
+            strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S", &tm);
+        }
+        const double runtime =
+            static_cast<double>(row["ExitedAt"].get<int64_t>() - started_at) /
+            1000;
+        const std::string status =
+            row.contains("TermSignal")
+                ? "SIG" + std::to_string(row["TermSignal"].get<int>())
+                : std::to_string(row["ExitStatus"].get<int>());
+        printf("%-19s %10.3f %-8s %-9s %s\n", started, runtime,
+               status.c_str(), row["Cause"].get<std::string>().c_str(),
+               row["Label"].get<std::string>().c_str());
+    }
+}
+
+json kill(std::vector<std::string> &args) {
     auto kwargs = json::object({{"Signal", args.at(0)}, {"Label", args.at(1)}});
-    json msg = json::array({"kill", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"kill", kwargs});
 }
 
-void list(Channel &chan, std::vector<std::string> &) {
+json list(std::vector<std::string> &) {
     // FIXME: parse options
-    chan.writeMessage(json::array({
+    return json::array({
         "list",
-    }));
-    auto msg = chan.readMessage();
+    });
+}
+
+void listReply(const json &msg, const std::vector<std::string> &) {
     printf("%-8s %-8s %s\n", "PID", "Status", "Label");
     for (const auto &row : msg) {
         auto pid = row["PID"].get<std::string>();
@@ -56,7 +102,7 @@ void list(Channel &chan, std::vector<std::string> &) {
     }
 }
 
-void load(Channel &chan, std::vector<std::string> &args) {
+json load(std::vector<std::string> &args) {
     auto kwargs = json::object({
         {"OverrideDisabled", false},
         {"Force", false},
@@ -76,42 +122,25 @@ void load(Channel &chan, std::vector<std::string> &args) {
             kwargs["Paths"].push_back(std::filesystem::canonical(path));
         }
     }
-    json msg = json::array({"load", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
-}
-
-void not_implemented(Channel &, std::vector<std::string> &) {
-    std::cerr << "ERROR: Not implemented yet" << std::endl;
-    exit(EXIT_FAILURE);
+    return json::array({"load", kwargs});
 }
 
-void remove(Channel &chan, std::vector<std::string> &args) {
+json remove(std::vector<std::string> &args) {
     auto kwargs = json::object({{"Label", args.at(0)}});
-    json msg = json::array({"remove", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"remove", kwargs});
 }
 
-void start(Channel &chan, std::vector<std::string> &args) {
+json start(std::vector<std::string> &args) {
     auto kwargs = json::object({{"Label", args.at(0)}});
-    json msg = json::array({"start", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"start", kwargs});
 }
 
-void stop(Channel &chan, std::vector<std::string> &args) {
+json stop(std::vector<std::string> &args) {
     auto kwargs = json::object({{"Label", args.at(0)}});
-    json msg = json::array({"stop", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"stop", kwargs});
 }
 
-void submit(Channel &chan, std::vector<std::string> &args) {
+json submit(std::vector<std::string> &args) {
     auto kwargs = json::object({{"ProgramArguments", json::array()}});
     int preamble = 1;
     for (auto it = args.begin(); it != args.end(); it++) {
@@ -128,6 +157,18 @@ void submit(Channel &chan, std::vector<std::string> &args) {
             } else if (*it == "-e") {
                 it++;
                 kwargs["StandardErrorPath"] = *it;
+            } else if (*it == "-I" || *it == "-O" || *it == "-E") {
+                // Pass our own stdio to the job, so that its output does
+                // not have to go through a path
+                static const std::unordered_map<std::string,
+                                                std::pair<const char *, int>>
+                    stdio = {{"-I", {"StandardInFD", STDIN_FILENO}},
+                             {"-O", {"StandardOutFD", STDOUT_FILENO}},
+                             {"-E", {"StandardErrorFD", STDERR_FILENO}}};
+                const auto &[key, fd] = stdio.at(*it);
+                auto &fds = kwargs["Descriptors"];
+                kwargs[key] = fds.size();
+                fds.push_back(fd);
             } else if (*it == "--") {
                 preamble = 0;
             }
@@ -138,14 +179,11 @@ void submit(Channel &chan, std::vector<std::string> &args) {
     if (!kwargs.contains("Label")) {
         throw std::runtime_error("Label is required");
     }
-    json msg = json::array({"submit", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"submit", kwargs});
 }
 
 // TODO: deduplicate this with load()
-void unload(Channel &chan, std::vector<std::string> &args) {
+json unload(std::vector<std::string> &args) {
     auto kwargs = json::object({
         {"OverrideDisabled", false},
         {"Force", false},
@@ -157,48 +195,325 @@ void unload(Channel &chan, std::vector<std::string> &args) {
         } else if (elem == "-F") {
             kwargs["Force"] = true;
         } else {
-            auto path = std::filesystem::path(elem);
-            if (!std::filesystem::exists(path)) {
-                // TODO: make this more informative to the user
-                throw std::runtime_error("path does not exist");
-            }
-            kwargs["Paths"].push_back(std::filesystem::canonical(path));
+            // The manifest may have been deleted since it was loaded
+            auto path = std::filesystem::absolute(elem);
+            kwargs["Paths"].push_back(std::filesystem::weakly_canonical(path));
+        }
+    }
+    return json::array({"unload", kwargs});
+}
+
+json reexec(std::vector<std::string> &) { return json::array({"reexec"}); }
+
+void reexecReply(const json &response, const std::vector<std::string> &) {
+    if (response.at("error").get<bool>()) {
+        throw std::runtime_error("re-exec was refused");
+    }
+}
+
+json wait(std::vector<std::string> &args) {
+    auto kwargs = json::object({{"Operations", json::array()}});
+    for (auto it = args.begin(); it != args.end(); it++) {
+        if (*it == "-t" && std::next(it) != args.end()) {
+            it++;
+            kwargs["Timeout"] = std::stod(*it);
+        } else {
+            kwargs["Operations"].push_back(std::stoull(*it));
         }
     }
-    json msg = json::array({"unload", kwargs});
-    chan.writeMessage(msg);
-    auto maybe_json = chan.readMessage();
-    // FIXME
+    return json::array({"wait", kwargs});
+}
+
+void waitReply(const json &response, const std::vector<std::string> &) {
+    for (const auto &op : response.at("Operations")) {
+        printf("%-8llu %-10s %s\n",
+               static_cast<unsigned long long>(op["Id"].get<uint64_t>()),
+               op["Status"].get<std::string>().c_str(),
+               op.value("Error", "").c_str());
+    }
+    if (response.at("error").get<bool>()) {
+        throw std::runtime_error("an operation did not succeed");
+    }
+}
+
+json version(std::vector<std::string> &) { return json::array({"version"}); }
+
+json watch(std::vector<std::string> &args) {
+    return json::array({"watch", {{"Labels", args}}});
 }
 
-void version(Channel &chan, std::vector<std::string> &) {
-    chan.writeMessage(json::array({"version"}));
-    auto msg = chan.readMessage();
+void watchReply(const json &record, const std::vector<std::string> &) {
+    const auto time = record.at("Time").get<int64_t>();
+    const time_t sec = static_cast<time_t>(time / 1000);
+    char timestamp[32] = "-";
+    struct tm tm;
+    if (localtime_r(&sec, &tm)) {
+        strftime(timestamp, sizeof(timestamp), "%H:%M:%S", &tm);
+    }
+    const auto event = record.at("Event").get<std::string>();
+    std::string details;
+    if (event == "Transition") {
+        details = record["From"].get<std::string>() + " -> " +
+                  record["To"].get<std::string>();
+    } else if (event == "Exit") {
+        details = "pid " + std::to_string(record["PID"].get<int>());
+        if (record.contains("TermSignal")) {
+            details += " signal " +
+                       std::to_string(record["TermSignal"].get<int>());
+        } else {
+            details += " status " +
+                       std::to_string(record["ExitStatus"].get<int>());
+        }
+    } else if (event == "Throttle") {
+        details = "restart in " +
+                  std::to_string(record["Delay"].get<int64_t>()) + "s";
+    } else if (event == "SpawnFailed") {
+        details = record["Error"].get<std::string>();
+    }
+    printf("%s.%03d %-12s %-32s %s\n", timestamp, static_cast<int>(time % 1000),
+           event.c_str(), record.at("Label").get<std::string>().c_str(),
+           details.c_str());
+    // Whoever reads the output wants to see each event as it happens
+    fflush(stdout);
+}
+
+void versionReply(const json &msg, const std::vector<std::string> &) {
     std::cout << msg.at("version").get<std::string>() << std::endl;
 }
 
-const std::unordered_map<std::string,
-                         void (*)(Channel &, std::vector<std::string> &)>
-    subcommands = {
-        {"disable", disable}, {"enable", enable},   {"kill", kill},
-        {"list", list},       {"load", load},       {"remove", remove},
-        {"start", start},     {"stop", stop},       {"submit", submit},
-        {"unload", unload},   {"version", version},
+//! How to make the request for a subcommand, and how to report its reply.
+//! Subcommands without a reply function ignore the reply.
+struct Subcommand {
+    json (*request)(std::vector<std::string> &args);
+    void (*reply)(const json &response, const std::vector<std::string> &args);
+    //! If true, the request is acknowledged, and then each message until
+    //! the server disconnects is passed to the reply function
+    bool streams = false;
+};
+
+const std::unordered_map<std::string, Subcommand> subcommands = {
+    {"disable", {disable, nullptr}},
+    {"enable", {enable, nullptr}},
+    {"history", {history, historyReply}},
+    {"instantiate", {instantiate, instantiateReply}},
+    {"kill", {kill, nullptr}},
+    {"list", {list, listReply}},
+    {"load", {load, nullptr}},
+    {"reexec", {reexec, reexecReply}},
+    {"remove", {remove, nullptr}},
+    {"start", {start, nullptr}},
+    {"stop", {stop, nullptr}},
+    {"submit", {submit, nullptr}},
+    {"unload", {unload, nullptr}},
+    {"version", {version, versionReply}},
+    {"wait", {wait, waitReply}},
+    {"watch", {watch, watchReply, true}},
 
-        // launchd v2 API not implemented yet
-        //{"print",    subcommand::not_implemented},
+    // launchd v2 API not implemented yet
+    //{"print",    subcommand::not_implemented},
 
 };
 } // namespace subcommand
 
+//! Split a line into words. Quotes group words, and a line that starts with
+//! a hash is a comment.
+static std::vector<std::string> splitWords(const std::string &line) {
+    std::vector<std::string> words;
+    std::optional<std::string> word;
+    char quote = '\0';
+    for (char ch : line) {
+        if (quote) {
+            if (ch == quote) {
+                quote = '\0';
+            } else {
+                word->push_back(ch);
+            }
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
+            word.emplace();
+        } else if (isspace(static_cast<unsigned char>(ch))) {
+            if (word) {
+                words.push_back(std::move(*word));
+                word.reset();
+            }
+        } else if (ch == '#' && !word && words.empty()) {
+            break;
+        } else {
+            if (!word) {
+                word.emplace();
+            }
+            word->push_back(ch);
+        }
+    }
+    if (quote) {
+        throw std::runtime_error("unterminated quote");
+    }
+    if (word) {
+        words.push_back(std::move(*word));
+    }
+    return words;
+}
+
+//! Remove the list of descriptors to pass from the arguments of a request.
+//! The request refers to them by their index.
+static std::vector<int> takeDescriptors(json &request) {
+    std::vector<int> fds;
+    if (request.size() > 1 && request[1].is_object() &&
+        request[1].contains("Descriptors")) {
+        fds = request[1]["Descriptors"].get<std::vector<int>>();
+        request[1].erase("Descriptors");
+    }
+    return fds;
+}
+
 void RpcClient::invokeMethod(const std::string &method,
                              std::vector<std::string> &args,
                              const Domain &domain) {
     Channel chan;
     auto statedir = domain.statedir;
     chan.connect(statedir.append("rpc.sock"));
-    auto funcptr = subcommand::subcommands.at(method);
-    (*funcptr)(chan, args);
+    chan.setEncoding(encoding);
+    const auto &sub = subcommand::subcommands.at(method);
+    auto request = sub.request(args);
+    const auto fds = takeDescriptors(request);
+    if (fds.empty()) {
+        chan.writeMessage(request);
+    } else {
+        chan.writeMessage({{"FDs", fds.size()}, {"Request", request}}, fds);
+    }
+    auto response = chan.readMessage();
+    if (sub.streams) {
+        if (response.at("error").get<bool>()) {
+            throw std::runtime_error(method + " was refused");
+        }
+        while (auto msg = chan.tryReadMessage()) {
+            sub.reply(*msg, args);
+        }
+    } else if (sub.reply) {
+        sub.reply(response, args);
+    }
+}
+
+size_t RpcClient::runBatch(std::istream &input, const Domain &domain) {
+    Channel chan;
+    auto statedir = domain.statedir;
+    if (chan.connect(statedir.append("rpc.sock")) < 0) {
+        throw std::runtime_error("unable to connect to launchd");
+    }
+    chan.setEncoding(encoding);
+
+    struct Pending {
+        size_t line;
+        const subcommand::Subcommand *sub;
+        std::vector<std::string> args;
+    };
+    std::mutex mtx;
+    std::unordered_map<uint64_t, Pending> pending;
+    std::atomic<size_t> failures{0};
+
+    // Replies carry the id of their request
+    auto handleReply = [&](const json &envelope) {
+        Pending request;
+        {
+            std::lock_guard<std::mutex> lock{mtx};
+            auto it = pending.find(envelope.at("Id").get<uint64_t>());
+            if (it == pending.end()) {
+                throw std::runtime_error("reply to an unknown request");
+            }
+            request = std::move(it->second);
+            pending.erase(it);
+        }
+        const auto &response = envelope.at("Reply");
+        try {
+            if (request.sub->reply) {
+                request.sub->reply(response, request.args);
+            } else if (response.is_object() && response.value("error", false)) {
+                throw std::runtime_error("request failed");
+            }
+        } catch (const std::exception &exc) {
+            std::cerr << "line " << request.line << ": " << exc.what()
+                      << std::endl;
+            failures++;
+        }
+    };
+
+    // The first request is answered before the others are sent, so that the
+    // encoding is settled. After that, one thread sends requests and another
+    // reports replies as they arrive.
+    std::thread reader;
+    auto readReplies = [&] {
+        try {
+            while (auto envelope = chan.tryReadMessage()) {
+                handleReply(*envelope);
+            }
+        } catch (const std::exception &exc) {
+            std::cerr << "ERROR: " << exc.what() << std::endl;
+        }
+    };
+    uint64_t next_id = 1;
+    size_t lineno = 0;
+    std::string line;
+    while (std::getline(input, line)) {
+        lineno++;
+        std::vector<std::string> words;
+        json request;
+        std::vector<int> fds;
+        const subcommand::Subcommand *sub;
+        try {
+            words = splitWords(line);
+            if (words.empty()) {
+                continue;
+            }
+            auto it = subcommand::subcommands.find(words[0]);
+            if (it == subcommand::subcommands.end()) {
+                throw std::runtime_error("unknown subcommand: " + words[0]);
+            }
+            sub = &it->second;
+            if (sub->streams) {
+                throw std::runtime_error(words[0] + " cannot be used in a "
+                                                    "batch");
+            }
+            words.erase(words.begin());
+            request = sub->request(words);
+            fds = takeDescriptors(request);
+        } catch (const std::exception &exc) {
+            std::cerr << "line " << lineno << ": " << exc.what() << std::endl;
+            failures++;
+            continue;
+        }
+        const uint64_t id = next_id++;
+        {
+            std::lock_guard<std::mutex> lock{mtx};
+            pending.emplace(id, Pending{lineno, sub, std::move(words)});
+        }
+        json envelope = {{"Id", id}, {"Request", std::move(request)}};
+        if (!fds.empty()) {
+            envelope["FDs"] = fds.size();
+        }
+        if (!reader.joinable()) {
+            chan.writeMessage(envelope, fds);
+            handleReply(chan.readMessage());
+            reader = std::thread{readReplies};
+        } else {
+            Channel::writeMessage(chan.getSockFD(), envelope,
+                                  chan.getEncoding(), fds);
+        }
+    }
+    // The server answers the remaining requests before it disconnects
+    chan.shutdownWrite();
+    if (reader.joinable()) {
+        reader.join();
+    }
+    for (const auto &[id, request] : pending) {
+        std::cerr << "line " << request.line << ": no reply" << std::endl;
+        failures++;
+    }
+    return failures;
+}
+
+json RpcClient::makeRequest(const std::string &method,
+                            std::vector<std::string> &args) {
+    return subcommand::subcommands.at(method).request(args);
 }
 
 bool RpcClient::methodExists(const std::string &method) const {
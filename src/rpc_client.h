@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <istream>
+
 #include "channel.h"
 #include "manager.h"
 
@@ -23,5 +25,25 @@ class RpcClient {
   public:
     void invokeMethod(const std::string &method, std::vector<std::string> &args,
                       const Domain &domain);
+    //! Run one subcommand per line, pipelined over a single connection.
+    //! Replies are reported as they arrive. Returns the number of
+    //! subcommands that failed.
+    size_t runBatch(std::istream &input, const Domain &domain);
+
     bool methodExists(const std::string &method) const;
+
+    //! The request that a subcommand sends, for callers that manage their
+    //! own Channel
+    static json makeRequest(const std::string &method,
+                            std::vector<std::string> &args);
+
+    //! The encoding to request. JSON is used if the server does not
+    //! support it.
+    void setEncoding(Channel::Encoding encoding_) { encoding = encoding_; }
+    Channel::Encoding getEncoding() const { return encoding; }
+
+  private:
+    //! Encoding replies is the largest cost of big listings for the daemon,
+    //! and MessagePack halves it
+    Channel::Encoding encoding = Channel::Encoding::MessagePack;
 };
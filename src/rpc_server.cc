@@ -16,13 +16,19 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <array>
 #include <filesystem>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -41,6 +47,13 @@ static json _rpc_op_enable(const json &args, Manager &mgr) {
     return {{"error", false}};
 }
 
+static json _rpc_op_instantiate(const json &args, Manager &mgr) {
+    const Label label{args[1]["Label"]};
+    bool ok = mgr.instantiateJob(label);
+    mgr.startRunning();
+    return {{"error", !ok}};
+}
+
 static json _rpc_op_kill(const json &args, Manager &mgr) {
     const Label label{args[1]["Label"]};
     const std::string &signame_or_num = args[1]["Signal"];
@@ -52,90 +65,153 @@ static json _rpc_op_list(const json &, Manager &mgr) {
     return mgr.listJobs();
 }
 
+static json _rpc_op_history(const json &args, Manager &mgr) {
+    std::optional<std::string> label;
+    size_t limit = 20;
+    if (args.size() > 1) {
+        if (args[1].contains("Label")) {
+            label = args[1]["Label"].get<std::string>();
+        }
+        limit = args[1].value("Limit", limit);
+    }
+    return {{"error", false}, {"Runs", mgr.runHistory(label, limit)}};
+}
+
+// Mutating requests reply as soon as the request has been made, with the id
+// of an operation that the client can pass to "wait".
+
 static json _rpc_op_load(const json &args, Manager &mgr) {
     bool forceLoad = args[1]["Force"];
     bool overrideDisabled = args[1]["OverrideDisabled"];
-    bool error = false;
-    for (const auto &load_path : args[1]["Paths"]) {
-        if (!mgr.loadAllManifests(load_path, overrideDisabled, forceLoad)) {
-            error = true;
-        }
-    }
-    mgr.startRunning();
-    return {{"error", error}};
+    bool ok;
+    const auto id = mgr.requestLoad(
+        args[1]["Paths"].get<std::vector<std::string>>(), overrideDisabled,
+        forceLoad, ok);
+    return {{"error", !ok}, {"Operation", id}};
 }
 
 static json _rpc_op_unload(const json &args, Manager &mgr) {
     bool forceUnload = args[1]["Force"];
     bool overrideDisabled = args[1]["OverrideDisabled"];
-    bool is_error = false;
-    for (const auto &jsonobj : args[1]["Paths"]) {
-        const std::filesystem::path path{jsonobj.get<std::string>()};
-        if (!std::filesystem::exists(path)) {
-            log_warning("path does not exist: %s", path.c_str());
-            is_error = true;
-            break;
-        }
-        if (std::filesystem::is_directory(path)) {
-            using std::filesystem::directory_iterator;
-            for (const auto &file : directory_iterator(path)) {
-                if (!mgr.unloadJob(file.path(), overrideDisabled,
-                                   forceUnload)) {
-                    log_warning("unload failed: %s", file.path().c_str());
-                    is_error = true;
-                    break;
+    bool ok;
+    const auto id = mgr.requestUnload(
+        [&] {
+            bool success = true;
+            for (const auto &jsonobj : args[1]["Paths"]) {
+                const std::filesystem::path path{jsonobj.get<std::string>()};
+                if (!mgr.unloadJob(path, overrideDisabled, forceUnload)) {
+                    log_warning("unload failed: %s", path.c_str());
+                    success = false;
                 }
             }
-        } else {
-            if (!mgr.unloadJob(path, overrideDisabled, forceUnload)) {
-                log_warning("unload failed: %s", path.c_str());
-                is_error = true;
-                break;
-            }
-        }
-    }
-    return {{"error", is_error}};
+            return success;
+        },
+        ok);
+    return {{"error", !ok}, {"Operation", id}};
 }
 
-/* FIXME: will need to ask the manager to start/stop the job,
- * instead of directly controlling the job.
- */
-#if 0
 static json _rpc_op_start(const json &args, Manager &mgr) {
-    const std::string &label = args[1]["Label"];
-    if (mgr.jobExists(label)) {
-        auto & job = mgr.getJob(label);
-        job.run();
-        return {{"error", false}};
-    } else {
+    const Label label{args[1]["Label"]};
+    const auto id = mgr.requestStart(label);
+    if (!id) {
         return {{"error", true}};
     }
+    return {{"error", false}, {"Operation", *id}};
 }
 
 static json _rpc_op_stop(const json &args, Manager &mgr) {
-    const std::string &label = args[1]["Label"];
-    if (mgr.jobExists(label)) {
-        auto & job = mgr.getJob(label);
-        job.kill("SIGTERM");
-        return {{"error", false}};
-    } else {
+    const Label label{args[1]["Label"]};
+    const auto id = mgr.requestStop(label);
+    if (!id) {
         return {{"error", true}};
     }
+    return {{"error", false}, {"Operation", *id}};
+}
+
+static json _rpc_op_reexec(const json &, Manager &mgr) {
+    // Hosted user domains share the daemon with other users
+    if (mgr.getDomain().uid) {
+        log_error("refusing to re-exec from a hosted user domain");
+        return {{"error", true}};
+    }
+    log_notice("re-exec requested");
+    mgr.requestReexec();
+    return {{"error", false}};
 }
-#endif
 
 static json _rpc_op_remove(const json &args, Manager &mgr) {
     const Label label{args[1]["Label"]};
-    bool status = mgr.unloadJob(label);
-    // FIXME: should return immediately, not waiting for job to be unloaded
-    return {{"error", status}};
+    bool ok;
+    const auto id =
+        mgr.requestUnload([&] { return mgr.unloadJob(label); }, ok);
+    return {{"error", !ok}, {"Operation", id}};
 }
 
-static json _rpc_op_submit(const json &args, Manager &mgr) {
+//! Reply when the operations have completed, without blocking the event
+//! loop. The connection is kept open until then.
+static void _rpc_op_wait(const json &args, Manager &mgr,
+                         OperationTracker::Reply reply) {
+    std::vector<Operation::Id> ids;
+    std::optional<std::chrono::milliseconds> timeout;
+    if (args.size() > 1) {
+        ids = args[1].value("Operations", ids);
+        if (args[1].contains("Timeout")) {
+            timeout = std::chrono::milliseconds{
+                static_cast<int64_t>(args[1]["Timeout"].get<double>() * 1000)};
+        }
+    }
+    mgr.getOperations().wait(ids, timeout, std::move(reply));
+}
+
+//! Descriptors passed with a request. Those that a handler does not take
+//! are closed.
+struct Descriptors {
+    std::vector<int> fds;
+
+    Descriptors() = default;
+    Descriptors(const Descriptors &) = delete;
+    Descriptors &operator=(const Descriptors &) = delete;
+    ~Descriptors() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                (void)close(fd);
+            }
+        }
+    }
+
+    //! Take the descriptor with the given index, or throw
+    int take(const json &index) {
+        int &fd = fds.at(index.get<size_t>());
+        if (fd < 0) {
+            throw std::invalid_argument("descriptor was already used");
+        }
+        return std::exchange(fd, -1);
+    }
+};
+
+static json _rpc_op_submit(const json &args, Manager &mgr, Descriptors &fds) {
     std::string path = "/dev/null";
     bool ok = mgr.loadManifest(args[1], path);
+    if (ok) {
+        // The job may use passed descriptors instead of its stdio paths
+        static const char *const keys[] = {"StandardInFD", "StandardOutFD",
+                                           "StandardErrorFD"};
+        std::array<int, 3> stdio = {-1, -1, -1};
+        for (size_t i = 0; i < stdio.size(); i++) {
+            if (args[1].contains(keys[i])) {
+                stdio[i] = fds.take(args[1][keys[i]]);
+            }
+        }
+        const Label label{args[1]["Label"]};
+        ok = mgr.adoptStandardDescriptors(label, stdio);
+        for (int fd : stdio) {
+            if (fd >= 0) {
+                (void)close(fd);
+            }
+        }
+    }
     mgr.startRunning();
-    return {{"error", ok}};
+    return {{"error", !ok}};
 }
 
 static json _rpc_op_version(const json &, Manager &) {
@@ -144,42 +220,612 @@ static json _rpc_op_version(const json &, Manager &) {
     return {{"error", false}, {"version", version}};
 }
 
+RpcServer::RpcServer(kq::EventManager &eventmgr_, Manager &manager_)
+    : eventmgr(eventmgr_), manager(manager_),
+      // Each domain on the shared event loop needs its own IPC method
+      process_method("rpc_process:" + manager.getDomain().statedir.string()) {
+    privileged_uids = {0, manager.getDomain().uid.value_or(getuid())};
+}
+
+//! The uid of the process at the other end of a local socket
+static std::optional<uid_t> peerUid(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        log_errno("getsockopt(SO_PEERCRED)");
+        return std::nullopt;
+    }
+    return cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        log_errno("getpeereid(3)");
+        return std::nullopt;
+    }
+    return uid;
+#endif
+}
+
+RpcServer::~RpcServer() { stop(); }
+
+void RpcServer::start(int listenfd) {
+    if (sockfd >= 0) {
+        throw std::logic_error("already listening");
+    }
+    int flags = fcntl(listenfd, F_GETFL);
+    if (flags < 0 || fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw std::system_error(errno, std::system_category(), "fcntl()");
+    }
+    sockfd = listenfd;
+    eventmgr.addIpcMethod(process_method, [this](const std::string &arg) {
+        auto it = connections.find(std::stoi(arg));
+        if (it != connections.end()) {
+            process(ConnectionPtr{it->second});
+        }
+    });
+    resumeAccepting();
+}
+
+void RpcServer::stop() noexcept {
+    if (sockfd < 0) {
+        return;
+    }
+    try {
+        pauseAccepting();
+        eventmgr.deleteIpcMethod(process_method);
+        if (resume_timer_id) {
+            eventmgr.deleteTimer(*resume_timer_id);
+            resume_timer_id.reset();
+        }
+        if (idle_timer_id) {
+            eventmgr.deleteTimer(*idle_timer_id);
+            idle_timer_id.reset();
+        }
+        for (auto &[uid, caller] : callers) {
+            if (caller.resume_timer_id) {
+                eventmgr.deleteTimer(*caller.resume_timer_id);
+                caller.resume_timer_id.reset();
+            }
+            caller.waiting.clear();
+        }
+    } catch (const std::exception &exc) {
+        log_error("unable to stop watching the RPC socket: %s", exc.what());
+    }
+    while (!connections.empty()) {
+        closeConnection(*connections.begin()->second);
+    }
+    // The listening socket belongs to the Channel that created it
+    sockfd = -1;
+}
+
+void RpcServer::pauseAccepting() {
+    if (accepting) {
+        eventmgr.deleteSocketRead(sockfd);
+        accepting = false;
+    }
+}
+
+void RpcServer::resumeAccepting() {
+    if (!accepting) {
+        eventmgr.addSocketRead(sockfd, [this](int) { acceptConnections(); });
+        accepting = true;
+    }
+}
+
+void RpcServer::acceptConnections() {
+    // Bound the work per wakeup, so that a burst of connections does not
+    // delay the other events. The socket is level-triggered.
+    for (int i = 0; i < 64; i++) {
+        if (connections.size() >= max_connections) {
+            log_warning("too many RPC connections; deferring new ones");
+            pauseAccepting();
+            return;
+        }
+        int fd = accept4(sockfd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == ECONNABORTED || errno == EINTR) {
+                return;
+            }
+            log_errno("accept(2)");
+            if (errno == EMFILE || errno == ENFILE) {
+                // Retry later rather than spinning on the pending connection
+                pauseAccepting();
+                resume_timer_id =
+                    eventmgr.addTimer(std::chrono::milliseconds{100}, [this] {
+                        resume_timer_id.reset();
+                        resumeAccepting();
+                    });
+            }
+            return;
+        }
+        const auto uid = peerUid(fd);
+        if (!uid) {
+            (void)close(fd);
+            continue;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        auto [it, created] = callers.try_emplace(*uid);
+        auto &caller = it->second;
+        if (created) {
+            caller.tokens = admission.burst;
+            caller.refilled = now;
+        }
+        const bool privileged = privileged_uids.count(*uid) > 0;
+        if (!privileged &&
+            (caller.connections >= admission.connections_per_uid ||
+             connections.size() + admission.reserved_connections >=
+                 max_connections)) {
+            if (caller.stats.refused++ % 1000 == 0) {
+                log_warning("refusing RPC connections from uid %u, which "
+                            "has %zu open",
+                            static_cast<unsigned>(*uid), caller.connections);
+            }
+            (void)close(fd);
+            continue;
+        }
+        caller.connections++;
+        auto conn = std::make_shared<Connection>();
+        conn->fd = fd;
+        conn->uid = *uid;
+        conn->privileged = privileged;
+        conn->last_active = now;
+        connections.emplace(fd, conn);
+        try {
+            updateInterest(*conn);
+        } catch (const std::exception &exc) {
+            log_error("unable to watch an RPC connection: %s", exc.what());
+            closeConnection(*conn);
+            continue;
+        }
+        scheduleIdleCheck();
+    }
+}
+
+void RpcServer::handleRead(const ConnectionPtr &conn) {
+    char buf[16384];
+    for (;;) {
+        ssize_t bytes = Channel::receive(conn->fd, buf, sizeof(buf), conn->fds);
+        if (conn->fds.size() > IPC_MAX_FDS) {
+            log_error("RPC client passed more than %u descriptors",
+                      IPC_MAX_FDS);
+            closeConnection(*conn);
+            return;
+        }
+        if (bytes > 0) {
+            conn->input.append(buf, bytes);
+            conn->last_active = std::chrono::steady_clock::now();
+            if (conn->input.size() >= IPC_HEADER_LEN + IPC_MAX_MSGLEN) {
+                break;
+            }
+        } else if (bytes == 0) {
+            // The client may still be reading replies
+            conn->peer_closed = true;
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            log_errno("read(2)");
+            closeConnection(*conn);
+            return;
+        }
+    }
+    process(conn);
+}
+
+void RpcServer::handleWrite(const ConnectionPtr &conn) {
+    if (flush(*conn) && conn->output.empty()) {
+        // Requests that arrived while the reply was being written
+        process(conn);
+    }
+}
+
+bool RpcServer::flush(Connection &conn) {
+    while (!conn.output.empty()) {
+        struct iovec iov[16];
+        int count = 0;
+        for (auto it = conn.output.begin();
+             it != conn.output.end() && count < 16; ++it, ++count) {
+            const size_t skip = count ? 0 : conn.output_offset;
+            iov[count].iov_base = it->data() + skip;
+            iov[count].iov_len = it->size() - skip;
+        }
+        ssize_t bytes = writev(conn.fd, iov, count);
+        if (bytes >= 0) {
+            conn.last_active = std::chrono::steady_clock::now();
+            conn.output_size -= bytes;
+            size_t written = bytes;
+            while (written > 0) {
+                const size_t left =
+                    conn.output.front().size() - conn.output_offset;
+                if (written < left) {
+                    conn.output_offset += written;
+                    break;
+                }
+                written -= left;
+                conn.output.pop_front();
+                conn.output_offset = 0;
+            }
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            if (errno != EPIPE) {
+                log_errno("writev(2)");
+            }
+            closeConnection(conn);
+            return false;
+        }
+    }
+    return true;
+}
+
+void RpcServer::process(const ConnectionPtr &conn) {
+    // A deferred reply can arrive while its request is being dispatched
+    if (conn->processing) {
+        return;
+    }
+    conn->processing = true;
+    // Requests are answered one at a time, and not while a reply is still
+    // being written, so that a client that does not read cannot make the
+    // output grow without bound.
+    while (conn->fd >= 0 && !conn->deferred && !conn->throttled &&
+           conn->output.empty()) {
+        if (conn->input.size() < IPC_HEADER_LEN) {
+            break;
+        }
+        const auto header = Channel::decodeHeader(conn->input.data());
+        if (header.length > IPC_MAX_MSGLEN) {
+            log_error("RPC request of %u bytes exceeds the limit of %u",
+                      header.length, IPC_MAX_MSGLEN);
+            closeConnection(*conn);
+            break;
+        }
+        const size_t end = IPC_HEADER_LEN + header.length;
+        if (conn->input.size() < end) {
+            break;
+        }
+        if (!Channel::isSupported(header.encoding)) {
+            // Tell the client to fall back to JSON
+            conn->input.erase(0, end);
+            conn->encoding = Channel::Encoding::Json;
+            reply(*conn, {{"error", true}, {"UnsupportedEncoding", true}});
+            continue;
+        }
+        if (!admit(conn)) {
+            break;
+        }
+        conn->encoding = static_cast<Channel::Encoding>(header.encoding);
+        json msg;
+        try {
+            msg = Channel::decode(conn->input.data() + IPC_HEADER_LEN,
+                                  conn->input.data() + end, conn->encoding);
+        } catch (const std::exception &exc) {
+            log_error("unable to decode an RPC request: %s", exc.what());
+            closeConnection(*conn);
+            break;
+        }
+        conn->input.erase(0, end);
+        dispatch(conn, msg);
+    }
+    conn->processing = false;
+    if (conn->fd < 0) {
+        return;
+    }
+    if (conn->peer_closed && conn->output.empty() && !conn->throttled &&
+        (!conn->deferred || conn->subscription)) {
+        // Every request has been answered. A partial one is discarded.
+        closeConnection(*conn);
+        return;
+    }
+    updateInterest(*conn);
+}
+
+//! Wrap the reply to a pipelined request with the id of the request
+static json envelope(const json &id, const json &response) {
+    if (id.is_null()) {
+        return response;
+    }
+    return {{"Id", id}, {"Reply", response}};
+}
+
 // FIXME: needs a lot more error checking
-int rpc_dispatch(Channel &chan, Manager &mgr) {
+void RpcServer::dispatch(const ConnectionPtr &conn, const json &msg) {
     static const std::unordered_map<std::string,
                                     json (*)(const json &, Manager &)>
         handlers = {
             {"disable", _rpc_op_disable},
             {"enable", _rpc_op_enable},
+            {"instantiate", _rpc_op_instantiate},
+            {"history", _rpc_op_history},
             {"kill", _rpc_op_kill},
             {"list", _rpc_op_list},
             {"load", _rpc_op_load},
+            {"reexec", _rpc_op_reexec},
             {"remove", _rpc_op_remove},
-            // FIXME:{"start", _rpc_op_start},
-            // FIXME:{"stop", _rpc_op_stop},
-            {"submit", _rpc_op_submit},
+            {"start", _rpc_op_start},
+            {"stop", _rpc_op_stop},
             {"unload", _rpc_op_unload},
             {"version", _rpc_op_version},
         };
-    chan.accept();
+    // Pipelined requests carry an id, which is echoed in the reply
+    json id;
+    const json *request = &msg;
+    Descriptors fds;
+    std::string method;
+    json response;
+    const size_t journal_size = manager.stateJournalSize();
     try {
-        auto msg = chan.readMessage();
-        auto method = msg.at(0).get<std::string>();
-        auto funcptr = handlers.at(method);
-        json response;
+        if (msg.is_object()) {
+            id = msg.value("Id", json{});
+            if (msg.contains("Request")) {
+                request = &msg.at("Request");
+            }
+            const size_t count = msg.value("FDs", size_t{0});
+            if (count > conn->fds.size()) {
+                throw std::invalid_argument("descriptors are missing");
+            }
+            fds.fds.assign(conn->fds.begin(), conn->fds.begin() + count);
+            conn->fds.erase(conn->fds.begin(), conn->fds.begin() + count);
+        }
+        method = request->at(0).get<std::string>();
+        if (method == "wait") {
+            // The connection may be closed before the operations complete
+            conn->deferred = true;
+            _rpc_op_wait(*request, manager,
+                         [this, id, weak = std::weak_ptr<Connection>(conn)](
+                             const json &result) {
+                             auto conn = weak.lock();
+                             if (!conn) {
+                                 return;
+                             }
+                             conn->deferred = false;
+                             reply(*conn, envelope(id, result));
+                             // This runs while the operation tracker wakes
+                             // its waiters, and the next request may start
+                             // operations of its own, so it is handled on
+                             // the next pass of the event loop
+                             if (conn->fd >= 0) {
+                                 eventmgr.submitIpcCallback(
+                                     process_method, std::to_string(conn->fd));
+                             }
+                         });
+            return;
+        }
+        if (method == "watch") {
+            watch(conn, *request, id);
+            return;
+        }
+        if (method == "submit") {
+            response = _rpc_op_submit(*request, manager, fds);
+        } else {
+            auto funcptr = handlers.at(method);
+            response = (*funcptr)(*request, manager);
+        }
+    } catch (const std::exception &exc) {
+        log_error("unhandled exception in %s(): %s", method.c_str(),
+                  exc.what());
+        response = {{"error", true}};
+        conn->deferred = false;
+    }
+    // Changes must be durable before they are acknowledged
+    const bool changed = manager.stateJournalSize() != journal_size;
+    if (!manager.syncStateFile() && changed && response.is_object()) {
+        response["error"] = true;
+    }
+    reply(*conn, envelope(id, response));
+}
+
+void RpcServer::watch(const ConnectionPtr &conn, const json &request,
+                      const json &id) {
+    std::vector<std::string> patterns;
+    if (request.size() > 1) {
+        patterns = request[1].value("Labels", patterns);
+    }
+    // No further requests are read, and the connection is never idle
+    conn->deferred = true;
+    reply(*conn, envelope(id, {{"error", false}}));
+    if (conn->fd < 0) {
+        return;
+    }
+    conn->subscription = manager.getJobEvents().subscribe(
+        std::move(patterns),
+        [this, id, weak = std::weak_ptr<Connection>(conn)](const json &record) {
+            auto conn = weak.lock();
+            if (!conn || conn->fd < 0) {
+                return;
+            }
+            if (conn->output_size > watch_buffer_size) {
+                log_warning("dropping an RPC watcher on fd %d that has %zu "
+                            "bytes of unread events",
+                            conn->fd, conn->output_size);
+                closeConnection(*conn);
+                return;
+            }
+            reply(*conn, envelope(id, record));
+            if (!conn->processing && conn->fd >= 0) {
+                updateInterest(*conn);
+            }
+        });
+}
+
+void RpcServer::reply(Connection &conn, const json &response) {
+    if (conn.fd < 0) {
+        return;
+    }
+    std::string body = Channel::encode(response, conn.encoding);
+    const auto header = Channel::encodeHeader(body.size(), conn.encoding);
+    conn.output_size += header.size() + body.size();
+    conn.output.emplace_back(header.begin(), header.end());
+    conn.output.push_back(std::move(body));
+    // Most replies fit in the socket buffer, so try to write them now
+    flush(conn);
+}
+
+void RpcServer::updateInterest(Connection &conn) {
+    // Stop reading while a reply is being written, or while the input is
+    // full
+    const bool want_read = !conn.peer_closed && !conn.throttled &&
+                           conn.output.empty() &&
+                           conn.input.size() < IPC_HEADER_LEN + IPC_MAX_MSGLEN;
+    const bool want_write = !conn.output.empty();
+    if (want_read != conn.reading) {
+        if (want_read) {
+            eventmgr.addSocketRead(conn.fd, [this](int fd) {
+                auto it = connections.find(fd);
+                if (it != connections.end()) {
+                    handleRead(ConnectionPtr{it->second});
+                }
+            });
+        } else {
+            eventmgr.deleteSocketRead(conn.fd);
+        }
+        conn.reading = want_read;
+    }
+    if (want_write != conn.writing) {
+        if (want_write) {
+            eventmgr.addSocketWrite(conn.fd, [this](int fd) {
+                auto it = connections.find(fd);
+                if (it != connections.end()) {
+                    handleWrite(ConnectionPtr{it->second});
+                }
+            });
+        } else {
+            eventmgr.deleteSocketWrite(conn.fd);
+        }
+        conn.writing = want_write;
+    }
+}
+
+void RpcServer::closeConnection(Connection &conn) noexcept {
+    if (conn.fd < 0) {
+        return;
+    }
+    try {
+        if (conn.reading) {
+            eventmgr.deleteSocketRead(conn.fd);
+        }
+        if (conn.writing) {
+            eventmgr.deleteSocketWrite(conn.fd);
+        }
+    } catch (const std::exception &exc) {
+        log_error("unable to stop watching an RPC connection: %s", exc.what());
+    }
+    conn.reading = conn.writing = false;
+    if (conn.subscription) {
+        manager.getJobEvents().unsubscribe(*conn.subscription);
+        conn.subscription.reset();
+    }
+    for (int fd : conn.fds) {
+        (void)close(fd);
+    }
+    conn.fds.clear();
+    if (auto it = callers.find(conn.uid); it != callers.end()) {
+        it->second.connections--;
+    }
+    if (close(conn.fd) < 0) {
+        log_errno("close(2)");
+    }
+    const int fd = conn.fd;
+    conn.fd = -1;
+    // This may destroy the connection, unless a caller holds a reference
+    connections.erase(fd);
+    if (sockfd >= 0 && !accepting && !resume_timer_id &&
+        connections.size() < max_connections) {
         try {
-            response = (*funcptr)(msg, mgr);
+            resumeAccepting();
         } catch (const std::exception &exc) {
-            log_error("unhandled exception in %s(): %s", method.c_str(),
-                      exc.what());
-            response = {{"error", true}};
+            log_error("unable to accept RPC connections: %s", exc.what());
         }
-        chan.writeMessage(response);
-    } catch (const std::exception &exc) {
-        log_error("dispatch failed: %s", exc.what());
     }
+}
+
+bool RpcServer::admit(const ConnectionPtr &conn) {
+    auto &caller = callers.at(conn->uid);
+    if (conn->privileged) {
+        caller.stats.requests++;
+        return true;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - caller.refilled;
+    const double refill = elapsed.count() * admission.requests_per_second;
+    caller.tokens = std::min(admission.burst, caller.tokens + refill);
+    caller.refilled = now;
+    if (caller.tokens >= 1) {
+        caller.tokens -= 1;
+        caller.stats.requests++;
+        return true;
+    }
+    if (caller.stats.throttled++ % 1000 == 0) {
+        log_warning("throttling RPC requests from uid %u",
+                    static_cast<unsigned>(conn->uid));
+    }
+    conn->throttled = true;
+    caller.waiting.push_back(conn);
+    if (!caller.resume_timer_id) {
+        // Wake up when the next token is due
+        const auto delay = std::chrono::milliseconds{static_cast<int64_t>(
+            (1 - caller.tokens) * 1000 / admission.requests_per_second + 1)};
+        caller.resume_timer_id =
+            eventmgr.addTimer(delay, [this, uid = conn->uid] {
+                callers.at(uid).resume_timer_id.reset();
+                resumeThrottled(uid);
+            });
+    }
+    return false;
+}
+
+void RpcServer::resumeThrottled(uid_t uid) {
+    auto &waiting = callers.at(uid).waiting;
+    while (!waiting.empty()) {
+        auto conn = waiting.front().lock();
+        waiting.pop_front();
+        if (!conn || conn->fd < 0) {
+            continue;
+        }
+        conn->throttled = false;
+        process(conn);
+        // Out of tokens again, and the timer is set
+        if (conn->throttled) {
+            break;
+        }
+    }
+}
+
+std::optional<RpcServer::CallerStats> RpcServer::callerStats(uid_t uid) const {
+    auto it = callers.find(uid);
+    if (it == callers.end()) {
+        return std::nullopt;
+    }
+    return it->second.stats;
+}
 
-    chan.disconnect();
+void RpcServer::scheduleIdleCheck() {
+    if (idle_timer_id || connections.empty()) {
+        return;
+    }
+    // Checking periodically is cheaper than a timer per connection. An idle
+    // connection is closed between one and two timeouts after its last
+    // activity.
+    idle_timer_id = eventmgr.addTimer(idle_timeout, [this] {
+        idle_timer_id.reset();
+        closeIdleConnections();
+        scheduleIdleCheck();
+    });
+}
 
-    return 0;
+void RpcServer::closeIdleConnections() {
+    const auto deadline = std::chrono::steady_clock::now() - idle_timeout;
+    std::vector<int> idle;
+    for (const auto &[fd, conn] : connections) {
+        if (!conn->deferred && conn->last_active <= deadline) {
+            idle.push_back(fd);
+        }
+    }
+    for (int fd : idle) {
+        log_debug("closing idle RPC connection on fd %d", fd);
+        closeConnection(*connections.at(fd));
+    }
 }
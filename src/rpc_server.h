@@ -16,9 +16,191 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/types.h>
+
+#include <nlohmann/json.hpp>
+
 #include "channel.h"
-#include "manager.h"
+#include "event.h"
+#include "job_events.h"
+
+using json = nlohmann::json;
+
+class Manager;
 
 int rpc_init(int kqfd);
 
-int rpc_dispatch(Channel &chan, Manager &manager);
+/**
+ * Serves RPC requests from many clients at once. Sockets are non-blocking,
+ * and each connection keeps its own partial input and output, so a slow
+ * client never stalls the event loop or other clients.
+ *
+ * A connection may send several requests, each framed by a length header.
+ * They are answered in order, one at a time. A request may be wrapped as
+ * {"Id": id, "Request": request}, and its reply is then wrapped as
+ * {"Id": id, "Reply": reply}, so that a client can pipeline requests. A
+ * client that shuts down its side of the connection still gets the replies
+ * to the requests it has sent.
+ *
+ * After a "watch" request, the connection receives a record of each job
+ * event until the client disconnects.
+ *
+ * Descriptors that are passed with a request are held by the connection.
+ * A request in the {"Request": request} form takes as many of them as its
+ * FDs key says, and the request refers to them by their index.
+ *
+ * Callers are identified by the uid of the peer. Each uid has a token
+ * bucket that limits its request rate, and a limit on its connections, so
+ * that one misbehaving client cannot monopolize the daemon. A caller that
+ * runs out of tokens is not read from until it has a token again.
+ * Privileged callers are never limited, and a few connections are kept
+ * free for them.
+ */
+class RpcServer {
+  public:
+    RpcServer(kq::EventManager &eventmgr_, Manager &manager_);
+    ~RpcServer();
+    RpcServer(const RpcServer &) = delete;
+    RpcServer &operator=(const RpcServer &) = delete;
+
+    //! Accept connections on a socket that is bound and listening
+    void start(int listenfd);
+
+    //! Stop accepting connections, and close the ones that are open
+    void stop() noexcept;
+
+    [[nodiscard]] bool isListening() const { return sockfd >= 0; }
+
+    [[nodiscard]] size_t connectionCount() const { return connections.size(); }
+
+    //! Connections beyond the limit wait in the listen backlog
+    size_t max_connections = 1024;
+
+    //! Close connections that make no progress for this long, unless they
+    //! are waiting for a deferred reply
+    std::chrono::milliseconds idle_timeout{30000};
+
+    struct AdmissionLimits {
+        //! The sustained rate of requests for each unprivileged uid
+        double requests_per_second = 100;
+        //! How many requests a uid can make at once after being idle
+        double burst = 200;
+        //! Connections from one unprivileged uid beyond this are closed
+        size_t connections_per_uid = 64;
+        //! Connections that only privileged callers may use
+        size_t reserved_connections = 16;
+    };
+    AdmissionLimits admission;
+
+    //! Callers that are not limited. By default, root and the owner of the
+    //! domain.
+    std::unordered_set<uid_t> privileged_uids;
+
+    struct CallerStats {
+        uint64_t requests = 0;
+        //! Requests that were delayed for lack of tokens
+        uint64_t throttled = 0;
+        //! Connections that were closed because of a limit
+        uint64_t refused = 0;
+    };
+
+    //! The statistics of a uid that has connected, if any
+    [[nodiscard]] std::optional<CallerStats> callerStats(uid_t uid) const;
+
+    //! Watchers whose unsent records exceed this many bytes are dropped,
+    //! so that a slow consumer cannot make the daemon buffer without bound
+    size_t watch_buffer_size = 256 * 1024;
+
+  private:
+    struct Connection {
+        int fd;
+        //! The uid of the peer
+        uid_t uid;
+        bool privileged;
+        //! Set while the caller has no tokens for the next request
+        bool throttled = false;
+        //! Bytes received but not yet handled
+        std::string input;
+        //! Replies that have not been written yet, as a header and a body
+        //! each, and how much of the first one has been written
+        std::deque<std::string> output;
+        size_t output_offset = 0;
+        //! The number of bytes in the output that have not been written
+        size_t output_size = 0;
+        //! The encoding of the current request, and of its reply
+        Channel::Encoding encoding = Channel::Encoding::Json;
+        std::chrono::steady_clock::time_point last_active;
+        //! Set while a request waits for its reply, such as "wait"
+        bool deferred = false;
+        //! Set while process() is handling the input
+        bool processing = false;
+        //! Set once the client has finished sending requests
+        bool peer_closed = false;
+        //! Set if the connection watches for job events
+        std::optional<JobEvents::Id> subscription;
+        //! Descriptors received but not taken by a request yet
+        std::vector<int> fds;
+        bool reading = false;
+        bool writing = false;
+    };
+    using ConnectionPtr = std::shared_ptr<Connection>;
+
+    //! The admission state of a uid
+    struct Caller {
+        double tokens;
+        std::chrono::steady_clock::time_point refilled;
+        size_t connections = 0;
+        CallerStats stats;
+        //! Throttled connections, oldest first, and the timer that resumes
+        //! them
+        std::deque<std::weak_ptr<Connection>> waiting;
+        std::optional<int> resume_timer_id;
+    };
+
+    //! Take a token for a request on the connection. If there is none, the
+    //! connection is throttled until there is.
+    bool admit(const ConnectionPtr &conn);
+    void resumeThrottled(uid_t uid);
+
+    void acceptConnections();
+    void pauseAccepting();
+    void resumeAccepting();
+    void handleRead(const ConnectionPtr &conn);
+    void handleWrite(const ConnectionPtr &conn);
+    //! Handle the complete requests in the input buffer
+    void process(const ConnectionPtr &conn);
+    void dispatch(const ConnectionPtr &conn, const json &msg);
+    //! Send job events to the connection from now on
+    void watch(const ConnectionPtr &conn, const json &request,
+               const json &id);
+    void reply(Connection &conn, const json &response);
+    //! Write as much output as the socket accepts. Returns false if the
+    //! connection was closed.
+    bool flush(Connection &conn);
+    //! Watch for the events that the connection can make progress on
+    void updateInterest(Connection &conn);
+    void closeConnection(Connection &conn) noexcept;
+    void scheduleIdleCheck();
+    void closeIdleConnections();
+
+    kq::EventManager &eventmgr;
+    Manager &manager;
+    //! The IPC method that handles the requests that a connection sent
+    //! while its deferred reply was pending
+    std::string process_method;
+    int sockfd = -1;
+    bool accepting = false;
+    std::optional<int> idle_timer_id;
+    std::optional<int> resume_timer_id;
+    std::unordered_map<int, ConnectionPtr> connections;
+    std::unordered_map<uid_t, Caller> callers;
+};
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "run_history.h"
+
+namespace {
+
+constexpr uint32_t history_magic = 0x4e52444c; // "LDRN"
+constexpr uint32_t history_version = 2;
+
+const char *causeToString(StartCause cause) {
+    switch (cause) {
+    case StartCause::Request:
+        return "Request";
+    case StartCause::Load:
+        return "Load";
+    case StartCause::KeepAlive:
+        return "KeepAlive";
+    case StartCause::Interval:
+        return "Interval";
+    default:
+        return "Unknown";
+    }
+}
+
+int64_t toMicroseconds(const struct timeval &tv) {
+    return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+} // namespace
+
+void RunRecord::setUsage(const struct rusage &usage) {
+    user_time_us = toMicroseconds(usage.ru_utime);
+    system_time_us = toMicroseconds(usage.ru_stime);
+#ifdef __APPLE__
+    max_rss_kb = usage.ru_maxrss / 1024;
+#else
+    max_rss_kb = usage.ru_maxrss;
+#endif
+}
+
+json RunRecord::toJson() const {
+    json result = {{"Label", label},
+                   {"PID", pid},
+                   {"StartedAt", started_at},
+                   {"ExitedAt", exited_at},
+                   {"Cause", causeToString(cause)},
+                   {"UserTimeUsec", user_time_us},
+                   {"SystemTimeUsec", system_time_us},
+                   {"MaxRSSKb", max_rss_kb}};
+    if (exit_status < 0) {
+        result["TermSignal"] = term_signal;
+    } else {
+        result["ExitStatus"] = exit_status;
+    }
+    return result;
+}
+
+RunHistory::~RunHistory() { close(); }
+
+void RunHistory::open(const std::filesystem::path &path, uint32_t jobs,
+                      uint32_t runs) {
+    close();
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "open(2) of " + path.string());
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        int saved_errno = errno;
+        (void)::close(fd);
+        throw std::system_error(saved_errno, std::system_category(),
+                                "fstat(2)");
+    }
+
+    // Keep the records of a valid file
+    bool valid = false;
+    if (static_cast<size_t>(sb.st_size) >= sizeof(Header)) {
+        Header existing;
+        if (pread(fd, &existing, sizeof(existing), 0) ==
+                static_cast<ssize_t>(sizeof(existing)) &&
+            existing.magic == history_magic &&
+            existing.version == history_version &&
+            existing.record_size == sizeof(RunRecord) && existing.jobs > 0 &&
+            existing.runs > 0 &&
+            sizeof(Header) + existing.jobs * regionSize(existing.runs) ==
+                static_cast<size_t>(sb.st_size)) {
+            jobs = existing.jobs;
+            runs = existing.runs;
+            valid = true;
+        }
+    }
+    if (!valid && sb.st_size > 0) {
+        log_notice("discarding the run history in %s", path.c_str());
+    }
+
+    const size_t new_length = sizeof(Header) + jobs * regionSize(runs);
+    if (!valid && (ftruncate(fd, 0) < 0 ||
+                   ftruncate(fd, static_cast<off_t>(new_length)) < 0)) {
+        int saved_errno = errno;
+        (void)::close(fd);
+        throw std::system_error(saved_errno, std::system_category(),
+                                "ftruncate(2)");
+    }
+    void *addr = mmap(nullptr, new_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    int saved_errno = errno;
+    (void)::close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(saved_errno, std::system_category(),
+                                "mmap(2) of " + path.string());
+    }
+    header = static_cast<Header *>(addr);
+    length = new_length;
+    if (!valid) {
+        header->magic = history_magic;
+        header->version = history_version;
+        header->record_size = sizeof(RunRecord);
+        header->jobs = jobs;
+        header->runs = runs;
+        header->appended = 0;
+    }
+    for (uint32_t i = 0; i < header->jobs; i++) {
+        Region *r = region(i);
+        r->label[sizeof(r->label) - 1] = '\0';
+        if (r->label[0] != '\0') {
+            regions[r->label] = i;
+        }
+    }
+}
+
+void RunHistory::close() {
+    if (header) {
+        (void)munmap(header, length);
+        header = nullptr;
+        length = 0;
+    }
+    regions.clear();
+}
+
+RunHistory::Region *RunHistory::regionFor(const std::string &label) {
+    auto it = regions.find(label);
+    if (it != regions.end()) {
+        return region(it->second);
+    }
+    // Take a free region, or else the one that was used least recently
+    uint32_t index = 0;
+    for (uint32_t i = 0; i < header->jobs; i++) {
+        if (region(i)->label[0] == '\0') {
+            index = i;
+            break;
+        }
+        if (region(i)->last_used < region(index)->last_used) {
+            index = i;
+        }
+    }
+    Region *r = region(index);
+    if (r->label[0] != '\0') {
+        log_debug("run history: %s replaces %s", label.c_str(), r->label);
+        regions.erase(r->label);
+    }
+    // The label is written last, so a crash leaves the region free
+    r->label[0] = '\0';
+    r->appended = 0;
+    r->last_used = 0;
+    label.copy(r->label, sizeof(r->label) - 1);
+    r->label[std::min(label.size(), sizeof(r->label) - 1)] = '\0';
+    regions[r->label] = index;
+    return r;
+}
+
+void RunHistory::append(const RunRecord &record) noexcept {
+    if (!header) {
+        return;
+    }
+    Region *r;
+    try {
+        std::string label{record.label,
+                          strnlen(record.label, sizeof(record.label) - 1)};
+        r = regionFor(label);
+    } catch (const std::exception &e) {
+        log_error("unable to record a run: %s", e.what());
+        return;
+    }
+    // The counts are advanced after the record is complete, so a crash in
+    // the middle of a write can only damage the oldest record of the job.
+    RunRecord &slot = records(r)[r->appended % header->runs];
+    slot = record;
+    memcpy(slot.label, r->label, sizeof(slot.label));
+    slot.sequence = header->appended;
+    __atomic_store_n(&r->appended, r->appended + 1, __ATOMIC_RELEASE);
+    r->last_used = slot.sequence;
+    __atomic_store_n(&header->appended, header->appended + 1,
+                     __ATOMIC_RELEASE);
+}
+
+std::vector<RunRecord>
+RunHistory::query(const std::optional<std::string> &label,
+                  size_t limit) const {
+    std::vector<RunRecord> result;
+    if (!header) {
+        return result;
+    }
+    // The newest records of a region first
+    auto collect = [&](Region *r, size_t max) {
+        const uint64_t appended = r->appended;
+        const uint64_t available = std::min<uint64_t>(appended, header->runs);
+        for (uint64_t i = 1; i <= available && i <= max; i++) {
+            result.push_back(records(r)[(appended - i) % header->runs]);
+        }
+    };
+    if (label) {
+        auto it = regions.find(*label);
+        if (it != regions.end()) {
+            collect(region(it->second), limit);
+        }
+        return result;
+    }
+    for (const auto &[_, index] : regions) {
+        collect(region(index), limit);
+    }
+    std::sort(result.begin(), result.end(),
+              [](const RunRecord &a, const RunRecord &b) {
+                  return a.sequence > b.sequence;
+              });
+    if (result.size() > limit) {
+        result.resize(limit);
+    }
+    return result;
+}
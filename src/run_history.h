@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+//! Why a job was started
+enum class StartCause : uint8_t {
+    //! A client asked for it, or another job needed it
+    Request,
+    //! RunAtLoad, or KeepAlive when the job was loaded
+    Load,
+    //! KeepAlive after the previous process exited
+    KeepAlive,
+    //! StartInterval
+    Interval,
+};
+
+//! One finished run of a job. The layout is stored in the history file.
+struct RunRecord {
+    char label[128];
+    //! Wall clock times, in milliseconds since the epoch
+    int64_t started_at;
+    int64_t exited_at;
+    int32_t pid;
+    //! The exit status, or -1 if the process was killed by a signal
+    int32_t exit_status;
+    int32_t term_signal;
+    StartCause cause;
+    uint8_t reserved[3];
+    int64_t user_time_us;
+    int64_t system_time_us;
+    int64_t max_rss_kb;
+    //! Set by RunHistory::append(), to order the runs of different jobs
+    uint64_t sequence;
+
+    void setUsage(const struct rusage &usage);
+    [[nodiscard]] json toJson() const;
+};
+
+/**
+ * The most recent runs of every job in a domain, kept in a memory-mapped
+ * file. Each job has a region of the file with a ring of fixed-size records,
+ * so a job that restarts often cannot push out the history of the others.
+ * When every region is in use, the job that ran least recently loses its
+ * region to the new one. The history survives restarts of launchd, and
+ * adding a record does not need a system call.
+ */
+class RunHistory {
+  public:
+    static constexpr uint32_t default_jobs = 256;
+    static constexpr uint32_t default_runs = 32;
+
+    RunHistory() = default;
+    ~RunHistory();
+    RunHistory(const RunHistory &) = delete;
+    RunHistory &operator=(const RunHistory &) = delete;
+
+    //! Map the history file, creating it with room for the given number of
+    //! jobs and runs of each job if needed. The records in an existing file
+    //! are kept, along with its geometry.
+    void open(const std::filesystem::path &path, uint32_t jobs = default_jobs,
+              uint32_t runs = default_runs);
+
+    void close();
+
+    [[nodiscard]] bool isOpen() const { return header != nullptr; }
+
+    //! Add a record, overwriting the oldest run of the job if its ring is
+    //! full. Does nothing if the history is not open.
+    void append(const RunRecord &record) noexcept;
+
+    //! The newest records first, optionally only those of one job
+    [[nodiscard]] std::vector<RunRecord>
+    query(const std::optional<std::string> &label, size_t limit) const;
+
+    //! The number of jobs that have a region
+    [[nodiscard]] uint32_t jobCapacity() const {
+        return header ? header->jobs : 0;
+    }
+
+    //! The number of runs kept for each job
+    [[nodiscard]] uint32_t runsPerJob() const {
+        return header ? header->runs : 0;
+    }
+
+  private:
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t jobs;
+        uint32_t runs;
+        uint32_t reserved;
+        //! The number of records ever appended
+        uint64_t appended;
+    };
+
+    //! The start of the region of a job, which is followed by its records
+    struct Region {
+        //! Empty if the region is free
+        char label[sizeof(RunRecord::label)];
+        //! The number of records ever appended to the region
+        uint64_t appended;
+        //! The sequence number of the newest record
+        uint64_t last_used;
+    };
+
+    [[nodiscard]] static size_t regionSize(uint32_t runs) {
+        return sizeof(Region) + runs * sizeof(RunRecord);
+    }
+
+    [[nodiscard]] Region *region(uint32_t index) const {
+        return reinterpret_cast<Region *>(reinterpret_cast<char *>(header + 1) +
+                                          index * regionSize(header->runs));
+    }
+
+    [[nodiscard]] static RunRecord *records(Region *region) {
+        return reinterpret_cast<RunRecord *>(region + 1);
+    }
+
+    //! The region of a job, which is assigned if necessary
+    Region *regionFor(const std::string &label);
+
+    Header *header = nullptr;
+    size_t length = 0;
+    //! The region of each job, by label
+    std::unordered_map<std::string, uint32_t> regions;
+};
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "slab.h"
+
+//! Blocks are aligned for any fundamental type
+static constexpr size_t block_alignment = alignof(std::max_align_t);
+
+SlabPool::SlabPool(size_t block_size_, size_t blocks_per_chunk_)
+    : block_size((std::max(block_size_, sizeof(FreeBlock)) +
+                  block_alignment - 1) &
+                 ~(block_alignment - 1)),
+      blocks_per_chunk(blocks_per_chunk_) {}
+
+void *SlabPool::allocate() {
+    if (!free_list) {
+        chunks.emplace_back(new std::byte[block_size * blocks_per_chunk]);
+        std::byte *chunk = chunks.back().get();
+        // Link the blocks so that they are handed out in address order
+        for (size_t i = blocks_per_chunk; i > 0; i--) {
+            auto *block = reinterpret_cast<FreeBlock *>(chunk +
+                                                        (i - 1) * block_size);
+            block->next = free_list;
+            free_list = block;
+        }
+    }
+    FreeBlock *block = free_list;
+    free_list = block->next;
+    in_use++;
+    return block;
+}
+
+void SlabPool::deallocate(void *ptr) noexcept {
+    auto *block = static_cast<FreeBlock *>(ptr);
+    block->next = free_list;
+    free_list = block;
+    in_use--;
+}
+
+SlabPool &SlabPool::forSize(size_t size) {
+    // Leaked on purpose, so that objects destroyed during static destruction
+    // can still be freed.
+    static auto *pools =
+        new std::unordered_map<size_t, std::unique_ptr<SlabPool>>;
+    const size_t rounded = (size + block_alignment - 1) & ~(block_alignment - 1);
+    auto &pool = (*pools)[rounded];
+    if (!pool) {
+        pool = std::make_unique<SlabPool>(rounded);
+    }
+    return *pool;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Jobs and manifests are created and destroyed constantly as jobs are loaded
+ * and unloaded. Their fixed-size parts are allocated from slabs so that this
+ * churn reuses the same memory instead of fragmenting the heap.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+//! A pool of fixed-size blocks that are carved out of large chunks. Freed
+//! blocks are kept on a free list for reuse; chunks are never returned to
+//! the system.
+class SlabPool {
+  public:
+    explicit SlabPool(size_t block_size_, size_t blocks_per_chunk_ = 64);
+
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    void *allocate();
+
+    void deallocate(void *ptr) noexcept;
+
+    //! The total number of blocks, free or in use
+    size_t capacity() const { return chunks.size() * blocks_per_chunk; }
+
+    //! The number of blocks in use
+    size_t inUse() const { return in_use; }
+
+    //! The pool for objects of the given size. Pools are shared by all types
+    //! with the same rounded-up size, and are never destroyed.
+    static SlabPool &forSize(size_t size);
+
+  private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    const size_t block_size;
+    const size_t blocks_per_chunk;
+    FreeBlock *free_list = nullptr;
+    size_t in_use = 0;
+    std::vector<std::unique_ptr<std::byte[]>> chunks;
+};
+
+//! Destroys an object that was created by make_slab()
+template <typename T> struct SlabDeleter {
+    void operator()(T *ptr) const noexcept {
+        ptr->~T();
+        SlabPool::forSize(sizeof(T)).deallocate(ptr);
+    }
+};
+
+template <typename T> using slab_ptr = std::unique_ptr<T, SlabDeleter<T>>;
+
+//! Create an object in the slab for its size
+template <typename T, typename... Args> slab_ptr<T> make_slab(Args &&...args) {
+    auto &pool = SlabPool::forSize(sizeof(T));
+    void *mem = pool.allocate();
+    try {
+        return slab_ptr<T>(new (mem) T(std::forward<Args>(args)...));
+    } catch (...) {
+        pool.deallocate(mem);
+        throw;
+    }
+}
+
+//! An allocator for single objects, such as the combined control block and
+//! object created by std::allocate_shared()
+template <typename T> struct SlabAllocator {
+    using value_type = T;
+
+    SlabAllocator() = default;
+
+    template <typename U> SlabAllocator(const SlabAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T *>(SlabPool::forSize(sizeof(T)).allocate());
+    }
+
+    void deallocate(T *ptr, size_t n) noexcept {
+        if (n != 1) {
+            ::operator delete(ptr);
+        } else {
+            SlabPool::forSize(sizeof(T)).deallocate(ptr);
+        }
+    }
+
+    template <typename U> bool operator==(const SlabAllocator<U> &) const {
+        return true;
+    }
+
+    template <typename U> bool operator!=(const SlabAllocator<U> &) const {
+        return false;
+    }
+};
@@ -15,41 +15,334 @@
  */
 
 #include "state_file.hpp"
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <system_error>
 #include <unistd.h>
 
+#include "log.h"
+
 using json = nlohmann::json;
 
+//! Write a file and rename it over the target, so that a crash leaves
+//! either the old or the new contents. Returns false on failure. This runs
+//! on the compaction thread, so it does not log.
+static bool writeFileDurably(const std::string &path, const std::string &data) {
+    // TODO: randomize this filename
+    const std::string tmpfilepath =
+        std::string{path}.append(".tmp").append(std::to_string(getpid()));
+    int fd = open(tmpfilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t rv = write(fd, data.data() + written, data.size() - written);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += static_cast<size_t>(rv);
+    }
+    bool ok = written == data.size() && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmpfilepath.c_str(), path.c_str()) != 0) {
+        unlink(tmpfilepath.c_str());
+        return false;
+    }
+    // Make the rename durable
+    auto dir = std::filesystem::path{path}.parent_path();
+    int dirfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dirfd >= 0) {
+        (void)fsync(dirfd);
+        (void)close(dirfd);
+    }
+    return true;
+}
+
 StateFile::StateFile(std::string path, json default_value)
-    : dataPath(std::move(path)), defaultValue(std::move(default_value)) {
-    if (std::filesystem::exists(dataPath)) {
-        std::ifstream ifs{dataPath};
-        currentValue = json::parse(ifs);
-    } else {
+    : dataPath(std::move(path)), journalPath(dataPath + ".journal"),
+      compactingPath(journalPath + ".old"),
+      defaultValue(std::move(default_value)) {
+    if (!std::filesystem::exists(dataPath)) {
         clear();
+        return;
+    }
+    std::ifstream ifs{dataPath};
+    load(json::parse(ifs));
+    // A previous compaction did not finish
+    (void)replay(compactingPath);
+    const size_t valid = replay(journalPath);
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(journalPath, ec);
+    if (!ec && size > valid) {
+        // Drop the torn record, so that new records start on a new line
+        log_warning("%s: discarding %zu bytes of a partial record",
+                    journalPath.c_str(), static_cast<size_t>(size - valid));
+        std::filesystem::resize_file(journalPath, valid);
     }
+    openJournal();
 }
 
-void StateFile::setValue(const json &new_value) const {
-    // TODO: randomize this filename
-    std::string tmpfilepath =
-        std::string{dataPath}.append(".tmp").append(std::to_string(getpid()));
-    std::ofstream ofs{tmpfilepath};
-    ofs << new_value;
-    ofs.close();
-    if (rename(tmpfilepath.c_str(), dataPath.c_str()) != 0) {
-        std::filesystem::remove(tmpfilepath);
-        throw std::system_error(errno, std::system_category(), "rename()");
+StateFile::~StateFile() {
+    try {
+        finishCompaction();
+        sync();
+    } catch (const std::exception &exc) {
+        log_error("failed to save %s: %s", dataPath.c_str(), exc.what());
+    }
+    if (journal_fd >= 0) {
+        (void)close(journal_fd);
+    }
+}
+
+void StateFile::openJournal() {
+    if (journal_fd >= 0) {
+        (void)close(journal_fd);
+    }
+    journal_fd = open(journalPath.c_str(),
+                      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (journal_fd < 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "open() of " + journalPath);
+    }
+    std::error_code ec;
+    journal_bytes = std::filesystem::file_size(journalPath, ec);
+}
+
+void StateFile::load(json doc) {
+    overrides.clear();
+    value_cache.reset();
+    has_overrides = doc.is_object() && doc.contains("Overrides") &&
+                    doc["Overrides"].is_object();
+    if (has_overrides) {
+        for (const auto &[label, val] : doc["Overrides"].items()) {
+            Override ovr;
+            ovr.enabled = val.value("Enabled", true);
+            overrides.emplace(label, ovr);
+        }
+        doc.erase("Overrides");
     }
-    currentValue = new_value;
+    document = std::move(doc);
 }
 
-const json &StateFile::getValue() const { return currentValue; }
+size_t StateFile::replay(const std::string &path) {
+    std::ifstream ifs{path};
+    size_t valid = 0;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (ifs.eof()) {
+            // The last record was not terminated
+            break;
+        }
+        try {
+            apply(json::parse(line));
+        } catch (const std::exception &exc) {
+            log_error("%s: invalid record: %s", path.c_str(), exc.what());
+            break;
+        }
+        valid += line.size() + 1;
+    }
+    return valid;
+}
+
+void StateFile::apply(const json &record) {
+    const auto &op = record.at("Op").get_ref<const std::string &>();
+    if (op == "SetOverride") {
+        Override ovr;
+        ovr.enabled = record.at("Enabled").get<bool>();
+        overrides[record.at("Label").get<std::string>()] = ovr;
+        has_overrides = true;
+    } else if (op == "ClearOverride") {
+        overrides.erase(record.at("Label").get<std::string>());
+    } else if (op == "SetFact") {
+        document["Facts"][record.at("Key").get<std::string>()] =
+            record.at("Value");
+    } else {
+        throw std::runtime_error("unknown operation: " + op);
+    }
+    value_cache.reset();
+}
+
+void StateFile::append(const json &record) {
+    if (!document.is_object()) {
+        throw std::logic_error("the state file does not support records");
+    }
+    apply(record);
+    pending.append(record.dump()).push_back('\n');
+}
+
+json StateFile::serialize() const {
+    if (!has_overrides) {
+        return document;
+    }
+    json result = document;
+    auto &obj = result["Overrides"] = json::object();
+    for (const auto &[label, ovr] : overrides) {
+        obj[label] = json{{"Enabled", ovr.enabled}};
+    }
+    return result;
+}
+
+void StateFile::setValue(const json &new_value) {
+    writeSnapshot(new_value);
+    load(new_value);
+}
+
+const json &StateFile::getValue() const {
+    if (!value_cache) {
+        value_cache = serialize();
+    }
+    return *value_cache;
+}
+
+const StateFile::Override *
+StateFile::findOverride(const std::string &label) const {
+    auto it = overrides.find(label);
+    return it == overrides.end() ? nullptr : &it->second;
+}
+
+void StateFile::setOverride(const std::string &label, Override value) {
+    append({{"Op", "SetOverride"},
+            {"Label", label},
+            {"Enabled", value.enabled}});
+}
+
+void StateFile::clearOverride(const std::string &label) {
+    append({{"Op", "ClearOverride"}, {"Label", label}});
+}
+
+const json *StateFile::getFact(const std::string &key) const {
+    if (!document.is_object() || !document.contains("Facts")) {
+        return nullptr;
+    }
+    const auto &facts = document["Facts"];
+    auto it = facts.find(key);
+    return it == facts.end() ? nullptr : &*it;
+}
+
+void StateFile::setFact(const std::string &key, json value) {
+    append({{"Op", "SetFact"}, {"Key", key}, {"Value", std::move(value)}});
+}
+
+void StateFile::sync() {
+    if (!pending.empty()) {
+        size_t written = 0;
+        while (written < pending.size()) {
+            ssize_t rv = write(journal_fd, pending.data() + written,
+                               pending.size() - written);
+            if (rv < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                const int saved_errno = errno;
+                discardUnsynced(written);
+                throw std::system_error(saved_errno, std::system_category(),
+                                        "write() to " + journalPath);
+            }
+            written += static_cast<size_t>(rv);
+        }
+        if (fdatasync(journal_fd) < 0) {
+            const int saved_errno = errno;
+            discardUnsynced(written);
+            throw std::system_error(saved_errno, std::system_category(),
+                                    "fdatasync() of " + journalPath);
+        }
+        journal_bytes += pending.size();
+        pending.clear();
+    }
+    if (journal_bytes >= compaction_threshold && !isCompacting()) {
+        startCompaction();
+    }
+}
+
+void StateFile::discardUnsynced(size_t written) {
+    // A torn record would hide every record after it from replay()
+    if (ftruncate(journal_fd, static_cast<off_t>(journal_bytes)) == 0) {
+        return;
+    }
+    log_errno("ftruncate() of %s", journalPath.c_str());
+    // Finish the torn record on the next sync() instead
+    journal_bytes += written;
+    pending.erase(0, written);
+}
+
+bool StateFile::isCompacting() {
+    if (!compaction.valid()) {
+        return false;
+    }
+    if (compaction.wait_for(std::chrono::seconds{0}) !=
+        std::future_status::ready) {
+        return true;
+    }
+    finishCompaction();
+    return false;
+}
+
+void StateFile::finishCompaction() {
+    if (!compaction.valid()) {
+        return;
+    }
+    if (compaction.get()) {
+        log_debug("compacted the journal of %s", dataPath.c_str());
+    } else {
+        // The old journal is kept, and will be compacted again
+        log_error("failed to compact the journal of %s", dataPath.c_str());
+    }
+}
+
+void StateFile::startCompaction() {
+    if (std::filesystem::exists(compactingPath)) {
+        // A previous compaction failed, so its journal cannot be replaced
+        compact();
+        return;
+    }
+    if (rename(journalPath.c_str(), compactingPath.c_str()) != 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "rename() of " + journalPath);
+    }
+    openJournal();
+    // The snapshot covers every record in the old journal
+    auto data = getValue().dump();
+    compaction = std::async(std::launch::async, [path = dataPath,
+                                                 old_journal = compactingPath,
+                                                 data = std::move(data)] {
+        return writeFileDurably(path, data) && unlink(old_journal.c_str()) == 0;
+    });
+}
+
+void StateFile::writeSnapshot(const json &doc) {
+    finishCompaction();
+    if (!writeFileDurably(dataPath, doc.dump())) {
+        throw std::system_error(errno, std::system_category(),
+                                "unable to write " + dataPath);
+    }
+    // The snapshot replaces every record written so far
+    pending.clear();
+    (void)unlink(compactingPath.c_str());
+    if (journal_fd >= 0) {
+        if (ftruncate(journal_fd, 0) < 0) {
+            throw std::system_error(errno, std::system_category(),
+                                    "ftruncate() of " + journalPath);
+        }
+        journal_bytes = 0;
+    }
+}
+
+void StateFile::compact() {
+    finishCompaction();
+    writeSnapshot(getValue());
+}
 
 void StateFile::clear() {
-    std::ofstream ofs{dataPath};
-    ofs << defaultValue;
-    ofs.close();
-    currentValue = defaultValue;
+    writeSnapshot(defaultValue);
+    load(defaultValue);
+    if (journal_fd < 0) {
+        (void)unlink(journalPath.c_str());
+        openJournal();
+    }
 }
@@ -16,6 +16,11 @@
 
 #pragma once
 
+#include <future>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
@@ -24,20 +29,129 @@ using json = nlohmann::json;
  * A state file used by a single-threaded program. The
  * assumption is that no other process (or user) will
  * modify the state file while this program is running.
+ *
+ * The "Overrides" object of the document is kept in a typed index keyed by
+ * label, so that lookups do not touch the JSON document.
+ *
+ * Changes to overrides and facts are appended to a journal next to the
+ * snapshot, one JSON record per line, and made durable in groups by sync().
+ * When the journal grows past a threshold, it is compacted into a new
+ * snapshot on a background thread. Loading replays the journal on top of
+ * the snapshot.
  */
 class StateFile {
   public:
+    //! Settings of a job that take precedence over its manifest
+    struct Override {
+        bool enabled = true;
+    };
+
     StateFile(std::string path, json default_value);
 
+    ~StateFile();
+
+    StateFile(const StateFile &) = delete;
+    StateFile &operator=(const StateFile &) = delete;
+
+    //! The whole document. After an override is changed, the document is
+    //! rebuilt on the next call.
     [[nodiscard]] const json &getValue() const;
 
-    void setValue(const json &) const;
+    //! Replace the whole document. This writes a new snapshot immediately.
+    void setValue(const json &);
+
+    //! Return the override for a job, or nullptr if it has none
+    [[nodiscard]] const Override *findOverride(const std::string &label) const;
+
+    //! Set the override for a job. The change is durable after sync().
+    void setOverride(const std::string &label, Override value);
+
+    //! Remove the override for a job. The change is durable after sync().
+    void clearOverride(const std::string &label);
+
+    //! The number of jobs with an override
+    [[nodiscard]] size_t overrideCount() const { return overrides.size(); }
+
+    //! Return a fact recorded at runtime, or nullptr if it is not set
+    [[nodiscard]] const json *getFact(const std::string &key) const;
+
+    //! Record a fact that must survive a restart. The change is durable after
+    //! sync().
+    void setFact(const std::string &key, json value);
+
+    //! Write the journal records added since the last call with a single
+    //! fdatasync(2), and start a compaction if the journal is too large.
+    void sync();
+
+    //! Write a snapshot and empty the journal, waiting for it to finish
+    void compact();
+
+    //! The size of the journal, including records that have not been synced
+    [[nodiscard]] size_t journalSize() const {
+        return journal_bytes + pending.size();
+    }
+
+    //! Compact the journal once it is larger than this many bytes
+    void setCompactionThreshold(size_t bytes) { compaction_threshold = bytes; }
+
+    //! Return true if a compaction is running on the background thread
+    [[nodiscard]] bool isCompacting();
 
     //! Discard all custom values in the state file
     void clear();
 
   private:
+    //! Replace the document, moving its overrides into the index
+    void load(json doc);
+
+    //! Apply the records in a journal file. Returns the length of the valid
+    //! records; anything after that is a torn write.
+    size_t replay(const std::string &path);
+
+    //! Apply a single journal record
+    void apply(const json &record);
+
+    //! Queue a record for the next sync()
+    void append(const json &record);
+
+    //! Remove the bytes that a failed sync() wrote to the journal, so that
+    //! the pending records can be written again
+    void discardUnsynced(size_t written);
+
+    //! Build the document, including the overrides
+    json serialize() const;
+
+    //! Rotate the journal and write a snapshot on a background thread
+    void startCompaction();
+
+    //! Wait for a background compaction, if any
+    void finishCompaction();
+
+    //! Write a snapshot and empty both journals
+    void writeSnapshot(const json &doc);
+
+    void openJournal();
+
     const std::string dataPath;
+    //! Records written since the last snapshot
+    const std::string journalPath;
+    //! Records that are being compacted into the next snapshot
+    const std::string compactingPath;
     const json defaultValue;
-    mutable json currentValue;
+    //! The document, without the Overrides key if it is indexed
+    json document;
+    //! True if the document has an Overrides object
+    bool has_overrides = false;
+    std::unordered_map<std::string, Override> overrides;
+    //! The result of serialize(), until the next change
+    mutable std::optional<json> value_cache;
+
+    int journal_fd = -1;
+    //! Bytes in the journal file
+    size_t journal_bytes = 0;
+    //! Records that have not been written yet
+    std::string pending;
+    size_t compaction_threshold = 256 * 1024;
+    //! True if the snapshot written by the background thread succeeded
+    std::future<bool> compaction;
 };
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "status_page.h"
+
+namespace {
+
+size_t pageLength(uint32_t capacity) {
+    return sizeof(launch_status_header) +
+           static_cast<size_t>(capacity) * sizeof(launch_status_entry);
+}
+
+//! Tell the readers of an older page at the path to open the file again
+void markStale(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 &&
+        static_cast<size_t>(sb.st_size) >= sizeof(launch_status_header)) {
+        void *addr = mmap(nullptr, sizeof(launch_status_header),
+                          PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            auto *header = static_cast<launch_status_header *>(addr);
+            if (header->magic == LAUNCH_STATUS_MAGIC) {
+                __atomic_or_fetch(&header->flags, LAUNCH_STATUS_STALE,
+                                  __ATOMIC_RELEASE);
+            }
+            (void)munmap(addr, sizeof(launch_status_header));
+        }
+    }
+    (void)::close(fd);
+}
+
+} // namespace
+
+StatusPage::~StatusPage() { close(); }
+
+void StatusPage::open(const std::filesystem::path &path_, uint32_t capacity) {
+    close();
+    path = path_;
+    markStale(path);
+    create(std::max<uint32_t>(capacity, 1));
+}
+
+void StatusPage::create(uint32_t capacity_) {
+    const auto tmp_path = path.string() + ".new";
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(),
+                                "open(2) of " + tmp_path);
+    }
+    const size_t new_length = pageLength(capacity_);
+    void *addr = MAP_FAILED;
+    struct stat sb;
+    if (ftruncate(fd, static_cast<off_t>(new_length)) == 0 &&
+        fstat(fd, &sb) == 0) {
+        addr = mmap(nullptr, new_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    }
+    if (addr == MAP_FAILED) {
+        int saved_errno = errno;
+        (void)::close(fd);
+        (void)unlink(tmp_path.c_str());
+        throw std::system_error(saved_errno, std::system_category(),
+                                "unable to map " + tmp_path);
+    }
+    (void)::close(fd);
+
+    auto *new_header = static_cast<launch_status_header *>(addr);
+    new_header->magic = LAUNCH_STATUS_MAGIC;
+    new_header->version = LAUNCH_STATUS_VERSION;
+    new_header->entry_size = sizeof(launch_status_entry);
+    new_header->capacity = capacity_;
+    if (header) {
+        new_header->count = header->count;
+        memcpy(new_header + 1, entries(),
+               header->count * sizeof(launch_status_entry));
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        int saved_errno = errno;
+        (void)munmap(addr, new_length);
+        (void)unlink(tmp_path.c_str());
+        throw std::system_error(saved_errno, std::system_category(),
+                                "rename(2) to " + path.string());
+    }
+
+    if (header) {
+        __atomic_or_fetch(&header->flags, LAUNCH_STATUS_STALE,
+                          __ATOMIC_RELEASE);
+        (void)munmap(header, length);
+    }
+    header = new_header;
+    length = new_length;
+    dev = sb.st_dev;
+    ino = sb.st_ino;
+}
+
+void StatusPage::close() {
+    if (!header) {
+        return;
+    }
+    __atomic_or_fetch(&header->flags, LAUNCH_STATUS_STALE, __ATOMIC_RELEASE);
+    (void)munmap(header, length);
+    header = nullptr;
+    length = 0;
+
+    // Another manager may have replaced our page
+    struct stat sb;
+    if (stat(path.c_str(), &sb) == 0 && sb.st_dev == dev && sb.st_ino == ino &&
+        unlink(path.c_str()) < 0) {
+        log_errno("unlink(2) of %s", path.c_str());
+    }
+}
+
+void StatusPage::update(uint32_t slot, const launch_status_entry &entry) {
+    if (!header) {
+        return;
+    }
+    if (slot >= header->capacity) {
+        uint32_t new_capacity = header->capacity;
+        while (slot >= new_capacity) {
+            new_capacity *= 2;
+        }
+        try {
+            create(new_capacity);
+        } catch (const std::system_error &exc) {
+            log_error("unable to grow the status page: %s", exc.what());
+            return;
+        }
+    }
+    beginWrite();
+    entries()[slot] = entry;
+    entries()[slot].label[LAUNCH_STATUS_LABEL_MAX - 1] = '\0';
+    if (slot >= header->count) {
+        __atomic_store_n(&header->count, slot + 1, __ATOMIC_RELAXED);
+    }
+    endWrite();
+}
+
+void StatusPage::clear(uint32_t slot) {
+    if (!header || slot >= header->count) {
+        return;
+    }
+    beginWrite();
+    memset(&entries()[slot], 0, sizeof(launch_status_entry));
+    uint32_t count = header->count;
+    while (count > 0 && entries()[count - 1].label[0] == '\0') {
+        count--;
+    }
+    __atomic_store_n(&header->count, count, __ATOMIC_RELAXED);
+    endWrite();
+}
+
+// The sequence number is odd while the entries are being written
+void StatusPage::beginWrite() {
+    __atomic_store_n(&header->sequence, header->sequence + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void StatusPage::endWrite() {
+    __atomic_store_n(&header->sequence, header->sequence + 1,
+                     __ATOMIC_RELEASE);
+}
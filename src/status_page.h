@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+#include <sys/types.h>
+
+#include "launch_status.h"
+
+//! The writer of the status page that is described in launch_status.h.
+//! Each job is published in the entry given by its JobTable id.
+class StatusPage {
+  public:
+    StatusPage() = default;
+    ~StatusPage();
+    StatusPage(const StatusPage &) = delete;
+    StatusPage &operator=(const StatusPage &) = delete;
+
+    //! Create the page at the given path. A page that was left behind by a
+    //! previous launchd is replaced and marked as stale.
+    void open(const std::filesystem::path &path_, uint32_t capacity = 64);
+
+    //! Mark the page as stale and remove the file
+    void close();
+
+    [[nodiscard]] bool isOpen() const { return header != nullptr; }
+
+    [[nodiscard]] uint32_t capacity() const {
+        return header ? header->capacity : 0;
+    }
+
+    //! Publish an entry, growing the page if needed. Does nothing if the
+    //! page is not open.
+    void update(uint32_t slot, const launch_status_entry &entry);
+
+    //! Mark an entry as free
+    void clear(uint32_t slot);
+
+  private:
+    //! Create a page in a temporary file and rename it to the path
+    void create(uint32_t capacity_);
+    void beginWrite();
+    void endWrite();
+    [[nodiscard]] launch_status_entry *entries() const {
+        return reinterpret_cast<launch_status_entry *>(header + 1);
+    }
+
+    std::filesystem::path path;
+    launch_status_header *header = nullptr;
+    size_t length = 0;
+    //! Identifies our file, so that close() does not remove a newer page
+    dev_t dev = 0;
+    ino_t ino = 0;
+};
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "string_pool.h"
+
+StringPool &StringPool::global() {
+    static StringPool pool;
+    return pool;
+}
+
+StringPool::Entry *StringPool::acquire(std::string_view s) {
+    auto &entry = *strings.try_emplace(std::string{s}, 0).first;
+    entry.second++;
+    return &entry;
+}
+
+void StringPool::release(Entry *entry) {
+    if (--entry->second == 0) {
+        strings.erase(strings.find(entry->first));
+    }
+}
+
+size_t StringPool::heapBytes() const {
+    // Each node holds a string, its count and a next pointer; the bucket
+    // array holds one pointer per bucket.
+    size_t result = strings.bucket_count() * sizeof(void *);
+    for (const auto &[s, refs] : strings) {
+        result += sizeof(Entry) + sizeof(void *);
+        if (s.capacity() > std::string{}.capacity()) {
+            result += s.capacity() + 1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Manifest strings such as user names, paths and environment variables are
+ * often identical across thousands of jobs. They are interned so that each
+ * distinct string is stored once.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+//! Storage for interned strings. Each string is reference counted by the
+//! InternedString objects that point to it, and removed when the last of
+//! them is destroyed, so strings of unloaded jobs do not accumulate.
+class StringPool {
+  public:
+    //! A stored string and the number of references to it
+    using Entry = std::pair<const std::string, size_t>;
+
+    //! The pool used for all manifests
+    static StringPool &global();
+
+    //! Return the stored copy of the string with one more reference, adding
+    //! it if necessary
+    Entry *acquire(std::string_view s);
+
+    //! Drop a reference, and remove the string if it was the last one
+    void release(Entry *entry);
+
+    //! The number of distinct strings
+    size_t size() const { return strings.size(); }
+
+    //! An estimate of the heap memory used by the pool, in bytes
+    size_t heapBytes() const;
+
+  private:
+    std::unordered_map<std::string, size_t> strings;
+};
+
+//! A string stored in the global StringPool. Copying it copies a pointer and
+//! updates a reference count. Like the pool, it is not thread-safe.
+class InternedString {
+  public:
+    InternedString() : InternedString(std::string_view{}) {}
+
+    InternedString(std::string_view s)
+        : ptr(StringPool::global().acquire(s)) {}
+
+    InternedString(const std::string &s) : InternedString(std::string_view{s}) {}
+
+    InternedString(const char *s) : InternedString(std::string_view{s}) {}
+
+    InternedString(const InternedString &other) : ptr(other.ptr) {
+        ptr->second++;
+    }
+
+    InternedString &operator=(const InternedString &other) {
+        other.ptr->second++;
+        StringPool::global().release(ptr);
+        ptr = other.ptr;
+        return *this;
+    }
+
+    ~InternedString() { StringPool::global().release(ptr); }
+
+    const std::string &str() const { return ptr->first; }
+
+    const char *c_str() const { return ptr->first.c_str(); }
+
+    bool empty() const { return ptr->first.empty(); }
+
+    operator const std::string &() const { return ptr->first; }
+
+    //! Interned strings are equal if and only if they are the same object
+    bool operator==(const InternedString &rhs) const { return ptr == rhs.ptr; }
+
+    bool operator!=(const InternedString &rhs) const { return ptr != rhs.ptr; }
+
+    bool operator<(const InternedString &rhs) const {
+        return ptr->first < rhs.ptr->first;
+    }
+
+    bool operator==(std::string_view rhs) const { return ptr->first == rhs; }
+
+    bool operator==(const std::string &rhs) const { return ptr->first == rhs; }
+
+    bool operator==(const char *rhs) const { return ptr->first == rhs; }
+
+    bool operator!=(std::string_view rhs) const { return ptr->first != rhs; }
+
+    bool operator!=(const std::string &rhs) const { return ptr->first != rhs; }
+
+    bool operator!=(const char *rhs) const { return ptr->first != rhs; }
+
+  private:
+    StringPool::Entry *ptr;
+};
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+
+#include "boot_scheduler.h"
+#include "common.hpp"
+
+using Priority = BootScheduler::Priority;
+
+// Critical jobs are dequeued before normal and background jobs
+void testPriorityOrder() {
+    BootScheduler sched;
+    sched.enqueue("c.background", {}, Priority::Background);
+    sched.enqueue("b.normal", {}, Priority::Normal);
+    sched.enqueue("a.normal", {}, Priority::Normal);
+    sched.enqueue("d.critical", {}, Priority::Critical);
+    assert(sched.criticalRemaining() == 1);
+    assert(sched.dequeue() == "d.critical");
+    assert(sched.criticalRemaining() == 0);
+    assert(sched.dequeue() == "a.normal");
+    assert(sched.dequeue() == "b.normal");
+    assert(sched.dequeue() == "c.background");
+    assert(!sched.dequeue());
+    assert(sched.empty());
+}
+
+// A critical job raises the priority of the jobs it depends on
+void testPriorityInheritance() {
+    BootScheduler sched;
+    sched.enqueue("a.normal", {}, Priority::Normal);
+    sched.enqueue("z.background", {}, Priority::Background);
+    sched.enqueue("b.critical", {"z.background"}, Priority::Critical);
+    assert(sched.criticalRemaining() == 2);
+    assert(sched.dequeue() == "z.background");
+    assert(sched.dequeue() == "b.critical");
+    assert(sched.dequeue() == "a.normal");
+}
+
+// The batch limit tracks the observed time per job
+void testAdaptiveBatchLimit() {
+    using std::chrono::microseconds;
+    BootScheduler sched;
+    assert(sched.batchLimit() == BootScheduler::initial_batch_limit);
+    sched.recordBatch(16, microseconds{16});
+    assert(sched.batchLimit() == 32);
+    sched.recordBatch(32, microseconds{32 * 100000});
+    assert(sched.batchLimit() == 16);
+    for (int i = 0; i < 10; i++) {
+        sched.recordBatch(1, microseconds{1000000});
+    }
+    assert(sched.batchLimit() == BootScheduler::min_batch_limit);
+}
+
+void addBootSchedulerTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testPriorityOrder);
+    X(testPriorityInheritance);
+    X(testAdaptiveBatchLimit);
+#undef X
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/log.h"
+#include "channel.h"
+#include "common.hpp"
+
+namespace {
+
+const Channel::Encoding encodings[] = {Channel::Encoding::Json,
+                                       Channel::Encoding::Cbor,
+                                       Channel::Encoding::MessagePack};
+
+const char *encodingName(Channel::Encoding encoding) {
+    switch (encoding) {
+    case Channel::Encoding::Json:
+        return "JSON";
+    case Channel::Encoding::Cbor:
+        return "CBOR";
+    case Channel::Encoding::MessagePack:
+        return "MessagePack";
+    }
+    return "unknown";
+}
+
+//! A job listing in the format of Manager::listJobs()
+json makeListing(size_t count) {
+    auto result = json::array();
+    for (size_t i = 0; i < count; i++) {
+        result.emplace_back(json::object({
+            {"Label", "com.example.job." + std::to_string(i)},
+            {"PID", (i % 3) ? std::to_string(1000 + i) : "-"},
+            {"LastExitStatus", static_cast<int>(i % 2)},
+        }));
+    }
+    return result;
+}
+
+} // namespace
+
+// Every encoding survives a round trip through the framing
+void testChannelEncodings() {
+    const json msg = {{"Label", "test.encoding"},
+                      {"Args", {"a", "b"}},
+                      {"Pid", 1234},
+                      {"Ratio", 0.5},
+                      {"Enabled", true}};
+    for (auto encoding : encodings) {
+        const auto body = Channel::encode(msg, encoding);
+        const auto header = Channel::encodeHeader(body.size(), encoding);
+        const auto decoded = Channel::decodeHeader(header.data());
+        assert(decoded.length == body.size());
+        assert(decoded.encoding == static_cast<uint8_t>(encoding));
+        assert(Channel::decode(body.data(), body.data() + body.size(),
+                               encoding) == msg);
+    }
+    assert(!Channel::isSupported(0x7f));
+}
+
+// A client falls back to JSON when the server does not know its encoding
+void testChannelEncodingFallback() {
+    const std::string path = tmpdir + "/fallback.sock";
+    Channel server;
+    server.bindAndListen(path, 1);
+    std::thread thr{[&server] {
+        // Act like a server that only speaks JSON
+        int fd = accept(server.getSockFD(), nullptr, nullptr);
+        assert(fd >= 0);
+        for (int i = 0; i < 2; i++) {
+            char header[IPC_HEADER_LEN];
+            assert(recv(fd, header, sizeof(header), MSG_WAITALL) ==
+                   sizeof(header));
+            const auto hdr = Channel::decodeHeader(header);
+            std::string body(hdr.length, '\0');
+            assert(recv(fd, body.data(), body.size(), MSG_WAITALL) ==
+                   (ssize_t)body.size());
+            if (hdr.encoding != 0) {
+                Channel::writeMessage(
+                    fd, {{"error", true}, {"UnsupportedEncoding", true}});
+            } else {
+                Channel::writeMessage(fd, {{"error", false},
+                                           {"Echo", json::parse(body)}});
+            }
+        }
+        close(fd);
+    }};
+
+    Channel client;
+    assert(client.connect(path) == 0);
+    client.setEncoding(Channel::Encoding::MessagePack);
+    client.writeMessage(json::array({"version"}));
+    auto reply = client.readMessage();
+    thr.join();
+    assert(!reply["error"]);
+    assert(reply["Echo"] == json::array({"version"}));
+    assert(client.getEncoding() == Channel::Encoding::Json);
+    unlink(path.c_str());
+}
+
+// The RPC server answers in the encoding of the request
+void testChannelBinaryRpc() {
+    TestContext ctx;
+    ctx.mgr.startRunning();
+    for (auto encoding : encodings) {
+        auto fp = std::async(std::launch::async, [&ctx, encoding] {
+            Channel chan;
+            chan.connect(ctx.mgr.getDomain().statedir / "rpc.sock");
+            chan.setEncoding(encoding);
+            chan.writeMessage(json::array({"version"}));
+            auto reply = chan.readMessage();
+            assert(chan.getEncoding() == encoding);
+            return reply;
+        });
+        while (fp.wait_for(std::chrono::seconds{0}) !=
+               std::future_status::ready) {
+            ctx.mgr.handleEvent(std::chrono::milliseconds{10});
+        }
+        assert(fp.get()["version"].get<std::string>().find(
+                   "relaunch version") == 0);
+    }
+}
+
+// Compare the cost of each encoding for a large job listing
+void testChannelEncodingBenchmark() {
+    using namespace std::chrono;
+    const size_t count = 50000;
+    const json listing = makeListing(count);
+    for (auto encoding : encodings) {
+        auto start = steady_clock::now();
+        const auto body = Channel::encode(listing, encoding);
+        const auto encode_time =
+            duration_cast<microseconds>(steady_clock::now() - start);
+        start = steady_clock::now();
+        const auto decoded =
+            Channel::decode(body.data(), body.data() + body.size(), encoding);
+        const auto decode_time =
+            duration_cast<microseconds>(steady_clock::now() - start);
+        assert(decoded == listing);
+        log_notice("%s listing of %zu jobs: %zu bytes, encode=%lld us, "
+                   "decode=%lld us",
+                   encodingName(encoding), count, body.size(),
+                   static_cast<long long>(encode_time.count()),
+                   static_cast<long long>(decode_time.count()));
+    }
+}
+
+// Descriptors travel with the message that they were sent with
+void testChannelDescriptorPassing() {
+    int sv[2], pipefd[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(pipe(pipefd) == 0);
+    Channel::writeMessage(sv[0], json::array({"first"}),
+                          Channel::Encoding::Json, {pipefd[1]});
+    Channel::writeMessage(sv[0], json::array({"second"}));
+    close(pipefd[1]);
+
+    char buf[256];
+    std::vector<int> fds;
+    const ssize_t bytes = Channel::receive(sv[1], buf, sizeof(buf), fds);
+    assert(bytes > 0);
+    assert(fds.size() == 1);
+    assert(fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+    assert(write(fds[0], "x", 1) == 1);
+    close(fds[0]);
+    assert(read(pipefd[0], buf, sizeof(buf)) == 1 && buf[0] == 'x');
+
+    // Too many descriptors are refused by the sender
+    std::vector<int> too_many(IPC_MAX_FDS + 1, pipefd[0]);
+    try {
+        Channel::writeMessage(sv[0], json::array({"third"}),
+                              Channel::Encoding::Json, too_many);
+        assert(!"should have thrown");
+    } catch (const std::length_error &) {
+    }
+    close(pipefd[0]);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void addChannelTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testChannelDescriptorPassing);
+    X(testChannelEncodings);
+    X(testChannelEncodingFallback);
+    X(testChannelBinaryRpc);
+    X(testChannelEncodingBenchmark);
+#undef X
+}
@@ -39,6 +39,15 @@ namespace testutil {
         return mpath;
     }
 
+    //! Handle events until a launchctl call on another thread returns
+    static inline void serveUntilReady(Manager &mgr, std::future<int> &fp) {
+        // Accepting, reading and replying are separate events
+        while (fp.wait_for(std::chrono::seconds{0}) !=
+               std::future_status::ready) {
+            mgr.handleEvent(std::chrono::milliseconds{10});
+        }
+    }
+
     static inline std::unique_ptr<Manager> getTemporaryManager() {
         Domain domain{DomainType::User, TMPDIR};
         auto mgr = std::make_unique<Manager>(domain);
@@ -70,7 +79,7 @@ struct TestContext {
             }
         };
         std::future<int> fp = async(std::launch::async, cb);
-        mgr.handleEvent();
+        testutil::serveUntilReady(mgr, fp);
         return fp.get();
     }
 
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+#include <pwd.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "domain_host.h"
+#include "log.h"
+
+// Two domains on one event loop share parsed manifests but nothing else
+void testHostedDomains() {
+    using namespace std::chrono_literals;
+    const auto dir = std::filesystem::path{tmpdir} / "testHostedDomains";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const auto path = dir / "test.shared.json";
+    {
+        std::ofstream ofs{path};
+        ofs << json{{"Label", "test.shared"},
+                    {"RunAtLoad", true},
+                    {"ProgramArguments",
+                     json::array({"/bin/sh", "-c", "exit 0"})}};
+    }
+
+    DomainHost host;
+    auto &a = host.addDomain(Domain{DomainType::User, dir / "a", getuid()});
+    auto &b = host.addDomain(Domain{DomainType::User, dir / "b", getuid()});
+    host.startRunning();
+    assert(std::filesystem::exists(dir / "a" / "rpc.sock"));
+    assert(std::filesystem::exists(dir / "b" / "rpc.sock"));
+
+    // Each domain has its own state file
+    a.overrideJobEnabled(Label{"test.shared"}, false);
+    assert(!a.loadManifest(path));
+    assert(b.loadManifest(path));
+    a.overrideJobEnabled(Label{"test.shared"}, true);
+    assert(a.loadManifest(path));
+    assert(host.getManifestCache().size() == 1);
+
+    a.startRunning();
+    b.startRunning();
+    assert(a.jobExists(Label{"test.shared"}));
+    assert(b.jobExists(Label{"test.shared"}));
+    for (int i = 0; i < 4; i++) {
+        assert(host.runOnce(100ms));
+    }
+
+    // Hosting the same state directory twice is refused
+    bool thrown = false;
+    try {
+        host.addDomain(Domain{DomainType::User, dir / "a", getuid()});
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    host.stopRunning();
+    while (host.runOnce(100ms)) {
+    }
+    assert(!a.jobExists(Label{"test.shared"}));
+    assert(!b.jobExists(Label{"test.shared"}));
+    assert(host.getManifestCache().size() == 0);
+}
+
+// The owner of a hosted domain cannot run jobs as another user or group
+void testHostedDomainCredentials() {
+    const auto dir =
+        std::filesystem::path{tmpdir} / "testHostedDomainCredentials";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    // As root, host the domain for another user
+    const struct passwd *pwent =
+        getuid() == 0 ? getpwnam("nobody") : getpwuid(getuid());
+    assert(pwent);
+    const uid_t uid = pwent->pw_uid;
+    const std::string user_name = pwent->pw_name;
+
+    DomainHost host;
+    auto &mgr = host.addDomain(Domain{DomainType::User, dir, uid});
+    auto manifest = [](const std::string &label, const json &extra) {
+        json result{{"Label", label},
+                    {"ProgramArguments", json::array({"/bin/true"})}};
+        result.update(extra);
+        return result;
+    };
+    const std::string path = "/dev/null";
+    assert(!mgr.loadManifest(manifest("test.root", {{"UserName", "root"}}),
+                             path));
+    assert(!mgr.loadManifest(manifest("test.wheel", {{"GroupName", "root"}}),
+                             path));
+    assert(!mgr.loadManifest(
+        manifest("test.missing", {{"UserName", "test.no-such-user"}}), path));
+    assert(!mgr.loadManifest(manifest("test.chroot", {{"RootDirectory", dir}}),
+                             path));
+    assert(!mgr.loadManifest(manifest("test.nice", {{"Nice", -5}}), path));
+    assert(mgr.loadManifest(manifest("test.nicer", {{"Nice", 5}}), path));
+    assert(mgr.loadManifest(manifest("test.owner", {{"UserName", user_name}}),
+                            path));
+    mgr.startRunning();
+    assert(!mgr.jobExists(Label{"test.root"}));
+    assert(!mgr.jobExists(Label{"test.chroot"}));
+    assert(!mgr.jobExists(Label{"test.nice"}));
+    assert(mgr.jobExists(Label{"test.nicer"}));
+    assert(mgr.jobExists(Label{"test.owner"}));
+}
+
+// A state directory that other users can write to is refused
+void testHostedDomainStateDir() {
+    const auto dir = std::filesystem::path{tmpdir} / "testHostedDomainStateDir";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "unsafe");
+    std::filesystem::permissions(dir / "unsafe", std::filesystem::perms::all);
+
+    DomainHost host;
+    for (const auto &statedir : {dir / "unsafe", dir / "unsafe" / "a"}) {
+        bool thrown = false;
+        try {
+            host.addDomain(Domain{DomainType::User, statedir, getuid()});
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    // New directories are created with safe permissions
+    host.addDomain(Domain{DomainType::User, dir / "a" / "b", getuid()});
+    for (const auto &created : {dir / "a", dir / "a" / "b"}) {
+        assert((std::filesystem::status(created).permissions() &
+                std::filesystem::perms::others_write) ==
+               std::filesystem::perms::none);
+    }
+}
+
+void addDomainHostTests(TestRunner &runner) {
+    runner.addTest("testHostedDomains", testHostedDomains);
+    runner.addTest("testHostedDomainCredentials", testHostedDomainCredentials);
+    runner.addTest("testHostedDomainStateDir", testHostedDomainStateDir);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "job_events.h"
+
+// Subscribers get the records of the jobs that match their patterns
+void testJobEventsFilter() {
+    JobEvents events;
+    assert(events.empty());
+    std::vector<json> all, some;
+    events.subscribe({}, [&all](const json &record) { all.push_back(record); });
+    const auto id = events.subscribe(
+        {"com.example.*", "other"},
+        [&some](const json &record) { some.push_back(record); });
+    assert(events.size() == 2);
+
+    events.publish("com.example.a", "Throttle", {{"Delay", 5}});
+    events.publish("unrelated", "Exit", {{"PID", 1}, {"ExitStatus", 0}});
+    events.publish("other", "SpawnFailed", {{"Error", "oops"}});
+    assert(all.size() == 3);
+    assert(some.size() == 2);
+    assert(some[0]["Label"] == "com.example.a");
+    assert(some[0]["Event"] == "Throttle");
+    assert(some[0]["Delay"] == 5);
+    assert(some[0]["Time"].get<int64_t>() > 0);
+    assert(some[1]["Label"] == "other");
+
+    events.unsubscribe(id);
+    events.publish("other", "Exit", {{"PID", 1}, {"ExitStatus", 0}});
+    assert(all.size() == 4);
+    assert(some.size() == 2);
+}
+
+// Listeners may unsubscribe themselves and others while a record is sent
+void testJobEventsUnsubscribeWhilePublishing() {
+    JobEvents events;
+    int first_calls = 0, second_calls = 0, third_calls = 0;
+    JobEvents::Id first = 0, second = 0;
+    first = events.subscribe({}, [&](const json &) {
+        first_calls++;
+        events.unsubscribe(first);
+        events.unsubscribe(second);
+    });
+    second = events.subscribe({}, [&](const json &) { second_calls++; });
+    events.subscribe({}, [&](const json &) { third_calls++; });
+    events.publish("job", "Exit", {{"PID", 1}, {"ExitStatus", 0}});
+    events.publish("job", "Exit", {{"PID", 1}, {"ExitStatus", 0}});
+    assert(first_calls == 1);
+    assert(second_calls == 0);
+    assert(third_calls == 2);
+    assert(events.size() == 1);
+}
+
+void addJobEventsTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testJobEventsFilter);
+    X(testJobEventsUnsubscribeWhilePublishing);
+#undef X
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "common.hpp"
+#include "job_table.h"
+#include "log.h"
+
+// Ids of removed jobs are reused
+void testJobTableReuse() {
+    JobTable table;
+    auto *job = reinterpret_cast<Job *>(&table);
+    auto a = table.add(job);
+    auto b = table.add(job);
+    assert(a != b);
+    table.pids[a] = 123;
+    table.unload_requested[a] = true;
+    table.remove(a);
+    assert(table.size() == 1);
+    assert(!table.jobs[a]);
+    auto c = table.add(job);
+    assert(c == a);
+    assert(table.pids[c] == 0);
+    assert(!table.unload_requested[c]);
+    assert(table.pending[c]);
+    assert(table.slots() == 2);
+}
+
+// Compare a scan of the table with a scan of individually allocated jobs
+void testJobTableScan() {
+    using namespace std::chrono;
+    const size_t count = 100000;
+
+    // A job as it was laid out before the table, with its hot fields next to
+    // a large manifest in its own heap allocation.
+    struct LegacyJob {
+        char manifest[512];
+        pid_t pid;
+        uint8_t state;
+        bool unload_requested;
+    };
+    std::vector<std::unique_ptr<LegacyJob>> legacy;
+    std::vector<std::unique_ptr<char[]>> noise;
+    JobTable table;
+    auto *job = reinterpret_cast<Job *>(&table);
+    for (size_t i = 0; i < count; i++) {
+        auto id = table.add(job);
+        table.pids[id] = (i % 3) ? static_cast<pid_t>(i) : 0;
+        table.states[id] = (i % 3) ? 2 : 0;
+        legacy.emplace_back(new LegacyJob{});
+        legacy.back()->pid = table.pids[id];
+        legacy.back()->state = table.states[id];
+        noise.emplace_back(new char[64]);
+    }
+
+    auto start = steady_clock::now();
+    size_t table_running = 0;
+    for (JobTable::JobId id = 0; id < table.slots(); id++) {
+        if (table.jobs[id] && table.states[id] == 2 && table.pids[id] > 0 &&
+            !table.unload_requested[id]) {
+            table_running++;
+        }
+    }
+    auto table_time = duration_cast<microseconds>(steady_clock::now() - start);
+
+    start = steady_clock::now();
+    size_t legacy_running = 0;
+    for (const auto &jobp : legacy) {
+        if (jobp->state == 2 && jobp->pid > 0 && !jobp->unload_requested) {
+            legacy_running++;
+        }
+    }
+    auto legacy_time = duration_cast<microseconds>(steady_clock::now() - start);
+
+    assert(table_running == legacy_running);
+    log_notice("scanned %zu jobs: table=%lld us, heap-allocated jobs=%lld us",
+               count, static_cast<long long>(table_time.count()),
+               static_cast<long long>(legacy_time.count()));
+}
+
+void addJobTableTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testJobTableReuse);
+    X(testJobTableScan);
+#undef X
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+
+#include <unistd.h>
+
+#include "common.hpp"
+#include "launch_client.h"
+#include "manager.h"
+
+static std::string socketPath(const Manager &mgr) {
+    return (mgr.getDomain().statedir / "rpc.sock").string();
+}
+
+// Typed requests are pipelined over one connection, and their replies can be
+// collected in any order
+void testLaunchClientRequests() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.client",
+          "ProgramArguments": ["/bin/sleep", "30"]
+        }
+    )"), path);
+    mgr.startRunning();
+    const auto sock = socketPath(mgr);
+    auto fp = std::async(std::launch::async, [&] {
+        auto *client =
+            launch_client_open(sock.c_str(), LAUNCH_ENCODING_MSGPACK);
+        assert(client);
+        assert(launch_client_encoding(client) == LAUNCH_ENCODING_MSGPACK);
+
+        uint64_t start_id, missing_id;
+        assert(launch_request_start(client, "test.client", &start_id) == 0);
+        assert(launch_request_start(client, "test.missing", &missing_id) == 0);
+        assert(launch_client_outstanding(client) == 2);
+        auto *missing = launch_client_wait(client, missing_id, -1);
+        assert(missing && launch_reply_failed(missing));
+        auto *start = launch_client_wait(client, start_id, -1);
+        assert(start && !launch_reply_failed(start));
+        uint64_t op;
+        assert(launch_reply_operation(start, &op) == 0);
+        assert(launch_reply_operation(missing, &op) < 0 && errno == ENOENT);
+        launch_reply_free(missing);
+        launch_reply_free(start);
+
+        uint64_t wait_id;
+        assert(launch_request_wait(client, &op, 1, 5, &wait_id) == 0);
+        auto *waited = launch_client_wait(client, wait_id, -1);
+        assert(waited);
+        struct launch_operation *ops;
+        size_t count;
+        int timed_out;
+        assert(launch_reply_operations(waited, &ops, &count, &timed_out) ==
+               0);
+        assert(count == 1 && ops[0].id == op && !timed_out);
+        assert(ops[0].status == LAUNCH_OPERATION_SUCCEEDED);
+        free(ops);
+        launch_reply_free(waited);
+
+        uint64_t list_id;
+        assert(launch_request_list(client, &list_id) == 0);
+        auto *list = launch_client_next(client, -1);
+        assert(list && launch_reply_id(list) == list_id);
+        struct launch_job *jobs;
+        assert(launch_reply_jobs(list, &jobs, &count) == 0);
+        assert(count == 1 && strcmp(jobs[0].label, "test.client") == 0);
+        assert(jobs[0].pid > 0);
+        free(jobs);
+
+        // The message can also be decoded by the caller
+        size_t len;
+        launch_encoding encoding;
+        const auto *data = static_cast<const uint8_t *>(
+            launch_reply_data(list, &len, &encoding));
+        assert(encoding == LAUNCH_ENCODING_MSGPACK);
+        const auto msg = json::from_msgpack(data, data + len);
+        assert(msg["Id"] == list_id && msg["Reply"].size() == 1);
+        char *text = launch_reply_json(list);
+        assert(text && json::parse(text).is_array());
+        free(text);
+        launch_reply_free(list);
+
+        assert(!launch_client_next(client, 0) && errno == ENOENT);
+        assert(!launch_client_wait(client, 12345, 0) && errno == ENOENT);
+
+        uint64_t stop_id;
+        const char *request = R"(["stop", {"Label": "test.client"}])";
+        assert(launch_client_send(client, request, nullptr, 0, &stop_id) ==
+               0);
+        auto *stop = launch_client_wait(client, stop_id, -1);
+        assert(stop && !launch_reply_failed(stop));
+        launch_reply_free(stop);
+        assert(launch_client_send(client, "not json", nullptr, 0, &stop_id) <
+                   0 &&
+               errno == EINVAL);
+        launch_client_close(client);
+        return 0;
+    });
+    testutil::serveUntilReady(mgr, fp);
+    fp.get();
+    mgr.stopRunning();
+}
+
+// A client connects again after launchd closes its idle connection
+void testLaunchClientReconnect() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.getRpcServer().idle_timeout = std::chrono::milliseconds{100};
+    mgr.startRunning();
+    const auto sock = socketPath(mgr);
+    auto fp = std::async(std::launch::async, [&] {
+        assert(!launch_client_open(TMPDIR "/no-such-socket",
+                                   LAUNCH_ENCODING_JSON));
+        assert(errno == ENOENT);
+
+        auto *client = launch_client_open(sock.c_str(), LAUNCH_ENCODING_CBOR);
+        assert(client);
+        // The second request is sent after the connection was closed
+        for (int i = 0; i < 2; i++) {
+            uint64_t id;
+            assert(launch_request_list(client, &id) == 0);
+            auto *reply = launch_client_wait(client, id, 5000);
+            assert(reply && launch_reply_id(reply) == id);
+            launch_reply_free(reply);
+            usleep(500000);
+        }
+        launch_client_close(client);
+        return 0;
+    });
+    testutil::serveUntilReady(mgr, fp);
+    fp.get();
+    mgr.stopRunning();
+}
+
+// A reply that arrived before launchd closed the connection is not lost
+void testLaunchClientReplyBeforeClose() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.getRpcServer().idle_timeout = std::chrono::milliseconds{100};
+    mgr.startRunning();
+    const auto sock = socketPath(mgr);
+    auto fp = std::async(std::launch::async, [&] {
+        auto *client = launch_client_open(sock.c_str(), LAUNCH_ENCODING_JSON);
+        assert(client);
+        uint64_t id;
+        assert(launch_request_list(client, &id) == 0);
+        // The reply is read only after the idle connection was closed
+        usleep(500000);
+        auto *reply = launch_client_wait(client, id, 5000);
+        assert(reply && launch_reply_id(reply) == id);
+        launch_reply_free(reply);
+        assert(!launch_client_wait(client, id, 0) && errno == ENOENT);
+
+        assert(launch_request_list(client, &id) == 0);
+        reply = launch_client_wait(client, id, 5000);
+        assert(reply && !launch_reply_failed(reply));
+        launch_reply_free(reply);
+        launch_client_close(client);
+        return 0;
+    });
+    testutil::serveUntilReady(mgr, fp);
+    fp.get();
+    mgr.stopRunning();
+}
+
+void addLaunchClientTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testLaunchClientRequests);
+    X(testLaunchClientReconnect);
+    X(testLaunchClientReplyBeforeClose);
+#undef X
+}
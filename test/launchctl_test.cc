@@ -15,6 +15,7 @@
  */
 
 #include <future>
+#include <sstream>
 #include <thread>
 
 #include "common.hpp"
@@ -53,7 +54,7 @@ void testKill() {
         return 0;
     };
     std::future<int> fp = async(std::launch::async, cb);
-    mgr.handleEvent();
+    testutil::serveUntilReady(mgr, fp);
     assert(fp.get() == 0);
 }
 
@@ -80,7 +81,7 @@ void testVersion() {
         return 0;
     };
     std::future<int> fp = async(std::launch::async, cb);
-    mgr.handleEvent();
+    testutil::serveUntilReady(mgr, fp);
     assert(fp.get() == 0);
 }
 
@@ -111,7 +112,7 @@ void testLoadAndUnload() {
         return 0;
     };
     std::future<int> fp = async(std::launch::async, cb);
-    ctx.mgr.handleEvent();
+    testutil::serveUntilReady(ctx.mgr, fp);
     assert(ctx.mgr.jobExists(label));
     assert(fp.get() == 0);
 
@@ -123,10 +124,12 @@ void testLoadAndUnload() {
         return 0;
     };
     std::future<int> fp2 = async(std::launch::async, cb2);
-    ctx.mgr.handleEvent();
-    ctx.mgr.handleEvent();
-    ctx.mgr.handleEvent();
+    testutil::serveUntilReady(ctx.mgr, fp2);
     assert(fp2.get() == 0);
+    // Unloaded jobs are removed after the reply
+    for (int i = 0; i < 10 && ctx.mgr.jobExists(label); i++) {
+        ctx.mgr.handleEvent(std::chrono::milliseconds{100});
+    }
     if (ctx.mgr.jobExists(label)) {
         log_error("unexpected state");
         ctx.mgr.dumpJob(label);
@@ -142,7 +145,7 @@ void forceTestLoad(const std::string &path, Manager &mgr) {
                                     client.invokeMethod("load", args, mgr.getDomain());
                                     return 0;
                                 });
-    mgr.handleEvent();
+    testutil::serveUntilReady(mgr, fp);
     assert(fp.get() == 0);
 }
 
@@ -162,7 +165,7 @@ void testDisable() {
             client.invokeMethod("disable", args, ctx.mgr.getDomain());
             return 0;
         });
-    ctx.mgr.handleEvent();
+    testutil::serveUntilReady(ctx.mgr, fp);
     assert(fp.get() == 0);
     ctx.mgr.loadManifest(path);
     assert(!ctx.mgr.jobExists(label));
@@ -193,7 +196,7 @@ void testEnable() {
         return 0;
     };
     std::future<int> fp = async(std::launch::async, cb);
-    mgr.handleEvent();
+    testutil::serveUntilReady(mgr, fp);
     assert(fp.get() == 0);
     assert(mgr.jobExists(label));
     mgr.dumpJob(label);
@@ -212,13 +215,73 @@ void testSubmit() {
         return 0;
     };
     std::future<int> fp = async(std::launch::async, cb);
-    mgr.handleEvent();
+    testutil::serveUntilReady(mgr, fp);
     assert(fp.get() == 0);
     assert(mgr.jobExists(label));
 }
 
+void testBatch() {
+    TestContext ctx;
+    ctx.mgr.startRunning();
+    std::istringstream input{R"(
+        # Comments and blank lines are skipped
+        version
+
+        submit -l testBatch -- /bin/sh -c 'exit 0'
+        no-such-subcommand
+        stop "no such job"
+        list
+    )"};
+    auto cb = [&ctx, &input]() -> int {
+        RpcClient client;
+        return client.runBatch(input, ctx.mgr.getDomain());
+    };
+    std::future<int> fp = async(std::launch::async, cb);
+    testutil::serveUntilReady(ctx.mgr, fp);
+    // The unknown subcommand and the unknown job
+    assert(fp.get() == 2);
+    assert(ctx.mgr.jobExists(Label{"testBatch"}));
+}
+
+void testWatch() {
+    TestContext ctx;
+    ctx.loadTemporaryManifest(
+        {{"Label", "testWatch"},
+         {"ProgramArguments", {"/bin/sh", "-c", "exit 0"}}});
+    ctx.mgr.startRunning();
+    auto cb = [&ctx]() -> int {
+        RpcClient client;
+        std::vector<std::string> args = {"testWatch"};
+        client.invokeMethod("watch", args, ctx.mgr.getDomain());
+        return 0;
+    };
+    std::future<int> fp = async(std::launch::async, cb);
+    while (ctx.mgr.getJobEvents().empty()) {
+        ctx.mgr.handleEvent(std::chrono::milliseconds{10});
+    }
+    assert(ctx.mgr.requestStart(Label{"testWatch"}));
+    for (int i = 0; i < 20; i++) {
+        ctx.mgr.handleEvent(std::chrono::milliseconds{10});
+    }
+    // The stream ends when the server goes away
+    ctx.mgr.getRpcServer().stop();
+    assert(fp.get() == 0);
+}
+
+void testSubmitPassingStdio() {
+    TestContext ctx;
+    ctx.mgr.startRunning();
+    std::vector<std::string> args = {"-l", "testSubmitPassingStdio", "-E",
+                                     "--", "/bin/sh", "-c", "exit 0"};
+    assert(ctx.runLaunchctl("submit", args) == 0);
+    assert(ctx.mgr.jobExists(Label{"testSubmitPassingStdio"}));
+}
+
 void addLaunchctlTests(TestRunner &runner) {
 #define X(y) runner.addTest("" #y, y)
+    X(testSubmitPassingStdio);
+    X(testWatch);
+    X(testBatch);
     X(testSubmit);
     X(testDisable);
     X(testEnable);
@@ -17,10 +17,22 @@
 #include "common.hpp"
 #include "../src/log.h"
 
+extern void addBootSchedulerTests(TestRunner &runner);
+extern void addChannelTests(TestRunner &runner);
+extern void addDomainHostTests(TestRunner &runner);
+extern void addJobEventsTests(TestRunner &runner);
+extern void addJobTableTests(TestRunner &runner);
+extern void addLaunchClientTests(TestRunner &runner);
 extern void addLaunchctlTests(TestRunner &runner);
 extern void addManagerTests(TestRunner &runner);
 extern void addManifestTests(TestRunner &runner);
+extern void addNotifyBrokerTests(TestRunner &runner);
+extern void addOperationTests(TestRunner &runner);
+extern void addRpcServerTests(TestRunner &runner);
+extern void addRunHistoryTests(TestRunner &runner);
+extern void addSlabTests(TestRunner &runner);
 extern void addStateFileTests(TestRunner &runner);
+extern void addStatusPageTests(TestRunner &runner);
 
 void test_usage() {
     std::cout << "TODO: usage" << std::endl;
@@ -46,10 +58,22 @@ int test_main(int argc, char *argv[]) {
 
     TestRunner runner;
     std::unordered_map<std::string, std::function<void(TestRunner &)>> tests = {
+            {"BootScheduler", addBootSchedulerTests},
+            {"Channel", addChannelTests},
+            {"DomainHost", addDomainHostTests},
+            {"JobEvents", addJobEventsTests},
+            {"JobTable", addJobTableTests},
+            {"LaunchClient", addLaunchClientTests},
             {"Launchctl", addLaunchctlTests},
             {"Manager", addManagerTests},
             {"Manifest", addManifestTests},
+            {"NotifyBroker", addNotifyBrokerTests},
+            {"Operation", addOperationTests},
+            {"RpcServer", addRpcServerTests},
+            {"RunHistory", addRunHistoryTests},
+            {"Slab", addSlabTests},
             {"StateFile", addStateFileTests},
+            {"StatusPage", addStatusPageTests},
     };
     for (const auto &[key, func] : tests) {
         auto& vec = positional_args;
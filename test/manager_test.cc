@@ -47,8 +47,8 @@ using namespace std;
 Manager getManager() {
     Domain domain{DomainType::User, TMPDIR};
     auto statefile = domain.statedir / "state.json";
-    if (std::filesystem::exists(statefile)) {
-        std::filesystem::remove(statefile);
+    for (const auto &suffix : {"", ".journal", ".journal.old"}) {
+        std::filesystem::remove(statefile.string() + suffix);
     }
     return Manager{domain};
 }
@@ -65,9 +65,22 @@ struct ManagerTest {
     static void testKillJobBySignal();
     static void testUnload();
     static void testUnloadAllJobs();
+    static void testForceUnload();
     static void testUnloadWithOverrideDisabled();
     static void testAbandonProcessGroup();
     static void testEnvironmentVar();
+    static void testDependencyWaves();
+    static void testDependencyCycle();
+    static void testRequiresMissing();
+    static void testBootQueue();
+    static void testTemplateInstances();
+    static void testInherits();
+    static void testHeapUsage();
+    static void testLoadUnloadChurn();
+    static void testUnloadByPath();
+    static void testReexecImage();
+    static void testReexecNotifications();
+    static void testNotificationConditions();
 };
 
 //! Verify that ThrottleInterval works
@@ -90,13 +103,13 @@ void ManagerTest::testThrottleInterval() {
     mgr.startRunning();
     auto &job = mgr.getJob({"test.job1"});
     assert(job.fsm.state() == Job::States::Running);
-    pid_t old_pid = job.pid;
+    pid_t old_pid = job.pid();
     assert(mgr.handleEvent());      // event: reap the PID of the job
     assert(job.fsm.state() == Job::States::Waiting);
     sleep(2);
     assert(mgr.handleEvent());      // event: timer expires due to ThrottleInterval, job restarts
     assert(job.fsm.state() == Job::States::Running);
-    assert((job.pid != old_pid) != 0);
+    assert((job.pid() != old_pid) != 0);
 }
 
 void ManagerTest::testKeepaliveAfterExit() {
@@ -116,9 +129,9 @@ void ManagerTest::testKeepaliveAfterExit() {
     mgr.startRunning();
     auto &job = mgr.getJob({"test.job1"});
     assert(job.fsm.state() == Job::States::Running);
-    pid_t old_pid = job.pid;
+    pid_t old_pid = job.pid();
     mgr.handleEvent();
-    assert(old_pid != job.pid);
+    assert(old_pid != job.pid());
 }
 
 void ManagerTest::testKeepaliveAfterSignal() {
@@ -139,12 +152,12 @@ void ManagerTest::testKeepaliveAfterSignal() {
     mgr.startRunning();
     auto &job = mgr.getJob({"test.job1"});
     assert(job.fsm.state() == Job::States::Running);
-    pid_t old_pid = job.pid;
+    pid_t old_pid = job.pid();
     assert(mgr.killJob({"test.job1"}, "SIGKILL"));
     mgr.handleEvent(std::chrono::milliseconds{100});
     mgr.handleEvent(std::chrono::milliseconds{100});
     assert(job.fsm.state() == Job::States::Running);
-    assert(old_pid != job.pid);
+    assert(old_pid != job.pid());
 }
 
 void ManagerTest::testKillJobBySignal() {
@@ -167,8 +180,8 @@ void ManagerTest::testKillJobBySignal() {
     mgr.handleEvent();
     auto &job = mgr.getJob(label);
     assert(job.fsm.state() == Job::States::Exited);
-    assert(job.last_exit_status == -1);
-    assert(job.term_signal == 9);
+    assert(job.last_exit_status() == -1);
+    assert(job.term_signal() == 9);
 }
 
 
@@ -207,6 +220,31 @@ void ManagerTest::testUnloadAllJobs() {
     assert(ctx.mgr.unloadAllJobs());
 }
 
+// A forced unload is reported like any other change of state
+void ManagerTest::testForceUnload() {
+    auto mgr = getManager();
+    Label label{"test.force"};
+    std::string path = "/dev/null";
+    mgr.loadManifest(
+        json{{"Label", label.str()},
+             {"ProgramArguments", json::array({"/bin/sleep", "30"})},
+             {"RunAtLoad", true}},
+        path);
+    mgr.startRunning();
+    auto &job = mgr.getJob(label);
+    assert(job.fsm.state() == Job::States::Running);
+    bool ok;
+    const auto id =
+        mgr.requestUnload([&] { return mgr.unloadJob(label); }, ok);
+    assert(ok);
+    assert(mgr.operations.find(id)->status == Operation::Status::Pending);
+
+    job.forceUnloadJob();
+    assert(job.table.states[job.id] ==
+           static_cast<uint8_t>(Job::States::Unloaded));
+    assert(mgr.operations.find(id)->status == Operation::Status::Succeeded);
+}
+
 void ManagerTest::testUnloadWithOverrideDisabled() {
     auto mgr = getManager();
     Label label{"testUnloadWithOverrideDisabled"};
@@ -283,7 +321,404 @@ void ManagerTest::testEnvironmentVar() {
     auto &job = mgr.getJob(label);
     mgr.handleEvent();
     assert(job.fsm.state() == Job::States::Exited);
-    assert(job.last_exit_status == 0);
+    assert(job.last_exit_status() == 0);
+}
+
+// Ensure that jobs are started in dependency order
+void ManagerTest::testDependencyWaves() {
+    auto mgr = getManager();
+    std::string path = "/dev/null";
+    mgr.loadManifest(json{{"Label", "test.c"},
+                          {"ProgramArguments", json::array({"/bin/sh"})},
+                          {"After", json::array({"test.b"})},
+                          {"Requires", json::array({"test.a"})}},
+                     path);
+    mgr.loadManifest(json{{"Label", "test.b"},
+                          {"ProgramArguments", json::array({"/bin/sh"})},
+                          {"After", json::array({"test.a"})}},
+                     path);
+    mgr.loadManifest(json{{"Label", "test.a"},
+                          {"ProgramArguments", json::array({"/bin/sh"})}},
+                     path);
+    mgr.loadManifest(json{{"Label", "test.d"},
+                          {"ProgramArguments", json::array({"/bin/sh"})},
+                          {"After", json::array({"test.missing"})}},
+                     path);
+    auto waves = mgr.planStartWaves({"test.c", "test.b", "test.a", "test.d"});
+    assert(waves.size() == 3);
+    assert((waves[0] == std::vector<std::string>{"test.a", "test.d"}));
+    assert((waves[1] == std::vector<std::string>{"test.b"}));
+    assert((waves[2] == std::vector<std::string>{"test.c"}));
+}
+
+// Ensure that a manifest that would create a cycle is rejected
+void ManagerTest::testDependencyCycle() {
+    auto mgr = getManager();
+    std::string path = "/dev/null";
+    assert(mgr.loadManifest(json{{"Label", "test.a"},
+                                 {"ProgramArguments", json::array({"/bin/sh"})},
+                                 {"After", json::array({"test.b"})}},
+                            path));
+    assert(mgr.loadManifest(json{{"Label", "test.b"},
+                                 {"ProgramArguments", json::array({"/bin/sh"})},
+                                 {"Requires", json::array({"test.c"})}},
+                            path));
+    assert(!mgr.loadManifest(json{{"Label", "test.c"},
+                                  {"ProgramArguments", json::array({"/bin/sh"})},
+                                  {"After", json::array({"test.a"})}},
+                             path));
+    assert(!mgr.loadManifest(json{{"Label", "test.d"},
+                                  {"ProgramArguments", json::array({"/bin/sh"})},
+                                  {"After", json::array({"test.d"})}},
+                             path));
+}
+
+// Ensure that a job is not started if a required job is not loaded
+void ManagerTest::testRequiresMissing() {
+    auto mgr = getManager();
+    Label label{"testRequiresMissing"};
+    std::string path = "/dev/null";
+    mgr.loadManifest(json{{"Label", label.str()},
+                          {"ProgramArguments", json::array({"/bin/sh"})},
+                          {"RunAtLoad", true},
+                          {"Requires", json::array({"test.missing"})}},
+                     path);
+    mgr.startRunning();
+    auto &job = mgr.getJob(label);
+    assert(job.fsm.state() == Job::States::Loaded);
+    assert(job.pid() == 0);
+}
+
+// Ensure that a large number of jobs are bootstrapped over several batches
+void ManagerTest::testBootQueue() {
+    auto mgr = getManager();
+    std::string path = "/dev/null";
+    const size_t count = BootScheduler::initial_batch_limit * 3;
+    for (size_t i = 0; i < count; i++) {
+        json manifest = {{"Label", "test.job" + std::to_string(i)},
+                         {"ProgramArguments", json::array({"/bin/sh"})}};
+        if (i == count - 1) {
+            manifest["Priority"] = "critical";
+        }
+        assert(mgr.loadManifest(manifest, path));
+    }
+    mgr.startRunning();
+    // The critical job was in the first batch
+    assert(mgr.getBootStats().critical_ready);
+    assert(mgr.getJob({"test.job" + std::to_string(count - 1)}).fsm.state() ==
+           Job::States::Loaded);
+    while (!mgr.getBootStats().finished) {
+        assert(mgr.boot_timer_id);
+        mgr.handleEvent(std::chrono::milliseconds{100});
+    }
+    assert(mgr.getBootStats().jobs_started == count);
+    assert(!mgr.boot_timer_id);
+}
+
+// Ensure that instances of a template share its manifest and expand %i
+void ManagerTest::testTemplateInstances() {
+    auto mgr = getManager();
+    std::string path = "/dev/null";
+    Label template_label{"test.worker@"};
+    Label label{"test.worker@42"};
+    assert(mgr.loadManifest(
+        json{{"Label", template_label.str()},
+             {"EnvironmentVariables", json::object({{"INSTANCE", "%i"}})},
+             {"StandardOutPath", tmpdir + "/test.worker.%i.log"},
+             {"ProgramArguments",
+              json::array({"/bin/sh", "-e", "-c",
+                           "test \"$INSTANCE\" = 42 && test \"$0\" = w%i",
+                           "w%i"})},
+             {"RunAtLoad", true}},
+        path));
+    assert(mgr.templateExists(template_label));
+    assert(!mgr.jobExists(template_label));
+    assert(!mgr.instantiateJob({"test.missing@1"}));
+    assert(!mgr.instantiateJob({"test.worker@"}));
+    assert(mgr.instantiateJob(label));
+    assert(!mgr.instantiateJob(label));
+    assert(mgr.instantiateJob({"test.worker@43"}));
+    mgr.startRunning();
+
+    auto &job = mgr.getJob(label);
+    auto &job2 = mgr.getJob({"test.worker@43"});
+    assert(job.shared_manifest == job2.shared_manifest);
+    assert(job.shared_manifest == mgr.templates.at(template_label.str()));
+    while (job.fsm.state() == Job::States::Running ||
+           job2.fsm.state() == Job::States::Running) {
+        mgr.handleEvent(std::chrono::milliseconds{500});
+    }
+    assert(job.last_exit_status() == 0);
+    assert(job2.last_exit_status() != 0);
+    assert(std::filesystem::exists(tmpdir + "/test.worker.42.log"));
+
+    // The template cannot be removed while instances are loaded
+    assert(!mgr.unloadJob(template_label));
+    assert(mgr.unloadJob(label));
+    assert(mgr.unloadJob(Label{"test.worker@43"}));
+    while (mgr.jobExists(label) || mgr.jobExists({"test.worker@43"})) {
+        mgr.handleEvent(std::chrono::milliseconds{500});
+    }
+    assert(mgr.unloadJob(template_label));
+    assert(!mgr.templateExists(template_label));
+}
+
+// Ensure that manifests in a directory share a defaults document
+void ManagerTest::testInherits() {
+    auto mgr = getManager();
+    auto dir = std::filesystem::path{tmpdir} / "testInherits";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "defaults");
+    {
+        std::ofstream ofs{dir / "defaults" / "base.json"};
+        ofs << json{{"EnvironmentVariables", json::object({{"FOO", "BAR"}})},
+                    {"Priority", "background"}};
+    }
+    for (const auto &label : {"test.a", "test.b"}) {
+        std::ofstream ofs{dir / (std::string{label} + ".json")};
+        ofs << json{{"Label", label},
+                    {"Inherits", "base"},
+                    {"ProgramArguments", json::array({"/bin/sh"})}};
+    }
+    mgr.loadAllManifests(dir);
+    assert(mgr.manifest_cache.defaults().size() == 1);
+    for (const auto &label : {"test.a", "test.b"}) {
+        const Manifest *manifest = mgr.findManifest(label);
+        assert(manifest);
+        assert(manifest->priority == Manifest::Priority::Background);
+        assert(manifest->environment_variables.at("FOO") == "BAR");
+    }
+}
+
+// Ensure that strings shared by many manifests are only stored once
+void ManagerTest::testHeapUsage() {
+    auto mgr = getManager();
+    std::string path = "/dev/null";
+    json env = json::object();
+    for (int i = 0; i < 20; i++) {
+        env["VARIABLE_" + std::to_string(i)] = "/usr/share/testHeapUsage";
+    }
+    auto load = [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            assert(mgr.loadManifest(
+                json{{"Label", "test.job" + std::to_string(i)},
+                     {"UserName", "nobody"},
+                     {"EnvironmentVariables", env},
+                     {"StandardOutPath", "/var/log/testHeapUsage.log"},
+                     {"ProgramArguments",
+                      json::array({"/usr/bin/testHeapUsage", "--verbose"})}},
+                path));
+        }
+    };
+    load(0, 100);
+    const size_t pool_size = StringPool::global().size();
+    load(100, 5000);
+    assert(StringPool::global().size() == pool_size);
+
+    auto usage = mgr.getHeapUsage();
+    assert(usage.jobs == 5000);
+    log_notice("heap usage: %zu bytes per job (%zu in the string pool)",
+               usage.perJob(), usage.string_pool_bytes);
+    const auto &manifest = mgr.pending_jobs.at("test.job1")->manifest;
+    assert(manifest.environment_variables.size() == 20);
+    assert(manifest.environment_variables.at("VARIABLE_0") ==
+           "/usr/share/testHeapUsage");
+    assert(manifest.environment_variables.begin()->first == "VARIABLE_0");
+}
+
+//! The resident set size of this process, in kilobytes
+static long residentKilobytes() {
+    std::ifstream ifs{"/proc/self/statm"};
+    long size = 0, resident = 0;
+    ifs >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Ensure that repeatedly loading and unloading a job reuses the same memory
+void ManagerTest::testLoadUnloadChurn() {
+    auto mgr = getManager();
+    mgr.startRunning();
+    std::string path = "/dev/null";
+    Label label{"test.churn"};
+    int generation = 0;
+    auto cycle = [&] {
+        // A value that changes on every reload must not stay in the pool
+        const auto value = "BAR" + std::to_string(generation++);
+        assert(mgr.loadManifest(
+            json{{"Label", label.str()},
+                 {"EnvironmentVariables", json::object({{"FOO", value}})},
+                 {"ProgramArguments", json::array({"/bin/sh", "-c", "true"})}},
+            path));
+        mgr.startRunning();
+        assert(mgr.unloadJob(label));
+        while (mgr.jobExists(label)) {
+            mgr.handleEvent(std::chrono::milliseconds{0});
+        }
+    };
+    cycle();
+    const size_t pool_size = StringPool::global().size();
+    const auto &job_slab = SlabPool::forSize(sizeof(Job));
+    const size_t capacity = job_slab.capacity();
+    const long rss = residentKilobytes();
+    const int cycles = 2000;
+    for (int i = 0; i < cycles; i++) {
+        cycle();
+    }
+    assert(job_slab.capacity() == capacity);
+    assert(job_slab.inUse() == 0);
+    assert(StringPool::global().size() == pool_size);
+    log_notice("RSS changed by %ld KiB after %d load/unload cycles",
+               residentKilobytes() - rss, cycles);
+}
+
+// Ensure that jobs can be unloaded by path without reading the manifests
+void ManagerTest::testUnloadByPath() {
+    auto mgr = getManager();
+    auto dir = std::filesystem::path{tmpdir} / "testUnloadByPath";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    for (const auto &label : {"test.a", "test.b", "test.c"}) {
+        std::ofstream ofs{dir / (std::string{label} + ".json")};
+        ofs << json{{"Label", label},
+                    {"ProgramArguments", json::array({"/bin/sh"})}};
+    }
+    mgr.loadAllManifests(dir);
+    mgr.startRunning();
+    assert(mgr.path_index.size() == 3);
+
+    // The manifests are no longer needed
+    std::filesystem::remove_all(dir);
+    assert(mgr.unloadJob(dir / "." / "test.a.json"));
+    assert(!mgr.unloadJob(dir / "test.missing.json"));
+    assert(mgr.unloadJob(dir));
+    while (!mgr.jobs.empty()) {
+        mgr.handleEvent(std::chrono::milliseconds{100});
+    }
+    assert(mgr.path_index.empty());
+    assert(!mgr.unloadJob(dir));
+}
+
+//! Verify that a manager can take over the jobs of a previous manager
+void ManagerTest::testReexecImage() {
+    json image;
+    pid_t pid;
+    std::string path = "/dev/null";
+    {
+        auto mgr = getManager();
+        mgr.loadManifest(json::parse(R"(
+            {
+              "Label": "test.running",
+              "ProgramArguments": ["/bin/sleep", "9999"],
+              "RunAtLoad": true
+            }
+        )"), path);
+        mgr.loadManifest(json::parse(R"(
+            {
+              "Label": "test.periodic",
+              "Program": "/bin/true",
+              "StartInterval": 3600
+            }
+        )"), path);
+        mgr.startRunning();
+        pid = mgr.getJob({"test.running"}).pid();
+        assert(pid > 0);
+        assert(mgr.getJob({"test.periodic"}).timer_id());
+        image = mgr.saveImage();
+        assert(image.contains("RpcFd"));
+        // Forget the jobs, as if the process had called execve(2)
+        mgr.jobs.clear();
+    }
+
+    auto mgr = Manager{Manager::domainFromImage(image)};
+    mgr.restoreImage(image);
+    auto &running = mgr.getJob({"test.running"});
+    assert(running.pid() == pid);
+    assert(running.fsm.state() == Job::States::Running);
+    auto &periodic = mgr.getJob({"test.periodic"});
+    assert(periodic.timer_id());
+
+    // The listening socket was inherited
+    Channel client;
+    assert(client.connect(mgr.domain.statedir / "rpc.sock") == 0);
+
+    assert(mgr.killJob({"test.running"}, "SIGKILL"));
+    // Accepting the client is a separate event, which may come first
+    for (int i = 0; i < 10 && running.fsm.state() != Job::States::Exited;
+         i++) {
+        mgr.handleEvent(std::chrono::milliseconds{100});
+    }
+    assert(running.fsm.state() == Job::States::Exited);
+    assert(running.term_signal() == 9);
+}
+
+//! A job that posts notifications is restarted after a re-exec, so that it
+//! attaches to the new table
+void ManagerTest::testReexecNotifications() {
+    json image;
+    pid_t pid;
+    std::string path = "/dev/null";
+    {
+        auto mgr = getManager();
+        mgr.loadManifest(json::parse(R"(
+            {
+              "Label": "test.poster",
+              "ProgramArguments": ["/bin/sleep", "9999"],
+              "RunAtLoad": true,
+              "Notifications": {"Send": ["test.poster.status"]}
+            }
+        )"), path);
+        mgr.startRunning();
+        pid = mgr.getJob({"test.poster"}).pid();
+        assert(pid > 0);
+        image = mgr.saveImage();
+        mgr.jobs.clear();
+    }
+
+    auto mgr = Manager{Manager::domainFromImage(image)};
+    mgr.restoreImage(image);
+    auto &job = mgr.getJob({"test.poster"});
+    for (int i = 0; i < 20 && (job.pid() == pid || job.pid() == 0); i++) {
+        mgr.handleEvent(std::chrono::milliseconds{100});
+    }
+    assert(job.fsm.state() == Job::States::Running);
+    assert(job.pid() > 0 && job.pid() != pid);
+    assert(job.term_signal() == SIGTERM);
+    assert(mgr.killJob({"test.poster"}, "SIGKILL"));
+}
+
+//! LaunchAfter holds a job back until its conditions hold, and ExitIf stops
+//! it
+void ManagerTest::testNotificationConditions() {
+    auto mgr = getManager();
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.waiter",
+          "ProgramArguments": ["/bin/sleep", "30"],
+          "RunAtLoad": true,
+          "Notifications": {
+            "Receive": ["test.peer.status"],
+            "LaunchAfter": ["test.peer.status=running"],
+            "ExitIf": ["test.peer.status=stopped"]
+          }
+        }
+    )"), path);
+    mgr.startRunning();
+    auto &job = mgr.getJob({"test.waiter"});
+    assert(job.fsm.state() == Job::States::Loaded);
+
+    auto &broker = mgr.getNotifyBroker();
+    assert(broker.post("test.peer.status", "starting"));
+    assert(job.fsm.state() == Job::States::Loaded);
+    assert(broker.post("test.peer.status", "running"));
+    assert(job.fsm.state() == Job::States::Running && job.pid() > 0);
+
+    assert(broker.post("test.peer.status", "stopped"));
+    for (int i = 0; i < 50 && job.fsm.state() != Job::States::Exited; i++) {
+        mgr.handleEvent(std::chrono::milliseconds{100});
+    }
+    assert(job.fsm.state() == Job::States::Exited);
+    assert(job.term_signal() == SIGTERM);
 }
 
 void addManagerTests(TestRunner &runner) {
@@ -296,6 +731,19 @@ void addManagerTests(TestRunner &runner) {
     X(testKillJobBySignal);
     X(testEnvironmentVar);
     X(testUnloadAllJobs);
+    X(testForceUnload);
+    X(testDependencyWaves);
+    X(testDependencyCycle);
+    X(testRequiresMissing);
+    X(testBootQueue);
+    X(testTemplateInstances);
+    X(testInherits);
+    X(testHeapUsage);
+    X(testLoadUnloadChurn);
+    X(testUnloadByPath);
+    X(testReexecImage);
+    X(testReexecNotifications);
+    X(testNotificationConditions);
     //X(testAbandonProcessGroup);
 #undef X
 }
@@ -15,10 +15,12 @@
  */
 
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 
 #include "common.hpp"
 #include "manifest.h"
+#include "manifest_cache.h"
 #include "log.h"
 
 using namespace std;
@@ -60,7 +62,115 @@ void testParseUmaskFromInt() {
     assert(m.umask.value() == 493);
 }
 
+void testParseNotifications() {
+    json manifest = json{
+            {"Label", "testParseNotifications"},
+            {"Program", "/bin/cat"},
+            {"Notifications", {
+                    {"Send", {"foo.status"}},
+                    {"Receive", {"bar.status"}},
+                    {"LaunchAfter", {"bar.status=running"}},
+                    {"ExitIf", {"bar.status="}}}}
+    };
+    Manifest m;
+    manifest::from_json(manifest, m);
+    assert(m.notifications.send.at(0) == "foo.status");
+    assert(m.notifications.launch_after.at(0).second == "running");
+    assert(m.notifications.exit_if.at(0).second == "");
+    json out;
+    manifest::to_json(out, m);
+    assert(out.at("Notifications") == manifest.at("Notifications"));
+
+    bool thrown = false;
+    manifest["Notifications"]["ExitIf"] = {"bar.status"};
+    try {
+        manifest::from_json(manifest, m);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void testApplyDefaults() {
+    json defaults = json{
+            {"UserName", "nobody"},
+            {"StandardOutPath", "/var/log/service.log"},
+            {"EnvironmentVariables", json::object({{"A", "1"}, {"B", "2"}})}
+    };
+    json manifest = json{
+            {"Label", "testApplyDefaults"},
+            {"Inherits", "base"},
+            {"Program", "/bin/cat"},
+            {"StandardOutPath", "/dev/null"},
+            {"EnvironmentVariables", json::object({{"B", "3"}})}
+    };
+    Manifest m = manifest::applyDefaults(manifest, defaults).get<Manifest>();
+    assert(m.user_name.value() == "nobody");
+    assert(m.stdout_path == "/dev/null");
+    assert(m.environment_variables.at("A") == "1");
+    assert(m.environment_variables.at("B") == "3");
+}
+
+void testDefaultsCache() {
+    auto dir = filesystem::path{tmpdir} / "defaults";
+    filesystem::create_directories(dir);
+    {
+        std::ofstream ofs{dir / "testDefaultsCache.json"};
+        ofs << json{{"UserName", "nobody"}};
+    }
+    manifest::DefaultsCache cache;
+    std::vector<filesystem::path> search_paths{"/nonexistent", tmpdir};
+    auto doc1 = cache.get("testDefaultsCache", search_paths);
+    auto doc2 = cache.get("testDefaultsCache", search_paths);
+    assert(doc1 == doc2);
+    assert(cache.size() == 1);
+    assert(doc1->at("UserName") == "nobody");
+
+    bool thrown = false;
+    try {
+        (void)cache.get("../testDefaultsCache", search_paths);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void testManifestCache() {
+    auto path = filesystem::path{tmpdir} / "testManifestCache.json";
+    auto write = [&path](const std::string &program) {
+        std::ofstream ofs{path};
+        ofs << json{{"Label", "test.cache"}, {"Program", program}};
+    };
+    write("/bin/true");
+    ManifestCache cache;
+    std::vector<std::string> load_paths{"/nonexistent"};
+    auto m1 = cache.get(path, load_paths);
+    auto m2 = cache.get(path, load_paths);
+    assert(m1 == m2);
+    assert(cache.size() == 1);
+
+    // Domains with other load paths do not share the manifest
+    auto other = cache.get(path, {"/elsewhere"});
+    assert(other != m1);
+    assert(cache.size() == 2);
+    other.reset();
+    assert(cache.size() == 1);
+
+    // A changed file is parsed again
+    write("/bin/false");
+    filesystem::last_write_time(
+        path, filesystem::last_write_time(path) + std::chrono::seconds{1});
+    auto m3 = cache.get(path, load_paths);
+    assert(m3 != m1);
+    assert(m3->program.value() == "/bin/false");
+    assert(m1->program.value() == "/bin/true");
+}
+
 void addManifestTests(TestRunner &runner) {
     runner.addTest("testParseUmaskFromStr", testParseUmaskFromStr);
     runner.addTest("testParseUmaskFromInt", testParseUmaskFromInt);
+    runner.addTest("testParseNotifications", testParseNotifications);
+    runner.addTest("testApplyDefaults", testApplyDefaults);
+    runner.addTest("testDefaultsCache", testDefaultsCache);
+    runner.addTest("testManifestCache", testManifestCache);
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "launch.h"
+#include "notify_broker.h"
+
+static bool readable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+// The library functions in launch.h talk to a broker over the endpoint that
+// a job would inherit. The library keeps its state for the life of the
+// process, so this is the only test that uses it.
+void testNotifyBrokerLibrary() {
+    kq::EventManager eventmgr;
+    NotifyBroker broker{eventmgr};
+    const auto path = std::filesystem::path{TMPDIR} / "notify_test";
+    // Start small, to make the table grow under the library's mapping
+    broker.open(path, 1);
+    assert(broker.post("test.other", "up"));
+
+    const auto *endpoint =
+        broker.attach("test.notify", {"test.status"}, {"test.other"});
+    assert(endpoint);
+    for (const auto &var : endpoint->environ) {
+        const auto eq = var.find('=');
+        setenv(var.substr(0, eq).c_str(), var.substr(eq + 1).c_str(), 1);
+    }
+
+    // The state that was posted before the job started is reported once
+    notify_state_t changes[2];
+    assert(notify_check(changes, 2) == 1);
+    assert(strcmp(changes[0]->ns_name, "test.other") == 0);
+    assert(strcmp(changes[0]->ns_state, "up") == 0);
+    assert(changes[0]->ns_len == 2);
+    assert(notify_check(changes, 2) == 0);
+
+    char running[] = "running";
+    assert(notify_post("test.status", running, strlen(running)) == 0);
+    eventmgr.waitForEvent(std::chrono::milliseconds{1000});
+    assert(broker.state("test.status") == "running");
+
+    // Names that are not in the Send list are ignored
+    assert(notify_post("test.other", running, strlen(running)) == 0);
+    eventmgr.waitForEvent(std::chrono::milliseconds{1000});
+    assert(broker.state("test.other") == "up");
+    char huge[NOTIFY_STATE_MAX + 1] = {};
+    assert(notify_post("test.status", huge, sizeof(huge)) < 0 &&
+           errno == EINVAL);
+
+    // A post wakes up the receivers, until they check
+    const int fd = notify_get_fd();
+    assert(fd >= 0 && !readable(fd));
+    assert(broker.post("test.other", "down"));
+    assert(broker.capacity() > 1);
+    assert(readable(fd));
+    assert(notify_check(changes, 2) == 1);
+    assert(strcmp(changes[0]->ns_state, "down") == 0);
+    assert(!readable(fd));
+
+    // Changes made while suspended are reported after resuming
+    assert(notify_suspend("test.missing") < 0 && errno == ENOENT);
+    assert(notify_suspend("test.other") == 0);
+    assert(broker.post("test.other", "up"));
+    assert(notify_check(changes, 2) == 0);
+    assert(notify_resume("test.other") == 0);
+    assert(notify_check(changes, 2) == 1);
+    assert(strcmp(changes[0]->ns_state, "up") == 0);
+
+    broker.detach("test.notify");
+    broker.close();
+    assert(!std::filesystem::exists(path));
+}
+
+void addNotifyBrokerTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testNotifyBrokerLibrary);
+#undef X
+}
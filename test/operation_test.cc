@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <chrono>
+#include <optional>
+
+#include <unistd.h>
+
+#include "common.hpp"
+#include "manager.h"
+
+namespace {
+
+//! Wait for operations, handling events until the reply arrives
+json waitFor(Manager &mgr, const std::vector<Operation::Id> &ids,
+             std::optional<std::chrono::milliseconds> timeout = std::nullopt) {
+    std::optional<json> reply;
+    mgr.getOperations().wait(ids, timeout,
+                             [&reply](const json &msg) { reply = msg; });
+    for (int i = 0; !reply && i < 100; i++) {
+        mgr.handleEvent(std::chrono::milliseconds{100});
+    }
+    assert(reply);
+    return *reply;
+}
+
+std::string statusOf(const json &reply, size_t index = 0) {
+    return reply["Operations"].at(index)["Status"].get<std::string>();
+}
+
+} // namespace
+
+// Start and stop report completion when the job reaches the target state
+void testOperationStartStop() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.op",
+          "ProgramArguments": ["/bin/sleep", "9999"]
+        }
+    )"), path);
+    mgr.startRunning();
+
+    assert(!mgr.requestStart(Label{"test.missing"}));
+    const auto start = mgr.requestStart(Label{"test.op"});
+    assert(start);
+    const auto *op = mgr.getOperations().find(*start);
+    assert(op && op->status == Operation::Status::Succeeded);
+
+    const auto stop = mgr.requestStop(Label{"test.op"});
+    assert(stop);
+    assert(mgr.getOperations().find(*stop)->status ==
+           Operation::Status::Pending);
+    auto reply = waitFor(mgr, {*start, *stop});
+    assert(!reply["error"]);
+    assert(!reply["TimedOut"]);
+    assert(statusOf(reply, 0) == "Succeeded");
+    assert(statusOf(reply, 1) == "Succeeded");
+    assert(mgr.getOperations().pendingCount() == 0);
+
+    // An exited job can be started again
+    const auto restart = mgr.requestStart(Label{"test.op"});
+    assert(statusOf(waitFor(mgr, {*restart})) == "Succeeded");
+
+    // Ids that were never issued are reported, not waited for
+    reply = waitFor(mgr, {12345});
+    assert(reply["error"]);
+    assert(statusOf(reply) == "Unknown");
+}
+
+// A client can give up waiting, and unloads complete when the job is gone
+void testOperationTimeoutAndUnload() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.stubborn",
+          "ProgramArguments": ["/bin/sh", "-c", "trap '' TERM; sleep 9999"],
+          "RunAtLoad": true
+        }
+    )"), path);
+    mgr.startRunning();
+    // Give the shell time to ignore SIGTERM
+    usleep(300000);
+
+    const auto stop = mgr.requestStop(Label{"test.stubborn"});
+    auto reply = waitFor(mgr, {*stop}, std::chrono::milliseconds{200});
+    assert(reply["TimedOut"]);
+    assert(statusOf(reply) == "Pending");
+    assert(reply["Operations"][0]["Waiting"][0] == "test.stubborn");
+
+    assert(mgr.killJob(Label{"test.stubborn"}, "SIGKILL"));
+    bool ok;
+    const auto unload =
+        mgr.requestUnload([&] { return mgr.unloadJob(Label{"test.stubborn"}); },
+                          ok);
+    assert(ok);
+    reply = waitFor(mgr, {*stop, unload});
+    assert(statusOf(reply, 0) == "Succeeded");
+    assert(statusOf(reply, 1) == "Succeeded");
+}
+
+// A job whose program cannot be run fails to start
+void testOperationSpawnFailed() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.nonexistent",
+          "ProgramArguments": ["/nonexistent/program"]
+        }
+    )"), path);
+    mgr.startRunning();
+
+    const auto start = mgr.requestStart(Label{"test.nonexistent"});
+    assert(start);
+    const auto reply = waitFor(mgr, {*start});
+    assert(statusOf(reply) == "Failed");
+    assert(reply["Operations"][0]["Error"] ==
+           "test.nonexistent could not be spawned");
+
+    // Stopping it does not wait for a process that never existed
+    const auto stop = mgr.requestStop(Label{"test.nonexistent"});
+    assert(statusOf(waitFor(mgr, {*stop})) == "Succeeded");
+}
+
+void addOperationTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testOperationStartStop);
+    X(testOperationSpawnFailed);
+    X(testOperationTimeoutAndUnload);
+#undef X
+}
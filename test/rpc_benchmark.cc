@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measures the latency and throughput of RPC requests. An in-process
+ * Manager serves a catalog of jobs on the main thread, while client threads
+ * send a weighted mix of requests through Channel, as launchctl does.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.hpp"
+#include "log.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    size_t clients = 4;
+    size_t jobs = 1000;
+    size_t requests = 1000;
+    //! The relative frequency of each request
+    std::map<std::string, double> mix = {
+        {"list", 1},  {"enable", 4}, {"disable", 4},
+        {"kill", 4},  {"load", 1},   {"submit", 1},
+    };
+    //! If true, each client keeps one connection open. Otherwise each
+    //! request connects, like launchctl does.
+    bool keep_alive = false;
+    Channel::Encoding encoding = Channel::Encoding::MessagePack;
+};
+
+//! Latencies in microseconds, by request
+using Samples = std::map<std::string, std::vector<int64_t>>;
+
+void usage() {
+    fprintf(stderr,
+            "usage: rpc_benchmark [-c clients] [-j jobs] [-n requests] [-k]\n"
+            "                     [-e json|cbor|msgpack] [-m list:1,kill:4,...] "
+            "[-v]\n");
+    exit(EXIT_FAILURE);
+}
+
+std::map<std::string, double> parseMix(const std::string &spec) {
+    static const std::vector<std::string> known = {
+        "list", "enable", "disable", "kill", "load", "submit"};
+    std::map<std::string, double> mix;
+    std::stringstream ss{spec};
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        const auto colon = item.find(':');
+        const auto name = item.substr(0, colon);
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            fprintf(stderr, "unknown request in mix: %s\n", name.c_str());
+            usage();
+        }
+        mix[name] = colon == std::string::npos
+                        ? 1.0
+                        : std::stod(item.substr(colon + 1));
+    }
+    return mix;
+}
+
+//! The arguments of a request. Manifests for load are written here, so
+//! that writing them is not measured.
+std::vector<std::string> makeArgs(const std::string &method, size_t client,
+                                  size_t seq, const Options &opts,
+                                  std::mt19937 &rng) {
+    const auto label = "bench." + std::to_string(rng() % opts.jobs);
+    const auto unique = std::to_string(client) + "." + std::to_string(seq);
+    if (method == "enable" || method == "disable") {
+        return {label};
+    } else if (method == "kill") {
+        // The jobs are not running, so this measures the request alone
+        return {"0", label};
+    } else if (method == "load") {
+        const json manifest = {{"Label", "bench.load." + unique},
+                               {"ProgramArguments", {"/bin/true"}}};
+        return {testutil::createManifest("bench.load." + unique, manifest)};
+    } else if (method == "submit") {
+        return {"-l", "bench.submit." + unique, "--", "/bin/true"};
+    }
+    return {};
+}
+
+void runClient(size_t client, const Options &opts, const Domain &domain,
+               Samples &samples) {
+    std::mt19937 rng{static_cast<std::mt19937::result_type>(client)};
+    std::vector<std::string> methods;
+    std::vector<double> weights;
+    for (const auto &[method, weight] : opts.mix) {
+        methods.push_back(method);
+        weights.push_back(weight);
+    }
+    std::discrete_distribution<size_t> pick{weights.begin(), weights.end()};
+    const auto socket_path = (domain.statedir / "rpc.sock").string();
+
+    std::unique_ptr<Channel> chan;
+    for (size_t seq = 0; seq < opts.requests; seq++) {
+        const auto &method = methods[pick(rng)];
+        auto args = makeArgs(method, client, seq, opts, rng);
+        const auto start = Clock::now();
+        if (!chan) {
+            chan = std::make_unique<Channel>();
+            if (chan->connect(socket_path) < 0) {
+                throw std::runtime_error("unable to connect");
+            }
+            chan->setEncoding(opts.encoding);
+        }
+        chan->writeMessage(RpcClient::makeRequest(method, args));
+        (void)chan->readMessage();
+        if (!opts.keep_alive) {
+            chan.reset();
+        }
+        const auto elapsed = Clock::now() - start;
+        samples[method].push_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+                .count());
+    }
+}
+
+int64_t percentile(const std::vector<int64_t> &sorted, double p) {
+    const auto index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void report(const Samples &samples, std::chrono::duration<double> wall) {
+    printf("%-8s %8s %10s %10s %10s\n", "Request", "Count", "p50(us)",
+           "p99(us)", "p999(us)");
+    std::vector<int64_t> all;
+    for (auto [method, latencies] : samples) {
+        std::sort(latencies.begin(), latencies.end());
+        printf("%-8s %8zu %10lld %10lld %10lld\n", method.c_str(),
+               latencies.size(),
+               static_cast<long long>(percentile(latencies, 0.5)),
+               static_cast<long long>(percentile(latencies, 0.99)),
+               static_cast<long long>(percentile(latencies, 0.999)));
+        all.insert(all.end(), latencies.begin(), latencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    printf("%-8s %8zu %10lld %10lld %10lld\n", "all", all.size(),
+           static_cast<long long>(percentile(all, 0.5)),
+           static_cast<long long>(percentile(all, 0.99)),
+           static_cast<long long>(percentile(all, 0.999)));
+    printf("%.0f requests per second\n", all.size() / wall.count());
+}
+
+} // namespace
+
+// Called by main() in unit test builds
+int test_main(int argc, char *argv[]) {
+    Options opts;
+    int c;
+    while ((c = getopt(argc, argv, "c:e:j:km:n:v")) != -1) {
+        switch (c) {
+        case 'c':
+            opts.clients = std::stoul(optarg);
+            break;
+        case 'e':
+            if (std::string{optarg} == "json") {
+                opts.encoding = Channel::Encoding::Json;
+            } else if (std::string{optarg} == "cbor") {
+                opts.encoding = Channel::Encoding::Cbor;
+            } else if (std::string{optarg} == "msgpack") {
+                opts.encoding = Channel::Encoding::MessagePack;
+            } else {
+                usage();
+            }
+            break;
+        case 'j':
+            opts.jobs = std::stoul(optarg);
+            break;
+        case 'k':
+            opts.keep_alive = true;
+            break;
+        case 'm':
+            opts.mix = parseMix(optarg);
+            break;
+        case 'n':
+            opts.requests = std::stoul(optarg);
+            break;
+        case 'v':
+            log_freopen(stderr);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (!opts.clients || !opts.jobs || !opts.requests || opts.mix.empty()) {
+        usage();
+    }
+
+    TestContext ctx;
+    const std::string path = "/dev/null";
+    for (size_t i = 0; i < opts.jobs; i++) {
+        const auto label = "bench." + std::to_string(i);
+        ctx.mgr.loadManifest(
+            json{{"Label", label}, {"ProgramArguments", {"/bin/true"}}}, path);
+    }
+    ctx.mgr.startRunning();
+    printf("%zu jobs, %zu clients, %zu requests each, %s connections\n",
+           opts.jobs, opts.clients, opts.requests,
+           opts.keep_alive ? "persistent" : "per-request");
+
+    std::vector<Samples> samples(opts.clients);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> running{opts.clients};
+    std::atomic<bool> failed{false};
+    const auto start = Clock::now();
+    for (size_t i = 0; i < opts.clients; i++) {
+        threads.emplace_back([&, i] {
+            try {
+                runClient(i, opts, ctx.mgr.getDomain(), samples[i]);
+            } catch (const std::exception &exc) {
+                fprintf(stderr, "client %zu: %s\n", i, exc.what());
+                failed = true;
+            }
+            running--;
+        });
+    }
+    while (running > 0) {
+        ctx.mgr.handleEvent(std::chrono::milliseconds{10});
+    }
+    const std::chrono::duration<double> wall = Clock::now() - start;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+
+    Samples merged;
+    for (auto &client_samples : samples) {
+        for (auto &[method, latencies] : client_samples) {
+            auto &dest = merged[method];
+            dest.insert(dest.end(), latencies.begin(), latencies.end());
+        }
+    }
+    report(merged, wall);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <future>
+#include <optional>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "manager.h"
+
+namespace {
+
+//! Connect to the RPC socket without waiting for the server
+int connectClient(const Manager &mgr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    struct sockaddr_un sun = {};
+    sun.sun_family = AF_UNIX;
+    const auto path = (mgr.getDomain().statedir / "rpc.sock").string();
+    strncpy(sun.sun_path, path.c_str(), sizeof(sun.sun_path) - 1);
+    assert(connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0);
+    assert(fcntl(fd, F_SETFL, O_NONBLOCK) == 0);
+    return fd;
+}
+
+void sendRaw(int fd, const std::string &data) {
+    assert(write(fd, data.data(), data.size()) == (ssize_t)data.size());
+}
+
+//! Encode a message with its length header
+std::string frame(const json &msg) {
+    const auto body = msg.dump();
+    const auto header =
+        Channel::encodeHeader(body.size(), Channel::Encoding::Json);
+    return std::string(header.begin(), header.end()) + body;
+}
+
+void sendRequest(int fd, const json &request) { sendRaw(fd, frame(request)); }
+
+//! Handle events until a reply arrives, or the server closes the connection
+std::optional<json> receive(Manager &mgr, int fd, std::string &input) {
+    for (int i = 0; i < 200; i++) {
+        if (input.size() >= IPC_HEADER_LEN) {
+            const size_t length = Channel::decodeHeader(input.data()).length;
+            const size_t end = IPC_HEADER_LEN + length;
+            if (input.size() >= end) {
+                auto msg = json::parse(input.substr(IPC_HEADER_LEN, length));
+                input.erase(0, end);
+                return msg;
+            }
+        }
+        char buf[4096];
+        ssize_t bytes = read(fd, buf, sizeof(buf));
+        if (bytes == 0) {
+            return std::nullopt;
+        } else if (bytes > 0) {
+            input.append(buf, bytes);
+        } else {
+            assert(errno == EAGAIN);
+            mgr.handleEvent(std::chrono::milliseconds{10});
+        }
+    }
+    assert(!"no reply");
+    return std::nullopt;
+}
+
+std::optional<json> receive(Manager &mgr, int fd) {
+    std::string input;
+    return receive(mgr, fd, input);
+}
+
+void handleEventsFor(Manager &mgr, std::chrono::milliseconds duration) {
+    const auto until = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < until) {
+        mgr.handleEvent(std::chrono::milliseconds{10});
+    }
+}
+
+} // namespace
+
+// A client that never finishes its request does not hold up other clients
+void testRpcServerStalledClient() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.startRunning();
+
+    const auto request = frame(json::array({"version"}));
+    int stalled = connectClient(mgr);
+    sendRaw(stalled, request.substr(0, 2));
+    int other = connectClient(mgr);
+    sendRequest(other, json::array({"version"}));
+    auto reply = receive(mgr, other);
+    assert(reply && !(*reply)["error"]);
+    assert(mgr.getRpcServer().connectionCount() == 2);
+
+    // The rest of the request arrives later
+    sendRaw(stalled, request.substr(2));
+    reply = receive(mgr, stalled);
+    assert(reply && (*reply)["version"].get<std::string>().find(
+                        "relaunch version") == 0);
+
+    // Requests that arrive together are answered in order
+    std::string input;
+    sendRaw(other, frame(json::array({"version"})) +
+                       frame(json::array({"history", {{"Limit", 1}}})));
+    assert(receive(mgr, other, input)->contains("version"));
+    assert(receive(mgr, other, input)->contains("Runs"));
+
+    // Messages are not limited to a single read
+    sendRequest(other,
+                json::array({"history", {{"Padding", std::string(65536, 'x')},
+                                         {"Limit", 1}}}));
+    assert(receive(mgr, other)->contains("Runs"));
+
+    // Closing the connection frees it
+    close(stalled);
+    handleEventsFor(mgr, std::chrono::milliseconds{50});
+    assert(mgr.getRpcServer().connectionCount() == 1);
+
+    // Requests over the limit are refused
+    sendRaw(other, frame(std::string(IPC_MAX_MSGLEN, 'x')).substr(0, 64));
+    assert(!receive(mgr, other));
+    close(other);
+    mgr.stopRunning();
+}
+
+// Replies are not limited in size
+void testRpcServerLargeReply() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    for (int i = 0; i < 1000; i++) {
+        mgr.loadManifest({{"Label", "test.large.reply." + std::to_string(i)},
+                          {"ProgramArguments", {"/bin/true"}}},
+                         path);
+    }
+    mgr.startRunning();
+    auto fp = std::async(std::launch::async, [&mgr] {
+        Channel chan;
+        chan.connect(mgr.getDomain().statedir / "rpc.sock");
+        chan.writeMessage(json::array({"list"}));
+        return chan.readMessage();
+    });
+    while (fp.wait_for(std::chrono::seconds{0}) != std::future_status::ready) {
+        mgr.handleEvent(std::chrono::milliseconds{10});
+    }
+    const auto reply = fp.get();
+    assert(reply.dump().size() > 32768);
+    mgr.stopRunning();
+}
+
+// Idle connections are closed, and the connection limit defers new clients
+// rather than refusing them
+void testRpcServerIdleTimeoutAndLimit() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.getRpcServer().idle_timeout = std::chrono::milliseconds{300};
+    mgr.getRpcServer().max_connections = 2;
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.ignoreterm",
+          "ProgramArguments": ["/bin/sh", "-c", "trap '' TERM; sleep 2"],
+          "RunAtLoad": true
+        }
+    )"), path);
+    mgr.startRunning();
+
+    int first = connectClient(mgr);
+    int second = connectClient(mgr);
+    handleEventsFor(mgr, std::chrono::milliseconds{20});
+    int third = connectClient(mgr);
+    sendRequest(third, json::array({"version"}));
+    handleEventsFor(mgr, std::chrono::milliseconds{20});
+    assert(mgr.getRpcServer().connectionCount() == 2);
+
+    // The idle clients are disconnected, which lets the third one in
+    auto reply = receive(mgr, third);
+    assert(reply && !(*reply)["error"]);
+    assert(!receive(mgr, first));
+    assert(!receive(mgr, second));
+
+    // A client waiting for an operation is not idle
+    usleep(300000); // let the shell install its trap
+    const auto stop = mgr.requestStop(Label{"test.ignoreterm"});
+    assert(stop);
+    sendRequest(third, json::array({"wait", {{"Operations", {*stop}},
+                                             {"Timeout", 0.7}}}));
+    reply = receive(mgr, third);
+    assert(reply && (*reply)["TimedOut"]);
+    assert((*reply)["Operations"][0]["Status"] == "Pending");
+
+    // Stopping the server closes the remaining connections
+    mgr.getRpcServer().stop();
+    assert(mgr.getRpcServer().connectionCount() == 0);
+    assert(!receive(mgr, third));
+    close(first);
+    close(second);
+    close(third);
+}
+
+// Unprivileged callers are held to their request rate and connection limit,
+// but throttled requests are still answered
+void testRpcServerAdmission() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    auto &server = mgr.getRpcServer();
+    server.privileged_uids.clear();
+    server.admission.requests_per_second = 20;
+    server.admission.burst = 2;
+    server.admission.connections_per_uid = 1;
+    mgr.startRunning();
+
+    int fd = connectClient(mgr);
+    std::string batch;
+    for (int i = 0; i < 4; i++) {
+        batch += frame({{"Id", i}, {"Request", json::array({"version"})}});
+    }
+    sendRaw(fd, batch);
+    const auto start = std::chrono::steady_clock::now();
+    std::string input;
+    for (int i = 0; i < 4; i++) {
+        auto reply = receive(mgr, fd, input);
+        assert(reply && (*reply)["Id"] == i);
+    }
+    // Two requests fit in the burst, the others wait for their tokens
+    assert(std::chrono::steady_clock::now() - start >=
+           std::chrono::milliseconds{90});
+    auto stats = server.callerStats(getuid());
+    assert(stats && stats->requests == 4 && stats->throttled >= 1);
+
+    // A second connection from the same uid is refused
+    int second = connectClient(mgr);
+    assert(!receive(mgr, second));
+    stats = server.callerStats(getuid());
+    assert(stats->refused == 1);
+
+    // Privileged callers are exempt
+    server.privileged_uids.insert(getuid());
+    close(fd);
+    handleEventsFor(mgr, std::chrono::milliseconds{20});
+    fd = connectClient(mgr);
+    batch.clear();
+    for (int i = 0; i < 10; i++) {
+        batch += frame({{"Id", i}, {"Request", json::array({"version"})}});
+    }
+    sendRaw(fd, batch);
+    for (int i = 0; i < 10; i++) {
+        assert(receive(mgr, fd, input));
+    }
+    assert(server.callerStats(getuid())->throttled == stats->throttled);
+    close(fd);
+    close(second);
+    mgr.stopRunning();
+}
+
+// Pipelined requests are answered with their ids, even after the client has
+// shut down its side of the connection
+void testRpcServerPipelined() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.startRunning();
+
+    int fd = connectClient(mgr);
+    sendRaw(fd, frame({{"Id", 1}, {"Request", json::array({"version"})}}) +
+                    frame({{"Id", 2}, {"Request", json::array({"bogus"})}}) +
+                    frame(json::array({"version"})));
+    assert(shutdown(fd, SHUT_WR) == 0);
+    std::string input;
+    auto reply = receive(mgr, fd, input);
+    assert(reply && (*reply)["Id"] == 1 &&
+           (*reply)["Reply"].contains("version"));
+    reply = receive(mgr, fd, input);
+    assert(reply && (*reply)["Id"] == 2 && (*reply)["Reply"]["error"] == true);
+    reply = receive(mgr, fd, input);
+    assert(reply && reply->contains("version") && !reply->contains("Id"));
+
+    // The connection is closed once every request is answered
+    assert(!receive(mgr, fd, input));
+    assert(mgr.getRpcServer().connectionCount() == 0);
+    close(fd);
+    mgr.stopRunning();
+}
+
+// A request pipelined after a wait is handled once the wait is answered, and
+// may complete operations of its own without answering the wait twice
+void testRpcServerPipelinedWait() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    for (const auto *label : {"test.waited", "test.next"}) {
+        mgr.loadManifest(
+            json{{"Label", label},
+                 {"ProgramArguments", json::array({"/bin/sleep", "30"})},
+                 {"RunAtLoad", std::string{label} == "test.waited"}},
+            path);
+    }
+    mgr.startRunning();
+
+    int fd = connectClient(mgr);
+    sendRequest(fd, json::array({"stop", {{"Label", "test.waited"}}}));
+    auto reply = receive(mgr, fd);
+    assert(reply && (*reply)["error"] == false);
+    const auto wait =
+        json::array({"wait", {{"Operations", {(*reply)["Operation"]}}}});
+    const auto start = json::array({"start", {{"Label", "test.next"}}});
+    sendRaw(fd, frame({{"Id", 1}, {"Request", wait}}) +
+                    frame({{"Id", 2}, {"Request", start}}) +
+                    frame({{"Id", 3}, {"Request", wait}}));
+    assert(shutdown(fd, SHUT_WR) == 0);
+
+    std::string input;
+    std::vector<int> ids;
+    while (auto msg = receive(mgr, fd, input)) {
+        ids.push_back((*msg)["Id"].get<int>());
+        assert((*msg)["Reply"]["error"] == false);
+    }
+    assert((ids == std::vector<int>{1, 2, 3}));
+    close(fd);
+    mgr.stopRunning();
+}
+
+// Watchers get the events of the jobs they watch as they happen
+void testRpcServerWatch() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    std::string path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.watched",
+          "ProgramArguments": ["/bin/sh", "-c", "exit 3"]
+        }
+    )"), path);
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.unwatched",
+          "ProgramArguments": ["/bin/sh", "-c", "exit 0"]
+        }
+    )"), path);
+    mgr.startRunning();
+
+    int fd = connectClient(mgr);
+    sendRequest(fd, json::array({"watch", {{"Labels", {"test.watch*"}}}}));
+    std::string input;
+    auto reply = receive(mgr, fd, input);
+    assert(reply && !(*reply)["error"]);
+    assert(mgr.getJobEvents().size() == 1);
+
+    assert(mgr.requestStart(Label{"test.unwatched"}));
+    assert(mgr.requestStart(Label{"test.watched"}));
+    std::vector<std::string> seen;
+    while (seen.empty() || seen.back() != "Exit") {
+        reply = receive(mgr, fd, input);
+        assert(reply && (*reply)["Label"] == "test.watched");
+        seen.push_back((*reply)["Event"].get<std::string>());
+        if (seen.back() == "Exit") {
+            assert((*reply)["ExitStatus"] == 3);
+        }
+    }
+    assert(seen.front() == "Transition");
+
+    // Disconnecting ends the subscription
+    close(fd);
+    handleEventsFor(mgr, std::chrono::milliseconds{50});
+    assert(mgr.getJobEvents().empty());
+    assert(mgr.getRpcServer().connectionCount() == 0);
+    mgr.stopRunning();
+}
+
+// A watcher that does not read its events is dropped
+void testRpcServerSlowWatcher() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.startRunning();
+    mgr.getRpcServer().watch_buffer_size = 65536;
+
+    int fd = connectClient(mgr);
+    sendRequest(fd, json::array({"watch"}));
+    assert(receive(mgr, fd) && mgr.getJobEvents().size() == 1);
+    const std::string padding(4096, 'x');
+    for (int i = 0; i < 10000 && !mgr.getJobEvents().empty(); i++) {
+        mgr.getJobEvents().publish("test.slow", "Test",
+                                   {{"Padding", padding}});
+    }
+    assert(mgr.getJobEvents().empty());
+    assert(mgr.getRpcServer().connectionCount() == 0);
+    close(fd);
+    mgr.stopRunning();
+}
+
+// A submitted job can write to a descriptor that the client passed
+void testRpcServerSubmitWithDescriptors() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.startRunning();
+    int pipefd[2];
+    assert(pipe(pipefd) == 0);
+
+    int fd = connectClient(mgr);
+    const json submit = json::array(
+        {"submit",
+         {{"Label", "test.passed_fd"},
+          {"ProgramArguments", {"/bin/sh", "-c", "echo hello"}},
+          {"RunAtLoad", true},
+          {"StandardOutFD", 0}}});
+    Channel::writeMessage(fd, {{"FDs", 1}, {"Request", submit}},
+                          Channel::Encoding::Json, {pipefd[1]});
+    close(pipefd[1]);
+    std::string input;
+    auto reply = receive(mgr, fd, input);
+    assert(reply && !(*reply)["error"]);
+
+    // The job holds the only other copy, so EOF follows its output
+    char buf[64];
+    std::string output;
+    assert(fcntl(pipefd[0], F_SETFL, O_NONBLOCK) == 0);
+    for (int i = 0; i < 200 && output != "hello\n"; i++) {
+        mgr.handleEvent(std::chrono::milliseconds{10});
+        const ssize_t bytes = read(pipefd[0], buf, sizeof(buf));
+        if (bytes > 0) {
+            output.append(buf, bytes);
+        }
+    }
+    assert(output == "hello\n");
+
+    // A request cannot take descriptors that were not passed
+    sendRequest(fd, {{"FDs", 1}, {"Request", json::array({"version"})}});
+    reply = receive(mgr, fd, input);
+    assert(reply && (*reply)["error"] == true);
+    close(pipefd[0]);
+    close(fd);
+    mgr.stopRunning();
+}
+
+// A change that could not be made durable is not acknowledged
+void testRpcServerUnsyncedChange() {
+    Manager mgr{Domain{DomainType::User, TMPDIR}};
+    mgr.startRunning();
+    int fd = connectClient(mgr);
+
+    // No file may grow
+    struct rlimit saved;
+    assert(getrlimit(RLIMIT_FSIZE, &saved) == 0);
+    struct rlimit limit = saved;
+    limit.rlim_cur = 0;
+    const auto old_handler = signal(SIGXFSZ, SIG_IGN);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    sendRequest(fd, json::array({"disable", {{"Label", "test.unsynced"}}}));
+    auto disable_reply = receive(mgr, fd);
+    // Requests that change nothing still succeed
+    sendRequest(fd, json::array({"version"}));
+    auto version_reply = receive(mgr, fd);
+    assert(setrlimit(RLIMIT_FSIZE, &saved) == 0);
+    (void)signal(SIGXFSZ, old_handler);
+
+    assert(disable_reply && (*disable_reply)["error"] == true);
+    assert(version_reply && version_reply->contains("version") &&
+           (*version_reply)["error"] == false);
+    close(fd);
+    mgr.stopRunning();
+}
+
+void addRpcServerTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testRpcServerSubmitWithDescriptors);
+    X(testRpcServerWatch);
+    X(testRpcServerSlowWatcher);
+    X(testRpcServerPipelined);
+    X(testRpcServerPipelinedWait);
+    X(testRpcServerAdmission);
+    X(testRpcServerStalledClient);
+    X(testRpcServerIdleTimeoutAndLimit);
+    X(testRpcServerLargeReply);
+    X(testRpcServerUnsyncedChange);
+#undef X
+}
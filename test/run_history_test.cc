@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "common.hpp"
+#include "manager.h"
+#include "run_history.h"
+
+static RunRecord makeRecord(const char *label, int exit_status) {
+    RunRecord record{};
+    strncpy(record.label, label, sizeof(record.label) - 1);
+    record.exit_status = exit_status;
+    return record;
+}
+
+// Each job keeps its newest records, and the history survives reopening
+void testRunHistoryRing() {
+    const auto path = std::filesystem::path{tmpdir} / "testRunHistoryRing";
+    std::filesystem::remove(path);
+    {
+        RunHistory history;
+        history.open(path, 3, 2);
+        for (int i = 0; i < 6; i++) {
+            history.append(makeRecord(i % 2 ? "test.odd" : "test.even", i));
+        }
+        auto records = history.query(std::nullopt, 10);
+        assert(records.size() == 4);
+        assert(records[0].exit_status == 5);
+        assert(records[3].exit_status == 2);
+        records = history.query(std::string{"test.even"}, 10);
+        assert(records.size() == 2);
+        assert(records[0].exit_status == 4);
+        assert(history.query(std::nullopt, 1).size() == 1);
+
+        // A job that restarts often does not push out the others
+        for (int i = 0; i < 10; i++) {
+            history.append(makeRecord("test.loop", 100 + i));
+        }
+        assert(history.query(std::string{"test.loop"}, 10).size() == 2);
+        assert(history.query(std::string{"test.even"}, 10).size() == 2);
+        records = history.query(std::nullopt, 3);
+        assert(records[0].exit_status == 109);
+        assert(records[2].exit_status == 5);
+
+        // When every region is in use, the least recently used one is taken
+        history.append(makeRecord("test.new", 200));
+        assert(history.query(std::string{"test.even"}, 10).empty());
+        assert(history.query(std::string{"test.odd"}, 10).size() == 2);
+        assert(history.query(std::string{"test.new"}, 10).size() == 1);
+    }
+
+    // The geometry of an existing file wins
+    RunHistory history;
+    history.open(path, 16, 16);
+    assert(history.jobCapacity() == 3);
+    assert(history.runsPerJob() == 2);
+    assert(history.query(std::string{"test.odd"}, 10).size() == 2);
+    assert(history.query(std::string{"test.new"}, 10).at(0).exit_status ==
+           200);
+    history.close();
+
+    // A damaged file is replaced
+    {
+        std::ofstream ofs{path, std::ios::trunc};
+        ofs << "garbage";
+    }
+    history.open(path, 16, 4);
+    assert(history.jobCapacity() == 16);
+    assert(history.query(std::nullopt, 10).empty());
+}
+
+// Every run of a job is recorded, including a process that is killed when
+// the manager goes away
+void testRunHistoryJobs() {
+    const auto dir = std::filesystem::path{tmpdir} / "testRunHistoryJobs";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string manifest_path = "/dev/null";
+    {
+        Manager mgr{Domain{DomainType::User, dir}};
+        mgr.loadManifest(json::parse(R"(
+            {
+              "Label": "test.exit",
+              "ProgramArguments": ["/bin/sh", "-c", "exit 3"],
+              "RunAtLoad": true
+            }
+        )"), manifest_path);
+        mgr.loadManifest(json::parse(R"(
+            {
+              "Label": "test.sleep",
+              "ProgramArguments": ["/bin/sleep", "9999"],
+              "RunAtLoad": true
+            }
+        )"), manifest_path);
+        mgr.startRunning();
+        while (mgr.runHistory(std::string{"test.exit"}, 1).empty()) {
+            mgr.handleEvent(std::chrono::milliseconds{100});
+        }
+        const auto run = mgr.runHistory(std::string{"test.exit"}, 10).at(0);
+        assert(run["ExitStatus"] == 3);
+        assert(run["Cause"] == "Load");
+        assert(run["ExitedAt"].get<int64_t>() >=
+               run["StartedAt"].get<int64_t>());
+        assert(run["StartedAt"].get<int64_t>() > 0);
+    }
+
+    RunHistory history;
+    history.open(dir / "history");
+    const auto records = history.query(std::string{"test.sleep"}, 10);
+    assert(records.size() == 1);
+    assert(records[0].exit_status == -1);
+    assert(records[0].term_signal == SIGKILL);
+}
+
+void addRunHistoryTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testRunHistoryRing);
+    X(testRunHistoryJobs);
+#undef X
+}
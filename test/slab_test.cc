@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+
+#include "common.hpp"
+#include "slab.h"
+
+// Freed blocks are reused before a new chunk is allocated
+void testSlabReuse() {
+    SlabPool pool{24, 4};
+    assert(pool.capacity() == 0);
+    std::vector<void *> blocks;
+    for (int i = 0; i < 4; i++) {
+        void *ptr = pool.allocate();
+        assert(reinterpret_cast<uintptr_t>(ptr) % alignof(std::max_align_t) ==
+               0);
+        blocks.push_back(ptr);
+    }
+    assert(pool.capacity() == 4);
+    assert(pool.inUse() == 4);
+    pool.deallocate(blocks[2]);
+    assert(pool.allocate() == blocks[2]);
+    assert(pool.capacity() == 4);
+    (void)pool.allocate();
+    assert(pool.capacity() == 8);
+    assert(pool.inUse() == 5);
+}
+
+// Objects created with make_slab() are destroyed and returned to the pool
+void testMakeSlab() {
+    struct Object {
+        std::string name;
+        int &destroyed;
+        ~Object() { destroyed++; }
+    };
+    auto &pool = SlabPool::forSize(sizeof(Object));
+    const size_t in_use = pool.inUse();
+    int destroyed = 0;
+    {
+        auto obj = make_slab<Object>(Object{"test", destroyed});
+        assert(pool.inUse() == in_use + 1);
+        assert(obj->name == "test");
+    }
+    assert(pool.inUse() == in_use);
+    // One temporary and one slab object
+    assert(destroyed == 2);
+
+    auto shared = std::allocate_shared<std::string>(
+        SlabAllocator<std::string>{}, "shared");
+    auto copy = shared;
+    assert(*copy == "shared");
+}
+
+void addSlabTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testSlabReuse);
+    X(testMakeSlab);
+#undef X
+}
@@ -14,6 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <chrono>
+#include <csignal>
+#include <thread>
+
+#include <sys/resource.h>
+
 #include "common.hpp"
 #include "state_file.hpp"
 
@@ -45,7 +51,160 @@ void testSetValue() {
     assert(buf == value);
 }
 
+void testOverrides() {
+    const std::string statefilepath = tmpdir + "/test_overrides.json";
+    if (std::filesystem::exists(statefilepath)) {
+        std::filesystem::remove(statefilepath);
+    }
+    json default_value = {{"SchemaVersion", 1}, {"Overrides", json::object()}};
+    {
+        auto sf = StateFile(statefilepath, default_value);
+        assert(!sf.findOverride("test.a"));
+        sf.setOverride("test.a", StateFile::Override{false});
+        sf.setOverride("test.b", StateFile::Override{true});
+        sf.setOverride("test.a", StateFile::Override{true});
+        assert(sf.overrideCount() == 2);
+        assert(sf.findOverride("test.a")->enabled);
+        const auto &doc = sf.getValue();
+        assert(doc.at("SchemaVersion") == 1);
+        assert(doc.at("Overrides").at("test.b").at("Enabled") == true);
+    }
+
+    // The index is rebuilt from the file
+    auto sf = StateFile(statefilepath, default_value);
+    assert(sf.overrideCount() == 2);
+    assert(sf.findOverride("test.b")->enabled);
+
+    // Replacing the document replaces the index
+    sf.setValue({{"SchemaVersion", 1},
+                 {"Overrides", {{"test.c", {{"Enabled", false}}}}}});
+    assert(sf.overrideCount() == 1);
+    assert(!sf.findOverride("test.a"));
+    assert(!sf.findOverride("test.c")->enabled);
+    sf.clear();
+    assert(sf.overrideCount() == 0);
+    std::filesystem::remove(statefilepath);
+}
+
+//! Remove a state file and its journals
+static void removeStateFile(const std::string &path) {
+    for (const auto &suffix : {"", ".journal", ".journal.old"}) {
+        std::filesystem::remove(path + suffix);
+    }
+}
+
+void testJournalReplay() {
+    const std::string statefilepath = tmpdir + "/test_journal.json";
+    removeStateFile(statefilepath);
+    json default_value = {{"SchemaVersion", 1}, {"Overrides", json::object()}};
+    {
+        auto sf = StateFile(statefilepath, default_value);
+        sf.setOverride("test.a", StateFile::Override{false});
+        sf.setOverride("test.b", StateFile::Override{false});
+        sf.clearOverride("test.b");
+        sf.setFact("BootCount", 3);
+        assert(sf.journalSize() > 0);
+        sf.sync();
+    }
+    // Only the journal was written
+    {
+        std::ifstream ifs{statefilepath};
+        assert(json::parse(ifs) == default_value);
+    }
+    // Simulate a crash in the middle of a write
+    {
+        std::ofstream ofs{statefilepath + ".journal", std::ios::app};
+        ofs << R"({"Op":"SetOverride","Label":"test.c")";
+    }
+    {
+        auto sf = StateFile(statefilepath, default_value);
+        assert(sf.overrideCount() == 1);
+        assert(!sf.findOverride("test.a")->enabled);
+        assert(!sf.findOverride("test.c"));
+        assert(*sf.getFact("BootCount") == 3);
+        sf.setOverride("test.d", StateFile::Override{true});
+    }
+    auto sf = StateFile(statefilepath, default_value);
+    assert(sf.overrideCount() == 2);
+    assert(sf.findOverride("test.d")->enabled);
+    removeStateFile(statefilepath);
+}
+
+void testJournalCompaction() {
+    const std::string statefilepath = tmpdir + "/test_compaction.json";
+    removeStateFile(statefilepath);
+    json default_value = {{"SchemaVersion", 1}, {"Overrides", json::object()}};
+    {
+        auto sf = StateFile(statefilepath, default_value);
+        sf.setCompactionThreshold(4096);
+        for (int i = 0; i < 1000; i++) {
+            sf.setOverride("test." + std::to_string(i % 50),
+                           StateFile::Override{i % 2 == 0});
+            sf.sync();
+        }
+        while (sf.isCompacting()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+        assert(sf.journalSize() < 4096);
+        assert(!std::filesystem::exists(statefilepath + ".journal.old"));
+        std::ifstream ifs{statefilepath};
+        assert(json::parse(ifs).at("Overrides").size() == 50);
+    }
+    auto sf = StateFile(statefilepath, default_value);
+    assert(sf.overrideCount() == 50);
+    assert(!sf.findOverride("test.49")->enabled);
+    sf.compact();
+    assert(sf.journalSize() == 0);
+    assert(std::filesystem::file_size(statefilepath + ".journal") == 0);
+    removeStateFile(statefilepath);
+}
+
+// A sync that fails part way through a record does not tear the journal
+void testJournalShortWrite() {
+    const std::string statefilepath = tmpdir + "/test_short_write.json";
+    removeStateFile(statefilepath);
+    json default_value = {{"SchemaVersion", 1}, {"Overrides", json::object()}};
+    {
+        auto sf = StateFile(statefilepath, default_value);
+        sf.setOverride("test.a", StateFile::Override{false});
+        sf.sync();
+        const auto synced = sf.journalSize();
+
+        // Let the next write stop in the middle of a record
+        struct rlimit saved;
+        assert(getrlimit(RLIMIT_FSIZE, &saved) == 0);
+        struct rlimit limit = saved;
+        limit.rlim_cur = synced + 10;
+        const auto old_handler = signal(SIGXFSZ, SIG_IGN);
+        assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+        sf.setOverride("test.b", StateFile::Override{false});
+        sf.setOverride("test.c", StateFile::Override{false});
+        bool thrown = false;
+        try {
+            sf.sync();
+        } catch (const std::system_error &) {
+            thrown = true;
+        }
+        assert(setrlimit(RLIMIT_FSIZE, &saved) == 0);
+        (void)signal(SIGXFSZ, old_handler);
+        assert(thrown);
+        assert(std::filesystem::file_size(statefilepath + ".journal") ==
+               synced);
+
+        // The records are written again
+        sf.sync();
+    }
+    auto sf = StateFile(statefilepath, default_value);
+    assert(sf.overrideCount() == 3);
+    assert(!sf.findOverride("test.c")->enabled);
+    removeStateFile(statefilepath);
+}
+
 void addStateFileTests(TestRunner &runner) {
     runner.addTest("testStateFile", testStateFile);
     runner.addTest("testSetValue", testSetValue);
+    runner.addTest("testOverrides", testOverrides);
+    runner.addTest("testJournalReplay", testJournalReplay);
+    runner.addTest("testJournalCompaction", testJournalCompaction);
+    runner.addTest("testJournalShortWrite", testJournalShortWrite);
 }
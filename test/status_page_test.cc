@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2024 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#include "common.hpp"
+#include "launch_status.h"
+#include "manager.h"
+#include "status_page.h"
+
+static launch_status_entry makeEntry(const char *label, pid_t pid) {
+    launch_status_entry entry{};
+    strncpy(entry.label, label, sizeof(entry.label) - 1);
+    entry.pid = pid;
+    entry.state = LAUNCH_STATUS_RUNNING;
+    return entry;
+}
+
+// A reader sees updates in place, and follows the page when it grows
+void testStatusPageReader() {
+    const auto path = std::filesystem::path{tmpdir} / "testStatusPageReader";
+    StatusPage page;
+    page.open(path, 2);
+    page.update(0, makeEntry("test.a", 100));
+    page.update(1, makeEntry("test.b", 101));
+
+    auto *status = launch_status_open(path.c_str());
+    assert(status);
+    launch_status_entry entry;
+    assert(launch_status_lookup(status, "test.b", &entry) == 0);
+    assert(entry.pid == 101);
+    assert(strcmp(launch_status_state_name(entry.state), "Running") == 0);
+    assert(launch_status_lookup(status, "test.missing", &entry) < 0);
+    assert(errno == ESRCH);
+
+    // The page is replaced with a larger one
+    page.update(5, makeEntry("test.c", 102));
+    assert(page.capacity() == 8);
+    page.clear(0);
+    launch_status_entry *entries;
+    size_t count;
+    assert(launch_status_snapshot(status, &entries, &count) == 0);
+    assert(count == 2);
+    assert(strcmp(entries[0].label, "test.b") == 0);
+    assert(strcmp(entries[1].label, "test.c") == 0);
+    free(entries);
+
+    page.close();
+    assert(!std::filesystem::exists(path));
+    assert(launch_status_lookup(status, "test.b", &entry) < 0);
+    assert(errno == ENOENT);
+    launch_status_close(status);
+
+    // A page that was left behind is marked as stale by the next launchd
+    StatusPage first, second;
+    first.open(path);
+    first.update(0, makeEntry("test.a", 100));
+    status = launch_status_open(path.c_str());
+    assert(status);
+    second.open(path);
+    assert(launch_status_lookup(status, "test.a", &entry) < 0);
+    second.update(0, makeEntry("test.a", 200));
+    assert(launch_status_lookup(status, "test.a", &entry) == 0);
+    assert(entry.pid == 200);
+    first.close();
+    assert(std::filesystem::exists(path));
+    launch_status_close(status);
+}
+
+// The manager publishes every state change of its jobs
+void testStatusPageJobs() {
+    Domain domain{DomainType::User, TMPDIR};
+    Manager mgr{domain};
+    const auto path = domain.statedir / LAUNCH_STATUS_FILENAME;
+    std::string manifest_path = "/dev/null";
+    mgr.loadManifest(json::parse(R"(
+        {
+          "Label": "test.status",
+          "ProgramArguments": ["/bin/sleep", "9999"],
+          "RunAtLoad": true
+        }
+    )"), manifest_path);
+    mgr.startRunning();
+
+    auto *status = launch_status_open(path.c_str());
+    assert(status);
+    launch_status_entry entry;
+    assert(launch_status_lookup(status, "test.status", &entry) == 0);
+    assert(entry.state == LAUNCH_STATUS_RUNNING);
+    assert(entry.pid > 0);
+
+    assert(mgr.killJob(Label{"test.status"}, "SIGKILL"));
+    mgr.handleEvent(std::chrono::milliseconds{100});
+    assert(launch_status_lookup(status, "test.status", &entry) == 0);
+    assert(entry.state == LAUNCH_STATUS_EXITED);
+    assert(entry.pid == 0);
+    assert(entry.term_signal == 9);
+    launch_status_close(status);
+}
+
+void addStatusPageTests(TestRunner &runner) {
+#define X(y) runner.addTest("" #y, y)
+    X(testStatusPageReader);
+    X(testStatusPageJobs);
+#undef X
+}